@@ -18,6 +18,8 @@
 
 #include "mgos.h"
 #include "mgos_i2c.h"
+#include "mgos_event.h"
+#include "mgos_barometer_compensate.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,33 +30,288 @@ enum mgos_barometer_type {
   BARO_MPL115,
   BARO_MPL3115,
   BARO_BME280,    // Also BMP280
-  BARO_MS5611
+  BARO_MS5611,
+  BARO_BMP3,      // BMP388 and BMP390
+  BARO_MS5607,
+  BARO_MS5637,
+  BARO_MS5803,    // MS5803-01BA
+
+  BARO_USER = 0x80  // first type available to out of tree drivers
 };
 
 struct mgos_barometer;
 
+enum mgos_barometer_read_result {
+  BARO_READ_ERROR = 0,  // driver read failed
+  BARO_READ_FRESH,      // a new sample was taken from the sensor
+  BARO_READ_CACHED,     // the most recent sample was returned
+  BARO_READ_TIMEOUT     // no sample could be produced within the budget
+};
+
+// Trade-offs between noise, rate and power, as far as the sensor offers them.
+enum mgos_barometer_profile {
+  BARO_PROFILE_DEFAULT = 0,  // the driver's configuration after create
+  BARO_PROFILE_LOW_POWER,    // fewest and cheapest conversions
+  BARO_PROFILE_HIGH_RATE     // shortest conversions, for variometers
+};
+
+// Channels of a sample, e.g. for per channel cache TTLs.
+enum mgos_barometer_channel {
+  BARO_CHANNEL_PRESSURE = 0,
+  BARO_CHANNEL_TEMPERATURE,
+  BARO_CHANNEL_HUMIDITY,
+  BARO_CHANNEL_ALTITUDE
+};
+#define MGOS_BAROMETER_CHANNELS           (4)
+
+// A consistent set of readings, all taken from the same sample.
+struct mgos_barometer_sample {
+  int64_t ts_usecs;              // mgos_uptime_micros() at the midpoint of the conversion
+  float   pressure;              // in Pascals
+  float   temperature;           // in Celsius
+  float   humidity;              // in % Relative Humidity
+  float   altitude;              // in meters, from on-chip altimeters, else 0
+};
+
+/*
+ * Upper bounds of the read latency histogram buckets, in microseconds. The
+ * last bucket counts reads slower than the last bound.
+ */
+#define MGOS_BAROMETER_LATENCY_BOUNDS_USECS \
+  { 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000 }
+#define MGOS_BAROMETER_LATENCY_BUCKETS    (11)
+
 struct mgos_barometer_stats {
   double   last_read_time;       // value of mg_time() upon last call to _read()
+  double   read_success_usecs;   // time spent in successful uncached _read()
+  double   jitter_abs_usecs;     // sum of |actual - scheduled| sampling interval
   uint32_t read;                 // calls to _read()
   uint32_t read_success;         // successful _read()
   uint32_t read_success_cached;  // calls to _read() which were cached
   // Note: read_errors := read - read_success - read_success_cached
-  double   read_success_usecs;   // time spent in successful uncached _read()
+  uint32_t cache_miss;           // calls to _read() which waited for the sensor
+  uint32_t cache_stale;          // cached calls served past their TTL
+  uint32_t cache_refresh;        // background refreshes which took a sample
+  uint32_t jitter_samples;       // intervals measured by the sampler
+  uint32_t i2c_transactions;     // bus transactions issued by the driver
+  uint32_t i2c_bytes;            // register addresses and data moved by them
+  int32_t  jitter_min_usecs;     // shortest interval, relative to the schedule
+  int32_t  jitter_max_usecs;     // longest interval, relative to the schedule
+  uint32_t read_latency[MGOS_BAROMETER_LATENCY_BUCKETS]; // successful uncached _read() by duration
+};
+
+/*
+ * Storage for a sensor created with mgos_barometer_create_i2c_static(). It
+ * holds both the core state and the driver private data, so that no heap is
+ * used for the lifetime of the sensor. The sizes are upper bounds for all
+ * drivers, and are checked at compile time.
+ */
+#define MGOS_BAROMETER_SIZE              (208 + 12 * sizeof(void *))
+#define MGOS_BAROMETER_USER_DATA_SIZE    (80)
+
+struct mgos_barometer_storage {
+  union {
+    double   d;
+    uint64_t u64;
+    void *   p;
+  } opaque[(MGOS_BAROMETER_SIZE + MGOS_BAROMETER_USER_DATA_SIZE + 7) / 8];
+};
+
+struct mgos_barometer_footprint {
+  uint16_t core_bytes;           // size of the sensor state
+  uint16_t user_data_bytes;      // size of the driver private data
+  uint32_t aux_bytes;            // heap used by sampler, history, FIFO, events and label
+  bool     heap;                 // true if allocated from the heap
 };
 
 struct mgos_barometer *mgos_barometer_create_i2c(struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type);
+
+/*
+ * Create a sensor in caller provided storage, which must outlive the sensor.
+ * mgos_barometer_destroy() may be called on it, but will not free anything.
+ */
+struct mgos_barometer *mgos_barometer_create_i2c_static(struct mgos_barometer_storage *storage, struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type);
 void mgos_barometer_destroy(struct mgos_barometer **sensor);
 
+/*
+ * Create a sensor without blocking the caller. Detection, the soft reset and
+ * configuration run from mgos timers, with the reset time waited out on a
+ * timer rather than in mgos_usleep(). cb is called exactly once, with the
+ * sensor or with NULL on failure. The sensor is not visible to
+ * mgos_barometer_get_next() and friends until cb runs.
+ */
+typedef void (*mgos_barometer_create_cb)(struct mgos_barometer *sensor, void *arg);
+bool mgos_barometer_create_i2c_async(struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type, mgos_barometer_create_cb cb, void *arg);
+
 bool mgos_barometer_has_thermometer(struct mgos_barometer *sensor);
 bool mgos_barometer_has_barometer(struct mgos_barometer *sensor);
 bool mgos_barometer_has_hygrometer(struct mgos_barometer *sensor);
+bool mgos_barometer_has_altimeter(struct mgos_barometer *sensor);
 
 /* Set cache TTL -- will limit reads and return cached data. Set msecs=0 to turn off */
 bool mgos_barometer_set_cache_ttl(struct mgos_barometer *sensor, uint16_t msecs);
 
+/*
+ * Set the cache TTL of one channel, e.g. a longer one for humidity, which
+ * changes far slower than pressure. mgos_barometer_get_humidity() and friends
+ * use the TTL of their channel, mgos_barometer_read() the shortest TTL of all
+ * channels the sensor has. mgos_barometer_set_cache_ttl() sets all channels.
+ */
+bool mgos_barometer_set_channel_ttl(struct mgos_barometer *sensor, enum mgos_barometer_channel channel, uint16_t msecs);
+
+/*
+ * Stale-while-revalidate: for up to msecs past its TTL, a cached sample is
+ * still returned at once, and a refresh is started in the background. The
+ * refresh uses the driver's non-blocking conversion if it has one, and runs
+ * from an mgos timer on the main task. Set msecs=0 to turn off, which makes
+ * reads past the TTL wait for the sensor. Only applies to channels whose TTL
+ * is not 0.
+ */
+bool mgos_barometer_set_cache_stale(struct mgos_barometer *sensor, uint16_t msecs);
+
 /* Read all available sensor data from the barometer */
 bool mgos_barometer_read(struct mgos_barometer *sensor);
 
+/*
+ * On-chip altitude computation. The sensor converts pressure to altitude
+ * itself, against the sea level pressure in the config, and applies the trims
+ * to its raw readings. Units of the trims are the sensor's own, e.g. for the
+ * MPL3115 4 Pa, 1/16 C and 1 m per step.
+ */
+struct mgos_barometer_altimeter_cfg {
+  uint32_t sea_level_pa;         // reference pressure, 0 for 101326 Pa
+  int8_t   offset_p;             // pressure trim
+  int8_t   offset_t;             // temperature trim
+  int8_t   offset_h;             // altitude trim
+};
+
+/*
+ * Switch the sensor to altimeter mode, or back to barometer mode if cfg is
+ * NULL. In altimeter mode the sensor reports altitude instead of pressure,
+ * and its capabilities change accordingly. Cached samples from the old mode
+ * are discarded. Returns false if the driver has no altimeter mode, or while
+ * raw capture is on.
+ */
+bool mgos_barometer_set_altimeter(struct mgos_barometer *sensor, const struct mgos_barometer_altimeter_cfg *cfg);
+
+/*
+ * Reconfigure the sensor for a profile. Returns false if the driver doesn't
+ * support it, in which case the sensor keeps its configuration.
+ */
+bool mgos_barometer_set_profile(struct mgos_barometer *sensor, enum mgos_barometer_profile profile);
+
+/*
+ * Non-blocking reads. mgos_barometer_start_conversion() starts a conversion
+ * and sets wait_usecs to when it will be done. mgos_barometer_collect_conversion()
+ * then returns 1 if a new sample was published, 0 if the driver needs another
+ * conversion first, or -1 on error. Sensors without non-blocking support
+ * report wait_usecs=0 and read synchronously on collect. Until the conversion
+ * is collected, mgos_barometer_read() returns the cached sample.
+ */
+bool mgos_barometer_start_conversion(struct mgos_barometer *sensor, uint32_t *wait_usecs);
+int mgos_barometer_collect_conversion(struct mgos_barometer *sensor);
+
+/*
+ * Read sensor data, spending at most max_usecs blocking on the sensor. The
+ * decision is made up front, based on the driver's worst-case read cost: if a
+ * fresh sample cannot be guaranteed within the budget, the most recent sample
+ * is kept and BARO_READ_CACHED is returned, or BARO_READ_TIMEOUT if there is
+ * none. The same applies while another caller holds the bus. If age_usecs is
+ * not NULL, it is set to the age of the returned sample, saturating at
+ * UINT32_MAX.
+ */
+enum mgos_barometer_read_result mgos_barometer_read_deadline(struct mgos_barometer *sensor, uint32_t max_usecs, uint32_t *age_usecs);
+
+/*
+ * Take a fresh sample every interval_ms on the main task, bypassing the
+ * cache. Intervals between successive sample timestamps are compared to the
+ * schedule and accumulated in the jitter stats. Set interval_ms=0 to stop.
+ */
+bool mgos_barometer_start_sampling(struct mgos_barometer *sensor, uint32_t interval_ms);
+
+struct mgos_barometer_adaptive_cfg {
+  uint32_t min_interval_ms;      // fastest rate, while pressure moves
+  uint32_t max_interval_ms;      // floor rate, while pressure is flat
+  uint32_t window_ms;            // time constant of the trend estimate
+  float    slope_pa_s;           // |dP/dt| above which sampling speeds up
+  float    sigma_pa;             // scatter around the trend above which sampling speeds up
+};
+
+/*
+ * Like mgos_barometer_start_sampling(), but the interval adapts to the
+ * signal. A least squares trend is fitted over roughly the last window_ms;
+ * while its slope or the scatter around it exceeds the thresholds, the
+ * interval halves down to min_interval_ms. Once both are below half their
+ * thresholds, it grows by a quarter per sample up to max_interval_ms.
+ * sigma_pa must sit above the sensor's noise floor at the chosen profile.
+ * Sampling starts at min_interval_ms.
+ */
+bool mgos_barometer_start_adaptive_sampling(struct mgos_barometer *sensor, const struct mgos_barometer_adaptive_cfg *cfg);
+
+struct mgos_barometer_sampling_stats {
+  double   busy_usecs;           // time spent reading the sensor
+  double   overhead_usecs;       // time spent in the sampler besides that
+  double   elapsed_usecs;        // since sampling started
+  float    duty_cycle;           // busy_usecs / elapsed_usecs
+  float    slope_pa_s;           // current trend, adaptive sampling only
+  float    sigma_pa;             // current scatter around the trend
+  uint32_t interval_ms;          // current interval
+  uint32_t samples;
+  uint32_t rate_changes;
+  uint32_t ticks;                // sampler timer callbacks
+  uint32_t missed;               // deadlines missed: skipped ticks and failed reads
+};
+
+/* Report on the sampler, returns false if the sensor is not sampling. */
+bool mgos_barometer_get_sampling_stats(struct mgos_barometer *sensor, struct mgos_barometer_sampling_stats *stats);
+
+/*
+ * Read all samples the sensor has buffered, up to max, oldest first. Sensors
+ * without a hardware FIFO return a single fresh sample. Returns the number of
+ * samples, or -1 on error.
+ */
+int mgos_barometer_read_batch(struct mgos_barometer *sensor, struct mgos_barometer_sample *samples, int max);
+
+typedef void (*mgos_barometer_batch_cb)(struct mgos_barometer *sensor, const struct mgos_barometer_sample *samples, int n, void *cb_arg);
+
+/*
+ * Buffer samples in the sensor's hardware FIFO, and drain it into buf once
+ * watermark samples are waiting. If int_gpio is >= 0, the sensor's watermark
+ * interrupt is wired to that pin, and cb is called on the main task with the
+ * drained samples. Otherwise call mgos_barometer_read_batch() periodically.
+ * buf must hold at least watermark samples.
+ * Set watermark=0 to turn the FIFO off.
+ */
+bool mgos_barometer_set_fifo(struct mgos_barometer *sensor, uint16_t watermark, int int_gpio,
+                             struct mgos_barometer_sample *buf, uint16_t len, mgos_barometer_batch_cb cb, void *cb_arg);
+
+struct mgos_barometer_subscription;
+
+/*
+ * Sample the sensor every period_ms on the main task, and call cb once batch
+ * samples have been collected, with all of them in one array. The array is
+ * reused for the next batch, so cb must copy what it keeps. Sensors with a
+ * FIFO contribute all samples buffered since the previous tick. Unsubscribe
+ * before destroying the sensor. Returns NULL on error.
+ */
+struct mgos_barometer_subscription *mgos_barometer_subscribe(struct mgos_barometer *sensor, uint32_t period_ms, uint16_t batch,
+                                                             mgos_barometer_batch_cb cb, void *cb_arg);
+void mgos_barometer_unsubscribe(struct mgos_barometer_subscription *sub);
+
+/*
+ * Sample the sensor every interval_ms from a worker task that owns its I2C
+ * bus, so that sensors on different buses are read in parallel. On ESP32 each
+ * bus gets a FreeRTOS task, pinned to core 0 or 1 unless core is -1; the core
+ * is fixed when the bus's first sensor is added, and a different core for
+ * later sensors is logged and ignored. Intervals are kept to within one
+ * FreeRTOS tick, and shorter intervals are sampled once per tick. Other
+ * platforms fall back to a timer on the main task. Samples are published as
+ * usual, and handed to cb on the main task in batches. Set interval_ms=0 to
+ * stop.
+ */
+bool mgos_barometer_start_worker_sampling(struct mgos_barometer *sensor, uint32_t interval_ms, int core,
+                                          mgos_barometer_batch_cb cb, void *cb_arg);
+
 /* Return barometer data in units of Pascals */
 bool mgos_barometer_get_pressure(struct mgos_barometer *sensor, float *p);
 
@@ -64,17 +321,134 @@ bool mgos_barometer_get_temperature(struct mgos_barometer *sensor, float *t);
 /* Return humidity data in units of % Relative Humidity */
 bool mgos_barometer_get_humidity(struct mgos_barometer *sensor, float *h);
 
+/* Return altitude in meters, from sensors in altimeter mode */
+bool mgos_barometer_get_altitude(struct mgos_barometer *sensor, float *a);
+
+/*
+ * Return the most recent sample without reading the sensor. This never blocks
+ * on the bus, and is safe to call from any task or core while another task is
+ * reading the sensor. Returns false if no sample has been taken yet, or
+ * none since the last altimeter mode switch.
+ */
+bool mgos_barometer_get_sample(struct mgos_barometer *sensor, struct mgos_barometer_sample *sample);
+
+/*
+ * Keep the last len samples of the sensor in a history ring. If buf is NULL,
+ * the ring is allocated from the heap, otherwise buf must hold len samples
+ * and outlive the sensor. Set len=0 to turn the history off.
+ */
+bool mgos_barometer_set_history(struct mgos_barometer *sensor, struct mgos_barometer_sample *buf, uint16_t len);
+
+/*
+ * Capture raw ADC words into a ring of len entries in buf instead of
+ * compensating each read. Compensation is deferred until a sample is asked
+ * for: mgos_barometer_get_sample() and friends convert the latest entry on
+ * the fly, and mgos_barometer_compensate_samples() converts captures in bulk.
+ * Lock-free readers may still hold buf after capture is turned off, so it
+ * must outlive the sensor. While capturing, synchronous reads do not
+ * feed the history ring, and humidity is not captured. Requires a driver with
+ * a read_raw() hook. Set len=0 to turn capture off.
+ */
+bool mgos_barometer_set_raw_capture(struct mgos_barometer *sensor, struct mgos_barometer_raw *buf, uint16_t len);
+
+/*
+ * Sample events. Once enabled with mgos_barometer_set_events(), every new
+ * sample taken by mgos_barometer_start_sampling(), a subscription, a FIFO
+ * watermark or a worker is published on the mgos event bus as
+ * MGOS_BAROMETER_EV_SAMPLES, with a struct mgos_barometer_event_data as
+ * ev_data. Events are triggered from the main task, one per sample or batch,
+ * and samples already published (e.g. served from cache) are not repeated.
+ *
+ * ev_data->samples points into the sensor's event ring, read-only, and is
+ * valid until the handler returns. A handler that needs the samples longer
+ * copies the (small) struct mgos_barometer_event_data, calls
+ * mgos_barometer_event_hold() on it, and mgos_barometer_event_release() when
+ * done, both from the main task. Held slots are never overwritten: publishing
+ * skips them, leaving a gap in seq, and only when every slot is held is a
+ * sample left out of the event stream (it still updates the snapshot and
+ * history). Both are counted in events_dropped, so one slow consumer costs
+ * events, never blocks the sampler. Holds may outlive the sensor or
+ * mgos_barometer_set_events(sensor, 0); the ring is freed when the last one
+ * is released, but a held copy's sensor must not be used once the handler
+ * has returned, as the sensor may be gone.
+ *
+ * Handlers run inside the sampling path, so they must not destroy the sensor
+ * or stop the sampling that triggered them; defer that with mgos_invoke_cb().
+ * They may turn events off, and the handlers after them still get the event.
+ */
+#define MGOS_BAROMETER_EV_BASE           MGOS_EVENT_BASE('B', 'A', 'R')
+
+enum mgos_barometer_event {
+  MGOS_BAROMETER_EV_SAMPLES = MGOS_BAROMETER_EV_BASE,
+};
+
+struct mgos_barometer_event_ring;
+
+struct mgos_barometer_event_data {
+  struct mgos_barometer *             sensor;  // only valid during the handler
+  const struct mgos_barometer_sample *samples; // oldest first
+  struct mgos_barometer_event_ring *  ring;
+  uint32_t                            seq;     // sequence number of samples[0]
+  uint16_t                            n;
+};
+
+/* Publish events through a ring of len samples, len=0 stops publishing. */
+bool mgos_barometer_set_events(struct mgos_barometer *sensor, uint16_t len);
+bool mgos_barometer_event_hold(const struct mgos_barometer_event_data *ev);
+void mgos_barometer_event_release(const struct mgos_barometer_event_data *ev);
+
+/* Number of sequence numbers skipped, or samples left out, because slots were held. */
+uint32_t mgos_barometer_get_events_dropped(struct mgos_barometer *sensor);
+
+/*
+ * Copy the last captured raw samples, up to max, oldest first. Returns the
+ * number of samples, or -1 if capture is off.
+ */
+int mgos_barometer_get_raw(struct mgos_barometer *sensor, struct mgos_barometer_raw *raw, int max);
+
+/*
+ * Compensate n raw samples into out. Returns the number of samples converted,
+ * which is short of n if a sample has no usable calibration block.
+ */
+int mgos_barometer_compensate_samples(const struct mgos_barometer_raw *raw, int n, struct mgos_barometer_sample *out);
+
+/*
+ * Iterate over all sensors in order of id: returns the first sensor if sensor
+ * is NULL, and NULL after the last one.
+ */
+struct mgos_barometer *mgos_barometer_get_next(struct mgos_barometer *sensor);
+
+/* Return the sensor with the given id, as reported by mgos_barometer_get_id() */
+struct mgos_barometer *mgos_barometer_get_by_id(uint16_t id);
+uint16_t mgos_barometer_get_id(struct mgos_barometer *sensor);
+
+/*
+ * Sensors declared in the barometer.sN config are labelled with barometer.sN.label,
+ * other sensors can be labelled by the app. The label is copied.
+ */
+bool mgos_barometer_set_label(struct mgos_barometer *sensor, const char *label);
+const char *mgos_barometer_get_label(struct mgos_barometer *sensor);
+struct mgos_barometer *mgos_barometer_get_by_label(const char *label);
+
 /* String representation of the barometer type, guaranteed to be 10 characters or less. */
 const char *mgos_barometer_get_name(struct mgos_barometer *sensor);
 
 /*
- * Return statistics on the sensor.
+ * Return statistics on the sensor. They are copied under the bus lock, so
+ * this waits for a read in progress on the same bus.
  */
 bool mgos_barometer_get_stats(struct mgos_barometer *sensor, struct mgos_barometer_stats *stats);
 
+/*
+ * Return the memory used by the sensor, and whether it lives on the heap.
+ * Buffers passed in by the caller are not counted.
+ */
+bool mgos_barometer_get_footprint(struct mgos_barometer *sensor, struct mgos_barometer_footprint *fp);
 
 /*
- * Initialization function for MGOS -- currently a noop.
+ * Initialization function for MGOS. Starts the RPC service and metrics, and
+ * brings up the sensors enabled in the barometer.sN config. Those come up
+ * asynchronously, so they may not be available yet when this returns.
  */
 bool mgos_barometer_init(void);
 
@@ -0,0 +1,215 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos_barometer.h"
+#include "mgos_barometer_driver.h"
+
+/*
+ * Header-only C++ wrapper. Barometer<Driver> owns a sensor of a driver known
+ * at compile time: its type, capabilities and timings are constants, so
+ * capability checks fold away and asking a sensor for a channel it cannot
+ * have fails to compile. AnyBarometer wraps a sensor whose type is only known
+ * at runtime. Both go through the C API for reads, which keeps bus locking,
+ * caching and stats in one place.
+ */
+
+namespace mgos {
+namespace barometer {
+
+// Holds a value or nothing, after std::optional, which C++11 lacks.
+template <typename T>
+class Optional {
+ public:
+  Optional() : has_value_(false), value_() {}
+  Optional(const T &value) : has_value_(true), value_(value) {}
+
+  bool has_value() const { return has_value_; }
+  explicit operator bool() const { return has_value_; }
+  const T &value() const { return value_; }
+  const T &operator*() const { return value_; }
+  const T *operator->() const { return &value_; }
+  T value_or(const T &other) const { return has_value_ ? value_ : other; }
+
+ private:
+  bool has_value_;
+  T    value_;
+};
+
+typedef Optional<struct mgos_barometer_sample> Reading;
+
+/*
+ * Driver traits, mirroring the C driver descriptors. capabilities are the
+ * channels every sensor of the type has; max_capabilities those detect() may
+ * find or the application may enable, e.g. the MPL3115 altimeter.
+ * conv_usecs come from the same macros as the descriptors'.
+ */
+template <enum mgos_barometer_type Type, uint8_t Caps, uint8_t MaxCaps, uint32_t ConvUsecs>
+struct DriverTraits {
+  static constexpr enum mgos_barometer_type type             = Type;
+  static constexpr uint8_t                  capabilities     = Caps;
+  static constexpr uint8_t                  max_capabilities = MaxCaps;
+  static constexpr uint32_t                 conv_usecs       = ConvUsecs;
+};
+
+#define MGOS_BAROMETER_CAPS_PT (MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER)
+
+typedef DriverTraits<BARO_MPL115, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_MPL115_CONV_USECS> MPL115;
+typedef DriverTraits<BARO_MPL3115, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT | MGOS_BAROMETER_CAP_ALTIMETER,
+                     MGOS_BAROMETER_MPL3115_CONV_USECS> MPL3115;
+// No humidity until the BME280 driver reads it.
+typedef DriverTraits<BARO_BME280, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_BME280_CONV_USECS> BME280;
+typedef DriverTraits<BARO_MS5611, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_MS5611_CONV_USECS> MS5611;
+typedef DriverTraits<BARO_MS5607, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_MS5611_CONV_USECS> MS5607;
+typedef DriverTraits<BARO_MS5637, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_MS5611_CONV_USECS> MS5637;
+typedef DriverTraits<BARO_MS5803, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_MS5611_CONV_USECS> MS5803;
+typedef DriverTraits<BARO_BMP3, MGOS_BAROMETER_CAPS_PT, MGOS_BAROMETER_CAPS_PT,
+                     MGOS_BAROMETER_BMP3_CONV_USECS> BMP3;
+
+#undef MGOS_BAROMETER_CAPS_PT
+
+// Owns the sensor and exposes the runtime API; not used on its own.
+class BarometerBase {
+ public:
+  BarometerBase(const BarometerBase &) = delete;
+  BarometerBase &operator=(const BarometerBase &) = delete;
+
+  ~BarometerBase() { mgos_barometer_destroy(&sensor_); }
+
+  explicit operator bool() const { return sensor_ != nullptr; }
+  struct mgos_barometer *get() const { return sensor_; }
+
+  // Read the sensor, or its cache while that is fresh.
+  Reading read() {
+    struct mgos_barometer_sample sample;
+
+    if (!mgos_barometer_read(sensor_) || !mgos_barometer_get_sample(sensor_, &sample)) {
+      return Reading();
+    }
+    return Reading(sample);
+  }
+
+  // The most recent sample, without touching the bus.
+  Reading latest() const {
+    struct mgos_barometer_sample sample;
+
+    if (!mgos_barometer_get_sample(sensor_, &sample)) {
+      return Reading();
+    }
+    return Reading(sample);
+  }
+
+  bool set_profile(enum mgos_barometer_profile profile) { return mgos_barometer_set_profile(sensor_, profile); }
+  bool set_altimeter(const struct mgos_barometer_altimeter_cfg *cfg) { return mgos_barometer_set_altimeter(sensor_, cfg); }
+  bool set_cache_ttl(uint16_t msecs) { return mgos_barometer_set_cache_ttl(sensor_, msecs); }
+  bool set_channel_ttl(enum mgos_barometer_channel channel, uint16_t msecs) {
+    return mgos_barometer_set_channel_ttl(sensor_, channel, msecs);
+  }
+  bool set_cache_stale(uint16_t msecs) { return mgos_barometer_set_cache_stale(sensor_, msecs); }
+  bool start_sampling(uint32_t interval_ms) { return mgos_barometer_start_sampling(sensor_, interval_ms); }
+  const char *name() const { return mgos_barometer_get_name(sensor_); }
+
+ protected:
+  explicit BarometerBase(struct mgos_barometer *sensor) : sensor_(sensor) {}
+  BarometerBase(BarometerBase &&other) : sensor_(other.sensor_) { other.sensor_ = nullptr; }
+
+  struct mgos_barometer *sensor_;
+};
+
+// A sensor whose type is chosen at runtime.
+class AnyBarometer : public BarometerBase {
+ public:
+  AnyBarometer(struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type)
+    : BarometerBase(mgos_barometer_create_i2c(i2c, i2caddr, type)) {}
+  AnyBarometer(AnyBarometer &&other) = default;
+
+  bool has_barometer() const { return mgos_barometer_has_barometer(sensor_); }
+  bool has_thermometer() const { return mgos_barometer_has_thermometer(sensor_); }
+  bool has_hygrometer() const { return mgos_barometer_has_hygrometer(sensor_); }
+  bool has_altimeter() const { return mgos_barometer_has_altimeter(sensor_); }
+};
+
+template <typename Driver>
+class Barometer : public BarometerBase {
+ public:
+  // i2caddr=0 picks the driver's default address.
+  explicit Barometer(struct mgos_i2c *i2c, uint8_t i2caddr = 0)
+    : BarometerBase(mgos_barometer_create_i2c(i2c, i2caddr, Driver::type)) {}
+  Barometer(Barometer &&other) = default;
+
+  static constexpr enum mgos_barometer_type type() { return Driver::type; }
+  static constexpr uint32_t conv_usecs() { return Driver::conv_usecs; }
+  static constexpr bool has_barometer() { return Driver::capabilities & MGOS_BAROMETER_CAP_BAROMETER; }
+  static constexpr bool has_thermometer() { return Driver::capabilities & MGOS_BAROMETER_CAP_THERMOMETER; }
+
+  // Only known at runtime for drivers which detect it.
+  bool has_hygrometer() const {
+    if (Driver::capabilities & MGOS_BAROMETER_CAP_HYGROMETER) {
+      return true;
+    }
+    return (Driver::max_capabilities & MGOS_BAROMETER_CAP_HYGROMETER) && mgos_barometer_has_hygrometer(sensor_);
+  }
+
+  // Only known at runtime for drivers with an altimeter mode.
+  bool has_altimeter() const {
+    return (Driver::max_capabilities & MGOS_BAROMETER_CAP_ALTIMETER) && mgos_barometer_has_altimeter(sensor_);
+  }
+
+  Optional<float> pressure() {
+    static_assert(Driver::capabilities & MGOS_BAROMETER_CAP_BAROMETER, "driver has no barometer");
+    // Altimeter mode reports altitude in place of pressure.
+    if ((Driver::max_capabilities & MGOS_BAROMETER_CAP_ALTIMETER) && has_altimeter()) {
+      return Optional<float>();
+    }
+    Reading r = read();
+    return r ? Optional<float>(r->pressure) : Optional<float>();
+  }
+
+  Optional<float> temperature() {
+    static_assert(Driver::capabilities & MGOS_BAROMETER_CAP_THERMOMETER, "driver has no thermometer");
+    Reading r = read();
+    return r ? Optional<float>(r->temperature) : Optional<float>();
+  }
+
+  Optional<float> humidity() {
+    static_assert(Driver::max_capabilities & MGOS_BAROMETER_CAP_HYGROMETER, "driver has no hygrometer");
+    if (!has_hygrometer()) {
+      return Optional<float>();
+    }
+    Reading r = read();
+    return r ? Optional<float>(r->humidity) : Optional<float>();
+  }
+
+  Optional<float> altitude() {
+    static_assert(Driver::max_capabilities & MGOS_BAROMETER_CAP_ALTIMETER, "driver has no altimeter");
+    if (!has_altimeter()) {
+      return Optional<float>();
+    }
+    Reading r = read();
+    return r ? Optional<float>(r->altitude) : Optional<float>();
+  }
+};
+
+}  // namespace barometer
+}  // namespace mgos
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compensation kernels, converting raw ADC words to Pascals and Celsius.
+ * They are plain C99 without Mongoose OS dependencies, so the same code that
+ * runs in the drivers also builds on a host, e.g. to convert raw captures in
+ * bulk after upload. The host tests in test/ check them against datasheet
+ * examples and high precision references.
+ */
+
+enum mgos_barometer_calib_kind {
+  BARO_CALIB_NONE = 0,
+  BARO_CALIB_MPL115,
+  BARO_CALIB_MPL3115,            // compensated on chip, only scaled here
+  BARO_CALIB_BME280,
+  BARO_CALIB_MS56XX,
+  BARO_CALIB_BMP3
+};
+
+enum mgos_barometer_ms56xx_variant {
+  BARO_MS56XX_MS5611 = 0,
+  BARO_MS56XX_MS5607,
+  BARO_MS56XX_MS5637,
+  BARO_MS56XX_MS5803             // MS5803-01BA
+};
+
+struct mgos_barometer_calib_mpl115 {
+  float a0, b1, b2, c12;
+};
+
+// Laid out as in the chip's NVM, which is read into it directly.
+struct mgos_barometer_calib_bme280 {
+  uint16_t dig_T1;
+  int16_t  dig_T2;
+  int16_t  dig_T3;
+  uint16_t dig_P1;
+  int16_t  dig_P2;
+  int16_t  dig_P3;
+  int16_t  dig_P4;
+  int16_t  dig_P5;
+  int16_t  dig_P6;
+  int16_t  dig_P7;
+  int16_t  dig_P8;
+  int16_t  dig_P9;
+
+  // Additional calibration data for BME280
+  uint8_t  dig_H1;
+  int16_t  dig_H2;
+  uint8_t  dig_H3;
+  int16_t  dig_H4; // Note: this is 0xE4 / 0xE5[3:0]
+  int16_t  dig_H5; // Note: this is 0xE5[7:4] / 0xE6
+  int8_t   dig_H6;
+};
+
+struct mgos_barometer_calib_ms56xx {
+  // PROM: factory code, c1..c6, crc
+  uint16_t prom[8];
+  uint8_t  variant;              // enum mgos_barometer_ms56xx_variant
+};
+
+// Scaled once from the NVM, see datasheet section 9.1
+struct mgos_barometer_calib_bmp3 {
+  float par_t1, par_t2, par_t3;
+  float par_p1, par_p2, par_p3, par_p4, par_p5, par_p6;
+  float par_p7, par_p8, par_p9, par_p10, par_p11;
+};
+
+struct mgos_barometer_calib {
+  uint8_t kind;                  // enum mgos_barometer_calib_kind
+  union {
+    struct mgos_barometer_calib_mpl115 mpl115;
+    struct mgos_barometer_calib_bme280 bme280;
+    struct mgos_barometer_calib_ms56xx ms56xx;
+    struct mgos_barometer_calib_bmp3   bmp3;
+  } u;
+};
+
+// One uncompensated sample. The calibration block must outlive it.
+struct mgos_barometer_raw {
+  int64_t                            ts_usecs;    // as in struct mgos_barometer_sample
+  const struct mgos_barometer_calib *calib;
+  uint32_t                           adc_p;       // pressure ADC word, as read from the chip
+  uint32_t                           adc_t;       // temperature ADC word
+};
+
+/*
+ * Compensate n raw samples into pressure[] and temperature[]. Runs of samples
+ * sharing a calibration block go through one kernel call. Returns the number
+ * of samples converted, stopping at the first unknown calibration.
+ */
+size_t mgos_barometer_compensate(const struct mgos_barometer_raw *raw, size_t n, float *pressure, float *temperature);
+
+/* Kernels for a single calibration, which all samples must share */
+void mgos_barometer_compensate_mpl115(const struct mgos_barometer_calib_mpl115 *c, const struct mgos_barometer_raw *raw, size_t n,
+                                      float *pressure, float *temperature);
+void mgos_barometer_compensate_mpl3115(const struct mgos_barometer_raw *raw, size_t n, float *pressure, float *temperature);
+void mgos_barometer_compensate_bme280(const struct mgos_barometer_calib_bme280 *c, const struct mgos_barometer_raw *raw, size_t n,
+                                      float *pressure, float *temperature);
+void mgos_barometer_compensate_ms56xx(const struct mgos_barometer_calib_ms56xx *c, const struct mgos_barometer_raw *raw, size_t n,
+                                      float *pressure, float *temperature);
+void mgos_barometer_compensate_bmp3(const struct mgos_barometer_calib_bmp3 *c, const struct mgos_barometer_raw *raw, size_t n,
+                                    float *pressure, float *temperature);
+
+#ifdef __cplusplus
+}
+#endif
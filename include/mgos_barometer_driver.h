@@ -0,0 +1,161 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "mgos.h"
+#include "mgos_barometer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Driver interface. Only needed by code that implements a barometer driver,
+ * either in this library or out of tree via mgos_barometer_register_driver().
+ */
+
+typedef bool (*mgos_barometer_mag_detect_fn)(struct mgos_barometer *dev);
+typedef bool (*mgos_barometer_mag_reset_fn)(struct mgos_barometer *dev);
+typedef bool (*mgos_barometer_mag_create_fn)(struct mgos_barometer *dev);
+typedef bool (*mgos_barometer_mag_destroy_fn)(struct mgos_barometer *dev);
+typedef bool (*mgos_barometer_mag_read_fn)(struct mgos_barometer *dev);
+typedef int (*mgos_barometer_mag_read_batch_fn)(struct mgos_barometer *dev, struct mgos_barometer_sample *samples, int max);
+typedef bool (*mgos_barometer_mag_set_fifo_fn)(struct mgos_barometer *dev, uint16_t watermark);
+typedef bool (*mgos_barometer_mag_set_profile_fn)(struct mgos_barometer *dev, enum mgos_barometer_profile profile);
+typedef bool (*mgos_barometer_mag_start_fn)(struct mgos_barometer *dev, uint32_t *wait_usecs);
+typedef int (*mgos_barometer_mag_collect_fn)(struct mgos_barometer *dev);
+typedef bool (*mgos_barometer_mag_read_raw_fn)(struct mgos_barometer *dev, struct mgos_barometer_raw *raw);
+typedef bool (*mgos_barometer_mag_set_altimeter_fn)(struct mgos_barometer *dev, const struct mgos_barometer_altimeter_cfg *cfg);
+
+#define MGOS_BAROMETER_CAP_BAROMETER      (0x01)
+#define MGOS_BAROMETER_CAP_THERMOMETER    (0x02)
+#define MGOS_BAROMETER_CAP_HYGROMETER     (0x04)
+#define MGOS_BAROMETER_CAP_ALTIMETER      (0x08) // set by the core while in altimeter mode
+
+// Conversion times of the built-in drivers in their default configuration,
+// used by both the descriptors and the C++ traits in mgos_barometer.hpp.
+#define MGOS_BAROMETER_MPL115_CONV_USECS  (3000)
+#define MGOS_BAROMETER_MPL3115_CONV_USECS (512000)
+#define MGOS_BAROMETER_BME280_CONV_USECS  (1250 + 2300 * 2 + 2300 * 16 + 575)
+#define MGOS_BAROMETER_MS5611_CONV_USECS  (10000)
+#define MGOS_BAROMETER_BMP3_CONV_USECS    (234 + 392 + 2 * 2020 + 163 + 2020)
+
+struct mgos_barometer_driver {
+  const char *                        name;            // guaranteed to be 10 characters or less
+  enum mgos_barometer_type            type;
+  uint8_t                             capabilities;    // MGOS_BAROMETER_CAP_*, detect() may clear some
+  uint8_t                             i2caddr[2];      // default I2C addresses, 0 if unused
+  uint16_t                            user_data_size;  // driver private data, allocated by the core
+  uint32_t                            conv_usecs;      // duration of one conversion
+  uint32_t                            read_cost_usecs; // worst-case duration of read()
+  uint32_t                            reset_usecs;     // time from reset() until create() may run
+
+  mgos_barometer_mag_detect_fn        detect;          // optional
+  mgos_barometer_mag_reset_fn         reset;           // optional, soft reset, never waits itself
+  mgos_barometer_mag_create_fn        create;          // optional
+  mgos_barometer_mag_destroy_fn       destroy;         // optional
+  mgos_barometer_mag_read_fn          read;
+  mgos_barometer_mag_read_batch_fn    read_batch;      // optional, drains buffered samples
+  mgos_barometer_mag_set_fifo_fn      set_fifo;        // optional, watermark=0 disables the FIFO
+  mgos_barometer_mag_set_profile_fn   set_profile;     // optional, BARO_PROFILE_DEFAULT after create()
+  // Optional non-blocking conversion. start() kicks off a conversion and
+  // sets how long it takes; collect() then returns 1 with a new sample in
+  // pressure/temperature/ts_usecs, 0 if another conversion is needed first,
+  // or -1 on error.
+  mgos_barometer_mag_start_fn         start;
+  mgos_barometer_mag_collect_fn       collect;
+  // Optional, like read() but returns the ADC words and calibration block
+  // without compensating them, see mgos_barometer_set_raw_capture().
+  mgos_barometer_mag_read_raw_fn      read_raw;
+  // Optional, on-chip altitude. cfg=NULL returns to barometer mode. While
+  // MGOS_BAROMETER_CAP_ALTIMETER is set, read() fills in altitude rather
+  // than pressure.
+  mgos_barometer_mag_set_altimeter_fn set_altimeter;
+};
+
+#define MGOS_BAROMETER_FLAG_STATIC        (0x01) // storage provided by the caller
+#define MGOS_BAROMETER_FLAG_HISTORY_HEAP  (0x02) // history ring allocated by the core
+#define MGOS_BAROMETER_FLAG_CONVERTING    (0x04) // between start() and collect()
+#define MGOS_BAROMETER_FLAG_REFRESHING    (0x08) // background cache refresh pending
+
+struct mgos_barometer_bus;
+struct mgos_barometer_fifo;
+struct mgos_barometer_sampler;
+
+/*
+ * Drivers write pressure, temperature and humidity from their read() hook,
+ * which the core calls with the bus locked. The core then publishes them to
+ * the snapshot, which readers access under the seqlock in snapshot_seq.
+ * Drivers which start a conversion from read() also set ts_usecs to its
+ * midpoint; otherwise the core assumes the conversion ended as read() did.
+ */
+// Members are ordered by alignment to keep the struct free of padding.
+struct mgos_barometer {
+  struct mgos_barometer_stats         stats;
+  struct mgos_barometer_sample        snapshot;
+  int64_t                             ts_usecs;    // conversion midpoint, 0 if the driver can't tell
+
+  struct mgos_barometer *             next;
+  struct mgos_i2c *                   i2c;
+  struct mgos_barometer_bus *         bus;
+  const struct mgos_barometer_driver *driver;
+  const char *                        name;
+  void *                              user_data;
+  struct mgos_barometer_sample *      history;
+  struct mgos_barometer_fifo *        fifo;
+  struct mgos_barometer_sampler *     sampler;
+  struct mgos_barometer_raw *         raw;         // capture ring, see mgos_barometer_set_raw_capture()
+  struct mgos_barometer_event_ring *  events;
+  char *                              label;       // from mgos_barometer_set_label()
+
+  float                               pressure;    // in Pascals
+  float                               temperature; // in Celcius
+  float                               humidity;    // in % Relative Humidity
+  float                               altitude;    // in meters
+
+  volatile uint32_t                   snapshot_seq;  // odd while snapshot is written
+  uint32_t                            history_count; // samples ever written to history
+  uint32_t                            raw_count;       // samples ever captured
+  uint32_t                            read_cost_usecs; // worst-case duration of read()
+  mgos_timer_id                       refresh_timer;   // background cache refresh
+  uint16_t                            history_len;
+  uint16_t                            raw_len;
+  uint16_t                            cache_ttl_ms[MGOS_BAROMETER_CHANNELS];
+  uint16_t                            cache_stale_ms;  // past the TTL, see mgos_barometer_set_cache_stale()
+  uint16_t                            id;
+  uint8_t                             i2caddr;
+  uint8_t                             capabilities;
+  uint8_t                             flags;
+  uint8_t                             profile;       // enum mgos_barometer_profile last set
+};
+
+/*
+ * Make a driver available to mgos_barometer_create_i2c(). The descriptor must
+ * outlive all sensors using it, and its type must not be in use already --
+ * out of tree drivers should pick types starting at BARO_USER.
+ */
+bool mgos_barometer_register_driver(const struct mgos_barometer_driver *drv);
+
+/* Return the driver for a given type, or NULL if it is not available. */
+const struct mgos_barometer_driver *mgos_barometer_get_driver(enum mgos_barometer_type type);
+
+/* Return the driver with the given name, ignoring case, or NULL. */
+const struct mgos_barometer_driver *mgos_barometer_get_driver_by_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "mgos_barometer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * OpenMetrics text exporter for all sensors. Rendering is incremental: each
+ * call to mgos_barometer_metrics_render() fills the caller's buffer with as
+ * many whole lines as fit and remembers where it left off, so a scrape of any
+ * size needs only one small, preallocated buffer.
+ *
+ * If the app includes the http-server library, the output is also served at
+ * MGOS_BAROMETER_METRICS_URI.
+ */
+#define MGOS_BAROMETER_METRICS_URI    "/metrics/barometer"
+
+struct mgos_barometer_metrics_cursor {
+  uint16_t next_id;              // next sensor to render in the current family
+  uint8_t  family;               // metric family being rendered
+  uint8_t  line;                 // next line of the sensor, for multi-line families
+  bool     header_done;          // family's # TYPE and # HELP are out
+};
+
+/* Start a new rendering pass */
+void mgos_barometer_metrics_begin(struct mgos_barometer_metrics_cursor *cur);
+
+/*
+ * Render the next lines into buf, which is not NUL terminated. Returns the
+ * number of bytes written, 0 once the pass is complete, or -1 if buf is too
+ * small for the next line. A buffer of 256 bytes always fits at least one
+ * line.
+ */
+int mgos_barometer_metrics_render(struct mgos_barometer_metrics_cursor *cur, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos_barometer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Differential pair: two sensors sampled together, e.g. across a duct or a
+ * pitot tube. Both conversions are started back to back and collected after
+ * the slower one is done, so the samples are taken at nearly the same time;
+ * the remaining skew between their conversion midpoints is reported. Sensors
+ * without non-blocking conversions are read one after the other instead, and
+ * their skew is a full read. The differential is formed in double precision
+ * and corrected by a per-pair offset, which can be measured with both ports
+ * at the same pressure.
+ */
+
+struct mgos_barometer_pair_output {
+  int64_t  ts_usecs;             // midway between the two conversion midpoints
+  double   diff_pa;              // a - b - offset
+  float    pressure_a;           // Pa
+  float    pressure_b;           // Pa
+  int32_t  skew_usecs;           // b's conversion midpoint minus a's
+};
+
+struct mgos_barometer_pair_stats {
+  uint32_t pairs;                // outputs produced
+  uint32_t unpaired;             // cycles where only one sensor had a new sample
+  uint32_t max_skew_usecs;       // largest |skew_usecs| seen
+  double   mean_skew_usecs;      // mean |skew_usecs|
+  double   offset_pa;            // current offset
+  uint32_t calibrating;          // samples left until the offset is updated
+};
+
+struct mgos_barometer_pair;
+
+typedef void (*mgos_barometer_pair_cb)(struct mgos_barometer_pair *pair, const struct mgos_barometer_pair_output *out, void *cb_arg);
+
+/*
+ * Start sampling the pair every period_ms, or back to back if period_ms is 0.
+ * cb, if not NULL, is called on the main task with every differential, and
+ * may destroy the pair. If that happens within mgos_barometer_pair_create(),
+ * with sensors that are read at once, it returns NULL. Both sensors must
+ * outlive the pair, and should not be sampled by anything else meanwhile.
+ */
+struct mgos_barometer_pair *mgos_barometer_pair_create(struct mgos_barometer *a, struct mgos_barometer *b, uint32_t period_ms,
+                                                       mgos_barometer_pair_cb cb, void *cb_arg);
+void mgos_barometer_pair_destroy(struct mgos_barometer_pair **pair);
+
+/* Return the latest differential, false if there is none yet */
+bool mgos_barometer_pair_get(struct mgos_barometer_pair *pair, struct mgos_barometer_pair_output *out);
+
+/*
+ * Average the uncorrected differential over the next n pairs and use it as
+ * the offset. Both sensors must see the same pressure meanwhile.
+ */
+bool mgos_barometer_pair_calibrate(struct mgos_barometer_pair *pair, uint32_t n);
+
+/* Set or read the offset, e.g. to persist a calibration */
+bool mgos_barometer_pair_set_offset(struct mgos_barometer_pair *pair, double offset_pa);
+bool mgos_barometer_pair_get_stats(struct mgos_barometer_pair *pair, struct mgos_barometer_pair_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
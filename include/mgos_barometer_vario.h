@@ -0,0 +1,85 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos_barometer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Variometer: samples a sensor as fast as it can convert and estimates
+ * altitude and vertical speed with a two-state (altitude, velocity) Kalman
+ * filter. Sensors with non-blocking conversions run them back to back in
+ * BARO_PROFILE_HIGH_RATE; others are polled at rate_hz.
+ */
+
+struct mgos_barometer_vario_cfg {
+  float    accel_sigma;          // m/s^2, expected vertical acceleration (process noise)
+  float    altitude_sigma;       // m, noise of a single altitude measurement
+  float    sea_level_pa;         // reference pressure for altitude
+  uint16_t rate_hz;              // polling rate for sensors without non-blocking reads
+};
+
+struct mgos_barometer_vario_output {
+  int64_t  ts_usecs;             // timestamp of the sample the estimate includes
+  float    altitude;             // m
+  float    vspeed;               // m/s, positive when climbing
+  float    vspeed_sigma;         // m/s, the filter's own 1-sigma uncertainty
+  float    altitude_noise;       // m, RMS of recent measurement residuals
+  uint32_t latency_usecs;        // from conversion midpoint to publication
+};
+
+struct mgos_barometer_vario;
+
+typedef void (*mgos_barometer_vario_cb)(struct mgos_barometer *sensor, const struct mgos_barometer_vario_output *out, void *cb_arg);
+
+/* Fill cfg with defaults suitable for a paraglider or small drone */
+void mgos_barometer_vario_default_cfg(struct mgos_barometer_vario_cfg *cfg);
+
+/*
+ * Start a variometer on the sensor, with the default cfg if cfg is NULL. cb,
+ * if not NULL, is called on the main task with every new estimate. The sensor
+ * must outlive the variometer.
+ */
+struct mgos_barometer_vario *mgos_barometer_vario_create(struct mgos_barometer *sensor, const struct mgos_barometer_vario_cfg *cfg,
+                                                         mgos_barometer_vario_cb cb, void *cb_arg);
+void mgos_barometer_vario_destroy(struct mgos_barometer_vario **vario);
+
+/* Return the latest estimate, false if there is none yet */
+bool mgos_barometer_vario_get(struct mgos_barometer_vario *vario, struct mgos_barometer_vario_output *out);
+
+/*
+ * Run the filter over recorded samples, oldest first, writing one estimate
+ * per sample to out (which may be NULL). latency_usecs is left 0. Returns the
+ * number of samples processed.
+ */
+int mgos_barometer_vario_replay(const struct mgos_barometer_vario_cfg *cfg, const struct mgos_barometer_sample *samples, int n,
+                                struct mgos_barometer_vario_output *out);
+
+/*
+ * Measure the filter's lag: replays a noise-free trace sampled at rate_hz
+ * that steps from level flight into a 1 m/s climb, and returns the time until
+ * the estimated vertical speed reaches 63% of the step.
+ */
+uint32_t mgos_barometer_vario_step_lag_usecs(const struct mgos_barometer_vario_cfg *cfg, uint16_t rate_hz);
+
+#ifdef __cplusplus
+}
+#endif
@@ -7,6 +7,11 @@ let barometer = {
   _hb: ffi('bool mgos_barometer_has_barometer(void *)'),
   _hh: ffi('bool mgos_barometer_has_hygrometer(void *)'),
   _read: ffi('bool mgos_barometer_read(void *)'),
+  _sub: ffi('void *mgos_barometer_subscribe(void *, int, int, void (*)(void *, void *, int, userdata), userdata)'),
+  _unsub: ffi('void mgos_barometer_unsubscribe(void *)'),
+  _gs: ffi('float mgos_barometer_return_sample(void *, int, int)'),
+  _gst: ffi('double mgos_barometer_return_sample_time(void *, int)'),
+  _gbl: ffi('void *mgos_barometer_get_by_label(char *)'),
   
 
   BARO_NONE: 0,
@@ -14,8 +19,12 @@ let barometer = {
   BARO_MPL3115: 2,
   BARO_BME280: 3, // Also BMP280
   BARO_MS5611: 4,
+  BARO_BMP3: 5, // BMP388 and BMP390
+  BARO_MS5607: 6,
+  BARO_MS5637: 7,
+  BARO_MS5803: 8, // MS5803-01BA
 
-  ADDRESSES: [null, null, 0x60, null, null],
+  ADDRESSES: [null, null, 0x60, null, null, null, null, null, null],
 
   create: function(i2cRef,type) {
     let obj = Object.create(barometer._proto);
@@ -23,6 +32,63 @@ let barometer = {
     return obj;
   },
 
+  // Return a sensor declared in the barometer.sN config by its label, or
+  // null if there is none (yet -- they are created in the background).
+  getByLabel: function(label) {
+    let ref = barometer._gbl(label);
+    if (ref === null) {
+      return null;
+    }
+    let obj = Object.create(barometer._proto);
+    obj.barometer = ref;
+    return obj;
+  },
+
+  // Sample sensor every periodMs in C, and call cb(readings) once per
+  // batchSize samples. readings is allocated once and refilled for every
+  // batch, so copy out what needs to outlive the callback. Each reading has
+  // time (uptime in seconds), pressure, temperature, humidity and altitude.
+  // Returns a subscription for unsubscribe(), or null on error.
+  subscribe: function(sensor, periodMs, batchSize, cb) {
+    let sub = {
+      handle: null,
+      cap: barometer._gc(sensor.barometer),
+      readings: [],
+      cb: cb
+    };
+    for (let i = 0; i < batchSize; i++) {
+      sub.readings.push({ time: 0, pressure: null, temperature: null, humidity: null, altitude: null });
+    }
+    sub.handle = barometer._sub(sensor.barometer, periodMs, batchSize, function(s, samples, n, sub) {
+      for (let i = 0; i < n; i++) {
+        let r = sub.readings[i];
+        r.time = barometer._gst(samples, i);
+        if (sub.cap & 0x01) {
+          r.pressure = barometer._gs(samples, i, 0x01);
+        }
+        if (sub.cap & 0x02) {
+          r.temperature = barometer._gs(samples, i, 0x02);
+        }
+        if (sub.cap & 0x04) {
+          r.humidity = barometer._gs(samples, i, 0x04);
+        }
+        if (sub.cap & 0x08) {
+          r.altitude = barometer._gs(samples, i, 0x08);
+        }
+      }
+      sub.cb(sub.readings);
+    }, sub);
+    if (!sub.handle) {
+      return null;
+    }
+    return sub;
+  },
+
+  unsubscribe: function(sub) {
+    barometer._unsub(sub.handle);
+    sub.handle = null;
+  },
+
   _proto: {
     close: function() {
       return barometer._cls(this.barometer);
@@ -42,7 +108,8 @@ let barometer = {
         let ret = {
           pressure: null,
           temperature: null,
-          humidity: null
+          humidity: null,
+          altitude: null
         };
         //there's obviously a better way to do this
         //but i'm c dumb and just trying to finish
@@ -56,6 +123,9 @@ let barometer = {
         if( cap & 0x01) {
           ret.pressure = barometer._gv(this.barometer,(0x01))
         }
+        if (cap & 0x08) {
+          ret.altitude = barometer._gv(this.barometer, 0x08);
+        }
         
         return ret;
 
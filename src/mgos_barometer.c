@@ -14,14 +14,770 @@
  * limitations under the License.
  */
 
+#include <math.h>
+
 #include "mgos.h"
+#include "mgos_gpio.h"
 #include "mgos_barometer_internal.h"
 #include "mgos_barometer_mpl115.h"
 #include "mgos_barometer_mpl3115.h"
 #include "mgos_barometer_bme280.h"
 #include "mgos_barometer_ms5611.h"
+#include "mgos_barometer_bmp3.h"
+
+_Static_assert(sizeof(struct mgos_barometer) <= MGOS_BAROMETER_SIZE, "MGOS_BAROMETER_SIZE too small");
+_Static_assert(MGOS_BAROMETER_SIZE % sizeof(double) == 0, "MGOS_BAROMETER_SIZE misaligns user data");
+
+static const struct mgos_barometer_driver *const s_builtin_drivers[] = {
+#if MGOS_BAROMETER_ENABLE_MPL115
+  &mgos_barometer_mpl115_driver,
+#endif
+#if MGOS_BAROMETER_ENABLE_MPL3115
+  &mgos_barometer_mpl3115_driver,
+#endif
+#if MGOS_BAROMETER_ENABLE_BME280
+  &mgos_barometer_bme280_driver,
+#endif
+#if MGOS_BAROMETER_ENABLE_MS5611
+  &mgos_barometer_ms5611_driver,
+  &mgos_barometer_ms5607_driver,
+  &mgos_barometer_ms5637_driver,
+  &mgos_barometer_ms5803_driver,
+#endif
+#if MGOS_BAROMETER_ENABLE_BMP3
+  &mgos_barometer_bmp3_driver,
+#endif
+  NULL
+};
+
+static const struct mgos_barometer_driver *s_user_drivers[MGOS_BAROMETER_MAX_USER_DRIVERS];
+
+static struct mgos_barometer_bus s_buses[MGOS_BAROMETER_MAX_BUSES];
+
+static const uint32_t s_latency_bounds_usecs[MGOS_BAROMETER_LATENCY_BUCKETS - 1] = MGOS_BAROMETER_LATENCY_BOUNDS_USECS;
+
+static struct mgos_barometer *s_sensors;
+static uint16_t               s_next_id;
 
 // Private functions follow
+
+// Sensors are expected to be created from the main task, so the bus table
+// itself needs no locking.
+static struct mgos_barometer_bus *mgos_barometer_get_bus(struct mgos_i2c *i2c) {
+  for (int i = 0; i < MGOS_BAROMETER_MAX_BUSES; i++) {
+    if (s_buses[i].i2c == i2c) {
+      return &s_buses[i];
+    }
+    if (!s_buses[i].i2c) {
+      s_buses[i].lock = mgos_rlock_create();
+      if (!s_buses[i].lock) {
+        return NULL;
+      }
+      s_buses[i].i2c = i2c;
+      return &s_buses[i];
+    }
+  }
+  LOG(LL_ERROR, ("Too many I2C buses, increase MGOS_BAROMETER_MAX_BUSES"));
+  return NULL;
+}
+
+// busy counts holders and waiters, so it is raised before blocking on the
+// lock and dropped only after releasing it. While a try-lock holds the
+// claim bit, the lock is promised to it: others wait for the bit to clear
+// rather than race it to the lock.
+void mgos_barometer_bus_acquire(struct mgos_barometer_bus *bus) {
+  if (__atomic_fetch_add(&bus->busy, 1, __ATOMIC_ACQUIRE) & MGOS_BAROMETER_BUS_CLAIMED) {
+    while (__atomic_load_n(&bus->busy, __ATOMIC_ACQUIRE) & MGOS_BAROMETER_BUS_CLAIMED) {
+      mgos_usleep(MGOS_BAROMETER_BUS_CLAIM_WAIT_USECS);
+    }
+  }
+  mgos_rlock(bus->lock);
+}
+
+void mgos_barometer_bus_release(struct mgos_barometer_bus *bus) {
+  mgos_runlock(bus->lock);
+  __atomic_fetch_sub(&bus->busy, 1, __ATOMIC_RELEASE);
+}
+
+void mgos_barometer_bus_lock(struct mgos_barometer *sensor) {
+  mgos_barometer_bus_acquire(sensor->bus);
+}
+
+void mgos_barometer_bus_unlock(struct mgos_barometer *sensor) {
+  mgos_barometer_bus_release(sensor->bus);
+}
+
+// mgos_rlock has no try-lock, so claim the bus through busy instead: if
+// nobody holds or waits for the lock, and nobody may take it until the claim
+// is dropped, taking it cannot block. A caller that already holds the lock
+// fails too, which errs on the side of not blocking.
+static bool mgos_barometer_bus_trylock(struct mgos_barometer *sensor) {
+  uint32_t idle = 0;
+
+  if (!__atomic_compare_exchange_n(&sensor->bus->busy, &idle, MGOS_BAROMETER_BUS_CLAIMED | 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return false;
+  }
+  mgos_rlock(sensor->bus->lock);
+  __atomic_fetch_and(&sensor->bus->busy, ~MGOS_BAROMETER_BUS_CLAIMED, __ATOMIC_RELEASE);
+  return true;
+}
+
+// A register access is one transaction: the register address is written,
+// then data follows after a repeated start.
+static void mgos_barometer_i2c_count(struct mgos_barometer *dev, size_t bytes) {
+  dev->stats.i2c_transactions++;
+  dev->stats.i2c_bytes += bytes;
+}
+
+bool mgos_barometer_i2c_write(struct mgos_barometer *dev, const void *data, size_t len, bool stop) {
+  mgos_barometer_i2c_count(dev, len);
+  return mgos_i2c_write(dev->i2c, dev->i2caddr, data, len, stop);
+}
+
+int mgos_barometer_i2c_read_reg_b(struct mgos_barometer *dev, uint8_t reg) {
+  mgos_barometer_i2c_count(dev, 2);
+  return mgos_i2c_read_reg_b(dev->i2c, dev->i2caddr, reg);
+}
+
+int mgos_barometer_i2c_read_reg_w(struct mgos_barometer *dev, uint8_t reg) {
+  mgos_barometer_i2c_count(dev, 3);
+  return mgos_i2c_read_reg_w(dev->i2c, dev->i2caddr, reg);
+}
+
+bool mgos_barometer_i2c_read_reg_n(struct mgos_barometer *dev, uint8_t reg, size_t n, uint8_t *buf) {
+  mgos_barometer_i2c_count(dev, 1 + n);
+  return mgos_i2c_read_reg_n(dev->i2c, dev->i2caddr, reg, n, buf);
+}
+
+bool mgos_barometer_i2c_write_reg_b(struct mgos_barometer *dev, uint8_t reg, uint8_t value) {
+  mgos_barometer_i2c_count(dev, 2);
+  return mgos_i2c_write_reg_b(dev->i2c, dev->i2caddr, reg, value);
+}
+
+bool mgos_barometer_i2c_write_reg_n(struct mgos_barometer *dev, uint8_t reg, size_t n, const uint8_t *buf) {
+  mgos_barometer_i2c_count(dev, 1 + n);
+  return mgos_i2c_write_reg_n(dev->i2c, dev->i2caddr, reg, n, buf);
+}
+
+// Called with the bus locked, which makes this the only writer.
+static void mgos_barometer_publish(struct mgos_barometer *sensor, const struct mgos_barometer_sample *sample) {
+  sensor->snapshot_seq++;
+  __sync_synchronize();
+  sensor->snapshot = *sample;
+  __sync_synchronize();
+  sensor->snapshot_seq++;
+
+  if (sensor->history) {
+    sensor->history[sensor->history_count % sensor->history_len] = *sample;
+    sensor->history_count++;
+  }
+}
+
+// Ids only grow, so appending keeps the list sorted by id.
+static void mgos_barometer_link(struct mgos_barometer *sensor) {
+  struct mgos_barometer **pp;
+
+  for (pp = &s_sensors; *pp; pp = &(*pp)->next) {
+  }
+  sensor->id   = s_next_id++;
+  sensor->next = NULL;
+  *pp          = sensor;
+}
+
+static void mgos_barometer_unlink(struct mgos_barometer *sensor) {
+  struct mgos_barometer **pp;
+
+  for (pp = &s_sensors; *pp; pp = &(*pp)->next) {
+    if (*pp == sensor) {
+      *pp = sensor->next;
+      break;
+    }
+  }
+}
+
+// Called with the bus locked. Raw samples share the snapshot's seqlock, so a
+// reader sees either the snapshot or the latest capture consistently.
+static void mgos_barometer_publish_raw(struct mgos_barometer *sensor, const struct mgos_barometer_raw *raw) {
+  sensor->snapshot_seq++;
+  __sync_synchronize();
+  sensor->raw[sensor->raw_count % sensor->raw_len] = *raw;
+  sensor->raw_count++;
+  __sync_synchronize();
+  sensor->snapshot_seq++;
+}
+
+// While capturing raw samples, the latest one is compensated here, by the
+// reader, unless a compensated sample (e.g. from collect()) is newer. The
+// ring's members are validated against the seqlock before the ring is
+// indexed, so a concurrent mgos_barometer_set_raw_capture() can never make
+// the reader index one buffer with another's length.
+static void mgos_barometer_load(struct mgos_barometer *sensor, struct mgos_barometer_sample *sample) {
+  struct mgos_barometer_raw *buf;
+  struct mgos_barometer_raw  raw;
+  uint32_t seq, count;
+  uint16_t len;
+
+  for (;;) {
+    seq = sensor->snapshot_seq;
+    __sync_synchronize();
+    *sample = sensor->snapshot;
+    buf     = sensor->raw;
+    count   = sensor->raw_count;
+    len     = sensor->raw_len;
+    __sync_synchronize();
+    if ((seq & 1) || seq != sensor->snapshot_seq) {
+      continue;
+    }
+    if (!buf || count == 0) {
+      return;
+    }
+    raw = buf[(count - 1) % len];
+    __sync_synchronize();
+    if (seq == sensor->snapshot_seq) {
+      break;
+    }
+  }
+
+  if (raw.ts_usecs > sample->ts_usecs) {
+    mgos_barometer_compensate_samples(&raw, 1, sample);
+  }
+}
+
+// Publishes what the driver left in the scratch members.
+static void mgos_barometer_publish_read(struct mgos_barometer *sensor) {
+  struct mgos_barometer_sample sample;
+
+  sample.ts_usecs = sensor->ts_usecs;
+  if (sample.ts_usecs == 0) {
+    sample.ts_usecs = mgos_uptime_micros() - sensor->driver->conv_usecs / 2;
+  }
+  sample.pressure    = sensor->pressure;
+  sample.temperature = sensor->temperature;
+  sample.humidity    = sensor->humidity;
+  sample.altitude    = sensor->altitude;
+  mgos_barometer_publish(sensor, &sample);
+}
+
+enum mgos_barometer_cache_state {
+  CACHE_MISS,
+  CACHE_HIT,
+  CACHE_STALE                    // hit, but a refresh is due
+};
+
+// A sample is served from cache while it is fresh for all channels in caps,
+// and while a non-blocking conversion is in flight, which a blocking read
+// would clobber.
+static enum mgos_barometer_cache_state mgos_barometer_cache_lookup(struct mgos_barometer *sensor, uint8_t caps, double now) {
+  uint16_t ttl_ms = 0;
+  bool     found  = false;
+  double   age_ms;
+  int      ch;
+
+  if (sensor->stats.read_success == 0) {
+    return CACHE_MISS;
+  }
+  if (sensor->flags & MGOS_BAROMETER_FLAG_CONVERTING) {
+    return CACHE_HIT;
+  }
+  // Channel n is capability bit n. Every TTL is valid, so whether any
+  // channel was asked for is tracked apart from the shortest one.
+  for (ch = 0; ch < MGOS_BAROMETER_CHANNELS; ch++) {
+    if ((caps & (1 << ch)) && (!found || sensor->cache_ttl_ms[ch] < ttl_ms)) {
+      ttl_ms = sensor->cache_ttl_ms[ch];
+      found  = true;
+    }
+  }
+  if (ttl_ms == 0) {
+    return CACHE_MISS;
+  }
+  age_ms = 1000 * (now - sensor->stats.last_read_time);
+  if (age_ms < ttl_ms) {
+    return CACHE_HIT;
+  }
+  if (age_ms < ttl_ms + sensor->cache_stale_ms) {
+    return CACHE_STALE;
+  }
+  return CACHE_MISS;
+}
+
+static bool mgos_barometer_read_uncached(struct mgos_barometer *sensor, double start) {
+  uint32_t usecs;
+  int      bucket;
+
+  if (sensor->flags & MGOS_BAROMETER_FLAG_CONVERTING) {
+    return false;
+  }
+  sensor->ts_usecs = 0;
+  if (sensor->raw) {
+    struct mgos_barometer_raw raw;
+
+    if (!sensor->driver->read_raw(sensor, &raw)) {
+      return false;
+    }
+    if (raw.ts_usecs == 0) {
+      raw.ts_usecs = mgos_uptime_micros() - sensor->driver->conv_usecs / 2;
+    }
+    mgos_barometer_publish_raw(sensor, &raw);
+  } else {
+    if (!sensor->driver->read(sensor)) {
+      return false;
+    }
+    mgos_barometer_publish_read(sensor);
+  }
+  usecs = 1000000 * (mg_time() - start);
+  sensor->stats.read_success++;
+  sensor->stats.read_success_usecs += usecs;
+  sensor->stats.last_read_time      = start;
+  for (bucket = 0; bucket < MGOS_BAROMETER_LATENCY_BUCKETS - 1; bucket++) {
+    if (usecs <= s_latency_bounds_usecs[bucket]) {
+      break;
+    }
+  }
+  sensor->stats.read_latency[bucket]++;
+
+  // Learn from reads that took longer than the driver predicted, and let a
+  // one-off stall decay back toward the driver's worst case.
+  if (usecs > sensor->read_cost_usecs) {
+    sensor->read_cost_usecs = usecs;
+  } else if (sensor->read_cost_usecs > sensor->driver->read_cost_usecs) {
+    uint32_t floor = usecs > sensor->driver->read_cost_usecs ? usecs : sensor->driver->read_cost_usecs;
+    sensor->read_cost_usecs -= (sensor->read_cost_usecs - floor + 7) / 8;
+  }
+  return true;
+}
+
+static void mgos_barometer_refresh_cb(void *arg) {
+  struct mgos_barometer *sensor = (struct mgos_barometer *)arg;
+  uint32_t wait_usecs;
+  int      ret;
+
+  mgos_barometer_bus_lock(sensor);
+  sensor->refresh_timer = MGOS_INVALID_TIMER_ID;
+  if (sensor->driver->start) {
+    // Someone else may have collected our conversion, which is as good.
+    ret = mgos_barometer_collect_conversion(sensor);
+    if (ret == 0 && mgos_barometer_start_conversion(sensor, &wait_usecs)) {
+      sensor->refresh_timer = mgos_set_timer((wait_usecs + 999) / 1000, 0, mgos_barometer_refresh_cb, sensor);
+      if (sensor->refresh_timer != MGOS_INVALID_TIMER_ID) {
+        mgos_barometer_bus_unlock(sensor);
+        return;
+      }
+      sensor->flags &= ~MGOS_BAROMETER_FLAG_CONVERTING;
+    }
+  } else {
+    sensor->stats.read++;
+    ret = mgos_barometer_read_uncached(sensor, mg_time()) ? 1 : -1;
+  }
+  if (ret > 0) {
+    sensor->stats.cache_refresh++;
+  }
+  sensor->flags &= ~MGOS_BAROMETER_FLAG_REFRESHING;
+  mgos_barometer_bus_unlock(sensor);
+}
+
+// Starts a background refresh unless one, or any conversion, is under way.
+// Called with the bus locked.
+static void mgos_barometer_refresh(struct mgos_barometer *sensor) {
+  uint32_t wait_usecs = 0;
+
+  if (sensor->flags & (MGOS_BAROMETER_FLAG_REFRESHING | MGOS_BAROMETER_FLAG_CONVERTING)) {
+    return;
+  }
+  if (sensor->driver->start && !mgos_barometer_start_conversion(sensor, &wait_usecs)) {
+    return;
+  }
+  sensor->refresh_timer = mgos_set_timer((wait_usecs + 999) / 1000, 0, mgos_barometer_refresh_cb, sensor);
+  if (sensor->refresh_timer == MGOS_INVALID_TIMER_ID) {
+    sensor->flags &= ~MGOS_BAROMETER_FLAG_CONVERTING;
+    return;
+  }
+  sensor->flags |= MGOS_BAROMETER_FLAG_REFRESHING;
+}
+
+// Reads the sensor unless the cache is fresh for all channels in caps.
+static bool mgos_barometer_read_caps(struct mgos_barometer *sensor, uint8_t caps) {
+  double start;
+  bool   ret = true;
+  enum mgos_barometer_cache_state state;
+
+  if (!sensor) {
+    return false;
+  }
+  if (!sensor->driver) {
+    return false;
+  }
+
+  // Callers which waited for the lock will usually find a cached sample.
+  mgos_barometer_bus_lock(sensor);
+  start = mg_time();
+  sensor->stats.read++;
+  state = mgos_barometer_cache_lookup(sensor, caps, start);
+  if (state == CACHE_STALE) {
+    sensor->stats.cache_stale++;
+    mgos_barometer_refresh(sensor);
+  }
+  if (state != CACHE_MISS) {
+    sensor->stats.read_success_cached++;
+  } else {
+    sensor->stats.cache_miss++;
+    ret = mgos_barometer_read_uncached(sensor, start);
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return ret;
+}
+
+// Compares the interval since the previous sample against the schedule.
+static void mgos_barometer_sampler_jitter(struct mgos_barometer *sensor, int64_t ts_usecs) {
+  struct mgos_barometer_sampler *sampler = sensor->sampler;
+  struct mgos_barometer_stats *  st      = &sensor->stats;
+  int32_t jitter;
+
+  if (sampler->last_ts_usecs) {
+    jitter = (int32_t)(ts_usecs - sampler->last_ts_usecs - sampler->interval_usecs);
+    if (st->jitter_samples == 0 || jitter < st->jitter_min_usecs) {
+      st->jitter_min_usecs = jitter;
+    }
+    if (st->jitter_samples == 0 || jitter > st->jitter_max_usecs) {
+      st->jitter_max_usecs = jitter;
+    }
+    st->jitter_abs_usecs += (jitter < 0) ? -jitter : jitter;
+    st->jitter_samples++;
+  }
+  sampler->last_ts_usecs = ts_usecs;
+}
+
+// Fold a sample into the trend, then refresh the slope and scatter.
+static void mgos_barometer_trend_update(struct mgos_barometer_sampler *sampler, const struct mgos_barometer_sample *sample) {
+  struct mgos_barometer_trend *tr = &sampler->trend;
+  double dt, decay, x, mt, mp, vt, vp, ctp, slope, resid;
+
+  if (tr->w == 0) {
+    tr->p0            = sample->pressure;
+    tr->last_ts_usecs = sample->ts_usecs;
+  }
+  dt                = (sample->ts_usecs - tr->last_ts_usecs) / 1e6;
+  tr->last_ts_usecs = sample->ts_usecs;
+
+  // Move the time origin to the new sample, then age the old ones.
+  tr->stt -= 2 * dt * tr->st - dt * dt * tr->w;
+  tr->stp -= dt * tr->sp;
+  tr->st  -= dt * tr->w;
+  decay    = exp(-1000 * dt / sampler->cfg.window_ms);
+  tr->w   *= decay;
+  tr->st  *= decay;
+  tr->sp  *= decay;
+  tr->stt *= decay;
+  tr->spp *= decay;
+  tr->stp *= decay;
+
+  x        = sample->pressure - tr->p0;
+  tr->w   += 1;
+  tr->sp  += x;
+  tr->spp += x * x;
+
+  mt    = tr->st / tr->w;
+  mp    = tr->sp / tr->w;
+  vt    = tr->stt / tr->w - mt * mt;
+  vp    = tr->spp / tr->w - mp * mp;
+  ctp   = tr->stp / tr->w - mt * mp;
+  slope = vt > 0 ? ctp / vt : 0;
+  resid = vp - slope * ctp;
+  sampler->slope_pa_s = slope;
+  sampler->sigma_pa   = resid > 0 ? sqrt(resid) : 0;
+}
+
+static void mgos_barometer_sampler_cb(void *arg);
+
+static bool mgos_barometer_sampler_arm(struct mgos_barometer *sensor, uint32_t interval_ms) {
+  struct mgos_barometer_sampler *sampler = sensor->sampler;
+
+  mgos_clear_timer(sampler->timer);
+  sampler->interval_usecs  = 1000 * interval_ms;
+  sampler->last_ts_usecs   = 0;
+  sampler->last_tick_usecs = 0;
+  sampler->timer          = mgos_set_timer(interval_ms, MGOS_TIMER_REPEAT, mgos_barometer_sampler_cb, sensor);
+  return sampler->timer != MGOS_INVALID_TIMER_ID;
+}
+
+// Speeds up quickly and slows down gradually, with a dead band in between
+// so that the rate does not flap around the thresholds.
+static void mgos_barometer_sampler_adapt(struct mgos_barometer *sensor) {
+  struct mgos_barometer_sampler *           sampler = sensor->sampler;
+  const struct mgos_barometer_adaptive_cfg *cfg     = &sampler->cfg;
+  uint32_t interval_ms = sampler->interval_usecs / 1000, next = interval_ms;
+  float    slope       = fabsf(sampler->slope_pa_s);
+
+  // A fit needs a few samples before it means anything.
+  if (sampler->samples < 3) {
+    return;
+  }
+  if (slope > cfg->slope_pa_s || sampler->sigma_pa > cfg->sigma_pa) {
+    next = interval_ms / 2;
+  } else if (slope < cfg->slope_pa_s / 2 && sampler->sigma_pa < cfg->sigma_pa / 2) {
+    next = interval_ms + interval_ms / 4 + 1;
+  }
+  if (next < cfg->min_interval_ms) {
+    next = cfg->min_interval_ms;
+  }
+  if (next > cfg->max_interval_ms) {
+    next = cfg->max_interval_ms;
+  }
+  if (next != interval_ms) {
+    sampler->rate_changes++;
+    if (!mgos_barometer_sampler_arm(sensor, next)) {
+      LOG(LL_ERROR, ("Could not reschedule sampling of %s", sensor->name));
+    }
+  }
+}
+
+// A tick that comes a whole interval or more late stands in for the ticks
+// that never happened, e.g. while the main task was busy.
+static void mgos_barometer_sampler_tick(struct mgos_barometer_sampler *sampler, int64_t now) {
+  int64_t late;
+
+  sampler->ticks++;
+  if (sampler->last_tick_usecs > 0) {
+    late = now - sampler->last_tick_usecs - sampler->interval_usecs;
+    if (late >= (int64_t)sampler->interval_usecs) {
+      sampler->missed += late / sampler->interval_usecs;
+    }
+  }
+  sampler->last_tick_usecs = now;
+}
+
+static void mgos_barometer_sampler_cb(void *arg) {
+  struct mgos_barometer *        sensor  = (struct mgos_barometer *)arg;
+  struct mgos_barometer_sampler *sampler = sensor->sampler;
+  struct mgos_barometer_sample   sample;
+  int64_t tick, start, busy;
+  bool    ok;
+
+  tick = mgos_uptime_micros();
+  mgos_barometer_sampler_tick(sampler, tick);
+  mgos_barometer_bus_lock(sensor);
+  sensor->stats.read++;
+  start = mgos_uptime_micros();
+  ok    = mgos_barometer_read_uncached(sensor, mg_time());
+  busy  = mgos_uptime_micros() - start;
+  sampler->busy_usecs += busy;
+  if (ok) {
+    sampler->samples++;
+    mgos_barometer_load(sensor, &sample);
+    mgos_barometer_sampler_jitter(sensor, sample.ts_usecs);
+  } else {
+    // A missed sample would otherwise count as one long interval.
+    sampler->last_ts_usecs = 0;
+    sampler->missed++;
+  }
+  mgos_barometer_bus_unlock(sensor);
+
+  if (ok && sampler->adaptive) {
+    mgos_barometer_trend_update(sampler, &sample);
+    mgos_barometer_sampler_adapt(sensor);
+  }
+  // Event handlers are the application's time, not the sampler's.
+  sampler->overhead_usecs += mgos_uptime_micros() - tick - busy;
+  // Publish last, once the sampler is done with its own state.
+  if (ok) {
+    mgos_barometer_emit(sensor, &sample, 1);
+  }
+}
+
+bool mgos_barometer_sample_locked(struct mgos_barometer *sensor, struct mgos_barometer_sample *sample) {
+  sensor->stats.read++;
+  if (!mgos_barometer_read_uncached(sensor, mg_time())) {
+    return false;
+  }
+  mgos_barometer_load(sensor, sample);
+  return true;
+}
+
+// Start, restart or stop (interval_ms=0) the sampler, adaptive if cfg is set.
+static bool mgos_barometer_sampler_start(struct mgos_barometer *sensor, uint32_t interval_ms, const struct mgos_barometer_adaptive_cfg *cfg) {
+  if (sensor->sampler) {
+    mgos_clear_timer(sensor->sampler->timer);
+    if (interval_ms == 0) {
+      free(sensor->sampler);
+      sensor->sampler = NULL;
+      return true;
+    }
+    memset(sensor->sampler, 0, sizeof(struct mgos_barometer_sampler));
+  } else if (interval_ms == 0) {
+    return true;
+  } else {
+    sensor->sampler = calloc(1, sizeof(struct mgos_barometer_sampler));
+    if (!sensor->sampler) {
+      return false;
+    }
+  }
+
+  if (1000 * interval_ms < sensor->read_cost_usecs) {
+    LOG(LL_WARN, ("Sampling interval %u ms is shorter than a read of %s (%u us)", interval_ms, sensor->name, sensor->read_cost_usecs));
+  }
+  if (cfg) {
+    sensor->sampler->cfg      = *cfg;
+    sensor->sampler->adaptive = true;
+  }
+  sensor->sampler->timer       = MGOS_INVALID_TIMER_ID;
+  sensor->sampler->start_usecs = mgos_uptime_micros();
+  if (!mgos_barometer_sampler_arm(sensor, interval_ms)) {
+    free(sensor->sampler);
+    sensor->sampler = NULL;
+    return false;
+  }
+  return true;
+}
+
+// Detect and reset the sensor, called with the bus locked. create() may
+// follow once the driver's reset_usecs have passed.
+static bool mgos_barometer_probe(struct mgos_barometer *sensor, void *user_data) {
+  const struct mgos_barometer_driver *drv = sensor->driver;
+
+  if (drv->detect) {
+    if (!drv->detect(sensor)) {
+      LOG(LL_ERROR, ("Could not detect mgos_barometer_type %d at I2C 0x%02x", drv->type, sensor->i2caddr));
+      return false;
+    } else {
+      LOG(LL_DEBUG, ("Successfully detected mgos_barometer_type %d at I2C 0x%02x", drv->type, sensor->i2caddr));
+    }
+  }
+
+  // Driver private data is owned by the core, so drivers never allocate.
+  if (drv->user_data_size > 0) {
+    if (user_data && drv->user_data_size > MGOS_BAROMETER_USER_DATA_SIZE) {
+      LOG(LL_ERROR, ("Driver %s does not fit in struct mgos_barometer_storage", drv->name));
+      return false;
+    }
+    if (!user_data) {
+      user_data = calloc(1, drv->user_data_size);
+      if (!user_data) {
+        return false;
+      }
+    }
+    sensor->user_data = user_data;
+  }
+
+  if (drv->reset && !drv->reset(sensor)) {
+    LOG(LL_ERROR, ("Could not reset mgos_barometer_type %d at I2C 0x%02x", drv->type, sensor->i2caddr));
+    return false;
+  }
+  return true;
+}
+
+// Configure the sensor after its reset, called with the bus locked.
+static bool mgos_barometer_configure(struct mgos_barometer *sensor) {
+  const struct mgos_barometer_driver *drv = sensor->driver;
+
+  if (drv->create) {
+    if (!drv->create(sensor)) {
+      LOG(LL_ERROR, ("Could not create mgos_barometer_type %d at I2C 0x%02x", drv->type, sensor->i2caddr));
+      return false;
+    } else {
+      LOG(LL_DEBUG, ("Successfully created mgos_barometer_type %d at I2C 0x%02x", drv->type, sensor->i2caddr));
+    }
+  }
+
+  return true;
+}
+
+// Fill in the sensor from its driver, without touching the bus.
+static bool mgos_barometer_attach(struct mgos_barometer *sensor, struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type) {
+  const struct mgos_barometer_driver *drv = mgos_barometer_get_driver(type);
+
+  if (!drv) {
+    LOG(LL_ERROR, ("Unknown mgos_barometer_type %d", type));
+    return false;
+  }
+  if (i2caddr == 0) {
+    i2caddr = drv->i2caddr[0];
+  }
+  sensor->bus = mgos_barometer_get_bus(i2c);
+  if (!sensor->bus) {
+    return false;
+  }
+  sensor->i2c             = i2c;
+  sensor->i2caddr         = i2caddr;
+  sensor->driver          = drv;
+  sensor->name            = drv->name;
+  sensor->capabilities    = drv->capabilities;
+  sensor->read_cost_usecs = drv->read_cost_usecs;
+  sensor->refresh_timer   = MGOS_INVALID_TIMER_ID;
+  return true;
+}
+
+static bool mgos_barometer_setup(struct mgos_barometer *sensor, void *user_data, struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type) {
+  bool ret;
+
+  if (!mgos_barometer_attach(sensor, i2c, i2caddr, type)) {
+    return false;
+  }
+  mgos_barometer_bus_lock(sensor);
+  ret = mgos_barometer_probe(sensor, user_data);
+  if (ret) {
+    mgos_usleep(sensor->driver->reset_usecs);
+    ret = mgos_barometer_configure(sensor);
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return ret;
+}
+
+static void mgos_barometer_free_user_data(struct mgos_barometer *sensor) {
+  if (sensor->user_data && !(sensor->flags & MGOS_BAROMETER_FLAG_STATIC)) {
+    free(sensor->user_data);
+  }
+  sensor->user_data = NULL;
+}
+
+// A sensor on its way through mgos_barometer_create_i2c_async()
+struct mgos_barometer_pending {
+  struct mgos_barometer *  sensor;
+  mgos_barometer_create_cb cb;
+  void *                   cb_arg;
+};
+
+static void mgos_barometer_pending_done(struct mgos_barometer_pending *p, bool ok) {
+  struct mgos_barometer *sensor = p->sensor;
+
+  if (ok) {
+    mgos_barometer_link(sensor);
+  } else {
+    mgos_barometer_free_user_data(sensor);
+    free(sensor);
+    sensor = NULL;
+  }
+  if (p->cb) {
+    p->cb(sensor, p->cb_arg);
+  }
+  free(p);
+}
+
+static void mgos_barometer_pending_configure(void *arg) {
+  struct mgos_barometer_pending *p = (struct mgos_barometer_pending *)arg;
+  bool ok;
+
+  mgos_barometer_bus_lock(p->sensor);
+  ok = mgos_barometer_configure(p->sensor);
+  mgos_barometer_bus_unlock(p->sensor);
+  mgos_barometer_pending_done(p, ok);
+}
+
+static void mgos_barometer_pending_probe(void *arg) {
+  struct mgos_barometer_pending *p = (struct mgos_barometer_pending *)arg;
+  uint32_t reset_usecs             = p->sensor->driver->reset_usecs;
+  bool     ok;
+
+  mgos_barometer_bus_lock(p->sensor);
+  ok = mgos_barometer_probe(p->sensor, NULL);
+  mgos_barometer_bus_unlock(p->sensor);
+  if (!ok) {
+    mgos_barometer_pending_done(p, false);
+    return;
+  }
+  if (mgos_set_timer((reset_usecs + 999) / 1000, 0, mgos_barometer_pending_configure, p) == MGOS_INVALID_TIMER_ID) {
+    mgos_barometer_pending_done(p, false);
+  }
+}
+
 // Private functions end
 
 // Public functions follow
@@ -36,75 +792,85 @@ struct mgos_barometer *mgos_barometer_create_i2c(struct mgos_i2c *i2c, uint8_t i
   if (!sensor) {
     return NULL;
   }
-  memset(sensor, 0, sizeof(struct mgos_barometer));
-  sensor->i2c     = i2c;
-  sensor->i2caddr = i2caddr;
-  switch (type) {
-  case BARO_MPL115:
-    sensor->create  = mgos_barometer_mpl115_create;
-    sensor->read    = mgos_barometer_mpl115_read;
-    sensor->destroy = mgos_barometer_mpl115_destroy;
-    break;
-
-  case BARO_MPL3115:
-    sensor->detect = mgos_barometer_mpl3115_detect;
-    sensor->create = mgos_barometer_mpl3115_create;
-    sensor->read   = mgos_barometer_mpl3115_read;
-    break;
-
-  case BARO_BME280:
-    sensor->detect  = mgos_barometer_bme280_detect;
-    sensor->create  = mgos_barometer_bme280_create;
-    sensor->read    = mgos_barometer_bme280_read;
-    sensor->destroy = mgos_barometer_bme280_destroy;
-    break;
-
-  case BARO_MS5611:
-    sensor->create  = mgos_barometer_ms5611_create;
-    sensor->read    = mgos_barometer_ms5611_read;
-    sensor->destroy = mgos_barometer_ms5611_destroy;
-    break;
-
-  default:
-    LOG(LL_ERROR, ("Unknown mgos_barometer_type %d", type));
+  if (!mgos_barometer_setup(sensor, NULL, i2c, i2caddr, type)) {
+    mgos_barometer_free_user_data(sensor);
     free(sensor);
     return NULL;
   }
-  sensor->type = type;
-  if (sensor->detect) {
-    if (!sensor->detect(sensor)) {
-      LOG(LL_ERROR, ("Could not detect mgos_barometer_type %d at I2C 0x%02x", type, i2caddr));
-      free(sensor);
-      return NULL;
-    } else {
-      LOG(LL_DEBUG, ("Successfully detected mgos_barometer_type %d at I2C 0x%02x", type, i2caddr));
-    }
+  mgos_barometer_link(sensor);
+
+  return sensor;
+}
+
+struct mgos_barometer *mgos_barometer_create_i2c_static(struct mgos_barometer_storage *storage, struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type) {
+  struct mgos_barometer *sensor;
+
+  if (!storage || !i2c) {
+    return NULL;
+  }
+
+  memset(storage, 0, sizeof(struct mgos_barometer_storage));
+  sensor        = (struct mgos_barometer *)storage;
+  sensor->flags = MGOS_BAROMETER_FLAG_STATIC;
+  if (!mgos_barometer_setup(sensor, (uint8_t *)storage + MGOS_BAROMETER_SIZE, i2c, i2caddr, type)) {
+    mgos_barometer_free_user_data(sensor);
+    return NULL;
+  }
+  mgos_barometer_link(sensor);
+
+  return sensor;
+}
+
+bool mgos_barometer_create_i2c_async(struct mgos_i2c *i2c, uint8_t i2caddr, enum mgos_barometer_type type, mgos_barometer_create_cb cb, void *arg) {
+  struct mgos_barometer_pending *p;
+
+  if (!i2c) {
+    return false;
+  }
+
+  p = calloc(1, sizeof(struct mgos_barometer_pending));
+  if (!p) {
+    return false;
+  }
+  p->sensor = calloc(1, sizeof(struct mgos_barometer));
+  if (!p->sensor || !mgos_barometer_attach(p->sensor, i2c, i2caddr, type)) {
+    free(p->sensor);
+    free(p);
+    return false;
   }
+  p->cb     = cb;
+  p->cb_arg = arg;
 
-  if (sensor->create) {
-    if (!sensor->create(sensor)) {
-      LOG(LL_ERROR, ("Could not create mgos_barometer_type %d at I2C 0x%02x", type, i2caddr));
-      free(sensor);
-      return NULL;
-    } else {
-      LOG(LL_DEBUG, ("Successfully created mgos_barometer_type %d at I2C 0x%02x", type, i2caddr));
-    }
+  // Even detection waits for the main loop, so the caller returns at once.
+  if (mgos_set_timer(0, 0, mgos_barometer_pending_probe, p) == MGOS_INVALID_TIMER_ID) {
+    free(p->sensor);
+    free(p);
+    return false;
   }
-
-  return sensor;
+  return true;
 }
 
 void mgos_barometer_destroy(struct mgos_barometer **sensor) {
   if (!*sensor) {
     return;
   }
-  if ((*sensor)->destroy && !(*sensor)->destroy(*sensor)) {
-    LOG(LL_ERROR, ("Could not destroy mgos_barometer_type %d at I2C 0x%02x", (*sensor)->type, (*sensor)->i2caddr));
+  mgos_barometer_unlink(*sensor);
+  mgos_barometer_start_sampling(*sensor, 0);
+  mgos_barometer_start_worker_sampling(*sensor, 0, -1, NULL, NULL);
+  mgos_barometer_set_fifo(*sensor, 0, -1, NULL, 0, NULL, NULL);
+  mgos_barometer_set_history(*sensor, NULL, 0);
+  mgos_barometer_set_raw_capture(*sensor, NULL, 0);
+  mgos_barometer_set_events(*sensor, 0);
+  mgos_clear_timer((*sensor)->refresh_timer);
+  if ((*sensor)->driver->destroy && !(*sensor)->driver->destroy(*sensor)) {
+    LOG(LL_ERROR, ("Could not destroy mgos_barometer_type %d at I2C 0x%02x", (*sensor)->driver->type, (*sensor)->i2caddr));
   }
-  if ((*sensor)->user_data) {
-    free((*sensor)->user_data);
+  mgos_barometer_free_user_data(*sensor);
+  free((*sensor)->label);
+  (*sensor)->label = NULL;
+  if (!((*sensor)->flags & MGOS_BAROMETER_FLAG_STATIC)) {
+    free(*sensor);
   }
-  free(*sensor);
   *sensor = NULL;
   return;
 }
@@ -130,41 +896,349 @@ bool mgos_barometer_has_hygrometer(struct mgos_barometer *sensor) {
   return sensor->capabilities & MGOS_BAROMETER_CAP_HYGROMETER;
 }
 
-bool mgos_barometer_read(struct mgos_barometer *sensor) {
-  double start = mg_time();
-  bool   ret   = false;
+bool mgos_barometer_has_altimeter(struct mgos_barometer *sensor) {
+  if (!sensor) {
+    return false;
+  }
+  return sensor->capabilities & MGOS_BAROMETER_CAP_ALTIMETER;
+}
 
+bool mgos_barometer_read(struct mgos_barometer *sensor) {
   if (!sensor) {
     return false;
   }
-  if (!sensor->read) {
+  return mgos_barometer_read_caps(sensor, sensor->capabilities);
+}
+
+bool mgos_barometer_set_altimeter(struct mgos_barometer *sensor, const struct mgos_barometer_altimeter_cfg *cfg) {
+  bool ret;
+
+  if (!sensor || !sensor->driver) {
+    return false;
+  }
+  if (!sensor->driver->set_altimeter) {
+    LOG(LL_ERROR, ("%s has no altimeter mode", sensor->driver->name));
+    return false;
+  }
+  if (sensor->raw) {
+    LOG(LL_ERROR, ("Altimeter mode is not available during raw capture"));
     return false;
   }
 
-  sensor->stats.read++;
-  if (1000 * (start - sensor->stats.last_read_time) < sensor->cache_ttl_ms) {
-    sensor->stats.read_success_cached++;
-    return true;
+  mgos_barometer_bus_lock(sensor);
+  ret = sensor->driver->set_altimeter(sensor, cfg);
+  if (ret) {
+    // Pressure and altitude share the output registers.
+    if (cfg) {
+      sensor->capabilities = (sensor->capabilities & ~MGOS_BAROMETER_CAP_BAROMETER) | MGOS_BAROMETER_CAP_ALTIMETER;
+    } else {
+      sensor->capabilities = (sensor->capabilities & ~MGOS_BAROMETER_CAP_ALTIMETER) | MGOS_BAROMETER_CAP_BAROMETER;
+    }
+    sensor->pressure = 0;
+    sensor->altitude = 0;
+
+    // Samples from the old mode no longer apply: miss the cache and publish
+    // an empty snapshot until the first read in the new mode.
+    sensor->stats.last_read_time = 0;
+    sensor->snapshot_seq++;
+    __sync_synchronize();
+    memset(&sensor->snapshot, 0, sizeof(struct mgos_barometer_sample));
+    __sync_synchronize();
+    sensor->snapshot_seq++;
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return ret;
+}
+
+bool mgos_barometer_set_profile(struct mgos_barometer *sensor, enum mgos_barometer_profile profile) {
+  bool ret;
+
+  if (!sensor || !sensor->driver) {
+    return false;
+  }
+  if (!sensor->driver->set_profile) {
+    return profile == BARO_PROFILE_DEFAULT;
   }
 
-  ret = sensor->read(sensor);
+  mgos_barometer_bus_lock(sensor);
+  ret = sensor->driver->set_profile(sensor, profile);
   if (ret) {
+    // Costs learned under the old profile no longer apply.
+    sensor->read_cost_usecs = sensor->driver->read_cost_usecs;
+    sensor->profile         = profile;
+  }
+  mgos_barometer_bus_unlock(sensor);
+  if (!ret) {
+    LOG(LL_ERROR, ("Could not set profile %d on %s", profile, sensor->name));
+  }
+  return ret;
+}
+
+bool mgos_barometer_start_conversion(struct mgos_barometer *sensor, uint32_t *wait_usecs) {
+  bool ret = true;
+
+  if (!sensor || !sensor->driver || !wait_usecs) {
+    return false;
+  }
+  *wait_usecs = 0;
+  if (!sensor->driver->start) {
+    return true;
+  }
+
+  mgos_barometer_bus_lock(sensor);
+  if (sensor->flags & MGOS_BAROMETER_FLAG_CONVERTING) {
+    ret = false;
+  } else {
+    sensor->ts_usecs = 0;
+    ret = sensor->driver->start(sensor, wait_usecs);
+    if (ret) {
+      sensor->flags |= MGOS_BAROMETER_FLAG_CONVERTING;
+    }
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return ret;
+}
+
+int mgos_barometer_collect_conversion(struct mgos_barometer *sensor) {
+  double start;
+  int    ret;
+
+  if (!sensor || !sensor->driver) {
+    return -1;
+  }
+  if (!sensor->driver->start) {
+    return mgos_barometer_read(sensor) ? 1 : -1;
+  }
+
+  mgos_barometer_bus_lock(sensor);
+  if (!(sensor->flags & MGOS_BAROMETER_FLAG_CONVERTING)) {
+    mgos_barometer_bus_unlock(sensor);
+    return -1;
+  }
+  start = mg_time();
+  ret   = sensor->driver->collect(sensor);
+  sensor->flags &= ~MGOS_BAROMETER_FLAG_CONVERTING;
+  if (ret > 0) {
+    sensor->stats.read++;
     sensor->stats.read_success++;
-    sensor->stats.read_success_usecs += 1000000 * (mg_time() - start);
-    sensor->stats.last_read_time      = start;
+    sensor->stats.last_read_time = start;
+    mgos_barometer_publish_read(sensor);
+  } else if (ret < 0) {
+    sensor->stats.read++;
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return ret;
+}
+
+enum mgos_barometer_read_result mgos_barometer_read_deadline(struct mgos_barometer *sensor, uint32_t max_usecs, uint32_t *age_usecs) {
+  double  start = mg_time();
+  int64_t age;
+  struct mgos_barometer_sample    sample;
+  enum mgos_barometer_read_result ret;
+  enum mgos_barometer_cache_state state;
+
+  if (!sensor) {
+    return BARO_READ_ERROR;
+  }
+  if (!sensor->driver) {
+    return BARO_READ_ERROR;
+  }
+
+  // Waiting for another caller's transaction could take arbitrarily long, so
+  // fall back to the published snapshot, which needs no lock. Such reads are
+  // not counted in the stats, which are only written under the lock.
+  if (!mgos_barometer_bus_trylock(sensor)) {
+    ret = BARO_READ_CACHED;
+  } else {
+    sensor->stats.read++;
+    state = mgos_barometer_cache_lookup(sensor, sensor->capabilities, start);
+    if (state == CACHE_STALE) {
+      sensor->stats.cache_stale++;
+      mgos_barometer_refresh(sensor);
+    }
+    if (state != CACHE_MISS) {
+      sensor->stats.read_success_cached++;
+      ret = BARO_READ_CACHED;
+    } else if (sensor->read_cost_usecs > max_usecs) {
+      if (sensor->stats.read_success > 0) {
+        // Revalidate in the background if the caller opted into that.
+        if (sensor->cache_stale_ms > 0) {
+          mgos_barometer_refresh(sensor);
+        }
+        sensor->stats.read_success_cached++;
+        ret = BARO_READ_CACHED;
+      } else {
+        ret = BARO_READ_TIMEOUT;
+      }
+    } else {
+      sensor->stats.cache_miss++;
+      ret = mgos_barometer_read_uncached(sensor, start) ? BARO_READ_FRESH : BARO_READ_ERROR;
+    }
+    mgos_barometer_bus_unlock(sensor);
+    if (ret == BARO_READ_TIMEOUT || ret == BARO_READ_ERROR) {
+      return ret;
+    }
+  }
+
+  mgos_barometer_load(sensor, &sample);
+  if (sample.ts_usecs == 0) {
+    return BARO_READ_TIMEOUT;
+  }
+  if (age_usecs) {
+    age        = mgos_uptime_micros() - sample.ts_usecs;
+    *age_usecs = age < 0 ? 0 : age > UINT32_MAX ? UINT32_MAX : (uint32_t)age;
   }
   return ret;
 }
 
+bool mgos_barometer_start_sampling(struct mgos_barometer *sensor, uint32_t interval_ms) {
+  if (!sensor || !sensor->driver) {
+    return false;
+  }
+  return mgos_barometer_sampler_start(sensor, interval_ms, NULL);
+}
+
+bool mgos_barometer_start_adaptive_sampling(struct mgos_barometer *sensor, const struct mgos_barometer_adaptive_cfg *cfg) {
+  if (!sensor || !sensor->driver || !cfg) {
+    return false;
+  }
+  if (cfg->min_interval_ms == 0 || cfg->max_interval_ms < cfg->min_interval_ms || cfg->window_ms == 0) {
+    LOG(LL_ERROR, ("Invalid adaptive sampling config"));
+    return false;
+  }
+  return mgos_barometer_sampler_start(sensor, cfg->min_interval_ms, cfg);
+}
+
+bool mgos_barometer_get_sampling_stats(struct mgos_barometer *sensor, struct mgos_barometer_sampling_stats *stats) {
+  struct mgos_barometer_sampler *sampler;
+
+  if (!sensor || !stats || !sensor->sampler) {
+    return false;
+  }
+  sampler = sensor->sampler;
+
+  stats->busy_usecs     = sampler->busy_usecs;
+  stats->overhead_usecs = sampler->overhead_usecs;
+  stats->elapsed_usecs  = mgos_uptime_micros() - sampler->start_usecs;
+  stats->duty_cycle     = stats->elapsed_usecs > 0 ? stats->busy_usecs / stats->elapsed_usecs : 0;
+  stats->slope_pa_s     = sampler->slope_pa_s;
+  stats->sigma_pa       = sampler->sigma_pa;
+  stats->interval_ms    = sampler->interval_usecs / 1000;
+  stats->samples        = sampler->samples;
+  stats->rate_changes   = sampler->rate_changes;
+  stats->ticks          = sampler->ticks;
+  stats->missed         = sampler->missed;
+  return true;
+}
+
+int mgos_barometer_read_batch(struct mgos_barometer *sensor, struct mgos_barometer_sample *samples, int max) {
+  int n;
+
+  if (!sensor || !samples || max <= 0) {
+    return -1;
+  }
+  if (!sensor->driver) {
+    return -1;
+  }
+  if (!sensor->driver->read_batch) {
+    return mgos_barometer_read(sensor) && mgos_barometer_get_sample(sensor, samples) ? 1 : -1;
+  }
+
+  mgos_barometer_bus_lock(sensor);
+  sensor->stats.read++;
+  n = sensor->driver->read_batch(sensor, samples, max);
+  if (n >= 0) {
+    for (int i = 0; i < n; i++) {
+      mgos_barometer_publish(sensor, &samples[i]);
+    }
+    sensor->stats.read_success++;
+    sensor->stats.last_read_time = mg_time();
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return n;
+}
+
+static void mgos_barometer_fifo_int_handler(int pin, void *arg) {
+  struct mgos_barometer *     sensor = (struct mgos_barometer *)arg;
+  struct mgos_barometer_fifo *fifo   = sensor->fifo;
+  int n;
+
+  n = mgos_barometer_read_batch(sensor, fifo->buf, fifo->len);
+  if (n > 0 && fifo->cb) {
+    fifo->cb(sensor, fifo->buf, n, fifo->cb_arg);
+  }
+  if (n > 0 && sensor->fifo == fifo) {
+    mgos_barometer_emit(sensor, fifo->buf, n);
+  }
+}
+
+bool mgos_barometer_set_fifo(struct mgos_barometer *sensor, uint16_t watermark, int int_gpio,
+                             struct mgos_barometer_sample *buf, uint16_t len, mgos_barometer_batch_cb cb, void *cb_arg) {
+  struct mgos_barometer_fifo *fifo;
+  bool ret;
+
+  if (!sensor || !sensor->driver || !sensor->driver->set_fifo) {
+    return false;
+  }
+  if (sensor->fifo && sensor->fifo->gpio >= 0) {
+    mgos_gpio_disable_int(sensor->fifo->gpio);
+    mgos_gpio_remove_int_handler(sensor->fifo->gpio, NULL, NULL);
+  }
+  if (watermark == 0) {
+    mgos_barometer_bus_lock(sensor);
+    ret = sensor->driver->set_fifo(sensor, 0);
+    mgos_barometer_bus_unlock(sensor);
+    free(sensor->fifo);
+    sensor->fifo = NULL;
+    return ret;
+  }
+  // The interrupt is edge triggered, so each drain must take the FIFO below
+  // the watermark again.
+  if (!buf || len < watermark) {
+    return false;
+  }
+
+  if (!sensor->fifo) {
+    sensor->fifo = calloc(1, sizeof(struct mgos_barometer_fifo));
+    if (!sensor->fifo) {
+      return false;
+    }
+  }
+  fifo         = sensor->fifo;
+  fifo->buf    = buf;
+  fifo->len    = len;
+  fifo->cb     = cb;
+  fifo->cb_arg = cb_arg;
+  fifo->gpio   = int_gpio;
+
+  mgos_barometer_bus_lock(sensor);
+  ret = sensor->driver->set_fifo(sensor, watermark);
+  mgos_barometer_bus_unlock(sensor);
+  if (!ret) {
+    fifo->gpio = -1;
+    return false;
+  }
+
+  // The handler runs on the main task, not in interrupt context.
+  if (int_gpio >= 0) {
+    mgos_gpio_set_mode(int_gpio, MGOS_GPIO_MODE_INPUT);
+    mgos_gpio_set_int_handler(int_gpio, MGOS_GPIO_INT_EDGE_POS, mgos_barometer_fifo_int_handler, sensor);
+    mgos_gpio_enable_int(int_gpio);
+  }
+  return true;
+}
+
 bool mgos_barometer_get_pressure(struct mgos_barometer *sensor, float *p) {
   if (!mgos_barometer_has_barometer(sensor)) {
     return false;
   }
-  if (!mgos_barometer_read(sensor)) {
+  if (!mgos_barometer_read_caps(sensor, MGOS_BAROMETER_CAP_BAROMETER)) {
     return false;
   }
-  if (*p) {
-    *p = sensor->pressure;
+  if (p) {
+    struct mgos_barometer_sample sample;
+    mgos_barometer_load(sensor, &sample);
+    *p = sample.pressure;
   }
   return true;
 }
@@ -173,11 +1247,13 @@ bool mgos_barometer_get_temperature(struct mgos_barometer *sensor, float *t) {
   if (!mgos_barometer_has_thermometer(sensor)) {
     return false;
   }
-  if (!mgos_barometer_read(sensor)) {
+  if (!mgos_barometer_read_caps(sensor, MGOS_BAROMETER_CAP_THERMOMETER)) {
     return false;
   }
-  if (*t) {
-    *t = sensor->temperature;
+  if (t) {
+    struct mgos_barometer_sample sample;
+    mgos_barometer_load(sensor, &sample);
+    *t = sample.temperature;
   }
   return true;
 }
@@ -186,20 +1262,245 @@ bool mgos_barometer_get_humidity(struct mgos_barometer *sensor, float *h) {
   if (!mgos_barometer_has_hygrometer(sensor)) {
     return false;
   }
-  if (!mgos_barometer_read(sensor)) {
+  if (!mgos_barometer_read_caps(sensor, MGOS_BAROMETER_CAP_HYGROMETER)) {
+    return false;
+  }
+  if (h) {
+    struct mgos_barometer_sample sample;
+    mgos_barometer_load(sensor, &sample);
+    *h = sample.humidity;
+  }
+  return true;
+}
+
+bool mgos_barometer_get_altitude(struct mgos_barometer *sensor, float *a) {
+  if (!mgos_barometer_has_altimeter(sensor)) {
+    return false;
+  }
+  if (!mgos_barometer_read_caps(sensor, MGOS_BAROMETER_CAP_ALTIMETER)) {
+    return false;
+  }
+  if (a) {
+    struct mgos_barometer_sample sample;
+    mgos_barometer_load(sensor, &sample);
+    *a = sample.altitude;
+  }
+  return true;
+}
+
+bool mgos_barometer_get_sample(struct mgos_barometer *sensor, struct mgos_barometer_sample *sample) {
+  if (!sensor || !sample) {
+    return false;
+  }
+  if (sensor->stats.read_success == 0) {
+    return false;
+  }
+  mgos_barometer_load(sensor, sample);
+  return sample->ts_usecs != 0;
+}
+
+bool mgos_barometer_set_history(struct mgos_barometer *sensor, struct mgos_barometer_sample *buf, uint16_t len) {
+  struct mgos_barometer_sample *old;
+  bool old_heap, heap = false;
+
+  if (!sensor) {
+    return false;
+  }
+  if (len > 0 && !buf) {
+    buf = calloc(len, sizeof(struct mgos_barometer_sample));
+    if (!buf) {
+      return false;
+    }
+    heap = true;
+  }
+
+  mgos_barometer_bus_lock(sensor);
+  old                   = sensor->history;
+  old_heap              = !!(sensor->flags & MGOS_BAROMETER_FLAG_HISTORY_HEAP);
+  sensor->history       = (len > 0) ? buf : NULL;
+  sensor->history_len   = len;
+  sensor->history_count = 0;
+  if (heap) {
+    sensor->flags |= MGOS_BAROMETER_FLAG_HISTORY_HEAP;
+  } else {
+    sensor->flags &= ~MGOS_BAROMETER_FLAG_HISTORY_HEAP;
+  }
+  mgos_barometer_bus_unlock(sensor);
+
+  if (old && old_heap) {
+    free(old);
+  }
+  return true;
+}
+
+bool mgos_barometer_set_raw_capture(struct mgos_barometer *sensor, struct mgos_barometer_raw *buf, uint16_t len) {
+  struct mgos_barometer_sample sample;
+
+  if (!sensor || !sensor->driver) {
     return false;
   }
-  if (*h) {
-    *h = sensor->humidity;
+  if (len > 0) {
+    if (!buf) {
+      return false;
+    }
+    if (!sensor->driver->read_raw) {
+      LOG(LL_ERROR, ("%s does not support raw capture", sensor->driver->name));
+      return false;
+    }
+    if (sensor->capabilities & MGOS_BAROMETER_CAP_ALTIMETER) {
+      LOG(LL_ERROR, ("Raw capture is not available in altimeter mode"));
+      return false;
+    }
+  } else {
+    buf = NULL;
   }
+
+  // Compensate the latest capture on the way out, so that readers keep
+  // seeing it once the ring is gone.
+  mgos_barometer_bus_lock(sensor);
+  mgos_barometer_load(sensor, &sample);
+  sensor->snapshot_seq++;
+  __sync_synchronize();
+  sensor->snapshot  = sample;
+  sensor->raw       = buf;
+  sensor->raw_count = 0;
+  sensor->raw_len   = len;
+  __sync_synchronize();
+  sensor->snapshot_seq++;
+  mgos_barometer_bus_unlock(sensor);
   return true;
 }
 
+int mgos_barometer_get_raw(struct mgos_barometer *sensor, struct mgos_barometer_raw *raw, int max) {
+  uint32_t n, first;
+
+  if (!sensor || !raw || max < 0) {
+    return -1;
+  }
+
+  mgos_barometer_bus_lock(sensor);
+  if (!sensor->raw) {
+    mgos_barometer_bus_unlock(sensor);
+    return -1;
+  }
+  n = sensor->raw_count < sensor->raw_len ? sensor->raw_count : sensor->raw_len;
+  if (n > (uint32_t)max) {
+    n = max;
+  }
+  first = sensor->raw_count - n;
+  for (uint32_t i = 0; i < n; i++) {
+    raw[i] = sensor->raw[(first + i) % sensor->raw_len];
+  }
+  mgos_barometer_bus_unlock(sensor);
+  return n;
+}
+
+int mgos_barometer_compensate_samples(const struct mgos_barometer_raw *raw, int n, struct mgos_barometer_sample *out) {
+  float  p[16], t[16];
+  int    done = 0;
+  size_t chunk, converted;
+
+  if (!raw || !out || n < 0) {
+    return -1;
+  }
+
+  // Convert in chunks, so that runs sharing a calibration block still go
+  // through the kernels together.
+  while (done < n) {
+    chunk     = (n - done) < 16 ? (size_t)(n - done) : 16;
+    converted = mgos_barometer_compensate(&raw[done], chunk, p, t);
+    for (size_t i = 0; i < converted; i++) {
+      out[done + i].ts_usecs    = raw[done + i].ts_usecs;
+      out[done + i].pressure    = p[i];
+      out[done + i].temperature = t[i];
+      out[done + i].humidity    = 0;
+      out[done + i].altitude    = 0;
+    }
+    done += converted;
+    if (converted < chunk) {
+      break;
+    }
+  }
+  return done;
+}
+
+struct mgos_barometer *mgos_barometer_get_next(struct mgos_barometer *sensor) {
+  if (!sensor) {
+    return s_sensors;
+  }
+  return sensor->next;
+}
+
+struct mgos_barometer *mgos_barometer_get_by_id(uint16_t id) {
+  struct mgos_barometer *sensor;
+
+  for (sensor = s_sensors; sensor; sensor = sensor->next) {
+    if (sensor->id == id) {
+      return sensor;
+    }
+  }
+  return NULL;
+}
+
+uint16_t mgos_barometer_get_id(struct mgos_barometer *sensor) {
+  if (!sensor) {
+    return 0;
+  }
+  return sensor->id;
+}
+
 bool mgos_barometer_set_cache_ttl(struct mgos_barometer *sensor, uint16_t msecs) {
+  int ch;
+
+  if (!sensor) {
+    return false;
+  }
+  for (ch = 0; ch < MGOS_BAROMETER_CHANNELS; ch++) {
+    sensor->cache_ttl_ms[ch] = msecs;
+  }
+  return true;
+}
+
+bool mgos_barometer_set_channel_ttl(struct mgos_barometer *sensor, enum mgos_barometer_channel channel, uint16_t msecs) {
+  if (!sensor || (int)channel < 0 || channel >= MGOS_BAROMETER_CHANNELS) {
+    return false;
+  }
+  sensor->cache_ttl_ms[channel] = msecs;
+  return true;
+}
+
+bool mgos_barometer_set_cache_stale(struct mgos_barometer *sensor, uint16_t msecs) {
   if (!sensor) {
     return false;
   }
-  sensor->cache_ttl_ms = msecs;
+  sensor->cache_stale_ms = msecs;
+  return true;
+}
+
+bool mgos_barometer_get_footprint(struct mgos_barometer *sensor, struct mgos_barometer_footprint *fp) {
+  if (!sensor || !fp) {
+    return false;
+  }
+
+  fp->core_bytes      = sizeof(struct mgos_barometer);
+  fp->user_data_bytes = sensor->user_data ? sensor->driver->user_data_size : 0;
+  fp->aux_bytes       = 0;
+  fp->heap            = !(sensor->flags & MGOS_BAROMETER_FLAG_STATIC);
+  if (sensor->sampler) {
+    fp->aux_bytes += sizeof(struct mgos_barometer_sampler);
+  }
+  if (sensor->flags & MGOS_BAROMETER_FLAG_HISTORY_HEAP) {
+    fp->aux_bytes += sensor->history_len * sizeof(struct mgos_barometer_sample);
+  }
+  if (sensor->fifo) {
+    fp->aux_bytes += sizeof(struct mgos_barometer_fifo);
+  }
+  if (sensor->events) {
+    fp->aux_bytes += sizeof(struct mgos_barometer_event_ring) + sensor->events->len * (sizeof(struct mgos_barometer_sample) + 1);
+  }
+  if (sensor->label) {
+    fp->aux_bytes += strlen(sensor->label) + 1;
+  }
   return true;
 }
 
@@ -208,30 +1509,108 @@ bool mgos_barometer_get_stats(struct mgos_barometer *sensor, struct mgos_baromet
     return false;
   }
 
+  // Under the bus lock, which workers hold while they update them.
+  mgos_barometer_bus_lock(sensor);
   memcpy((void *)stats, (const void *)&sensor->stats, sizeof(struct mgos_barometer_stats));
+  mgos_barometer_bus_unlock(sensor);
+  return true;
+}
+
+bool mgos_barometer_set_label(struct mgos_barometer *sensor, const char *label) {
+  char *copy = NULL;
+
+  if (!sensor) {
+    return false;
+  }
+  if (label && *label) {
+    copy = strdup(label);
+    if (!copy) {
+      return false;
+    }
+  }
+  free(sensor->label);
+  sensor->label = copy;
   return true;
 }
 
+const char *mgos_barometer_get_label(struct mgos_barometer *sensor) {
+  if (!sensor) {
+    return NULL;
+  }
+  return sensor->label;
+}
+
+struct mgos_barometer *mgos_barometer_get_by_label(const char *label) {
+  struct mgos_barometer *sensor;
+
+  if (!label) {
+    return NULL;
+  }
+  for (sensor = s_sensors; sensor; sensor = sensor->next) {
+    if (sensor->label && strcmp(sensor->label, label) == 0) {
+      return sensor;
+    }
+  }
+  return NULL;
+}
+
 const char *mgos_barometer_get_name(struct mgos_barometer *sensor) {
   if (!sensor) {
     return "Unknown";
   }
-  switch (sensor->type) {
-  case BARO_MPL115: return "MPL115";
-
-  case BARO_MPL3115: return "MPL3115";
+  if (!sensor->name) {
+    return "UNKNOWN";
+  }
+  return sensor->name;
+}
 
-  case BARO_BME280:
-    if (mgos_barometer_has_hygrometer(sensor)) {
-      return "BME280";
-    } else{
-      return "BMP280";
+bool mgos_barometer_register_driver(const struct mgos_barometer_driver *drv) {
+  if (!drv || !drv->name || !drv->read) {
+    return false;
+  }
+  if (mgos_barometer_get_driver(drv->type)) {
+    LOG(LL_ERROR, ("Driver for mgos_barometer_type %d already registered", drv->type));
+    return false;
+  }
+  for (int i = 0; i < MGOS_BAROMETER_MAX_USER_DRIVERS; i++) {
+    if (!s_user_drivers[i]) {
+      s_user_drivers[i] = drv;
+      return true;
     }
+  }
+  LOG(LL_ERROR, ("No room to register driver %s", drv->name));
+  return false;
+}
 
-  case BARO_MS5611: return "MS5611";
+const struct mgos_barometer_driver *mgos_barometer_get_driver(enum mgos_barometer_type type) {
+  for (int i = 0; s_builtin_drivers[i]; i++) {
+    if (s_builtin_drivers[i]->type == type) {
+      return s_builtin_drivers[i];
+    }
+  }
+  for (int i = 0; i < MGOS_BAROMETER_MAX_USER_DRIVERS && s_user_drivers[i]; i++) {
+    if (s_user_drivers[i]->type == type) {
+      return s_user_drivers[i];
+    }
+  }
+  return NULL;
+}
 
-  default: return "UNKNOWN";
+const struct mgos_barometer_driver *mgos_barometer_get_driver_by_name(const char *name) {
+  if (!name) {
+    return NULL;
+  }
+  for (int i = 0; s_builtin_drivers[i]; i++) {
+    if (strcasecmp(s_builtin_drivers[i]->name, name) == 0) {
+      return s_builtin_drivers[i];
+    }
+  }
+  for (int i = 0; i < MGOS_BAROMETER_MAX_USER_DRIVERS && s_user_drivers[i]; i++) {
+    if (strcasecmp(s_user_drivers[i]->name, name) == 0) {
+      return s_user_drivers[i];
+    }
   }
+  return NULL;
 }
 
 int mgos_barometer_return_capabilities(struct mgos_barometer *sensor){
@@ -239,19 +1618,31 @@ int mgos_barometer_return_capabilities(struct mgos_barometer *sensor){
 }
 
 float mgos_barometer_return_spec(struct mgos_barometer *sensor, uint8_t cap){
+  struct mgos_barometer_sample sample;
+  mgos_barometer_load(sensor, &sample);
+  if(cap & MGOS_BAROMETER_CAP_ALTIMETER){
+    return sample.altitude;
+  }
   if(cap & MGOS_BAROMETER_CAP_HYGROMETER){
-    return sensor->humidity;
+    return sample.humidity;
   }
   if(cap & MGOS_BAROMETER_CAP_THERMOMETER){
-    return sensor->temperature;
+    return sample.temperature;
   }
   if(cap & MGOS_BAROMETER_CAP_BAROMETER){
-    return sensor->pressure;
+    return sample.pressure;
   }
   return 0.0;
 }
 
 bool mgos_barometer_init(void) {
+  mgos_event_register_base(MGOS_BAROMETER_EV_BASE, "barometer");
+#if MGOS_BAROMETER_ENABLE_RPC
+  mgos_barometer_rpc_init();
+#endif
+  mgos_barometer_metrics_init();
+  // A sensor that fails to come up must not stop the device from booting.
+  mgos_barometer_config_init();
   return true;
 }
 
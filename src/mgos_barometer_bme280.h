@@ -61,37 +61,23 @@
 #define BME280_FILTER_16X                          (0x04)
 
 
-struct mgos_barometer_bme280_calib_data {
-  // Calibration data:
-  uint16_t dig_T1;
-  int16_t  dig_T2;
-  int16_t  dig_T3;
-  uint16_t dig_P1;
-  int16_t  dig_P2;
-  int16_t  dig_P3;
-  int16_t  dig_P4;
-  int16_t  dig_P5;
-  int16_t  dig_P6;
-  int16_t  dig_P7;
-  int16_t  dig_P8;
-  int16_t  dig_P9;
-
-  // Additional calibration data for BME280
-  uint8_t  dig_H1;
-  int16_t  dig_H2;
-  uint8_t  dig_H3;
-  int16_t  dig_H4; // Note: this is 0xE4 / 0xE5[3:0]
-  int16_t  dig_H5; // Note: this is 0xE5[7:4] / 0xE6
-  int8_t   dig_H6;
-};
-
 struct mgos_barometer_bme280_data {
-  struct mgos_barometer_bme280_calib_data calib;
+  struct mgos_barometer_calib calib;
 
-  float                                   humidity;
+  float                       humidity;
 };
 
+// Temperature oversampling 2x, pressure oversampling 16x.
+#define BME280_CONV_USECS                          MGOS_BAROMETER_BME280_CONV_USECS
+// The sensor runs in normal mode, so a read is a single burst transaction.
+#define BME280_READ_COST_USECS                     (1000)
+// Start-up time after a soft reset, until the NVM has been copied
+#define BME280_RESET_USECS                         (10000)
+
 bool mgos_barometer_bme280_detect(struct mgos_barometer *dev);
+bool mgos_barometer_bme280_reset(struct mgos_barometer *dev);
 bool mgos_barometer_bme280_create(struct mgos_barometer *dev);
-bool mgos_barometer_bme280_destroy(struct mgos_barometer *dev);
 bool mgos_barometer_bme280_read(struct mgos_barometer *dev);
+bool mgos_barometer_bme280_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw);
+
+extern const struct mgos_barometer_driver mgos_barometer_bme280_driver;
@@ -0,0 +1,370 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos_barometer_bmp3.h"
+#include "mgos_i2c.h"
+
+#if MGOS_BAROMETER_ENABLE_BMP3
+
+// Datasheet:
+// https://www.bosch-sensortec.com/media/boschsensortec/downloads/datasheets/bst-bmp388-ds001.pdf
+
+// Bytes of FIFO data read per bus transaction
+#define BMP3_FIFO_CHUNK    (16 * BMP3_FIFO_FRAME_LEN)
+
+static uint32_t bmp3_u24(const uint8_t *data) {
+  return ((uint32_t)data[2] << 16) | ((uint32_t)data[1] << 8) | data[0];
+}
+
+// Data bytes following a FIFO frame header, or -1 if the header is unknown.
+static int bmp3_fifo_frame_len(uint8_t hdr) {
+  switch (hdr) {
+  case BMP3_FIFO_FRAME_PRESS_TEMP: return 6;
+
+  case BMP3_FIFO_FRAME_TEMP:
+  case BMP3_FIFO_FRAME_PRESS:
+  case BMP3_FIFO_FRAME_TIME: return 3;
+
+  case BMP3_FIFO_FRAME_CONFIG_ERR:
+  case BMP3_FIFO_FRAME_CONFIG_CHG: return 1;
+
+  default: return -1;
+  }
+}
+
+// Reconfigures measurement in sleep mode, then resumes normal mode.
+static bool bmp3_configure(struct mgos_barometer *dev, uint8_t osr_p, uint8_t odr, uint8_t filter) {
+  struct mgos_barometer_bmp3_data *bmp3_data = (struct mgos_barometer_bmp3_data *)dev->user_data;
+  int val;
+
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_PWR_CTRL, BMP3_PWR_PRESS_EN | BMP3_PWR_TEMP_EN)) {
+    return false;
+  }
+  // Pressure OS | Temp OS
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_OSR, osr_p | BMP3_OVERSAMP_1X << 3)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_ODR, odr)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_CONFIG, filter << 1)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_PWR_CTRL, BMP3_PWR_PRESS_EN | BMP3_PWR_TEMP_EN | BMP3_PWR_MODE_NORMAL)) {
+    return false;
+  }
+
+  // The chip refuses combinations of oversampling and ODR it can't keep up with.
+  if ((val = mgos_barometer_i2c_read_reg_b(dev, BMP3_REG_ERR)) < 0 || (val & 0x04)) {
+    LOG(LL_ERROR, ("Invalid configuration (err=0x%02x)", val));
+    return false;
+  }
+  bmp3_data->frame_usecs     = 5000 << odr;
+  bmp3_data->last_sensortime = 0;
+  bmp3_data->frames          = 0;
+  return true;
+}
+
+bool mgos_barometer_bmp3_detect(struct mgos_barometer *dev) {
+  int val;
+
+  if (!dev) {
+    return false;
+  }
+
+  if ((val = mgos_barometer_i2c_read_reg_b(dev, BMP3_REG_CHIP_ID)) < 0) {
+    return false;
+  }
+
+  if (val == 0x50) {
+    dev->name = "BMP388";
+    return true;
+  }
+  if (val == 0x60) {
+    dev->name = "BMP390";
+    return true;
+  }
+
+  return false;
+}
+
+bool mgos_barometer_bmp3_reset(struct mgos_barometer *dev) {
+  if (!dev) {
+    return false;
+  }
+  return mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_CMD, BMP3_CMD_SOFTRESET);
+}
+
+bool mgos_barometer_bmp3_create(struct mgos_barometer *dev) {
+  struct mgos_barometer_bmp3_data *bmp3_data;
+
+  if (!dev) {
+    return false;
+  }
+  bmp3_data = (struct mgos_barometer_bmp3_data *)dev->user_data;
+  if (!bmp3_data) {
+    return false;
+  }
+
+  // Read calibration data and scale it once, rather than on every sample
+  uint8_t nvm[21];
+  if (!mgos_barometer_i2c_read_reg_n(dev, BMP3_REG_CALIB, sizeof(nvm), nvm)) {
+    return false;
+  }
+  struct mgos_barometer_calib_bmp3 *c = &bmp3_data->calib.u.bmp3;
+  bmp3_data->calib.kind = BARO_CALIB_BMP3;
+  c->par_t1  = (float)(uint16_t)(nvm[0] | nvm[1] << 8) * 256.0f;
+  c->par_t2  = (float)(uint16_t)(nvm[2] | nvm[3] << 8) / 1073741824.0f;        // 2^30
+  c->par_t3  = (float)(int8_t)nvm[4] / 281474976710656.0f;                     // 2^48
+  c->par_p1  = ((float)(int16_t)(nvm[5] | nvm[6] << 8) - 16384.0f) / 1048576.0f;    // 2^14, 2^20
+  c->par_p2  = ((float)(int16_t)(nvm[7] | nvm[8] << 8) - 16384.0f) / 536870912.0f;  // 2^14, 2^29
+  c->par_p3  = (float)(int8_t)nvm[9] / 4294967296.0f;                          // 2^32
+  c->par_p4  = (float)(int8_t)nvm[10] / 137438953472.0f;                       // 2^37
+  c->par_p5  = (float)(uint16_t)(nvm[11] | nvm[12] << 8) * 8.0f;
+  c->par_p6  = (float)(uint16_t)(nvm[13] | nvm[14] << 8) / 64.0f;
+  c->par_p7  = (float)(int8_t)nvm[15] / 256.0f;
+  c->par_p8  = (float)(int8_t)nvm[16] / 32768.0f;
+  c->par_p9  = (float)(int16_t)(nvm[17] | nvm[18] << 8) / 281474976710656.0f;  // 2^48
+  c->par_p10 = (float)(int8_t)nvm[19] / 281474976710656.0f;                    // 2^48
+  c->par_p11 = (float)(int8_t)nvm[20] / 36893488147419103232.0f;               // 2^65
+
+  return bmp3_configure(dev, BMP3_OVERSAMP_2X, BMP3_ODR_100HZ, BMP3_FILTER_COEF_3);
+}
+
+bool mgos_barometer_bmp3_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw) {
+  struct mgos_barometer_bmp3_data *bmp3_data;
+  uint8_t data[6];
+
+  if (!dev || !raw) {
+    return false;
+  }
+  bmp3_data = (struct mgos_barometer_bmp3_data *)dev->user_data;
+  if (!bmp3_data) {
+    return false;
+  }
+
+  if (!mgos_barometer_i2c_read_reg_n(dev, BMP3_REG_DATA, 6, data)) {
+    return false;
+  }
+  raw->ts_usecs = 0;
+  raw->calib    = &bmp3_data->calib;
+  raw->adc_p    = bmp3_u24(&data[0]);
+  raw->adc_t    = bmp3_u24(&data[3]);
+  return true;
+}
+
+bool mgos_barometer_bmp3_read(struct mgos_barometer *dev) {
+  struct mgos_barometer_raw raw;
+
+  if (!mgos_barometer_bmp3_read_raw(dev, &raw)) {
+    return false;
+  }
+  mgos_barometer_compensate_bmp3(&raw.calib->u.bmp3, &raw, 1, &dev->pressure, &dev->temperature);
+  return true;
+}
+
+int mgos_barometer_bmp3_read_batch(struct mgos_barometer *dev, struct mgos_barometer_sample *samples, int max) {
+  struct mgos_barometer_bmp3_data *bmp3_data;
+  uint8_t  buf[BMP3_FIFO_CHUNK];
+  int      remaining, avail, carry = 0, i, len, n = 0;
+  bool     done = false, have_time = false;
+  uint32_t sensortime = 0;
+  int64_t  now;
+
+  if (!dev || !samples) {
+    return -1;
+  }
+  bmp3_data = (struct mgos_barometer_bmp3_data *)dev->user_data;
+  if (!bmp3_data) {
+    return -1;
+  }
+
+  if (!mgos_barometer_i2c_read_reg_n(dev, BMP3_REG_FIFO_LENGTH, 2, buf)) {
+    return -1;
+  }
+  remaining = ((buf[1] & 0x01) << 8) | buf[0];
+  if (remaining == 0) {
+    return 0;
+  }
+  // Once the FIFO is read empty, the chip appends a sensor time frame.
+  remaining += 4;
+
+  // Frames are parsed as chunks arrive, carrying partial frames over. FIFO
+  // reads are destructive, so a chunk never reaches past the frame that
+  // fills the last free slot: every frame is at most BMP3_FIFO_FRAME_LEN
+  // bytes, so finishing the carried frame plus one full frame per free slot
+  // always ends on or before that boundary.
+  while (!done && remaining > 0) {
+    int slots = max - n;
+    len = 0;
+    if (carry > 0) {
+      len = 1 + bmp3_fifo_frame_len(buf[0]) - carry;
+      if (buf[0] == BMP3_FIFO_FRAME_PRESS_TEMP) {
+        slots--;
+      }
+    }
+    len += slots * BMP3_FIFO_FRAME_LEN;
+    if (len > (int)sizeof(buf) - carry) {
+      len = sizeof(buf) - carry;
+    }
+    if (len > remaining) {
+      len = remaining;
+    }
+    if (!mgos_barometer_i2c_read_reg_n(dev, BMP3_REG_FIFO_DATA, len, buf + carry)) {
+      return -1;
+    }
+    remaining -= len;
+    avail      = carry + len;
+
+    for (i = 0; i < avail; ) {
+      uint8_t hdr = buf[i];
+      int     flen;
+      if (hdr == BMP3_FIFO_FRAME_EMPTY || (flen = bmp3_fifo_frame_len(hdr)) < 0) {
+        done = true;
+        break;
+      }
+      if (i + 1 + flen > avail) {
+        break;
+      }
+      if (hdr == BMP3_FIFO_FRAME_PRESS_TEMP) {
+        struct mgos_barometer_raw raw = {
+          .calib = &bmp3_data->calib, .adc_p = bmp3_u24(&buf[i + 4]), .adc_t = bmp3_u24(&buf[i + 1])
+        };
+        mgos_barometer_compensate_bmp3(&bmp3_data->calib.u.bmp3, &raw, 1, &samples[n].pressure, &samples[n].temperature);
+        samples[n].humidity = 0;
+        samples[n].altitude = 0;
+        if (++n == max) {
+          done = true;
+        }
+      } else if (hdr == BMP3_FIFO_FRAME_TIME) {
+        sensortime = bmp3_u24(&buf[i + 1]);
+        have_time  = true;
+      }
+      i += 1 + flen;
+      if (done) {
+        break;
+      }
+    }
+    carry = avail - i;
+    memmove(buf, buf + i, carry);
+  }
+
+  // Frames are evenly spaced at the output data rate. The sensor time frame
+  // lets us measure that rate against the chip's own clock.
+  bmp3_data->frames += n;
+  if (have_time) {
+    if (bmp3_data->last_sensortime && bmp3_data->frames > 0) {
+      uint32_t ticks = (sensortime - bmp3_data->last_sensortime) & 0xFFFFFF;
+      uint32_t usecs = (uint32_t)(((uint64_t)ticks * BMP3_SENSORTIME_NSECS) / 1000 / bmp3_data->frames);
+      if (usecs > bmp3_data->frame_usecs / 2 && usecs < bmp3_data->frame_usecs * 2) {
+        bmp3_data->frame_usecs = usecs;
+      }
+    }
+    bmp3_data->last_sensortime = sensortime;
+    bmp3_data->frames          = 0;
+  }
+  now = mgos_uptime_micros();
+  for (i = 0; i < n; i++) {
+    samples[i].ts_usecs = now - (int64_t)(n - 1 - i) * bmp3_data->frame_usecs;
+  }
+  if (n > 0) {
+    dev->pressure    = samples[n - 1].pressure;
+    dev->temperature = samples[n - 1].temperature;
+  }
+
+  return n;
+}
+
+bool mgos_barometer_bmp3_set_profile(struct mgos_barometer *dev, enum mgos_barometer_profile profile) {
+  if (!dev || !dev->user_data) {
+    return false;
+  }
+
+  switch (profile) {
+  case BARO_PROFILE_DEFAULT: return bmp3_configure(dev, BMP3_OVERSAMP_2X, BMP3_ODR_100HZ, BMP3_FILTER_COEF_3);
+
+  case BARO_PROFILE_LOW_POWER: return bmp3_configure(dev, BMP3_OVERSAMP_1X, BMP3_ODR_1_5HZ, BMP3_FILTER_OFF);
+
+  // Unfiltered, so that downstream filters see the least lag.
+  case BARO_PROFILE_HIGH_RATE: return bmp3_configure(dev, BMP3_OVERSAMP_1X, BMP3_ODR_200HZ, BMP3_FILTER_OFF);
+
+  default: return false;
+  }
+}
+
+bool mgos_barometer_bmp3_set_fifo(struct mgos_barometer *dev, uint16_t watermark) {
+  uint8_t wtm[2];
+
+  if (!dev) {
+    return false;
+  }
+
+  if (watermark == 0) {
+    if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_INT_CTRL, 0x00)) {
+      return false;
+    }
+    if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_FIFO_CONFIG_1, 0x00)) {
+      return false;
+    }
+    return mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_CMD, BMP3_CMD_FIFO_FLUSH);
+  }
+
+  // Watermark is in bytes, leave room for the sensor time frame.
+  if (watermark > (BMP3_FIFO_SIZE - 4) / BMP3_FIFO_FRAME_LEN) {
+    watermark = (BMP3_FIFO_SIZE - 4) / BMP3_FIFO_FRAME_LEN;
+  }
+  wtm[0] = (watermark * BMP3_FIFO_FRAME_LEN) & 0xFF;
+  wtm[1] = (watermark * BMP3_FIFO_FRAME_LEN) >> 8;
+  if (!mgos_barometer_i2c_write_reg_n(dev, BMP3_REG_FIFO_WTM, 2, wtm)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_FIFO_CONFIG_2, BMP3_FIFO_FILTERED)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_FIFO_CONFIG_1,
+                            BMP3_FIFO_MODE | BMP3_FIFO_TIME_EN | BMP3_FIFO_PRESS_EN | BMP3_FIFO_TEMP_EN)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_INT_CTRL, BMP3_INT_LEVEL_HIGH | BMP3_INT_FWTM_EN)) {
+    return false;
+  }
+  return mgos_barometer_i2c_write_reg_b(dev, BMP3_REG_CMD, BMP3_CMD_FIFO_FLUSH);
+}
+
+_Static_assert(sizeof(struct mgos_barometer_bmp3_data) <= MGOS_BAROMETER_USER_DATA_SIZE, "MGOS_BAROMETER_USER_DATA_SIZE too small");
+
+const struct mgos_barometer_driver mgos_barometer_bmp3_driver = {
+  .name            = "BMP388",
+  .type            = BARO_BMP3,
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .i2caddr         = { 0x77, 0x76 },
+  .user_data_size  = sizeof(struct mgos_barometer_bmp3_data),
+  .conv_usecs      = BMP3_CONV_USECS,
+  .read_cost_usecs = BMP3_READ_COST_USECS,
+  .reset_usecs     = BMP3_RESET_USECS,
+  .detect          = mgos_barometer_bmp3_detect,
+  .reset           = mgos_barometer_bmp3_reset,
+  .create          = mgos_barometer_bmp3_create,
+  .destroy         = NULL,
+  .read            = mgos_barometer_bmp3_read,
+  .read_raw        = mgos_barometer_bmp3_read_raw,
+  .read_batch      = mgos_barometer_bmp3_read_batch,
+  .set_fifo        = mgos_barometer_bmp3_set_fifo,
+  .set_profile     = mgos_barometer_bmp3_set_profile,
+};
+
+#endif // MGOS_BAROMETER_ENABLE_BMP3
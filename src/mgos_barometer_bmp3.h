@@ -0,0 +1,115 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+
+// ChipID: 0x50 is BMP388, 0x60 is BMP390
+#define BMP3_REG_CHIP_ID          (0x00)
+#define BMP3_REG_ERR              (0x02)
+#define BMP3_REG_STATUS           (0x03)
+#define BMP3_REG_DATA             (0x04) /* Pressure XLSB .. Temperature MSB */
+#define BMP3_REG_SENSORTIME       (0x0C)
+#define BMP3_REG_INT_STATUS       (0x11)
+#define BMP3_REG_FIFO_LENGTH      (0x12)
+#define BMP3_REG_FIFO_DATA        (0x14)
+#define BMP3_REG_FIFO_WTM         (0x15)
+#define BMP3_REG_FIFO_CONFIG_1    (0x17)
+#define BMP3_REG_FIFO_CONFIG_2    (0x18)
+#define BMP3_REG_INT_CTRL         (0x19)
+#define BMP3_REG_PWR_CTRL         (0x1B)
+#define BMP3_REG_OSR              (0x1C)
+#define BMP3_REG_ODR              (0x1D)
+#define BMP3_REG_CONFIG           (0x1F)
+#define BMP3_REG_CALIB            (0x31)
+#define BMP3_REG_CMD              (0x7E)
+
+#define BMP3_CMD_FIFO_FLUSH       (0xB0)
+#define BMP3_CMD_SOFTRESET        (0xB6)
+
+#define BMP3_PWR_PRESS_EN         (0x01)
+#define BMP3_PWR_TEMP_EN          (0x02)
+#define BMP3_PWR_MODE_NORMAL      (0x30)
+
+#define BMP3_OVERSAMP_1X          (0x00)
+#define BMP3_OVERSAMP_2X          (0x01)
+#define BMP3_OVERSAMP_4X          (0x02)
+#define BMP3_OVERSAMP_8X          (0x03)
+#define BMP3_OVERSAMP_16X         (0x04)
+#define BMP3_OVERSAMP_32X         (0x05)
+
+// Output data rate is 200Hz / 2^ODR
+#define BMP3_ODR_200HZ            (0x00)
+#define BMP3_ODR_100HZ            (0x01)
+#define BMP3_ODR_50HZ             (0x02)
+#define BMP3_ODR_25HZ             (0x03)
+#define BMP3_ODR_1_5HZ            (0x07)
+
+#define BMP3_FILTER_OFF           (0x00)
+#define BMP3_FILTER_COEF_1        (0x01)
+#define BMP3_FILTER_COEF_3        (0x02)
+#define BMP3_FILTER_COEF_7        (0x03)
+
+#define BMP3_FIFO_MODE            (0x01)
+#define BMP3_FIFO_TIME_EN         (0x04)
+#define BMP3_FIFO_PRESS_EN        (0x08)
+#define BMP3_FIFO_TEMP_EN         (0x10)
+#define BMP3_FIFO_FILTERED        (0x08) /* FIFO_CONFIG_2 data_select */
+
+#define BMP3_INT_LEVEL_HIGH       (0x02)
+#define BMP3_INT_FWTM_EN          (0x08)
+
+// FIFO frame headers, followed by the given number of data bytes
+#define BMP3_FIFO_FRAME_PRESS_TEMP (0x94) /* 3 bytes temperature, 3 bytes pressure */
+#define BMP3_FIFO_FRAME_TEMP       (0x90) /* 3 bytes */
+#define BMP3_FIFO_FRAME_PRESS      (0x84) /* 3 bytes */
+#define BMP3_FIFO_FRAME_TIME       (0xA0) /* 3 bytes sensor time */
+#define BMP3_FIFO_FRAME_EMPTY      (0x80)
+#define BMP3_FIFO_FRAME_CONFIG_ERR (0x44) /* 1 byte */
+#define BMP3_FIFO_FRAME_CONFIG_CHG (0x48) /* 1 byte */
+
+#define BMP3_FIFO_SIZE            (512)
+#define BMP3_FIFO_FRAME_LEN       (7)
+
+// Sensor time ticks at 25.6kHz
+#define BMP3_SENSORTIME_NSECS     (39063)
+
+// Pressure oversampling 2x, temperature 1x, normal mode at 100Hz.
+#define BMP3_CONV_USECS           MGOS_BAROMETER_BMP3_CONV_USECS
+#define BMP3_READ_COST_USECS      (1000)
+#define BMP3_RESET_USECS          (2000)
+
+struct mgos_barometer_bmp3_data {
+  // Compensation coefficients, scaled from the NVM values once at create time
+  struct mgos_barometer_calib calib;
+
+  uint32_t                    frame_usecs;    // measured FIFO frame period
+  uint32_t                    last_sensortime;
+  uint32_t                    frames;         // frames drained since last_sensortime
+};
+
+bool mgos_barometer_bmp3_detect(struct mgos_barometer *dev);
+bool mgos_barometer_bmp3_reset(struct mgos_barometer *dev);
+bool mgos_barometer_bmp3_create(struct mgos_barometer *dev);
+bool mgos_barometer_bmp3_read(struct mgos_barometer *dev);
+bool mgos_barometer_bmp3_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw);
+int mgos_barometer_bmp3_read_batch(struct mgos_barometer *dev, struct mgos_barometer_sample *samples, int max);
+bool mgos_barometer_bmp3_set_fifo(struct mgos_barometer *dev, uint16_t watermark);
+bool mgos_barometer_bmp3_set_profile(struct mgos_barometer *dev, enum mgos_barometer_profile profile);
+
+extern const struct mgos_barometer_driver mgos_barometer_bmp3_driver;
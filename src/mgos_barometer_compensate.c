@@ -0,0 +1,257 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos_barometer_compensate.h"
+
+// Compensation constants of one member of the MS56xx/MS58xx family. The
+// variants differ only in the shifts and multipliers of the datasheet's
+// first and second order formulas.
+struct ms56xx_variant {
+  // First order: SENS = (C1 << sens_c1_shl) + ((C3 * dT) >> sens_c3_shr),
+  //              OFF  = (C2 << off_c2_shl) + ((C4 * dT) >> off_c4_shr)
+  uint8_t sens_c1_shl, sens_c3_shr;
+  uint8_t off_c2_shl, off_c4_shr;
+  // Second order below 20C, with d = TEMP - 2000:
+  // T2 = (t2_mul * dT^2) >> t2_shr, OFF2 = (off2_mul * d^2) >> off2_shr, and
+  // SENS2 likewise
+  uint8_t lo_t2_mul, lo_t2_shr;
+  uint8_t lo_off2_mul, lo_off2_shr;
+  uint8_t lo_sens2_mul, lo_sens2_shr;
+  // ... plus, below -15C with d = TEMP + 1500:
+  uint8_t vlo_off2_mul;
+  uint8_t vlo_sens2_mul, vlo_sens2_shr;
+  // At or above 20C: T2 = (t2_mul * dT^2) >> t2_shr
+  uint8_t hi_t2_mul, hi_t2_shr;
+  // Above 45C with d = TEMP - 4500: SENS2 -= (sens2_mul * d^2) >> sens2_shr
+  uint8_t vhi_sens2_mul, vhi_sens2_shr;
+};
+
+static const struct ms56xx_variant s_ms56xx_variants[] = {
+  [BARO_MS56XX_MS5611] = {
+    .sens_c1_shl   = 15, .sens_c3_shr   = 8,
+    .off_c2_shl    = 16, .off_c4_shr    = 7,
+    .lo_t2_mul     = 1,  .lo_t2_shr     = 31,
+    .lo_off2_mul   = 5,  .lo_off2_shr   = 1,
+    .lo_sens2_mul  = 5,  .lo_sens2_shr  = 2,
+    .vlo_off2_mul  = 7,
+    .vlo_sens2_mul = 11, .vlo_sens2_shr = 1,
+    .hi_t2_mul     = 0,  .hi_t2_shr     = 0,
+    .vhi_sens2_mul = 0,  .vhi_sens2_shr = 0,
+  },
+  [BARO_MS56XX_MS5607] = {
+    .sens_c1_shl   = 16, .sens_c3_shr   = 7,
+    .off_c2_shl    = 17, .off_c4_shr    = 6,
+    .lo_t2_mul     = 1,  .lo_t2_shr     = 31,
+    .lo_off2_mul   = 61, .lo_off2_shr   = 4,
+    .lo_sens2_mul  = 2,  .lo_sens2_shr  = 0,
+    .vlo_off2_mul  = 15,
+    .vlo_sens2_mul = 8,  .vlo_sens2_shr = 0,
+    .hi_t2_mul     = 0,  .hi_t2_shr     = 0,
+    .vhi_sens2_mul = 0,  .vhi_sens2_shr = 0,
+  },
+  [BARO_MS56XX_MS5637] = {
+    .sens_c1_shl   = 16, .sens_c3_shr   = 7,
+    .off_c2_shl    = 17, .off_c4_shr    = 6,
+    .lo_t2_mul     = 3,  .lo_t2_shr     = 33,
+    .lo_off2_mul   = 61, .lo_off2_shr   = 4,
+    .lo_sens2_mul  = 29, .lo_sens2_shr  = 4,
+    .vlo_off2_mul  = 17,
+    .vlo_sens2_mul = 9,  .vlo_sens2_shr = 0,
+    .hi_t2_mul     = 5,  .hi_t2_shr     = 38,
+    .vhi_sens2_mul = 0,  .vhi_sens2_shr = 0,
+  },
+  // MS5803-01BA; the other MS5803 ranges scale pressure differently.
+  [BARO_MS56XX_MS5803] = {
+    .sens_c1_shl   = 15, .sens_c3_shr   = 8,
+    .off_c2_shl    = 16, .off_c4_shr    = 7,
+    .lo_t2_mul     = 1,  .lo_t2_shr     = 31,
+    .lo_off2_mul   = 3,  .lo_off2_shr   = 0,
+    .lo_sens2_mul  = 7,  .lo_sens2_shr  = 3,
+    .vlo_off2_mul  = 0,
+    .vlo_sens2_mul = 2,  .vlo_sens2_shr = 0,
+    .hi_t2_mul     = 0,  .hi_t2_shr     = 0,
+    .vhi_sens2_mul = 1,  .vhi_sens2_shr = 3,
+  },
+};
+
+// Private functions follow
+
+// Compensation from datasheet section 9.3, in single precision so that it
+// runs on the FPU of ESP32. The error this adds is well below the noise floor.
+static void bmp3_compensate(const struct mgos_barometer_calib_bmp3 *c, uint32_t Padc, uint32_t Tadc, float *p, float *t) {
+  float pd1, pd2, pd3, pd4, out1, out2, t_lin;
+  float up = (float)Padc;
+
+  pd1   = (float)Tadc - c->par_t1;
+  pd2   = pd1 * c->par_t2;
+  t_lin = pd2 + (pd1 * pd1) * c->par_t3;
+  *t    = t_lin;
+
+  pd1  = c->par_p6 * t_lin;
+  pd2  = c->par_p7 * (t_lin * t_lin);
+  pd3  = c->par_p8 * (t_lin * t_lin * t_lin);
+  out1 = c->par_p5 + pd1 + pd2 + pd3;
+
+  pd1  = c->par_p2 * t_lin;
+  pd2  = c->par_p3 * (t_lin * t_lin);
+  pd3  = c->par_p4 * (t_lin * t_lin * t_lin);
+  out2 = up * (c->par_p1 + pd1 + pd2 + pd3);
+
+  pd1 = up * up;
+  pd2 = c->par_p9 + c->par_p10 * t_lin;
+  pd3 = pd1 * pd2;
+  pd4 = pd3 + (up * up * up) * c->par_p11;
+  *p  = out1 + out2 + pd4;
+}
+
+// Private functions end
+
+// Public functions follow
+
+/* TESTDATA (coefficients a0=2009.75 b1=-2.37585 b2=-0.92047 c12=0.000790,
+ * Padc=410, Tadc=507) yields:
+ * pressure=96587.33
+ * temperature=23.32
+ */
+void mgos_barometer_compensate_mpl115(const struct mgos_barometer_calib_mpl115 *c, const struct mgos_barometer_raw *raw, size_t n,
+                                      float *pressure, float *temperature) {
+  for (size_t i = 0; i < n; i++) {
+    float Padc  = (float)raw[i].adc_p;
+    float Tadc  = (float)raw[i].adc_t;
+    float Pcomp = c->a0 + (c->b1 + c->c12 * Tadc) * Padc + c->b2 * Tadc;
+
+    pressure[i]    = (Pcomp * (65.0F / 1023.0F) + 50.0F) * 1000.0F;   // Pascals
+    temperature[i] = (Tadc - 498.0F) / -5.35F + 25.0F;                // Celsius
+  }
+}
+
+// Pressure is Q18.2 Pascals, temperature a 12 bit signed Q8.4 Celsius.
+void mgos_barometer_compensate_mpl3115(const struct mgos_barometer_raw *raw, size_t n, float *pressure, float *temperature) {
+  for (size_t i = 0; i < n; i++) {
+    int16_t t = raw[i].adc_t & 0xFFF;
+
+    if (t & 0x800) {
+      t |= 0xF000;
+    }
+    pressure[i]    = raw[i].adc_p / 4.0F;
+    temperature[i] = t / 16.0F;
+  }
+}
+
+// From datasheet, section 8.1, in double precision
+void mgos_barometer_compensate_bme280(const struct mgos_barometer_calib_bme280 *c, const struct mgos_barometer_raw *raw, size_t n,
+                                      float *pressure, float *temperature) {
+  for (size_t i = 0; i < n; i++) {
+    int32_t Padc = raw[i].adc_p, Tadc = raw[i].adc_t;
+    double  var1, var2, T, P;
+    int32_t t_fine;
+
+    // Compensation for temperature -- double precision
+    var1 = (((double)Tadc) / 16384.0 - ((double)c->dig_T1) / 1024.0) * ((double)c->dig_T2);
+    var2 = ((((double)Tadc) / 131072.0 - ((double)c->dig_T1) / 8192.0) *
+            (((double)Tadc) / 131072.0 - ((double)c->dig_T1) / 8192.0)) * ((double)c->dig_T3);
+    t_fine         = (int32_t)(var1 + var2);
+    T              = (var1 + var2) / 5120.0;
+    temperature[i] = (float)T;
+
+    // Compensation for pressure -- double precision
+    var1 = ((double)t_fine / 2.0) - 64000.0;
+    var2 = var1 * var1 * ((double)c->dig_P6) / 32768.0;
+    var2 = var2 + var1 * ((double)c->dig_P5) * 2.0;
+    var2 = (var2 / 4.0) + (((double)c->dig_P4) * 65536.0);
+    var1 = (((double)c->dig_P3) * var1 * var1 / 524288.0 + ((double)c->dig_P2) * var1) / 524288.0;
+    var1 = (1.0 + var1 / 32768.0) * ((double)c->dig_P1);
+    if (var1 == 0.0) {
+      P = 0.0;
+    } else {
+      P    = 1048576.0 - (double)Padc;
+      P    = (P - (var2 / 4096.0)) * 6250.0 / var1;
+      var1 = ((double)c->dig_P9) * P * P / 2147483648.0;
+      var2 = P * ((double)c->dig_P8) / 32768.0;
+      P    = P + (var1 + var2 + ((double)c->dig_P7)) / 16.0;
+    }
+    pressure[i] = (float)P;
+  }
+}
+
+// The constants for the variant are looked up once per call, so the loop
+// runs the same straight-line code for every member of the family.
+void mgos_barometer_compensate_ms56xx(const struct mgos_barometer_calib_ms56xx *cal, const struct mgos_barometer_raw *raw, size_t n,
+                                      float *pressure, float *temperature) {
+  const struct ms56xx_variant *v = &s_ms56xx_variants[cal->variant < sizeof(s_ms56xx_variants) / sizeof(s_ms56xx_variants[0]) ? cal->variant : 0];
+  const uint16_t *c = cal->prom;
+
+  for (size_t i = 0; i < n; i++) {
+    int64_t dT   = (int64_t)raw[i].adc_t - ((int64_t)c[5] << 8);
+    int64_t temp = 2000 + ((dT * (int64_t)c[6]) >> 23);
+    int64_t off  = ((int64_t)c[2] << v->off_c2_shl) + (((int64_t)c[4] * dT) >> v->off_c4_shr);
+    int64_t sens = ((int64_t)c[1] << v->sens_c1_shl) + (((int64_t)c[3] * dT) >> v->sens_c3_shr);
+
+    // Second order compensation. Terms outside their temperature range are
+    // zeroed rather than branched around.
+    int64_t lo   = temp < 2000 ? temp - 2000 : 0;
+    int64_t vlo  = temp < -1500 ? temp + 1500 : 0;
+    int64_t vhi  = temp > 4500 ? temp - 4500 : 0;
+    int64_t dT2  = dT * dT;
+    int64_t t2   = temp < 2000 ? (v->lo_t2_mul * dT2) >> v->lo_t2_shr : (v->hi_t2_mul * dT2) >> v->hi_t2_shr;
+
+    off  -= ((v->lo_off2_mul * lo * lo) >> v->lo_off2_shr) + v->vlo_off2_mul * vlo * vlo;
+    sens -= ((v->lo_sens2_mul * lo * lo) >> v->lo_sens2_shr) + ((v->vlo_sens2_mul * vlo * vlo) >> v->vlo_sens2_shr)
+            - ((v->vhi_sens2_mul * vhi * vhi) >> v->vhi_sens2_shr);
+    temp -= t2;
+
+    pressure[i]    = ((((int64_t)raw[i].adc_p * sens) >> 21) - off) >> 15;
+    temperature[i] = (float)temp / 100.0F;
+  }
+}
+
+void mgos_barometer_compensate_bmp3(const struct mgos_barometer_calib_bmp3 *c, const struct mgos_barometer_raw *raw, size_t n,
+                                    float *pressure, float *temperature) {
+  for (size_t i = 0; i < n; i++) {
+    bmp3_compensate(c, raw[i].adc_p, raw[i].adc_t, &pressure[i], &temperature[i]);
+  }
+}
+
+size_t mgos_barometer_compensate(const struct mgos_barometer_raw *raw, size_t n, float *pressure, float *temperature) {
+  size_t i = 0, run;
+
+  while (i < n) {
+    const struct mgos_barometer_calib *c = raw[i].calib;
+
+    if (!c) {
+      break;
+    }
+    for (run = 1; i + run < n && raw[i + run].calib == c; run++) {
+    }
+
+    switch (c->kind) {
+    case BARO_CALIB_MPL115: mgos_barometer_compensate_mpl115(&c->u.mpl115, &raw[i], run, &pressure[i], &temperature[i]); break;
+
+    case BARO_CALIB_MPL3115: mgos_barometer_compensate_mpl3115(&raw[i], run, &pressure[i], &temperature[i]); break;
+
+    case BARO_CALIB_BME280: mgos_barometer_compensate_bme280(&c->u.bme280, &raw[i], run, &pressure[i], &temperature[i]); break;
+
+    case BARO_CALIB_MS56XX: mgos_barometer_compensate_ms56xx(&c->u.ms56xx, &raw[i], run, &pressure[i], &temperature[i]); break;
+
+    case BARO_CALIB_BMP3: mgos_barometer_compensate_bmp3(&c->u.bmp3, &raw[i], run, &pressure[i], &temperature[i]); break;
+
+    default: return i;
+    }
+    i += run;
+  }
+  return i;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos.h"
+#include "mgos_i2c.h"
+#include "mgos_barometer_internal.h"
+
+// Both slots share the schema of barometer.s0.
+typedef const struct mgos_config_barometer_s0 *(*mgos_barometer_config_get_fn)(void);
+
+static const mgos_barometer_config_get_fn s_slots[] = {
+  mgos_sys_config_get_barometer_s0,
+  mgos_sys_config_get_barometer_s1,
+};
+
+// Private functions follow
+static void mgos_barometer_config_created(struct mgos_barometer *sensor, void *arg) {
+  const struct mgos_config_barometer_s0 *cfg = (const struct mgos_config_barometer_s0 *)arg;
+
+  if (!sensor) {
+    LOG(LL_ERROR, ("Could not create %s barometer %s at I2C bus %d addr 0x%02x", cfg->type, cfg->label ? cfg->label : "", cfg->bus, cfg->addr));
+    return;
+  }
+  if (!mgos_barometer_set_label(sensor, cfg->label)) {
+    LOG(LL_ERROR, ("Could not label barometer %u", mgos_barometer_get_id(sensor)));
+  }
+  if (cfg->profile != BARO_PROFILE_DEFAULT && !mgos_barometer_set_profile(sensor, (enum mgos_barometer_profile)cfg->profile)) {
+    LOG(LL_WARN, ("%s does not support profile %d", mgos_barometer_get_name(sensor), cfg->profile));
+  }
+  if (cfg->rate_ms > 0 && !mgos_barometer_start_sampling(sensor, cfg->rate_ms)) {
+    LOG(LL_ERROR, ("Could not start sampling %s every %d ms", mgos_barometer_get_name(sensor), cfg->rate_ms));
+  }
+  LOG(LL_INFO, ("Barometer %s (%s) ready at I2C bus %d addr 0x%02x", cfg->label ? cfg->label : "", mgos_barometer_get_name(sensor), cfg->bus, sensor->i2caddr));
+}
+
+static bool mgos_barometer_config_start(const struct mgos_config_barometer_s0 *cfg) {
+  const struct mgos_barometer_driver *drv;
+  struct mgos_i2c *i2c;
+
+  drv = mgos_barometer_get_driver_by_name(cfg->type);
+  if (!drv) {
+    LOG(LL_ERROR, ("Unknown barometer type '%s'", cfg->type ? cfg->type : ""));
+    return false;
+  }
+  i2c = mgos_i2c_get_bus(cfg->bus);
+  if (!i2c) {
+    LOG(LL_ERROR, ("I2C bus %d is not enabled", cfg->bus));
+    return false;
+  }
+  return mgos_barometer_create_i2c_async(i2c, cfg->addr, drv->type, mgos_barometer_config_created, (void *)cfg);
+}
+
+// Private functions end
+
+// Public functions follow
+bool mgos_barometer_config_init(void) {
+  bool ret = true;
+
+  for (size_t i = 0; i < sizeof(s_slots) / sizeof(s_slots[0]); i++) {
+    const struct mgos_config_barometer_s0 *cfg = s_slots[i]();
+    if (!cfg->enable) {
+      continue;
+    }
+    if (!mgos_barometer_config_start(cfg)) {
+      LOG(LL_ERROR, ("Could not start barometer.s%u", (unsigned)i));
+      ret = false;
+    }
+  }
+  return ret;
+}
+
+// Public functions end
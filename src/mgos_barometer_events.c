@@ -0,0 +1,186 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+
+// Private functions follow
+static void mgos_barometer_event_ring_free(struct mgos_barometer_event_ring *ring) {
+  // buf and refs share the ring's allocation
+  free(ring);
+}
+
+static void mgos_barometer_event_ring_unhold(struct mgos_barometer_event_ring *ring) {
+  ring->holds--;
+  if (ring->orphaned && ring->holds == 0) {
+    mgos_barometer_event_ring_free(ring);
+  }
+}
+
+// Publish up to n samples into consecutive slots without wrapping. Held
+// slots are skipped first, which leaves a gap in the sequence numbers that
+// is counted as dropped. Returns the number published, 0 if every slot is
+// held.
+static int mgos_barometer_emit_chunk(struct mgos_barometer *sensor, const struct mgos_barometer_sample *samples, int n) {
+  struct mgos_barometer_event_ring *ring = sensor->events;
+  struct mgos_barometer_event_data  ev;
+  uint16_t first = ring->count % ring->len;
+  uint16_t skip  = 0;
+  int      k     = 0;
+
+  while (skip < ring->len && ring->refs[(first + skip) % ring->len] != 0) {
+    skip++;
+  }
+  if (skip == ring->len) {
+    return 0;
+  }
+  ring->count   += skip;
+  ring->dropped += skip;
+  first          = ring->count % ring->len;
+
+  while (k < n && first + k < ring->len && ring->refs[first + k] == 0) {
+    ring->buf[first + k] = samples[k];
+    k++;
+  }
+  if (k == 0) {
+    return 0;
+  }
+  ev.sensor  = sensor;
+  ev.samples = &ring->buf[first];
+  ev.ring    = ring;
+  ev.seq     = ring->count;
+  ev.n       = k;
+  ring->count        += k;
+  ring->last_ts_usecs = samples[k - 1].ts_usecs;
+  // A handler may turn events off, but later handlers still get the same
+  // ev, so the ring is held until all of them have run.
+  ring->holds++;
+  mgos_event_trigger(MGOS_BAROMETER_EV_SAMPLES, &ev);
+  mgos_barometer_event_ring_unhold(ring);
+  return k;
+}
+
+// Private functions end
+
+// Public functions follow
+void mgos_barometer_emit(struct mgos_barometer *sensor, const struct mgos_barometer_sample *samples, int n) {
+  struct mgos_barometer_event_ring *ring;
+
+  if (!sensor || !sensor->events || !samples) {
+    return;
+  }
+  ring = sensor->events;
+
+  // Skip what was published before, e.g. a cached sample read again.
+  while (n > 0 && samples->ts_usecs <= ring->last_ts_usecs) {
+    samples++;
+    n--;
+  }
+  while (n > 0) {
+    int k = mgos_barometer_emit_chunk(sensor, samples, n);
+    if (k == 0) {
+      // Every slot is held, and stays so until the main task runs again.
+      ring->dropped += n;
+      ring->last_ts_usecs = samples[n - 1].ts_usecs;
+      return;
+    }
+    samples += k;
+    n       -= k;
+    // A handler may have turned events off.
+    if (sensor->events != ring) {
+      return;
+    }
+  }
+}
+
+bool mgos_barometer_set_events(struct mgos_barometer *sensor, uint16_t len) {
+  struct mgos_barometer_event_ring *ring;
+
+  if (!sensor) {
+    return false;
+  }
+  if (sensor->events) {
+    ring            = sensor->events;
+    sensor->events  = NULL;
+    ring->orphaned  = true;
+    if (ring->holds == 0) {
+      mgos_barometer_event_ring_free(ring);
+    }
+  }
+  if (len == 0) {
+    return true;
+  }
+
+  ring = calloc(1, sizeof(struct mgos_barometer_event_ring) + len * (sizeof(struct mgos_barometer_sample) + 1));
+  if (!ring) {
+    return false;
+  }
+  ring->buf      = (struct mgos_barometer_sample *)(ring + 1);
+  ring->refs     = (uint8_t *)(ring->buf + len);
+  ring->len      = len;
+  sensor->events = ring;
+  return true;
+}
+
+bool mgos_barometer_event_hold(const struct mgos_barometer_event_data *ev) {
+  struct mgos_barometer_event_ring *ring;
+  uint16_t first;
+
+  if (!ev || !ev->ring || ev->n == 0) {
+    return false;
+  }
+  ring  = ev->ring;
+  first = ev->seq % ring->len;
+  // Only samples still in their slots can be held.
+  if (ev->samples != &ring->buf[first] || ring->count - ev->seq > ring->len) {
+    return false;
+  }
+  for (int i = 0; i < ev->n; i++) {
+    if (ring->refs[first + i] == UINT8_MAX) {
+      return false;
+    }
+  }
+  for (int i = 0; i < ev->n; i++) {
+    ring->refs[first + i]++;
+  }
+  ring->holds++;
+  return true;
+}
+
+void mgos_barometer_event_release(const struct mgos_barometer_event_data *ev) {
+  struct mgos_barometer_event_ring *ring;
+  uint16_t first;
+
+  if (!ev || !ev->ring || ev->n == 0) {
+    return;
+  }
+  ring  = ev->ring;
+  first = ev->seq % ring->len;
+  for (int i = 0; i < ev->n; i++) {
+    ring->refs[first + i]--;
+  }
+  mgos_barometer_event_ring_unhold(ring);
+}
+
+uint32_t mgos_barometer_get_events_dropped(struct mgos_barometer *sensor) {
+  if (!sensor || !sensor->events) {
+    return 0;
+  }
+  return sensor->events->dropped;
+}
+
+// Public functions end
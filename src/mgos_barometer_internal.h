@@ -18,43 +18,154 @@
 
 #include "mgos.h"
 #include "mgos_barometer.h"
+#include "mgos_barometer_driver.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// Barometer
-typedef bool (*mgos_barometer_mag_detect_fn)(struct mgos_barometer *dev);
-typedef bool (*mgos_barometer_mag_create_fn)(struct mgos_barometer *dev);
-typedef bool (*mgos_barometer_mag_destroy_fn)(struct mgos_barometer *dev);
-typedef bool (*mgos_barometer_mag_read_fn)(struct mgos_barometer *dev);
+// Drivers are compiled in unless excluded with e.g. -DMGOS_BAROMETER_ENABLE_MPL115=0
+#ifndef MGOS_BAROMETER_ENABLE_MPL115
+#define MGOS_BAROMETER_ENABLE_MPL115      1
+#endif
+#ifndef MGOS_BAROMETER_ENABLE_MPL3115
+#define MGOS_BAROMETER_ENABLE_MPL3115     1
+#endif
+#ifndef MGOS_BAROMETER_ENABLE_BME280
+#define MGOS_BAROMETER_ENABLE_BME280      1
+#endif
+#ifndef MGOS_BAROMETER_ENABLE_MS5611
+#define MGOS_BAROMETER_ENABLE_MS5611      1
+#endif
+#ifndef MGOS_BAROMETER_ENABLE_BMP3
+#define MGOS_BAROMETER_ENABLE_BMP3        1
+#endif
 
-#define MGOS_BAROMETER_CAP_BAROMETER      (0x01)
-#define MGOS_BAROMETER_CAP_THERMOMETER    (0x02)
-#define MGOS_BAROMETER_CAP_HYGROMETER     (0x04)
+// Barometer.* RPC service
+#ifndef MGOS_BAROMETER_ENABLE_RPC
+#define MGOS_BAROMETER_ENABLE_RPC         1
+#endif
 
-struct mgos_barometer {
-  struct mgos_i2c *             i2c;
-  uint8_t                       i2caddr;
-  uint16_t                      cache_ttl_ms;
-  enum mgos_barometer_type      type;
+// Number of out of tree drivers that can be registered
+#ifndef MGOS_BAROMETER_MAX_USER_DRIVERS
+#define MGOS_BAROMETER_MAX_USER_DRIVERS   4
+#endif
 
-  uint8_t                       capabilities;
+// Number of distinct I2C buses that sensors can be attached to
+#ifndef MGOS_BAROMETER_MAX_BUSES
+#define MGOS_BAROMETER_MAX_BUSES          2
+#endif
 
-  mgos_barometer_mag_detect_fn  detect;
-  mgos_barometer_mag_create_fn  create;
-  mgos_barometer_mag_destroy_fn destroy;
-  mgos_barometer_mag_read_fn    read;
+// Sensors per bus that can be sampled by its worker task
+#ifndef MGOS_BAROMETER_WORKER_SENSORS
+#define MGOS_BAROMETER_WORKER_SENSORS     4
+#endif
 
-  void *                        user_data;
+// Samples queued from a worker task to the main task, a power of two
+#ifndef MGOS_BAROMETER_WORKER_QUEUE_LEN
+#define MGOS_BAROMETER_WORKER_QUEUE_LEN   32
+#endif
 
-  float                         pressure;    // in Pascals
-  float                         temperature; // in Celcius
-  float                         humidity;    // in % Relative Humidity
+// FreeRTOS task parameters of the ESP32 worker tasks
+#ifndef MGOS_BAROMETER_WORKER_STACK
+#define MGOS_BAROMETER_WORKER_STACK       3072
+#endif
+#ifndef MGOS_BAROMETER_WORKER_PRIORITY
+#define MGOS_BAROMETER_WORKER_PRIORITY    5
+#endif
 
-  struct mgos_barometer_stats   stats;
+// All sensors on one mgos_i2c share a lock, so their transactions never interleave.
+struct mgos_barometer_bus {
+  struct mgos_i2c *       i2c;
+  struct mgos_rlock_type *lock;
+  uint32_t                busy; // holders and waiters of lock, and the claim bit
 };
 
+// Set in busy by a try-lock between claiming the idle bus and holding its
+// lock. Lockers that see it sleep in steps of a FreeRTOS tick, so that a
+// lower priority claimant gets to run.
+#define MGOS_BAROMETER_BUS_CLAIMED          (0x80000000u)
+#define MGOS_BAROMETER_BUS_CLAIM_WAIT_USECS (10000)
+
+// Destination for samples drained from a hardware FIFO
+struct mgos_barometer_fifo {
+  struct mgos_barometer_sample *buf;
+  mgos_barometer_batch_cb       cb;
+  void *                        cb_arg;
+  uint16_t                      len;
+  int                           gpio;
+};
+
+// Exponentially weighted least squares fit of pressure over time, with
+// time relative to the latest sample and pressure to the first one.
+struct mgos_barometer_trend {
+  double  w, st, sp, stt, spp, stp;
+  double  p0;
+  int64_t last_ts_usecs;
+};
+
+// Periodic sampling driven by an mgos timer
+struct mgos_barometer_sampler {
+  struct mgos_barometer_adaptive_cfg cfg;            // if adaptive
+  struct mgos_barometer_trend        trend;
+  double                             busy_usecs;     // spent in read()
+  double                             overhead_usecs; // spent in the sampler outside of read()
+  int64_t                            start_usecs;
+  int64_t                            last_ts_usecs;  // timestamp of the previous sample, 0 after a miss
+  int64_t                            last_tick_usecs; // previous timer callback, 0 after rescheduling
+  mgos_timer_id                      timer;
+  uint32_t                           interval_usecs;
+  uint32_t                           samples;
+  uint32_t                           rate_changes;
+  uint32_t                           ticks;
+  uint32_t                           missed;
+  float                              slope_pa_s;
+  float                              sigma_pa;
+  bool                               adaptive;
+};
+
+// Event ring, see mgos_barometer_set_events(). Only touched on the main task.
+struct mgos_barometer_event_ring {
+  struct mgos_barometer_sample *buf;
+  uint8_t *                     refs;           // holds per slot
+  int64_t                       last_ts_usecs;  // newest sample published
+  uint32_t                      count;          // samples ever published
+  uint32_t                      dropped;        // slots skipped or samples lost to holds
+  uint32_t                      holds;          // over all slots
+  uint16_t                      len;
+  bool                          orphaned;       // detached, freed on the last release
+};
+
+// Publish new samples as an event, if the sensor has events enabled. Called
+// on the main task without the bus locked.
+void mgos_barometer_emit(struct mgos_barometer *sensor, const struct mgos_barometer_sample *samples, int n);
+
+// Serialize access to the sensor's bus. The lock is recursive.
+void mgos_barometer_bus_lock(struct mgos_barometer *sensor);
+void mgos_barometer_bus_unlock(struct mgos_barometer *sensor);
+void mgos_barometer_bus_acquire(struct mgos_barometer_bus *bus);
+void mgos_barometer_bus_release(struct mgos_barometer_bus *bus);
+
+// Take a sample for a scheduled reader: read the sensor, count it in the
+// stats, publish it and return it. Called with the bus locked.
+bool mgos_barometer_sample_locked(struct mgos_barometer *sensor, struct mgos_barometer_sample *sample);
+
+// Bus access for drivers, as the mgos_i2c_* calls of the same name but
+// counted in the sensor's i2c_transactions and i2c_bytes. Called with the
+// bus locked.
+bool mgos_barometer_i2c_write(struct mgos_barometer *dev, const void *data, size_t len, bool stop);
+int mgos_barometer_i2c_read_reg_b(struct mgos_barometer *dev, uint8_t reg);
+int mgos_barometer_i2c_read_reg_w(struct mgos_barometer *dev, uint8_t reg);
+bool mgos_barometer_i2c_read_reg_n(struct mgos_barometer *dev, uint8_t reg, size_t n, uint8_t *buf);
+bool mgos_barometer_i2c_write_reg_b(struct mgos_barometer *dev, uint8_t reg, uint8_t value);
+bool mgos_barometer_i2c_write_reg_n(struct mgos_barometer *dev, uint8_t reg, size_t n, const uint8_t *buf);
+
+#if MGOS_BAROMETER_ENABLE_RPC
+bool mgos_barometer_rpc_init(void);
+#endif
+bool mgos_barometer_metrics_init(void);
+bool mgos_barometer_config_init(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,433 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdarg.h>
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+#include "mgos_barometer_metrics.h"
+
+#if MGOS_HAVE_HTTP_SERVER
+#include "mgos_http_server.h"
+#endif
+
+enum mgos_barometer_metric {
+  METRIC_PRESSURE = 0,
+  METRIC_TEMPERATURE,
+  METRIC_HUMIDITY,
+  METRIC_ALTITUDE,
+  METRIC_READS,
+  METRIC_READ_SUCCESSES,
+  METRIC_CACHED_READS,
+  METRIC_READ_ERRORS,
+  METRIC_READ_LATENCY,
+  METRIC_CACHE_HIT_RATIO,
+  METRIC_CACHE_MISSES,
+  METRIC_CACHE_STALE,
+  METRIC_CACHE_REFRESHES,
+  METRIC_SAMPLING_JITTER,
+  METRIC_I2C_TRANSACTIONS,
+  METRIC_I2C_BYTES,
+  METRIC_EOF
+};
+
+static const struct {
+  const char *name;
+  const char *type;
+  const char *unit;
+  const char *help;
+} s_families[METRIC_EOF] = {
+  { "barometer_pressure_pascals",        "gauge",     "pascals", "Most recent pressure reading"              },
+  { "barometer_temperature_celsius",     "gauge",     "celsius", "Most recent temperature reading"           },
+  { "barometer_humidity_percent",        "gauge",     "percent", "Most recent relative humidity"             },
+  { "barometer_altitude_meters",         "gauge",     "meters",  "Most recent on-chip altitude"              },
+  { "barometer_reads",                   "counter",   NULL,      "Calls to mgos_barometer_read()"            },
+  { "barometer_read_successes",          "counter",   NULL,      "Successful reads from the sensor"          },
+  { "barometer_cached_reads",            "counter",   NULL,      "Reads served from the cache"               },
+  { "barometer_read_errors",             "counter",   NULL,      "Failed reads"                              },
+  { "barometer_read_latency_seconds",    "histogram", "seconds", "Duration of reads from the sensor"         },
+  { "barometer_cache_hit_ratio",         "gauge",     NULL,      "Fraction of reads served from cache"       },
+  { "barometer_cache_misses",            "counter",   NULL,      "Reads which waited for the sensor"         },
+  { "barometer_cache_stale",             "counter",   NULL,      "Cached reads served past their TTL"        },
+  { "barometer_cache_refreshes",         "counter",   NULL,      "Background refreshes which took a sample"  },
+  { "barometer_sampling_jitter_seconds", "gauge",     "seconds", "Mean deviation from the sampling interval" },
+  { "barometer_i2c_transactions",        "counter",   NULL,      "I2C transactions issued by the driver"     },
+  { "barometer_i2c_bytes",               "counter",   "bytes",   "Bytes moved by I2C transactions"           },
+};
+
+static const uint32_t s_latency_bounds_usecs[MGOS_BAROMETER_LATENCY_BUCKETS - 1] = MGOS_BAROMETER_LATENCY_BOUNDS_USECS;
+
+// Private functions follow
+
+// Appends to buf at *pos, returns false and leaves *pos alone if it doesn't fit.
+static bool mgos_barometer_metrics_printf(char *buf, size_t len, size_t *pos, const char *fmt, ...) {
+  va_list ap;
+  int     n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(buf + *pos, len - *pos, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= len - *pos) {
+    return false;
+  }
+  *pos += n;
+  return true;
+}
+
+// Sensors are rendered in order of id, which stays stable while sensors come
+// and go. The sensor list is sorted by id, so a render call finds where it
+// left off once and then follows the list.
+static struct mgos_barometer *mgos_barometer_metrics_sensor(uint16_t id) {
+  struct mgos_barometer *sensor = mgos_barometer_get_next(NULL);
+
+  while (sensor && sensor->id < id) {
+    sensor = mgos_barometer_get_next(sensor);
+  }
+  return sensor;
+}
+
+static bool mgos_barometer_metrics_header(char *buf, size_t len, size_t *pos, uint8_t family) {
+  const char *name = s_families[family].name;
+
+  if (!mgos_barometer_metrics_printf(buf, len, pos, "# TYPE %s %s\n", name, s_families[family].type)) {
+    return false;
+  }
+  if (s_families[family].unit && !mgos_barometer_metrics_printf(buf, len, pos, "# UNIT %s %s\n", name, s_families[family].unit)) {
+    return false;
+  }
+  return mgos_barometer_metrics_printf(buf, len, pos, "# HELP %s %s.\n", name, s_families[family].help);
+}
+
+// Writes the line up to its labels, escaping the sensor type as label values
+// need. Driver names are free text, and out of tree ones have no length limit.
+static bool mgos_barometer_metrics_labels(char *buf, size_t len, size_t *pos, const char *name, const char *suffix,
+                                          struct mgos_barometer *sensor) {
+  const char *type = mgos_barometer_get_name(sensor);
+
+  if (!mgos_barometer_metrics_printf(buf, len, pos, "%s%s{sensor=\"%u\",type=\"", name, suffix, sensor->id)) {
+    return false;
+  }
+  for (; *type; type++) {
+    bool ok;
+
+    if (*type == '"' || *type == '\\') {
+      ok = mgos_barometer_metrics_printf(buf, len, pos, "\\%c", *type);
+    } else if (*type == '\n') {
+      ok = mgos_barometer_metrics_printf(buf, len, pos, "\\n");
+    } else {
+      ok = mgos_barometer_metrics_printf(buf, len, pos, "%c", *type);
+    }
+    if (!ok) {
+      return false;
+    }
+  }
+  return mgos_barometer_metrics_printf(buf, len, pos, "\"");
+}
+
+enum mgos_barometer_metrics_line {
+  LINE_WRITTEN,
+  LINE_FULL,                     // line didn't fit, nothing was written
+  LINE_END                       // no more lines for this sensor
+};
+
+// Renders one line of a family for a sensor. Most families have one line per
+// sensor, histograms have one per bucket plus _count and _sum.
+static enum mgos_barometer_metrics_line mgos_barometer_metrics_line(char *buf, size_t len, size_t *pos, uint8_t family,
+                                                                    struct mgos_barometer *sensor, uint8_t line) {
+  const struct mgos_barometer_stats *st = &sensor->stats;
+  const char *suffix = "";
+  struct mgos_barometer_sample sample;
+  char     le[24] = "", value[24];
+  uint32_t count  = 0;
+  size_t   mark   = *pos;
+
+  if (family == METRIC_READ_LATENCY) {
+    if (line > MGOS_BAROMETER_LATENCY_BUCKETS + 1) {
+      return LINE_END;
+    }
+    for (int i = 0; i <= line && i < MGOS_BAROMETER_LATENCY_BUCKETS; i++) {
+      count += st->read_latency[i];
+    }
+    snprintf(value, sizeof(value), "%u", count);
+    if (line < MGOS_BAROMETER_LATENCY_BUCKETS - 1) {
+      suffix = "_bucket";
+      snprintf(le, sizeof(le), ",le=\"%g\"", s_latency_bounds_usecs[line] / 1e6);
+    } else if (line == MGOS_BAROMETER_LATENCY_BUCKETS - 1) {
+      suffix = "_bucket";
+      snprintf(le, sizeof(le), ",le=\"+Inf\"");
+    } else if (line == MGOS_BAROMETER_LATENCY_BUCKETS) {
+      suffix = "_count";
+    } else {
+      suffix = "_sum";
+      snprintf(value, sizeof(value), "%.6f", st->read_success_usecs / 1e6);
+    }
+  } else if (line > 0) {
+    return LINE_END;
+  } else if (strcmp(s_families[family].type, "counter") == 0) {
+    switch (family) {
+    case METRIC_READS:
+      count = st->read;
+      break;
+
+    case METRIC_READ_SUCCESSES:
+      count = st->read_success;
+      break;
+
+    case METRIC_CACHED_READS:
+      count = st->read_success_cached;
+      break;
+
+    case METRIC_READ_ERRORS:
+      count = st->read - st->read_success - st->read_success_cached;
+      break;
+
+    case METRIC_CACHE_MISSES:
+      count = st->cache_miss;
+      break;
+
+    case METRIC_CACHE_STALE:
+      count = st->cache_stale;
+      break;
+
+    case METRIC_CACHE_REFRESHES:
+      count = st->cache_refresh;
+      break;
+
+    case METRIC_I2C_TRANSACTIONS:
+      count = st->i2c_transactions;
+      break;
+
+    case METRIC_I2C_BYTES:
+      count = st->i2c_bytes;
+      break;
+
+    default:
+      return LINE_END;
+    }
+    suffix = "_total";
+    snprintf(value, sizeof(value), "%u", count);
+  } else {
+    switch (family) {
+    case METRIC_PRESSURE:
+    case METRIC_TEMPERATURE:
+    case METRIC_HUMIDITY:
+    case METRIC_ALTITUDE:
+      if (!mgos_barometer_get_sample(sensor, &sample)) {
+        return LINE_END;
+      }
+      if (family == METRIC_PRESSURE && mgos_barometer_has_barometer(sensor)) {
+        snprintf(value, sizeof(value), "%.2f", sample.pressure);
+      } else if (family == METRIC_TEMPERATURE && mgos_barometer_has_thermometer(sensor)) {
+        snprintf(value, sizeof(value), "%.2f", sample.temperature);
+      } else if (family == METRIC_HUMIDITY && mgos_barometer_has_hygrometer(sensor)) {
+        snprintf(value, sizeof(value), "%.2f", sample.humidity);
+      } else if (family == METRIC_ALTITUDE && mgos_barometer_has_altimeter(sensor)) {
+        snprintf(value, sizeof(value), "%.2f", sample.altitude);
+      } else {
+        return LINE_END;
+      }
+      break;
+
+    case METRIC_CACHE_HIT_RATIO:
+      if (st->read == 0) {
+        return LINE_END;
+      }
+      snprintf(value, sizeof(value), "%.4f", (double)st->read_success_cached / st->read);
+      break;
+
+    case METRIC_SAMPLING_JITTER:
+      if (st->jitter_samples == 0) {
+        return LINE_END;
+      }
+      snprintf(value, sizeof(value), "%.6f", st->jitter_abs_usecs / st->jitter_samples / 1e6);
+      break;
+
+    default:
+      return LINE_END;
+    }
+  }
+
+  if (!mgos_barometer_metrics_labels(buf, len, pos, s_families[family].name, suffix, sensor) ||
+      !mgos_barometer_metrics_printf(buf, len, pos, "%s} %s\n", le, value)) {
+    *pos = mark;
+    return LINE_FULL;
+  }
+  return LINE_WRITTEN;
+}
+
+// Private functions end
+
+// Public functions follow
+void mgos_barometer_metrics_begin(struct mgos_barometer_metrics_cursor *cur) {
+  if (!cur) {
+    return;
+  }
+  memset(cur, 0, sizeof(struct mgos_barometer_metrics_cursor));
+}
+
+int mgos_barometer_metrics_render(struct mgos_barometer_metrics_cursor *cur, char *buf, size_t len) {
+  struct mgos_barometer *sensor;
+  size_t pos = 0, mark;
+  bool   full = false;
+
+  if (!cur || !buf) {
+    return -1;
+  }
+
+  while (!full && cur->family < METRIC_EOF) {
+    if (!cur->header_done) {
+      mark = pos;
+      if (!mgos_barometer_metrics_header(buf, len, &pos, cur->family)) {
+        pos  = mark;
+        full = true;
+        break;
+      }
+      cur->header_done = true;
+    }
+    sensor = mgos_barometer_metrics_sensor(cur->next_id);
+    while (sensor && !full) {
+      switch (mgos_barometer_metrics_line(buf, len, &pos, cur->family, sensor, cur->line)) {
+      case LINE_WRITTEN:
+        cur->line++;
+        break;
+
+      case LINE_FULL:
+        full = true;
+        break;
+
+      case LINE_END:
+        cur->next_id = sensor->id + 1;
+        cur->line    = 0;
+        sensor       = mgos_barometer_get_next(sensor);
+        break;
+      }
+    }
+    if (full) {
+      break;
+    }
+    cur->family++;
+    cur->next_id     = 0;
+    cur->line        = 0;
+    cur->header_done = false;
+  }
+
+  if (!full && cur->family == METRIC_EOF) {
+    if (mgos_barometer_metrics_printf(buf, len, &pos, "# EOF\n")) {
+      cur->family++;
+    } else {
+      full = true;
+    }
+  }
+
+  // Nothing fit at all, so rendering would never make progress.
+  if (full && pos == 0) {
+    LOG(LL_ERROR, ("Metrics buffer of %u bytes is too small for one line", (unsigned)len));
+    return -1;
+  }
+  return pos;
+}
+
+// Public functions end
+
+#if MGOS_HAVE_HTTP_SERVER
+
+// Concurrent scrapes share one render buffer, since rendering never yields
+// half way through a chunk. Each scrape needs its own cursor.
+#define MGOS_BAROMETER_METRICS_BUF_SIZE    (512)
+#define MGOS_BAROMETER_METRICS_MAX_SCRAPES (2)
+
+struct mgos_barometer_metrics_scrape {
+  struct mgos_barometer_metrics_cursor cur;
+  bool                                 in_use;
+};
+
+static char s_metrics_buf[MGOS_BAROMETER_METRICS_BUF_SIZE];
+static struct mgos_barometer_metrics_scrape s_scrapes[MGOS_BAROMETER_METRICS_MAX_SCRAPES];
+
+static void mgos_barometer_metrics_release(struct mg_connection *nc) {
+  struct mgos_barometer_metrics_scrape *scrape = (struct mgos_barometer_metrics_scrape *)nc->user_data;
+
+  if (scrape) {
+    scrape->in_use = false;
+    nc->user_data  = NULL;
+  }
+}
+
+// Renders until the send buffer holds a chunk, then waits for MG_EV_SEND.
+static void mgos_barometer_metrics_pump(struct mg_connection *nc) {
+  struct mgos_barometer_metrics_scrape *scrape = (struct mgos_barometer_metrics_scrape *)nc->user_data;
+  int n;
+
+  while (scrape && nc->send_mbuf.len < MGOS_BAROMETER_METRICS_BUF_SIZE) {
+    n = mgos_barometer_metrics_render(&scrape->cur, s_metrics_buf, sizeof(s_metrics_buf));
+    if (n < 0) {
+      // Without the terminating chunk, the client sees a truncated response.
+      nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+      mgos_barometer_metrics_release(nc);
+      return;
+    }
+    if (n == 0) {
+      mg_send_http_chunk(nc, "", 0);
+      nc->flags |= MG_F_SEND_AND_CLOSE;
+      mgos_barometer_metrics_release(nc);
+      return;
+    }
+    mg_send_http_chunk(nc, s_metrics_buf, n);
+  }
+}
+
+static void mgos_barometer_metrics_handler(struct mg_connection *nc, int ev, void *ev_data, void *user_data) {
+  switch (ev) {
+  case MG_EV_HTTP_REQUEST:
+    for (int i = 0; i < MGOS_BAROMETER_METRICS_MAX_SCRAPES && !nc->user_data; i++) {
+      if (!s_scrapes[i].in_use) {
+        s_scrapes[i].in_use = true;
+        nc->user_data       = &s_scrapes[i];
+      }
+    }
+    if (!nc->user_data) {
+      mg_http_send_error(nc, 503, "Too many concurrent scrapes");
+      return;
+    }
+    mgos_barometer_metrics_begin(&((struct mgos_barometer_metrics_scrape *)nc->user_data)->cur);
+    mg_send_response_line(nc, 200,
+                          "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                          "Transfer-Encoding: chunked");
+    mgos_barometer_metrics_pump(nc);
+    break;
+
+  case MG_EV_SEND:
+    mgos_barometer_metrics_pump(nc);
+    break;
+
+  case MG_EV_CLOSE:
+    mgos_barometer_metrics_release(nc);
+    break;
+  }
+}
+
+#endif // MGOS_HAVE_HTTP_SERVER
+
+// Internal functions follow
+bool mgos_barometer_metrics_init(void) {
+#if MGOS_HAVE_HTTP_SERVER
+  mgos_register_http_endpoint(MGOS_BAROMETER_METRICS_URI, mgos_barometer_metrics_handler, NULL);
+#endif
+  return true;
+}
+
+// Internal functions end
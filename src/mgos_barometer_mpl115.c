@@ -17,6 +17,8 @@
 #include "mgos_barometer_mpl115.h"
 #include "mgos_i2c.h"
 
+#if MGOS_BAROMETER_ENABLE_MPL115
+
 // Datasheet:
 // https://cdn-shop.adafruit.com/datasheets/MPL115A2.pdf
 
@@ -26,13 +28,13 @@ bool mgos_barometer_mpl115_create(struct mgos_barometer *dev) {
   if (!dev) {
     return false;
   }
-  uint8_t data[8];
-  if (!mgos_i2c_read_reg_n(dev->i2c, dev->i2caddr, MPL115_REG_COEFF_BASE, 8, data)) {
+  mpl115_data = (struct mgos_barometer_mpl115_data *)dev->user_data;
+  if (!mpl115_data) {
     return false;
   }
 
-  mpl115_data = calloc(1, sizeof(struct mgos_barometer_mpl115_data));
-  if (!mpl115_data) {
+  uint8_t data[8];
+  if (!mgos_barometer_i2c_read_reg_n(dev, MPL115_REG_COEFF_BASE, 8, data)) {
     return false;
   }
 
@@ -43,34 +45,19 @@ bool mgos_barometer_mpl115_create(struct mgos_barometer *dev) {
   int16_t b2  = ((uint16_t)data[4] << 8) | data[5];
   int16_t c12 = (((uint16_t)data[6] << 8) | data[7]) >> 2;
 
-  mpl115_data->a0  = (float)a0 / (1 << 3);
-  mpl115_data->b1  = (float)b1 / (1 << 13);
-  mpl115_data->b2  = (float)b2 / (1 << 14);
-  mpl115_data->c12 = (float)c12 / (1 << 22);
-  dev->user_data   = mpl115_data;
+  mpl115_data->calib.kind         = BARO_CALIB_MPL115;
+  mpl115_data->calib.u.mpl115.a0  = (float)a0 / (1 << 3);
+  mpl115_data->calib.u.mpl115.b1  = (float)b1 / (1 << 13);
+  mpl115_data->calib.u.mpl115.b2  = (float)b2 / (1 << 14);
+  mpl115_data->calib.u.mpl115.c12 = (float)c12 / (1 << 22);
 
-  dev->capabilities |= MGOS_BAROMETER_CAP_BAROMETER;
-  dev->capabilities |= MGOS_BAROMETER_CAP_THERMOMETER;
   return true;
 }
 
-bool mgos_barometer_mpl115_destroy(struct mgos_barometer *dev) {
-  if (!dev) {
-    return false;
-  }
-  if (dev->user_data) {
-    free(dev->user_data);
-    dev->user_data = NULL;
-  }
-  return true;
-}
-
-bool mgos_barometer_mpl115_read(struct mgos_barometer *dev) {
+bool mgos_barometer_mpl115_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw) {
   struct mgos_barometer_mpl115_data *mpl115_data;
-  int16_t Padc, Tadc;
-  float   Pcomp;
 
-  if (!dev) {
+  if (!dev || !raw) {
     return false;
   }
   mpl115_data = (struct mgos_barometer_mpl115_data *)dev->user_data;
@@ -78,29 +65,50 @@ bool mgos_barometer_mpl115_read(struct mgos_barometer *dev) {
     return false;
   }
 
-  if (!mgos_i2c_write_reg_b(dev->i2c, dev->i2caddr, MPL115_REG_START, 0x00)) {
+  if (!mgos_barometer_i2c_write_reg_b(dev, MPL115_REG_START, 0x00)) {
     return false;
   }
+  dev->ts_usecs = mgos_uptime_micros() + MPL115_CONV_USECS / 2;
 
   mgos_usleep(4000);
   uint8_t data[4];
-  if (!mgos_i2c_read_reg_n(dev->i2c, dev->i2caddr, MPL115_REG_PRESSURE, 4, data)) {
+  if (!mgos_barometer_i2c_read_reg_n(dev, MPL115_REG_PRESSURE, 4, data)) {
     return false;
   }
   // TESTDATA:
   // data[0]=0x66; data[1]=0x80; data[2]=0x7e; data[3]=0xc0;
-  Padc = (((uint16_t)data[0] << 8) | data[1]) >> 6;
-  Tadc = (((uint16_t)data[2] << 8) | data[3]) >> 6;
-
-  Pcomp = mpl115_data->a0 + (mpl115_data->b1 + mpl115_data->c12 * Tadc) * Padc + mpl115_data->b2 * Tadc;
-
-  dev->pressure    = (Pcomp * (65.0 / 1023) + 50.0) * 1000;   // Pascals
-  dev->temperature = ((float)Tadc - 498.0F) / -5.35F + 25.0F; // Celsius
+  raw->ts_usecs = dev->ts_usecs;
+  raw->calib    = &mpl115_data->calib;
+  raw->adc_p    = (((uint16_t)data[0] << 8) | data[1]) >> 6;
+  raw->adc_t    = (((uint16_t)data[2] << 8) | data[3]) >> 6;
+  return true;
+}
 
-  /* TESTDATA (in mpl115_data and Padc/Tadc) yields:
-   * pressure=96587.33
-   * temperature=23.32
-   */
+bool mgos_barometer_mpl115_read(struct mgos_barometer *dev) {
+  struct mgos_barometer_raw raw;
 
+  if (!mgos_barometer_mpl115_read_raw(dev, &raw)) {
+    return false;
+  }
+  mgos_barometer_compensate_mpl115(&raw.calib->u.mpl115, &raw, 1, &dev->pressure, &dev->temperature);
   return true;
 }
+
+_Static_assert(sizeof(struct mgos_barometer_mpl115_data) <= MGOS_BAROMETER_USER_DATA_SIZE, "MGOS_BAROMETER_USER_DATA_SIZE too small");
+
+const struct mgos_barometer_driver mgos_barometer_mpl115_driver = {
+  .name            = "MPL115",
+  .type            = BARO_MPL115,
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .i2caddr         = { 0x60, 0x00 },
+  .user_data_size  = sizeof(struct mgos_barometer_mpl115_data),
+  .conv_usecs      = MPL115_CONV_USECS,
+  .read_cost_usecs = MPL115_READ_COST_USECS,
+  .detect          = NULL,
+  .create          = mgos_barometer_mpl115_create,
+  .destroy         = NULL,
+  .read            = mgos_barometer_mpl115_read,
+  .read_raw        = mgos_barometer_mpl115_read_raw,
+};
+
+#endif // MGOS_BAROMETER_ENABLE_MPL115
@@ -25,9 +25,15 @@
 #define MPL115_REG_START          (0x12)
 
 struct mgos_barometer_mpl115_data {
-  float a0, b1, b2, c12;
+  struct mgos_barometer_calib calib;
 };
 
+// Conversion takes 3ms, reading it adds two bus transactions.
+#define MPL115_CONV_USECS         MGOS_BAROMETER_MPL115_CONV_USECS
+#define MPL115_READ_COST_USECS    (5000)
+
 bool mgos_barometer_mpl115_create(struct mgos_barometer *dev);
-bool mgos_barometer_mpl115_destroy(struct mgos_barometer *dev);
 bool mgos_barometer_mpl115_read(struct mgos_barometer *dev);
+bool mgos_barometer_mpl115_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw);
+
+extern const struct mgos_barometer_driver mgos_barometer_mpl115_driver;
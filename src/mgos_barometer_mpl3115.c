@@ -17,6 +17,8 @@
 #include "mgos_barometer_mpl3115.h"
 #include "mgos_i2c.h"
 
+#if MGOS_BAROMETER_ENABLE_MPL3115
+
 // Datasheet:
 // https://cdn-shop.adafruit.com/datasheets/1893_datasheet.pdf
 
@@ -27,7 +29,7 @@ bool mgos_barometer_mpl3115_detect(struct mgos_barometer *dev) {
     return false;
   }
 
-  if ((val = mgos_i2c_read_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_WHOAMI)) < 0) {
+  if ((val = mgos_barometer_i2c_read_reg_b(dev, MPL3115_REG_WHOAMI)) < 0) {
     return false;
   }
   LOG(LL_DEBUG, ("whoami=0x%02x", val));
@@ -39,95 +41,152 @@ bool mgos_barometer_mpl3115_detect(struct mgos_barometer *dev) {
   return true;
 }
 
-bool mgos_barometer_mpl3115_create(struct mgos_barometer *dev) {
+bool mgos_barometer_mpl3115_reset(struct mgos_barometer *dev) {
   if (!dev) {
     return false;
   }
 
-
-  // Reset
+  // The chip resets before it acknowledges the write, so the missing ACK
+  // is expected.
   LOG(LL_DEBUG, ("Reset"));
-  if (!mgos_i2c_write_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_CTRL1, 0x02)) {
+  mgos_barometer_i2c_write_reg_b(dev, MPL3115_REG_CTRL1, MPL3115_CTRL1_RST);
+  return true;
+}
+
+bool mgos_barometer_mpl3115_create(struct mgos_barometer *dev) {
+  if (!dev) {
     return false;
   }
-  mgos_usleep(20000);
 
   // Set sample period to 1sec ST[3:0], period 2^ST seconds
   //this isn't right
   LOG(LL_DEBUG, ("Sample Period"));
-  if (!mgos_i2c_write_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_CTRL2, 0x00)) {
+  if (!mgos_barometer_i2c_write_reg_b(dev, MPL3115_REG_CTRL2, 0x00)) {
     return false;
   }
 
   // Set Barometer Mode, OS[2:0], oversampling 2^OS times, continuous sampling
   LOG(LL_DEBUG, ("Baro Mode"));
-  if (!mgos_i2c_write_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_CTRL1, 0x39)) {
+  if (!mgos_barometer_i2c_write_reg_b(dev, MPL3115_REG_CTRL1, MPL3115_CTRL1_OS128 | MPL3115_CTRL1_SBYB)) {
     return false;
   }
 
   // Set event flags for temp+pressure
   LOG(LL_DEBUG, ("Event Flags"));
-  if (!mgos_i2c_write_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_PT_DATA, 0x07)) {
+  if (!mgos_barometer_i2c_write_reg_b(dev, MPL3115_REG_PT_DATA, 0x07)) {
     return false;
   }
 
-  dev->capabilities |= MGOS_BAROMETER_CAP_BAROMETER;
-  dev->capabilities |= MGOS_BAROMETER_CAP_THERMOMETER;
-
   return true;
 }
 
-bool mgos_barometer_mpl3115_read(struct mgos_barometer *dev) {
-  if (!dev) {
+// The chip compensates on its own, so all sensors share one calibration
+// block which only tells the kernels how to scale the output registers.
+static const struct mgos_barometer_calib s_mpl3115_calib = { .kind = BARO_CALIB_MPL3115 };
+
+bool mgos_barometer_mpl3115_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw) {
+  if (!dev || !raw) {
     return false;
   }
 
-  int     val     = 0;
+  // STATUS is followed by OUT_P and OUT_T, so one burst both polls data
+  // ready and fetches the data.
+  uint8_t data[6];
   uint8_t retries = 100;
   LOG(LL_DEBUG, ("Data Ready"));
-  if ((val = mgos_i2c_read_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_STATUS)) < 0) {
-    return false;
-  }
-
-  while (!(val & 0x08) && retries > 0) { // Data Ready
-    LOG(LL_DEBUG, ("Data Ready"));
-    if ((val = mgos_i2c_read_reg_b(dev->i2c, dev->i2caddr, MPL3115_REG_STATUS)) < 0) {
+  for (;;) {
+    if (!mgos_barometer_i2c_read_reg_n(dev, MPL3115_REG_STATUS, 6, data)) {
+      return false;
+    }
+    if (data[0] & 0x08) { // Data Ready
+      break;
+    }
+    if (--retries == 0) {
+      LOG(LL_ERROR, ("Timed out waiting for data ready"));
       return false;
     }
     mgos_usleep(10000);
 //    LOG(LL_DEBUG, ("Snoozing, retries=%d", retries));
-    retries--;
-  }
-  if (retries == 0) {
-    LOG(LL_ERROR, ("Timed out waiting for data ready"));
-    return false;
   }
 
-  uint32_t pressure;
-  int16_t  temperature;
-  uint8_t  data[5];
+  // Pressure is 20 bits, temperature 12 bits, both left aligned.
+  raw->ts_usecs = 0;
+  raw->calib    = &s_mpl3115_calib;
+  raw->adc_p    = (((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3]) >> 4;
+  raw->adc_t    = (((uint16_t)data[4] << 8) | data[5]) >> 4;
+  return true;
+}
+
+bool mgos_barometer_mpl3115_read(struct mgos_barometer *dev) {
+  struct mgos_barometer_raw raw;
 
-  LOG(LL_DEBUG, ("Read Data"));
-  if (!mgos_i2c_read_reg_n(dev->i2c, dev->i2caddr, MPL3115_REG_PRESSURE_MSB, 5, data)) {
+  if (!mgos_barometer_mpl3115_read_raw(dev, &raw)) {
     return false;
   }
+  mgos_barometer_compensate_mpl3115(&raw, 1, &dev->pressure, &dev->temperature);
+  if (dev->capabilities & MGOS_BAROMETER_CAP_ALTIMETER) {
+    // OUT_P holds the chip's altitude: signed meters, 4 fractional bits.
+    dev->altitude = (float)((int32_t)(raw.adc_p << 12) >> 12) / 16.0f;
+    dev->pressure = 0;
+  }
+  return true;
+}
 
-  pressure   = data[0];
-  pressure <<= 8;
-  pressure  |= data[1];
-  pressure <<= 8;
-  pressure  |= data[2];
-  pressure >>= 4;
+// BAR_IN and the trims are written in standby, then the chip is started
+// again in the requested mode. Leaving altimeter mode restores the reset
+// values.
+bool mgos_barometer_mpl3115_set_altimeter(struct mgos_barometer *dev, const struct mgos_barometer_altimeter_cfg *cfg) {
+  uint32_t sea_level_pa = MPL3115_BAR_IN_DEFAULT_PA;
+  uint16_t bar_in;
 
-  temperature   = data[3];
-  temperature <<= 8;
-  temperature  |= data[4];
-  temperature >>= 4;
-  if (temperature & 0x800) {
-    temperature |= 0xF000;
+  if (!dev) {
+    return false;
+  }
+  if (cfg && cfg->sea_level_pa > 0) {
+    sea_level_pa = cfg->sea_level_pa;
+  }
+  if (sea_level_pa / MPL3115_BAR_IN_PA_PER_LSB > UINT16_MAX) {
+    LOG(LL_ERROR, ("Sea level pressure %u Pa out of range", sea_level_pa));
+    return false;
+  }
+  bar_in = sea_level_pa / MPL3115_BAR_IN_PA_PER_LSB;
+
+  uint8_t bar[2] = { bar_in >> 8, bar_in & 0xFF };
+  uint8_t off[3] = { 0, 0, 0 };
+  if (cfg) {
+    off[0] = (uint8_t)cfg->offset_p;
+    off[1] = (uint8_t)cfg->offset_t;
+    off[2] = (uint8_t)cfg->offset_h;
   }
 
-  dev->pressure    = pressure / 4.0;
-  dev->temperature = temperature / 16.0;
-  return true;
+  if (!mgos_barometer_i2c_write_reg_b(dev, MPL3115_REG_CTRL1, MPL3115_CTRL1_OS128)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_n(dev, MPL3115_REG_BAR_IN_MSB, sizeof(bar), bar)) {
+    return false;
+  }
+  if (!mgos_barometer_i2c_write_reg_n(dev, MPL3115_REG_OFF_P, sizeof(off), off)) {
+    return false;
+  }
+  return mgos_barometer_i2c_write_reg_b(dev, MPL3115_REG_CTRL1, (cfg ? MPL3115_CTRL1_ALT : 0) | MPL3115_CTRL1_OS128 | MPL3115_CTRL1_SBYB);
 }
+
+const struct mgos_barometer_driver mgos_barometer_mpl3115_driver = {
+  .name            = "MPL3115",
+  .type            = BARO_MPL3115,
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .i2caddr         = { 0x60, 0x00 },
+  .user_data_size  = 0,
+  .conv_usecs      = MPL3115_CONV_USECS,
+  .read_cost_usecs = MPL3115_READ_COST_USECS,
+  .reset_usecs     = MPL3115_RESET_USECS,
+  .detect          = mgos_barometer_mpl3115_detect,
+  .reset           = mgos_barometer_mpl3115_reset,
+  .create          = mgos_barometer_mpl3115_create,
+  .destroy         = NULL,
+  .read            = mgos_barometer_mpl3115_read,
+  .read_raw        = mgos_barometer_mpl3115_read_raw,
+  .set_altimeter   = mgos_barometer_mpl3115_set_altimeter,
+};
+
+#endif // MGOS_BAROMETER_ENABLE_MPL3115
@@ -28,9 +28,34 @@
 #define MPL3115_REG_DR_STATUS       (0x06)
 #define MPL3115_REG_WHOAMI          (0x0C)
 #define MPL3115_REG_PT_DATA         (0x13)
+#define MPL3115_REG_BAR_IN_MSB      (0x14)
+#define MPL3115_REG_BAR_IN_LSB      (0x15)
 #define MPL3115_REG_CTRL1           (0x26)
 #define MPL3115_REG_CTRL2           (0x27)
+#define MPL3115_REG_OFF_P           (0x2B)
+#define MPL3115_REG_OFF_T           (0x2C)
+#define MPL3115_REG_OFF_H           (0x2D)
+
+#define MPL3115_CTRL1_SBYB          (0x01)    // active, standby when clear
+#define MPL3115_CTRL1_RST           (0x04)    // software reset
+#define MPL3115_CTRL1_OS128         (0x38)    // oversampling 128x
+#define MPL3115_CTRL1_ALT           (0x80)    // altimeter mode
+
+// BAR_IN counts 2 Pa per step, and resets to 101326 Pa.
+#define MPL3115_BAR_IN_PA_PER_LSB   (2)
+#define MPL3115_BAR_IN_DEFAULT_PA   (101326)
+
+// Oversampling 128x takes 512ms per conversion.
+#define MPL3115_CONV_USECS          MGOS_BAROMETER_MPL3115_CONV_USECS
+// Worst case is the data ready poll loop timing out: 100 retries of 10ms.
+#define MPL3115_READ_COST_USECS     (100 * 10000 + 2000)
+#define MPL3115_RESET_USECS         (20000)
 
 bool mgos_barometer_mpl3115_detect(struct mgos_barometer *dev);
+bool mgos_barometer_mpl3115_reset(struct mgos_barometer *dev);
 bool mgos_barometer_mpl3115_create(struct mgos_barometer *dev);
 bool mgos_barometer_mpl3115_read(struct mgos_barometer *dev);
+bool mgos_barometer_mpl3115_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw);
+bool mgos_barometer_mpl3115_set_altimeter(struct mgos_barometer *dev, const struct mgos_barometer_altimeter_cfg *cfg);
+
+extern const struct mgos_barometer_driver mgos_barometer_mpl3115_driver;
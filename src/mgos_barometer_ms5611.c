@@ -17,15 +17,34 @@
 #include "mgos_barometer_ms5611.h"
 #include "mgos_i2c.h"
 
-// Datasheet:
+#if MGOS_BAROMETER_ENABLE_MS5611
+
+// Datasheets:
 // http://www.amsys.info/sheets/amsys.en.ms5611_01ba03.pdf
+// https://www.te.com/usa-en/product-CAT-BLPS0035.datasheet.pdf (MS5607-02BA03)
+// https://www.te.com/usa-en/product-CAT-BLPS0037.datasheet.pdf (MS5637-02BA03)
+// https://www.te.com/usa-en/product-CAT-BLPS0038.datasheet.pdf (MS5803-01BA)
+//
+// The family shares one ADC protocol and PROM layout. Compensation for each
+// variant is a table of constants in mgos_barometer_compensate.c, picked by
+// the variant recorded in the calibration block at create time.
 
-static bool ms5611_crc4(uint16_t *data) {
+// AN520 CRC4 over the 8 PROM words. MS5637 keeps the CRC in bits 15:12 of
+// word 0 and has no word 7, which the algorithm then treats as zero.
+static bool ms5611_crc4(uint16_t *data, bool crc_in_word0) {
   int32_t  i, j;
   uint32_t res = 0;
-  uint8_t  crc = data[7] & 0xF;
+  uint16_t word0 = data[0], word7 = data[7];
+  uint8_t  crc;
 
-  data[7] &= 0xFF00;
+  if (crc_in_word0) {
+    crc      = data[0] >> 12;
+    data[0] &= 0x0FFF;
+    data[7]  = 0;
+  } else {
+    crc      = data[7] & 0xF;
+    data[7] &= 0xFF00;
+  }
 
   bool blankEeprom = true;
 
@@ -45,7 +64,8 @@ static bool ms5611_crc4(uint16_t *data) {
       res <<= 1;
     }
   }
-  data[7] |= crc;
+  data[0] = word0;
+  data[7] = word7;
   if (!blankEeprom && crc == ((res >> 12) & 0xF)) {
     return true;
   }
@@ -53,13 +73,28 @@ static bool ms5611_crc4(uint16_t *data) {
   return false;
 }
 
+static enum mgos_barometer_ms56xx_variant ms5611_variant(enum mgos_barometer_type type) {
+  switch (type) {
+  case BARO_MS5607: return BARO_MS56XX_MS5607;
+
+  case BARO_MS5637: return BARO_MS56XX_MS5637;
+
+  case BARO_MS5803: return BARO_MS56XX_MS5803;
+
+  default: return BARO_MS56XX_MS5611;
+  }
+}
+
+// Maximum conversion time by OSR, from the datasheet
+static const uint32_t s_ms5611_conv_usecs[] = { 600, 1170, 2280, 4540, 9040 };
+
 static bool ms5611_conv(struct mgos_barometer *dev, uint8_t cmd, uint32_t *conv) {
   uint8_t data[3];
 
   if (!dev) {
     return false;
   }
-  if (!mgos_i2c_write(dev->i2c, dev->i2caddr, &cmd, 1, true)) {
+  if (!mgos_barometer_i2c_write(dev, &cmd, 1, true)) {
     return false;
   }
 
@@ -74,7 +109,7 @@ static bool ms5611_conv(struct mgos_barometer *dev, uint8_t cmd, uint32_t *conv)
 
   default: mgos_usleep(10000); break;
   }
-  if (!mgos_i2c_read_reg_n(dev->i2c, dev->i2caddr, MS5611_CMD_ADC_READ, 3, data)) {
+  if (!mgos_barometer_i2c_read_reg_n(dev, MS5611_CMD_ADC_READ, 3, data)) {
     return false;
   }
 
@@ -82,59 +117,103 @@ static bool ms5611_conv(struct mgos_barometer *dev, uint8_t cmd, uint32_t *conv)
   return true;
 }
 
+bool mgos_barometer_ms5611_reset(struct mgos_barometer *dev) {
+  uint8_t cmd = MS5611_CMD_RESET;
+
+  if (!dev) {
+    return false;
+  }
+  return mgos_barometer_i2c_write(dev, &cmd, 1, true);
+}
+
 bool mgos_barometer_ms5611_create(struct mgos_barometer *dev) {
   struct mgos_barometer_ms5611_data *ms5611_data;
 
   if (!dev) {
     return false;
   }
-
-  ms5611_data = calloc(1, sizeof(struct mgos_barometer_ms5611_data));
+  ms5611_data = (struct mgos_barometer_ms5611_data *)dev->user_data;
   if (!ms5611_data) {
     return false;
   }
-  dev->user_data = ms5611_data;
 
-  // Reset device
-  uint8_t cmd = MS5611_CMD_RESET;
-  if (!mgos_i2c_write(dev->i2c, dev->i2caddr, &cmd, 1, true)) {
-    return false;
-  }
-  mgos_usleep(3000);
+  ms5611_data->calib.kind             = BARO_CALIB_MS56XX;
+  ms5611_data->calib.u.ms56xx.variant = ms5611_variant(dev->driver->type);
+  mgos_barometer_ms5611_set_profile(dev, BARO_PROFILE_DEFAULT);
 
-  // Read calibration coefficients from PROM
-  for (int i = 0; i < MS5611_PROM_SIZE; i++) {
-    int val = mgos_i2c_read_reg_w(dev->i2c, dev->i2caddr, MS5611_CMD_PROM_RD + i * 2);
+  // Read calibration coefficients from PROM. MS5637 has 7 words and keeps
+  // its CRC in word 0. Each word has its own read command, so this takes a
+  // transaction per word.
+  bool     ms5637 = ms5611_data->calib.u.ms56xx.variant == BARO_MS56XX_MS5637;
+  uint16_t *prom  = ms5611_data->calib.u.ms56xx.prom;
+  for (int i = 0; i < (ms5637 ? 7 : MS5611_PROM_SIZE); i++) {
+    int val = mgos_barometer_i2c_read_reg_w(dev, MS5611_CMD_PROM_RD + i * 2);
     if (val < 0) {
-      free(dev->user_data);
       return false;
     }
-    ms5611_data->calib[i] = val;
+    prom[i] = val;
   }
-  if (!ms5611_crc4(ms5611_data->calib)) {
+  if (!ms5611_crc4(prom, ms5637)) {
     LOG(LL_ERROR, ("CRC4 failure on PROM data"));
-    free(dev->user_data);
     return false;
   }
 
-  dev->capabilities |= MGOS_BAROMETER_CAP_BAROMETER;
-  dev->capabilities |= MGOS_BAROMETER_CAP_THERMOMETER;
-
   return true;
 }
 
-bool mgos_barometer_ms5611_destroy(struct mgos_barometer *dev) {
-  if (!dev) {
+bool mgos_barometer_ms5611_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw) {
+  struct mgos_barometer_ms5611_data *ms5611_data;
+
+  if (!dev || !raw) {
     return false;
   }
-  if (dev->user_data) {
-    free(dev->user_data);
-    dev->user_data = NULL;
+  ms5611_data = (struct mgos_barometer_ms5611_data *)dev->user_data;
+  if (!ms5611_data) {
+    return false;
+  }
+
+  // Temperature drifts slowly, so profiles may convert it only every
+  // temp_every samples, which saves two of the four bus transactions.
+  uint32_t Padc;
+  if (!ms5611_data->have_tadc || ms5611_data->temp_countdown == 0) {
+    if (!ms5611_conv(dev, MS5611_CMD_ADC_CONV | MS5611_CMD_ADC_D2 | ms5611_data->osr, &ms5611_data->Tadc)) {
+      LOG(LL_ERROR, ("Could not read temperature ADC"));
+      return false;
+    }
+    ms5611_data->have_tadc      = true;
+    ms5611_data->temp_countdown = ms5611_data->temp_every;
   }
+  // Stamp the midpoint of the pressure conversion
+  dev->ts_usecs = mgos_uptime_micros() + s_ms5611_conv_usecs[ms5611_data->osr >> 1] / 2;
+  if (!ms5611_conv(dev, MS5611_CMD_ADC_CONV | MS5611_CMD_ADC_D1 | ms5611_data->osr, &Padc)) {
+    LOG(LL_ERROR, ("Could not read pressure ADC"));
+    return false;
+  }
+//  LOG(LL_DEBUG, ("Padc=%u Tadc=%u", Padc, ms5611_data->Tadc));
+
+  ms5611_data->temp_countdown--;
+
+  raw->ts_usecs = dev->ts_usecs;
+  raw->calib    = &ms5611_data->calib;
+  raw->adc_p    = Padc;
+  raw->adc_t    = ms5611_data->Tadc;
   return true;
 }
 
 bool mgos_barometer_ms5611_read(struct mgos_barometer *dev) {
+  struct mgos_barometer_raw raw;
+
+  if (!mgos_barometer_ms5611_read_raw(dev, &raw)) {
+    return false;
+  }
+  mgos_barometer_compensate_ms56xx(&raw.calib->u.ms56xx, &raw, 1, &dev->pressure, &dev->temperature);
+
+//  LOG(LL_DEBUG, ("P=%.2f T=%.2f", dev->pressure, dev->temperature));
+
+  return true;
+}
+
+bool mgos_barometer_ms5611_set_profile(struct mgos_barometer *dev, enum mgos_barometer_profile profile) {
   struct mgos_barometer_ms5611_data *ms5611_data;
 
   if (!dev) {
@@ -145,43 +224,116 @@ bool mgos_barometer_ms5611_read(struct mgos_barometer *dev) {
     return false;
   }
 
-  uint32_t Tadc, Padc;
-  if (!ms5611_conv(dev, MS5611_CMD_ADC_CONV | MS5611_CMD_ADC_D2 | MS5611_CMD_ADC_4096, &Tadc)) {
-    LOG(LL_ERROR, ("Could not read temperature ADC"));
+  switch (profile) {
+  case BARO_PROFILE_DEFAULT:
+    ms5611_data->osr        = MS5611_CMD_ADC_4096;
+    ms5611_data->temp_every = 1;
+    break;
+
+  case BARO_PROFILE_LOW_POWER:
+    ms5611_data->osr        = MS5611_CMD_ADC_256;
+    ms5611_data->temp_every = 1;
+    break;
+
+  // Temperature drifts slowly, so most conversions can go to pressure.
+  case BARO_PROFILE_HIGH_RATE:
+    ms5611_data->osr        = MS5611_CMD_ADC_2048;
+    ms5611_data->temp_every = 16;
+    break;
+
+  default:
     return false;
   }
-  if (!ms5611_conv(dev, MS5611_CMD_ADC_CONV | MS5611_CMD_ADC_D1 | MS5611_CMD_ADC_4096, &Padc)) {
-    LOG(LL_ERROR, ("Could not read pressure ADC"));
+  ms5611_data->temp_countdown = 0;
+  return true;
+}
+
+bool mgos_barometer_ms5611_start(struct mgos_barometer *dev, uint32_t *wait_usecs) {
+  struct mgos_barometer_ms5611_data *ms5611_data;
+  uint8_t cmd;
+
+  if (!dev || !wait_usecs) {
     return false;
   }
-//  LOG(LL_DEBUG, ("Padc=%u Tadc=%u", Padc, Tadc));
-
-  // Convert ADC to values
-  int64_t temp;
-  int64_t delt;
-  int64_t dT   = (int64_t)Tadc - ((uint64_t)ms5611_data->calib[5] * 256);
-  int64_t off  = ((int64_t)ms5611_data->calib[2] << 16) + (((int64_t)ms5611_data->calib[4] * dT) >> 7);
-  int64_t sens = ((int64_t)ms5611_data->calib[1] << 15) + (((int64_t)ms5611_data->calib[3] * dT) >> 8);
-  temp = 2000 + ((dT * (int64_t)ms5611_data->calib[6]) >> 23);
-
-  if (temp < 2000) { // temperature lower than 20degC
-    delt  = temp - 2000;
-    delt  = 5 * delt * delt;
-    off  -= delt >> 1;
-    sens -= delt >> 2;
-    if (temp < -1500) { // temperature lower than -15degC
-      delt  = temp + 1500;
-      delt  = delt * delt;
-      off  -= 7 * delt;
-      sens -= (11 * delt) >> 1;
-    }
-    temp -= ((dT * dT) >> 31);
+  ms5611_data = (struct mgos_barometer_ms5611_data *)dev->user_data;
+  if (!ms5611_data) {
+    return false;
   }
 
-  dev->pressure    = ((((int64_t)Padc * sens) >> 21) - off) >> 15;
-  dev->temperature = (float)temp / 100.0;
+  ms5611_data->pending_temp = !ms5611_data->have_tadc || ms5611_data->temp_countdown == 0;
+  cmd = MS5611_CMD_ADC_CONV | ms5611_data->osr | (ms5611_data->pending_temp ? MS5611_CMD_ADC_D2 : MS5611_CMD_ADC_D1);
+  if (!mgos_barometer_i2c_write(dev, &cmd, 1, true)) {
+    return false;
+  }
+  *wait_usecs   = s_ms5611_conv_usecs[ms5611_data->osr >> 1];
+  dev->ts_usecs = mgos_uptime_micros() + *wait_usecs / 2;
+  return true;
+}
 
-//  LOG(LL_DEBUG, ("P=%.2f T=%.2f", dev->pressure, dev->temperature));
+int mgos_barometer_ms5611_collect(struct mgos_barometer *dev) {
+  struct mgos_barometer_ms5611_data *ms5611_data;
+  uint8_t data[3];
+  uint32_t adc;
 
-  return true;
+  if (!dev) {
+    return -1;
+  }
+  ms5611_data = (struct mgos_barometer_ms5611_data *)dev->user_data;
+  if (!ms5611_data) {
+    return -1;
+  }
+
+  if (!mgos_barometer_i2c_read_reg_n(dev, MS5611_CMD_ADC_READ, 3, data)) {
+    return -1;
+  }
+  adc = (((uint32_t)data[0]) << 16) | ((uint32_t)(data[1]) << 8) | data[2];
+  // The ADC reads 0 if it was read before the conversion finished.
+  if (adc == 0) {
+    return -1;
+  }
+
+  if (ms5611_data->pending_temp) {
+    ms5611_data->Tadc           = adc;
+    ms5611_data->have_tadc      = true;
+    ms5611_data->temp_countdown = ms5611_data->temp_every;
+    return 0;
+  }
+  ms5611_data->temp_countdown--;
+
+  struct mgos_barometer_raw raw = {
+    .calib = &ms5611_data->calib, .adc_p = adc, .adc_t = ms5611_data->Tadc
+  };
+  mgos_barometer_compensate_ms56xx(&ms5611_data->calib.u.ms56xx, &raw, 1, &dev->pressure, &dev->temperature);
+  return 1;
 }
+
+_Static_assert(sizeof(struct mgos_barometer_ms5611_data) <= MGOS_BAROMETER_USER_DATA_SIZE, "MGOS_BAROMETER_USER_DATA_SIZE too small");
+
+// The variants differ only in name, type and default addresses.
+#define MS5611_DRIVER(NAME, TYPE, ADDR0, ADDR1)                                                 \
+  {                                                                                             \
+    .name            = NAME,                                                                    \
+    .type            = TYPE,                                                                    \
+    .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,           \
+    .i2caddr         = { ADDR0, ADDR1 },                                                        \
+    .user_data_size  = sizeof(struct mgos_barometer_ms5611_data),                               \
+    .conv_usecs      = MS5611_CONV_USECS,                                                       \
+    .read_cost_usecs = MS5611_READ_COST_USECS,                                                  \
+    .reset_usecs     = MS5611_RESET_USECS,                                                      \
+    .detect          = NULL,                                                                    \
+    .reset           = mgos_barometer_ms5611_reset,                                             \
+    .create          = mgos_barometer_ms5611_create,                                            \
+    .destroy         = NULL,                                                                    \
+    .read            = mgos_barometer_ms5611_read,                                              \
+    .read_raw        = mgos_barometer_ms5611_read_raw,                                          \
+    .set_profile     = mgos_barometer_ms5611_set_profile,                                       \
+    .start           = mgos_barometer_ms5611_start,                                             \
+    .collect         = mgos_barometer_ms5611_collect,                                           \
+  }
+
+const struct mgos_barometer_driver mgos_barometer_ms5611_driver = MS5611_DRIVER("MS5611", BARO_MS5611, 0x77, 0x76);
+const struct mgos_barometer_driver mgos_barometer_ms5607_driver = MS5611_DRIVER("MS5607", BARO_MS5607, 0x77, 0x76);
+const struct mgos_barometer_driver mgos_barometer_ms5637_driver = MS5611_DRIVER("MS5637", BARO_MS5637, 0x76, 0x00);
+const struct mgos_barometer_driver mgos_barometer_ms5803_driver = MS5611_DRIVER("MS5803", BARO_MS5803, 0x77, 0x76);
+
+#endif // MGOS_BAROMETER_ENABLE_MS5611
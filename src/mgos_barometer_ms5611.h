@@ -34,13 +34,34 @@
 #define MS5611_CMD_PROM_RD     (0xA0)     // Prom read command
 
 struct mgos_barometer_ms5611_data {
-  // Calibration data:
-  // 16 bits -- factory code
+  // Calibration data, in calib.u.ms56xx.prom:
+  // 16 bits -- factory code (MS5637: CRC4 in the top 4 bits)
   // 6x 16 bits of calibration (c1..c6)
   // last 16 bits -- crc4 of the ROM in LSB4, other 12 bits are ignored
-  uint16_t calib[MS5611_PROM_SIZE];
+  struct mgos_barometer_calib calib;
+  uint32_t Tadc;                 // most recent temperature conversion
+  uint8_t  osr;                  // MS5611_CMD_ADC_*, for both conversions
+  uint8_t  temp_every;           // pressure conversions per temperature conversion
+  uint8_t  temp_countdown;
+  bool     pending_temp;         // start() began a temperature conversion
+  bool     have_tadc;
 };
 
+// Two OSR=4096 conversions of 10ms each, plus bus transactions.
+#define MS5611_CONV_USECS      MGOS_BAROMETER_MS5611_CONV_USECS
+#define MS5611_READ_COST_USECS (2 * MS5611_CONV_USECS + 1000)
+// PROM reload after a reset
+#define MS5611_RESET_USECS     (3000)
+
+bool mgos_barometer_ms5611_reset(struct mgos_barometer *dev);
 bool mgos_barometer_ms5611_create(struct mgos_barometer *dev);
-bool mgos_barometer_ms5611_destroy(struct mgos_barometer *dev);
 bool mgos_barometer_ms5611_read(struct mgos_barometer *dev);
+bool mgos_barometer_ms5611_read_raw(struct mgos_barometer *dev, struct mgos_barometer_raw *raw);
+bool mgos_barometer_ms5611_set_profile(struct mgos_barometer *dev, enum mgos_barometer_profile profile);
+bool mgos_barometer_ms5611_start(struct mgos_barometer *dev, uint32_t *wait_usecs);
+int mgos_barometer_ms5611_collect(struct mgos_barometer *dev);
+
+extern const struct mgos_barometer_driver mgos_barometer_ms5611_driver;
+extern const struct mgos_barometer_driver mgos_barometer_ms5607_driver;
+extern const struct mgos_barometer_driver mgos_barometer_ms5637_driver;
+extern const struct mgos_barometer_driver mgos_barometer_ms5803_driver;
@@ -0,0 +1,277 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+#include "mgos_barometer_pair.h"
+
+// Back off this long when a conversion could not be started
+#define PAIR_RETRY_MS             (100)
+
+struct mgos_barometer_pair {
+  struct mgos_barometer *           sensor[2];
+  struct mgos_barometer_pair_output out;
+  mgos_barometer_pair_cb            cb;
+  void *                            cb_arg;
+  double                            offset_pa;
+  double                            cal_sum;     // uncorrected differentials while calibrating
+  double                            skew_sum;    // |skew_usecs| over all pairs
+  mgos_timer_id                     period_timer;
+  mgos_timer_id                     timer;       // pending start or collect
+  uint32_t                          period_ms;
+  uint32_t                          pairs;
+  uint32_t                          unpaired;
+  uint32_t                          max_skew_usecs;
+  uint32_t                          cal_left;
+  uint32_t                          cal_n;
+  uint8_t                           depth;       // callbacks and creation in progress
+  bool                              have_out;
+  bool                              destroyed;   // by a callback, freed once it returns
+};
+
+// Private functions follow
+static void mgos_barometer_pair_publish(struct mgos_barometer_pair *pair) {
+  struct mgos_barometer_pair_output *out = &pair->out;
+  struct mgos_barometer_sample       a, b;
+  double   raw;
+  uint32_t abs_skew;
+
+  if (!mgos_barometer_get_sample(pair->sensor[0], &a) || !mgos_barometer_get_sample(pair->sensor[1], &b)) {
+    return;
+  }
+
+  // Subtract before anything is rounded to float again.
+  raw = (double)a.pressure - (double)b.pressure;
+  if (pair->cal_left > 0) {
+    pair->cal_sum += raw;
+    if (--pair->cal_left == 0) {
+      pair->offset_pa = pair->cal_sum / pair->cal_n;
+      LOG(LL_INFO, ("Pair offset calibrated to %.3f Pa over %u samples", pair->offset_pa, pair->cal_n));
+    }
+  }
+
+  out->ts_usecs   = a.ts_usecs + (b.ts_usecs - a.ts_usecs) / 2;
+  out->diff_pa    = raw - pair->offset_pa;
+  out->pressure_a = a.pressure;
+  out->pressure_b = b.pressure;
+  out->skew_usecs = (int32_t)(b.ts_usecs - a.ts_usecs);
+  abs_skew        = (out->skew_usecs < 0) ? -out->skew_usecs : out->skew_usecs;
+  if (abs_skew > pair->max_skew_usecs) {
+    pair->max_skew_usecs = abs_skew;
+  }
+  pair->skew_sum += abs_skew;
+  pair->pairs++;
+  pair->have_out = true;
+  if (pair->cb) {
+    pair->depth++;
+    pair->cb(pair, out, pair->cb_arg);
+    pair->depth--;
+  }
+}
+
+static void mgos_barometer_pair_start_cb(void *arg);
+
+static void mgos_barometer_pair_collect_cb(void *arg) {
+  struct mgos_barometer_pair *pair = (struct mgos_barometer_pair *)arg;
+  int ra, rb;
+
+  pair->timer = MGOS_INVALID_TIMER_ID;
+  ra          = mgos_barometer_collect_conversion(pair->sensor[0]);
+  rb          = mgos_barometer_collect_conversion(pair->sensor[1]);
+  if (ra > 0 && rb > 0) {
+    mgos_barometer_pair_publish(pair);
+    // The callback may have had enough and destroyed the pair.
+    if (pair->destroyed) {
+      if (pair->depth == 0) {
+        free(pair);
+      }
+      return;
+    }
+  } else if (ra > 0 || rb > 0) {
+    // One of them converted temperature this time; its partner's sample
+    // has nothing to pair with.
+    pair->unpaired++;
+  }
+
+  // Temperature conversions don't produce output, so follow them at once.
+  if (pair->period_ms == 0 || ra == 0 || rb == 0) {
+    mgos_barometer_pair_start_cb(pair);
+  }
+}
+
+// Both start commands go out back to back, with nothing in between.
+static bool mgos_barometer_pair_start(struct mgos_barometer_pair *pair, uint32_t *wait_usecs) {
+  uint32_t wait_b;
+
+  if (!mgos_barometer_start_conversion(pair->sensor[0], wait_usecs)) {
+    return false;
+  }
+  if (!mgos_barometer_start_conversion(pair->sensor[1], &wait_b)) {
+    mgos_barometer_collect_conversion(pair->sensor[0]);
+    return false;
+  }
+  if (wait_b > *wait_usecs) {
+    *wait_usecs = wait_b;
+  }
+  return true;
+}
+
+static void mgos_barometer_pair_retry_cb(void *arg) {
+  struct mgos_barometer_pair *pair = (struct mgos_barometer_pair *)arg;
+
+  pair->timer = MGOS_INVALID_TIMER_ID;
+  mgos_barometer_pair_start_cb(pair);
+}
+
+static void mgos_barometer_pair_start_cb(void *arg) {
+  struct mgos_barometer_pair *pair = (struct mgos_barometer_pair *)arg;
+  uint32_t wait_usecs;
+
+  // A periodic tick while the previous cycle is still converting
+  if (pair->timer != MGOS_INVALID_TIMER_ID) {
+    return;
+  }
+  if (!mgos_barometer_pair_start(pair, &wait_usecs)) {
+    if (pair->period_ms == 0) {
+      pair->timer = mgos_set_timer(PAIR_RETRY_MS, 0, mgos_barometer_pair_retry_cb, pair);
+    }
+    return;
+  }
+  if (wait_usecs == 0) {
+    // Neither sensor converts in the background: read them in turn.
+    mgos_barometer_pair_collect_cb(pair);
+    return;
+  }
+  pair->timer = mgos_set_timer((wait_usecs + 999) / 1000, 0, mgos_barometer_pair_collect_cb, pair);
+}
+
+// Private functions end
+
+// Public functions follow
+struct mgos_barometer_pair *mgos_barometer_pair_create(struct mgos_barometer *a, struct mgos_barometer *b, uint32_t period_ms,
+                                                       mgos_barometer_pair_cb cb, void *cb_arg) {
+  struct mgos_barometer_pair *pair;
+
+  if (!a || !b || a == b || !mgos_barometer_has_barometer(a) || !mgos_barometer_has_barometer(b)) {
+    return NULL;
+  }
+  if (period_ms == 0 && !(a->driver->start || b->driver->start)) {
+    LOG(LL_ERROR, ("Back to back pair sampling needs non-blocking conversions, set a period"));
+    return NULL;
+  }
+
+  pair = calloc(1, sizeof(struct mgos_barometer_pair));
+  if (!pair) {
+    return NULL;
+  }
+  pair->sensor[0] = a;
+  pair->sensor[1] = b;
+  pair->cb        = cb;
+  pair->cb_arg    = cb_arg;
+  pair->period_ms = period_ms;
+
+  // Cached samples would show up as skew, and as stale differentials.
+  mgos_barometer_set_cache_ttl(a, 0);
+  mgos_barometer_set_cache_ttl(b, 0);
+
+  pair->timer        = MGOS_INVALID_TIMER_ID;
+  pair->period_timer = MGOS_INVALID_TIMER_ID;
+  if (period_ms > 0) {
+    pair->period_timer = mgos_set_timer(period_ms, MGOS_TIMER_REPEAT, mgos_barometer_pair_start_cb, pair);
+    if (pair->period_timer == MGOS_INVALID_TIMER_ID) {
+      free(pair);
+      return NULL;
+    }
+  }
+  // Sensors without background conversions are read at once, and the
+  // callback may destroy the pair before it is even returned.
+  pair->depth++;
+  mgos_barometer_pair_start_cb(pair);
+  pair->depth--;
+  if (pair->destroyed) {
+    free(pair);
+    return NULL;
+  }
+  return pair;
+}
+
+void mgos_barometer_pair_destroy(struct mgos_barometer_pair **pair) {
+  if (!pair || !*pair) {
+    return;
+  }
+  if ((*pair)->period_timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer((*pair)->period_timer);
+  }
+  if ((*pair)->timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer((*pair)->timer);
+  }
+  // Finish conversions in flight so that blocking reads work again.
+  for (int i = 0; i < 2; i++) {
+    if ((*pair)->sensor[i]->flags & MGOS_BAROMETER_FLAG_CONVERTING) {
+      mgos_barometer_collect_conversion((*pair)->sensor[i]);
+    }
+  }
+  // From a callback, the pair is still in use until the callback returns.
+  if ((*pair)->depth > 0) {
+    (*pair)->destroyed = true;
+  } else {
+    free(*pair);
+  }
+  *pair = NULL;
+}
+
+bool mgos_barometer_pair_get(struct mgos_barometer_pair *pair, struct mgos_barometer_pair_output *out) {
+  if (!pair || !out || !pair->have_out) {
+    return false;
+  }
+  *out = pair->out;
+  return true;
+}
+
+bool mgos_barometer_pair_calibrate(struct mgos_barometer_pair *pair, uint32_t n) {
+  if (!pair || n == 0) {
+    return false;
+  }
+  pair->cal_sum  = 0;
+  pair->cal_n    = n;
+  pair->cal_left = n;
+  return true;
+}
+
+bool mgos_barometer_pair_set_offset(struct mgos_barometer_pair *pair, double offset_pa) {
+  if (!pair) {
+    return false;
+  }
+  pair->offset_pa = offset_pa;
+  pair->cal_left  = 0;
+  return true;
+}
+
+bool mgos_barometer_pair_get_stats(struct mgos_barometer_pair *pair, struct mgos_barometer_pair_stats *stats) {
+  if (!pair || !stats) {
+    return false;
+  }
+  stats->pairs           = pair->pairs;
+  stats->unpaired        = pair->unpaired;
+  stats->max_skew_usecs  = pair->max_skew_usecs;
+  stats->mean_skew_usecs = pair->pairs ? pair->skew_sum / pair->pairs : 0;
+  stats->offset_pa       = pair->offset_pa;
+  stats->calibrating     = pair->cal_left;
+  return true;
+}
+
+// Public functions end
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+
+#if MGOS_BAROMETER_ENABLE_RPC
+
+#include "mgos_rpc.h"
+
+// Upper bound on samples returned by one Barometer.History call
+#define MGOS_BAROMETER_RPC_MAX_SAMPLES    (64)
+
+static const uint32_t s_latency_bounds_usecs[MGOS_BAROMETER_LATENCY_BUCKETS - 1] = MGOS_BAROMETER_LATENCY_BOUNDS_USECS;
+
+// Private functions follow
+static int mgos_barometer_rpc_info(struct json_out *out, va_list *ap) {
+  struct mgos_barometer *sensor = va_arg(*ap, struct mgos_barometer *);
+
+  return json_printf(out, "{id: %d, name: %Q, type: %d, i2caddr: %d, capabilities: %d, history: %d}",
+                     sensor->id, mgos_barometer_get_name(sensor), sensor->driver->type, sensor->i2caddr,
+                     sensor->capabilities, sensor->history_len);
+}
+
+static int mgos_barometer_rpc_sample(struct json_out *out, va_list *ap) {
+  struct mgos_barometer *      sensor = va_arg(*ap, struct mgos_barometer *);
+  struct mgos_barometer_sample sample;
+
+  if (!mgos_barometer_get_sample(sensor, &sample)) {
+    return json_printf(out, "{id: %d, name: %Q}", sensor->id, mgos_barometer_get_name(sensor));
+  }
+  return json_printf(out, "{id: %d, name: %Q, ts_usecs: %lld, pressure: %.2f, temperature: %.2f, humidity: %.2f, altitude: %.2f}",
+                     sensor->id, mgos_barometer_get_name(sensor), (long long)sample.ts_usecs,
+                     sample.pressure, sample.temperature, sample.humidity, sample.altitude);
+}
+
+// Emits a JSON array of n uint32_t.
+static int mgos_barometer_rpc_u32s(struct json_out *out, va_list *ap) {
+  const uint32_t *v = va_arg(*ap, const uint32_t *);
+  int n   = va_arg(*ap, int);
+  int len = 0;
+
+  len += json_printf(out, "[");
+  for (int i = 0; i < n; i++) {
+    len += json_printf(out, "%s%u", (i > 0) ? ", " : "", v[i]);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+// The stats are copied under the bus lock, as workers update them from
+// their own tasks. read_latency has one more bucket than there are bounds,
+// for reads slower than the last one.
+static int mgos_barometer_rpc_stats(struct json_out *out, va_list *ap) {
+  struct mgos_barometer *     sensor = va_arg(*ap, struct mgos_barometer *);
+  struct mgos_barometer_stats st;
+
+  mgos_barometer_get_stats(sensor, &st);
+  return json_printf(out, "{id: %d, read: %u, read_success: %u, read_success_cached: %u, "
+                     "cache_miss: %u, cache_stale: %u, cache_refresh: %u, "
+                     "read_success_usecs: %.0f, last_read_time: %.3f, "
+                     "jitter_samples: %u, jitter_min_usecs: %d, jitter_max_usecs: %d, jitter_abs_usecs: %.0f, "
+                     "i2c_transactions: %u, i2c_bytes: %u, read_latency: %M, read_latency_bounds_usecs: %M}",
+                     sensor->id, st.read, st.read_success, st.read_success_cached,
+                     st.cache_miss, st.cache_stale, st.cache_refresh,
+                     st.read_success_usecs, st.last_read_time,
+                     st.jitter_samples, st.jitter_min_usecs, st.jitter_max_usecs,
+                     st.jitter_abs_usecs, st.i2c_transactions, st.i2c_bytes,
+                     mgos_barometer_rpc_u32s, st.read_latency, MGOS_BAROMETER_LATENCY_BUCKETS,
+                     mgos_barometer_rpc_u32s, s_latency_bounds_usecs, MGOS_BAROMETER_LATENCY_BUCKETS - 1);
+}
+
+// Emits a JSON array with fn applied to every sensor.
+static int mgos_barometer_rpc_all(struct json_out *out, va_list *ap) {
+  json_printf_callback_t fn = va_arg(*ap, json_printf_callback_t);
+  struct mgos_barometer *sensor;
+  int len = 0;
+
+  len += json_printf(out, "[");
+  for (sensor = mgos_barometer_get_next(NULL); sensor; sensor = mgos_barometer_get_next(sensor)) {
+    len += json_printf(out, "%s%M", (len > 1) ? ", " : "", fn, sensor);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+// Emits n samples, copied out of the history ring.
+static int mgos_barometer_rpc_history_samples(struct json_out *out, va_list *ap) {
+  const struct mgos_barometer_sample *samples = va_arg(*ap, const struct mgos_barometer_sample *);
+  uint32_t n   = va_arg(*ap, uint32_t);
+  int      len = 0;
+
+  len += json_printf(out, "[");
+  for (uint32_t i = 0; i < n; i++) {
+    const struct mgos_barometer_sample *s = &samples[i];
+    len += json_printf(out, "%s[%lld, %.2f, %.2f, %.2f, %.2f]", (i > 0) ? ", " : "",
+                       (long long)s->ts_usecs, s->pressure, s->temperature, s->humidity, s->altitude);
+  }
+  len += json_printf(out, "]");
+  return len;
+}
+
+static struct mgos_barometer *mgos_barometer_rpc_get_sensor(struct mg_rpc_request_info *ri, struct mg_str args, int *id) {
+  struct mgos_barometer *sensor;
+
+  *id = -1;
+  json_scanf(args.p, args.len, ri->args_fmt, id);
+  if (*id < 0) {
+    return NULL;
+  }
+  sensor = mgos_barometer_get_by_id(*id);
+  if (!sensor) {
+    mg_rpc_send_errorf(ri, 404, "no sensor with id %d", *id);
+  }
+  return sensor;
+}
+
+static void mgos_barometer_rpc_list_handler(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args) {
+  mg_rpc_send_responsef(ri, "{sensors: %M}", mgos_barometer_rpc_all, mgos_barometer_rpc_info);
+}
+
+static void mgos_barometer_rpc_read_handler(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args) {
+  struct mgos_barometer *sensor;
+  int  id;
+  bool fresh = false;
+
+  json_scanf(args.p, args.len, "{fresh: %B}", &fresh);
+  sensor = mgos_barometer_rpc_get_sensor(ri, args, &id);
+  if (!sensor) {
+    if (id >= 0) {
+      return;
+    }
+    if (fresh) {
+      for (sensor = mgos_barometer_get_next(NULL); sensor; sensor = mgos_barometer_get_next(sensor)) {
+        mgos_barometer_read(sensor);
+      }
+    }
+    mg_rpc_send_responsef(ri, "{sensors: %M}", mgos_barometer_rpc_all, mgos_barometer_rpc_sample);
+    return;
+  }
+  if (fresh && !mgos_barometer_read(sensor)) {
+    mg_rpc_send_errorf(ri, 500, "read of sensor %d failed", id);
+    return;
+  }
+  mg_rpc_send_responsef(ri, "%M", mgos_barometer_rpc_sample, sensor);
+}
+
+static void mgos_barometer_rpc_history_handler(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args) {
+  struct mgos_barometer *       sensor;
+  struct mgos_barometer_sample *samples;
+  int      id, since = 0, limit = MGOS_BAROMETER_RPC_MAX_SAMPLES;
+  uint32_t first, n;
+
+  json_scanf(args.p, args.len, "{since: %d, limit: %d}", &since, &limit);
+  sensor = mgos_barometer_rpc_get_sensor(ri, args, &id);
+  if (!sensor) {
+    if (id < 0) {
+      mg_rpc_send_errorf(ri, 400, "id is required");
+    }
+    return;
+  }
+  if (!sensor->history) {
+    mg_rpc_send_errorf(ri, 400, "history is not enabled on sensor %d", id);
+    return;
+  }
+  if (limit <= 0 || limit > MGOS_BAROMETER_RPC_MAX_SAMPLES) {
+    limit = MGOS_BAROMETER_RPC_MAX_SAMPLES;
+  }
+
+  samples = malloc(limit * sizeof(struct mgos_barometer_sample));
+  if (!samples) {
+    mg_rpc_send_errorf(ri, 500, "out of memory");
+    return;
+  }
+
+  // Copy the slots under the bus lock, so the producer can't overwrite them
+  // meanwhile, and serialize and send without it, so the sampler and worker
+  // on this bus don't wait for the send.
+  mgos_barometer_bus_lock(sensor);
+  first = (sensor->history_count > sensor->history_len) ? sensor->history_count - sensor->history_len : 0;
+  if (since > 0 && (uint32_t)since > first) {
+    first = since;
+  }
+  n = (first < sensor->history_count) ? sensor->history_count - first : 0;
+  if (n > (uint32_t)limit) {
+    n = limit;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    samples[i] = sensor->history[(first + i) % sensor->history_len];
+  }
+  mgos_barometer_bus_unlock(sensor);
+
+  mg_rpc_send_responsef(ri, "{id: %d, first: %u, next: %u, samples: %M}", id, first, first + n,
+                        mgos_barometer_rpc_history_samples, samples, n);
+  free(samples);
+}
+
+static void mgos_barometer_rpc_stats_handler(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args) {
+  struct mgos_barometer *sensor;
+  int id;
+
+  sensor = mgos_barometer_rpc_get_sensor(ri, args, &id);
+  if (!sensor) {
+    if (id < 0) {
+      mg_rpc_send_responsef(ri, "{sensors: %M}", mgos_barometer_rpc_all, mgos_barometer_rpc_stats);
+    }
+    return;
+  }
+  mg_rpc_send_responsef(ri, "%M", mgos_barometer_rpc_stats, sensor);
+}
+
+// Private functions end
+
+// Internal functions follow
+bool mgos_barometer_rpc_init(void) {
+  struct mg_rpc *c = mgos_rpc_get_global();
+
+  if (!c) {
+    return true;
+  }
+  mg_rpc_add_handler(c, "Barometer.List", "", mgos_barometer_rpc_list_handler, NULL);
+  mg_rpc_add_handler(c, "Barometer.Read", "{id: %d}", mgos_barometer_rpc_read_handler, NULL);
+  mg_rpc_add_handler(c, "Barometer.History", "{id: %d}", mgos_barometer_rpc_history_handler, NULL);
+  mg_rpc_add_handler(c, "Barometer.Stats", "{id: %d}", mgos_barometer_rpc_stats_handler, NULL);
+  return true;
+}
+
+// Internal functions end
+
+#endif // MGOS_BAROMETER_ENABLE_RPC
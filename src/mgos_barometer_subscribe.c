@@ -0,0 +1,128 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+
+struct mgos_barometer_subscription {
+  struct mgos_barometer *       sensor;
+  struct mgos_barometer_sample *buf;
+  mgos_barometer_batch_cb       cb;
+  void *                        cb_arg;
+  mgos_timer_id                 timer;
+  int64_t                       last_ts_usecs; // newest sample taken
+  uint16_t                      batch;
+  uint16_t                      count;       // samples waiting in buf
+};
+
+// Private functions follow
+static void mgos_barometer_subscription_cb(void *arg) {
+  struct mgos_barometer_subscription *sub = (struct mgos_barometer_subscription *)arg;
+  struct mgos_barometer_sample *      samples = &sub->buf[sub->count];
+  int n, i, k = 0;
+
+  // Sensors with a FIFO hand over everything they buffered since the last
+  // tick, the others a single sample.
+  n = mgos_barometer_read_batch(sub->sensor, samples, sub->batch - sub->count);
+  // The single sample may come from the cache if its TTL outlasts the
+  // period, and was then delivered already.
+  for (i = 0; i < n; i++) {
+    if (samples[i].ts_usecs > sub->last_ts_usecs) {
+      samples[k++]       = samples[i];
+      sub->last_ts_usecs = samples[i].ts_usecs;
+    }
+  }
+  n = k;
+  if (n <= 0) {
+    return;
+  }
+  mgos_barometer_emit(sub->sensor, samples, n);
+  sub->count += n;
+  if (sub->count < sub->batch) {
+    return;
+  }
+  sub->count = 0;
+  sub->cb(sub->sensor, sub->buf, sub->batch, sub->cb_arg);
+}
+
+// Private functions end
+
+// Public functions follow
+struct mgos_barometer_subscription *mgos_barometer_subscribe(struct mgos_barometer *sensor, uint32_t period_ms, uint16_t batch,
+                                                             mgos_barometer_batch_cb cb, void *cb_arg) {
+  struct mgos_barometer_subscription *sub;
+
+  if (!sensor || !cb || period_ms == 0 || batch == 0) {
+    return NULL;
+  }
+
+  // One allocation for the subscription and its batch buffer
+  sub = calloc(1, sizeof(struct mgos_barometer_subscription) + batch * sizeof(struct mgos_barometer_sample));
+  if (!sub) {
+    return NULL;
+  }
+  sub->sensor = sensor;
+  sub->buf    = (struct mgos_barometer_sample *)(sub + 1);
+  sub->cb     = cb;
+  sub->cb_arg = cb_arg;
+  sub->batch  = batch;
+  sub->timer  = mgos_set_timer(period_ms, MGOS_TIMER_REPEAT, mgos_barometer_subscription_cb, sub);
+  if (sub->timer == MGOS_INVALID_TIMER_ID) {
+    LOG(LL_ERROR, ("Could not start timer"));
+    free(sub);
+    return NULL;
+  }
+  return sub;
+}
+
+void mgos_barometer_unsubscribe(struct mgos_barometer_subscription *sub) {
+  if (!sub) {
+    return;
+  }
+  mgos_clear_timer(sub->timer);
+  free(sub);
+}
+
+// Accessors for batches handed to mJS callbacks, in the style of
+// mgos_barometer_return_spec().
+float mgos_barometer_return_sample(const struct mgos_barometer_sample *samples, int idx, uint8_t cap) {
+  if (!samples || idx < 0) {
+    return 0.0;
+  }
+  if (cap & MGOS_BAROMETER_CAP_ALTIMETER) {
+    return samples[idx].altitude;
+  }
+  if (cap & MGOS_BAROMETER_CAP_HYGROMETER) {
+    return samples[idx].humidity;
+  }
+  if (cap & MGOS_BAROMETER_CAP_THERMOMETER) {
+    return samples[idx].temperature;
+  }
+  if (cap & MGOS_BAROMETER_CAP_BAROMETER) {
+    return samples[idx].pressure;
+  }
+  return 0.0;
+}
+
+double mgos_barometer_return_sample_time(const struct mgos_barometer_sample *samples, int idx) {
+  if (!samples || idx < 0) {
+    return 0.0;
+  }
+  return samples[idx].ts_usecs / 1e6;
+}
+
+// Public functions end
@@ -0,0 +1,297 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <math.h>
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+#include "mgos_barometer_vario.h"
+
+// A gap this long restarts the filter rather than integrating across it.
+#define VARIO_MAX_DT_USECS        (1000000)
+// Weight of the newest residual in altitude_noise
+#define VARIO_NOISE_ALPHA         (0.05f)
+
+// Constant velocity model, with acceleration as white process noise. The
+// covariance is symmetric, so p10 is not stored.
+struct mgos_barometer_vario_filter {
+  float   h, v;                  // altitude (m), vertical speed (m/s)
+  float   p00, p01, p11;         // state covariance
+  float   q, r;                  // acceleration and measurement variance
+  float   resid2;                // moving average of squared residuals
+  float   sea_level_pa;
+  int64_t last_ts_usecs;
+  bool    init;
+};
+
+struct mgos_barometer_vario {
+  struct mgos_barometer *            sensor;
+  struct mgos_barometer_vario_filter filter;
+  struct mgos_barometer_vario_output out;
+  mgos_barometer_vario_cb            cb;
+  void *                             cb_arg;
+  mgos_timer_id                      timer;
+  uint32_t                           period_ms;
+  enum mgos_barometer_profile        saved_profile; // restored on destroy
+  bool                               async;
+  bool                               have_out;
+};
+
+// Private functions follow
+static float mgos_barometer_vario_altitude(float pressure, float sea_level_pa) {
+  return 44330.77f * (1.0f - powf(pressure / sea_level_pa, 0.190263f));
+}
+
+static void mgos_barometer_vario_filter_init(struct mgos_barometer_vario_filter *f, const struct mgos_barometer_vario_cfg *cfg) {
+  memset(f, 0, sizeof(struct mgos_barometer_vario_filter));
+  f->q            = cfg->accel_sigma * cfg->accel_sigma;
+  f->r            = cfg->altitude_sigma * cfg->altitude_sigma;
+  f->sea_level_pa = cfg->sea_level_pa;
+}
+
+static void mgos_barometer_vario_filter_update(struct mgos_barometer_vario_filter *f, const struct mgos_barometer_sample *sample,
+                                               struct mgos_barometer_vario_output *out) {
+  float z = mgos_barometer_vario_altitude(sample->pressure, f->sea_level_pa);
+  int64_t dt_usecs = sample->ts_usecs - f->last_ts_usecs;
+
+  if (!f->init || dt_usecs < 0 || dt_usecs > VARIO_MAX_DT_USECS) {
+    f->h      = z;
+    f->v      = 0;
+    f->p00    = f->r;
+    f->p01    = 0;
+    f->p11    = 1.0f;
+    f->resid2 = f->r;
+    f->init   = true;
+  } else {
+    float dt  = dt_usecs / 1e6f;
+    float dt2 = dt * dt;
+
+    // Predict
+    f->h   += f->v * dt;
+    f->p00 += dt * 2 * f->p01 + dt2 * f->p11 + f->q * dt2 * dt2 / 4;
+    f->p01 += dt * f->p11 + f->q * dt2 * dt / 2;
+    f->p11 += f->q * dt2;
+
+    // Update with the measured altitude
+    float y  = z - f->h;
+    float s  = f->p00 + f->r;
+    float k0 = f->p00 / s;
+    float k1 = f->p01 / s;
+    f->h   += k0 * y;
+    f->v   += k1 * y;
+    f->p11 -= k1 * f->p01;
+    f->p01 -= k0 * f->p01;
+    f->p00 -= k0 * f->p00;
+
+    f->resid2 += VARIO_NOISE_ALPHA * (y * y - f->resid2);
+  }
+  f->last_ts_usecs = sample->ts_usecs;
+
+  if (out) {
+    out->ts_usecs       = sample->ts_usecs;
+    out->altitude       = f->h;
+    out->vspeed         = f->v;
+    out->vspeed_sigma   = sqrtf(f->p11);
+    out->altitude_noise = sqrtf(f->resid2);
+    out->latency_usecs  = 0;
+  }
+}
+
+static void mgos_barometer_vario_publish(struct mgos_barometer_vario *vario) {
+  struct mgos_barometer_sample sample;
+  int64_t now = mgos_uptime_micros();
+
+  if (!mgos_barometer_get_sample(vario->sensor, &sample)) {
+    return;
+  }
+  // Sensors without start() may hand back a cached sample, which must not be
+  // fed to the filter twice.
+  if (vario->filter.init && sample.ts_usecs == vario->filter.last_ts_usecs) {
+    return;
+  }
+  mgos_barometer_vario_filter_update(&vario->filter, &sample, &vario->out);
+  vario->out.latency_usecs = (now > sample.ts_usecs) ? now - sample.ts_usecs : 0;
+  vario->have_out          = true;
+  if (vario->cb) {
+    vario->cb(vario->sensor, &vario->out, vario->cb_arg);
+  }
+}
+
+static void mgos_barometer_vario_start_cb(void *arg);
+
+static void mgos_barometer_vario_collect_cb(void *arg) {
+  struct mgos_barometer_vario *vario = (struct mgos_barometer_vario *)arg;
+
+  vario->timer = MGOS_INVALID_TIMER_ID;
+  if (mgos_barometer_collect_conversion(vario->sensor) > 0) {
+    mgos_barometer_vario_publish(vario);
+  }
+  mgos_barometer_vario_start_cb(vario);
+}
+
+// Conversions run back to back: each one is started as soon as the
+// previous one is collected.
+static void mgos_barometer_vario_start_cb(void *arg) {
+  struct mgos_barometer_vario *vario = (struct mgos_barometer_vario *)arg;
+  uint32_t wait_usecs;
+
+  if (!mgos_barometer_start_conversion(vario->sensor, &wait_usecs)) {
+    vario->timer = mgos_set_timer(vario->period_ms, 0, mgos_barometer_vario_start_cb, vario);
+    return;
+  }
+  vario->timer = mgos_set_timer((wait_usecs + 999) / 1000, 0, mgos_barometer_vario_collect_cb, vario);
+}
+
+static void mgos_barometer_vario_poll_cb(void *arg) {
+  struct mgos_barometer_vario *vario = (struct mgos_barometer_vario *)arg;
+
+  if (mgos_barometer_collect_conversion(vario->sensor) > 0) {
+    mgos_barometer_vario_publish(vario);
+  }
+}
+
+// Private functions end
+
+// Public functions follow
+void mgos_barometer_vario_default_cfg(struct mgos_barometer_vario_cfg *cfg) {
+  if (!cfg) {
+    return;
+  }
+  cfg->accel_sigma    = 1.0f;
+  cfg->altitude_sigma = 0.2f;
+  cfg->sea_level_pa   = 101325.0f;
+  cfg->rate_hz        = 50;
+}
+
+struct mgos_barometer_vario *mgos_barometer_vario_create(struct mgos_barometer *sensor, const struct mgos_barometer_vario_cfg *cfg,
+                                                         mgos_barometer_vario_cb cb, void *cb_arg) {
+  struct mgos_barometer_vario_cfg defaults;
+  struct mgos_barometer_vario *   vario;
+
+  if (!sensor || !mgos_barometer_has_barometer(sensor)) {
+    return NULL;
+  }
+  if (!cfg) {
+    mgos_barometer_vario_default_cfg(&defaults);
+    cfg = &defaults;
+  }
+  if (cfg->rate_hz == 0 || cfg->sea_level_pa <= 0 || cfg->altitude_sigma <= 0) {
+    return NULL;
+  }
+
+  vario = calloc(1, sizeof(struct mgos_barometer_vario));
+  if (!vario) {
+    return NULL;
+  }
+  vario->sensor        = sensor;
+  vario->cb            = cb;
+  vario->cb_arg        = cb_arg;
+  vario->period_ms     = 1000 / cfg->rate_hz;
+  vario->async         = (sensor->driver->start != NULL);
+  vario->saved_profile = (enum mgos_barometer_profile)sensor->profile;
+  mgos_barometer_vario_filter_init(&vario->filter, cfg);
+
+  if (!mgos_barometer_set_profile(sensor, BARO_PROFILE_HIGH_RATE)) {
+    LOG(LL_WARN, ("%s has no high rate profile, using its defaults", sensor->name));
+  }
+  if (vario->async) {
+    mgos_barometer_vario_start_cb(vario);
+  } else {
+    vario->timer = mgos_set_timer(vario->period_ms, MGOS_TIMER_REPEAT, mgos_barometer_vario_poll_cb, vario);
+  }
+  if (vario->timer == MGOS_INVALID_TIMER_ID) {
+    mgos_barometer_vario_destroy(&vario);
+    return NULL;
+  }
+  return vario;
+}
+
+void mgos_barometer_vario_destroy(struct mgos_barometer_vario **vario) {
+  if (!vario || !*vario) {
+    return;
+  }
+  if ((*vario)->timer != MGOS_INVALID_TIMER_ID) {
+    mgos_clear_timer((*vario)->timer);
+  }
+  // Finish a conversion in flight so that blocking reads work again.
+  if ((*vario)->sensor->flags & MGOS_BAROMETER_FLAG_CONVERTING) {
+    mgos_barometer_collect_conversion((*vario)->sensor);
+  }
+  mgos_barometer_set_profile((*vario)->sensor, (*vario)->saved_profile);
+  free(*vario);
+  *vario = NULL;
+}
+
+bool mgos_barometer_vario_get(struct mgos_barometer_vario *vario, struct mgos_barometer_vario_output *out) {
+  if (!vario || !out || !vario->have_out) {
+    return false;
+  }
+  *out = vario->out;
+  return true;
+}
+
+int mgos_barometer_vario_replay(const struct mgos_barometer_vario_cfg *cfg, const struct mgos_barometer_sample *samples, int n,
+                                struct mgos_barometer_vario_output *out) {
+  struct mgos_barometer_vario_cfg    defaults;
+  struct mgos_barometer_vario_filter f;
+
+  if (!samples || n < 0) {
+    return -1;
+  }
+  if (!cfg) {
+    mgos_barometer_vario_default_cfg(&defaults);
+    cfg = &defaults;
+  }
+  mgos_barometer_vario_filter_init(&f, cfg);
+  for (int i = 0; i < n; i++) {
+    mgos_barometer_vario_filter_update(&f, &samples[i], out ? &out[i] : NULL);
+  }
+  return n;
+}
+
+uint32_t mgos_barometer_vario_step_lag_usecs(const struct mgos_barometer_vario_cfg *cfg, uint16_t rate_hz) {
+  struct mgos_barometer_vario_cfg    defaults;
+  struct mgos_barometer_vario_filter f;
+  struct mgos_barometer_vario_output out;
+  struct mgos_barometer_sample       sample = { 0 };
+  int64_t period_usecs, step_usecs;
+  float   h = 0;
+
+  if (rate_hz == 0) {
+    return 0;
+  }
+  if (!cfg) {
+    mgos_barometer_vario_default_cfg(&defaults);
+    cfg = &defaults;
+  }
+  mgos_barometer_vario_filter_init(&f, cfg);
+  period_usecs = 1000000 / rate_hz;
+  step_usecs   = 2000000;
+
+  // Settle in level flight for 2s, then climb at 1 m/s for up to 10s.
+  for (sample.ts_usecs = period_usecs; sample.ts_usecs < step_usecs + 10000000; sample.ts_usecs += period_usecs) {
+    if (sample.ts_usecs > step_usecs) {
+      h = (sample.ts_usecs - step_usecs) / 1e6f;
+    }
+    sample.pressure = cfg->sea_level_pa * powf(1.0f - h / 44330.77f, 1.0f / 0.190263f);
+    mgos_barometer_vario_filter_update(&f, &sample, &out);
+    if (sample.ts_usecs > step_usecs && out.vspeed >= 0.63f) {
+      return sample.ts_usecs - step_usecs;
+    }
+  }
+  return UINT32_MAX;
+}
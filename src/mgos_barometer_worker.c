@@ -0,0 +1,376 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Per-bus sampling workers. Each bus with worker-sampled sensors gets a
+ * worker which reads them on schedule, with only that bus locked, and queues
+ * the samples to the main task through a single-producer, single-consumer
+ * ring. The main task drains all rings from mgos_invoke_cb(), so callbacks
+ * never run on a worker. Workers are FreeRTOS tasks on ESP32, threads on the
+ * POSIX port, and a main task timer everywhere else.
+ */
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+
+#if CS_PLATFORM == CS_P_ESP32
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#define MGOS_BAROMETER_WORKER_FREERTOS    1
+#elif CS_PLATFORM == CS_P_UNIX
+#include <pthread.h>
+#include <unistd.h>
+#define MGOS_BAROMETER_WORKER_PTHREAD     1
+#endif
+
+// How long an idle worker sleeps before looking for work again
+#define MGOS_BAROMETER_WORKER_IDLE_USECS  (100000)
+
+// Samples handed to a callback at once
+#define MGOS_BAROMETER_WORKER_BATCH       (8)
+
+struct mgos_barometer_worker_slot {
+  struct mgos_barometer * sensor;      // NULL if unused
+  mgos_barometer_batch_cb cb;
+  void *                  cb_arg;
+  int64_t                 next_usecs;
+  uint32_t                interval_usecs;
+};
+
+struct mgos_barometer_worker_item {
+  struct mgos_barometer_sample sample;
+  uint16_t                     id;     // sensor id, so a destroyed sensor's samples are dropped
+};
+
+struct mgos_barometer_worker {
+  struct mgos_barometer_worker_slot slots[MGOS_BAROMETER_WORKER_SENSORS]; // under the bus lock
+  struct mgos_barometer_worker_item queue[MGOS_BAROMETER_WORKER_QUEUE_LEN];
+  struct mgos_barometer_bus *       bus;
+  volatile uint32_t                 head;          // written by the worker only
+  volatile uint32_t                 tail;          // written by the main task only
+  volatile uint32_t                 dropped;       // samples lost to a full queue
+  uint32_t                          dropped_logged;
+  volatile int                      drain_pending;
+#if MGOS_BAROMETER_WORKER_FREERTOS
+  TaskHandle_t                      task;
+#elif MGOS_BAROMETER_WORKER_PTHREAD
+  pthread_t                         thread;
+#else
+  mgos_timer_id                     timer;
+#endif
+  int                               core;          // requested when started
+  bool                              started;
+};
+
+_Static_assert((MGOS_BAROMETER_WORKER_QUEUE_LEN & (MGOS_BAROMETER_WORKER_QUEUE_LEN - 1)) == 0, "MGOS_BAROMETER_WORKER_QUEUE_LEN must be a power of two");
+
+static struct mgos_barometer_worker *s_workers[MGOS_BAROMETER_MAX_BUSES];
+
+// Private functions follow
+static void mgos_barometer_worker_drain(void *arg) {
+  struct mgos_barometer_worker *w = (struct mgos_barometer_worker *)arg;
+  struct mgos_barometer_sample  batch[MGOS_BAROMETER_WORKER_BATCH];
+  struct mgos_barometer *       sensor = NULL;
+  mgos_barometer_batch_cb       cb     = NULL;
+  void *cb_arg = NULL;
+  int   n      = 0;
+
+  // Clear first: a sample queued from here on schedules another drain.
+  __sync_lock_release(&w->drain_pending);
+  __sync_synchronize();
+
+  while (w->tail != __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+    const struct mgos_barometer_worker_item *item = &w->queue[w->tail & (MGOS_BAROMETER_WORKER_QUEUE_LEN - 1)];
+    struct mgos_barometer *s = mgos_barometer_get_by_id(item->id);
+
+    if (n > 0 && (s != sensor || n == MGOS_BAROMETER_WORKER_BATCH)) {
+      mgos_barometer_emit(sensor, batch, n);
+      cb(sensor, batch, n, cb_arg);
+      n = 0;
+    }
+    if (n == 0) {
+      sensor = s;
+      cb     = NULL;
+      for (int i = 0; s && i < MGOS_BAROMETER_WORKER_SENSORS; i++) {
+        if (w->slots[i].sensor == s) {
+          cb     = w->slots[i].cb;
+          cb_arg = w->slots[i].cb_arg;
+        }
+      }
+    }
+    if (cb) {
+      batch[n++] = item->sample;
+    }
+    __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+  }
+  if (n > 0) {
+    mgos_barometer_emit(sensor, batch, n);
+    cb(sensor, batch, n, cb_arg);
+  }
+
+  uint32_t dropped = __atomic_load_n(&w->dropped, __ATOMIC_RELAXED);
+  if (dropped != w->dropped_logged) {
+    LOG(LL_WARN, ("Barometer worker queue overflowed, %u samples dropped", dropped - w->dropped_logged));
+    w->dropped_logged = dropped;
+  }
+}
+
+// Producer side of the ring, called on the worker.
+static void mgos_barometer_worker_push(struct mgos_barometer_worker *w, struct mgos_barometer *sensor, const struct mgos_barometer_sample *sample) {
+  if (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= MGOS_BAROMETER_WORKER_QUEUE_LEN) {
+    __atomic_fetch_add(&w->dropped, 1, __ATOMIC_RELAXED);
+  } else {
+    struct mgos_barometer_worker_item *item = &w->queue[w->head & (MGOS_BAROMETER_WORKER_QUEUE_LEN - 1)];
+    item->sample = *sample;
+    item->id     = sensor->id;
+    __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+  }
+  if (!__sync_lock_test_and_set(&w->drain_pending, 1)) {
+    mgos_invoke_cb(mgos_barometer_worker_drain, w, false);
+  }
+}
+
+// Sample whatever is due, and return how long until the next slot is.
+static uint32_t mgos_barometer_worker_run(struct mgos_barometer_worker *w) {
+  struct mgos_barometer_sample sample;
+  int64_t now, next;
+
+  // Through the bus helpers, so the bus counts as busy for the whole pass,
+  // and a try-lock never claims it between two slots only to wait behind
+  // the next one.
+  mgos_barometer_bus_acquire(w->bus);
+  now  = mgos_uptime_micros();
+  next = now + MGOS_BAROMETER_WORKER_IDLE_USECS;
+  for (int i = 0; i < MGOS_BAROMETER_WORKER_SENSORS; i++) {
+    struct mgos_barometer_worker_slot *slot = &w->slots[i];
+
+    if (!slot->sensor) {
+      continue;
+    }
+    if (slot->next_usecs <= now) {
+      mgos_barometer_bus_lock(slot->sensor);
+      if (mgos_barometer_sample_locked(slot->sensor, &sample)) {
+        mgos_barometer_worker_push(w, slot->sensor, &sample);
+      }
+      mgos_barometer_bus_unlock(slot->sensor);
+      slot->next_usecs += slot->interval_usecs;
+      now = mgos_uptime_micros();
+      // Skip ticks missed to a slow read rather than bursting to catch up.
+      if (slot->next_usecs <= now) {
+        slot->next_usecs = now + slot->interval_usecs;
+      }
+    }
+    if (slot->next_usecs < next) {
+      next = slot->next_usecs;
+    }
+  }
+  mgos_barometer_bus_release(w->bus);
+  return next > now ? next - now : 0;
+}
+
+#if MGOS_BAROMETER_WORKER_FREERTOS
+#define MGOS_BAROMETER_WORKER_TICK_USECS  (1000 * portTICK_PERIOD_MS)
+
+// Deadlines are rounded up to the next tick, so the worker never wakes
+// before one is due, and sleeps are counted from the previous wake-up so
+// that time spent sampling does not add up. Intervals shorter than a tick
+// end up sampled once per tick.
+static void mgos_barometer_worker_task(void *arg) {
+  struct mgos_barometer_worker *w = (struct mgos_barometer_worker *)arg;
+  TickType_t wake = xTaskGetTickCount();
+
+  for (;;) {
+    uint32_t   wait_usecs = mgos_barometer_worker_run(w);
+    TickType_t due        = xTaskGetTickCount() + (wait_usecs + MGOS_BAROMETER_WORKER_TICK_USECS - 1) / MGOS_BAROMETER_WORKER_TICK_USECS;
+    if (due == wake) {
+      due++;
+    }
+    vTaskDelayUntil(&wake, due - wake);
+  }
+}
+
+static bool mgos_barometer_worker_start(struct mgos_barometer_worker *w, int core) {
+  BaseType_t affinity = (core < 0) ? tskNO_AFFINITY : core;
+
+  if (w->started) {
+    if (core != w->core) {
+      LOG(LL_WARN, ("Barometer worker already runs on core %d, ignoring core %d", w->core, core));
+    }
+    return true;
+  }
+  if (xTaskCreatePinnedToCore(mgos_barometer_worker_task, "barometer", MGOS_BAROMETER_WORKER_STACK, w,
+                              MGOS_BAROMETER_WORKER_PRIORITY, &w->task, affinity) != pdPASS) {
+    return false;
+  }
+  w->core    = core;
+  w->started = true;
+  return true;
+}
+
+static void mgos_barometer_worker_idle(struct mgos_barometer_worker *w) {
+  (void)w;
+}
+
+#elif MGOS_BAROMETER_WORKER_PTHREAD
+static void *mgos_barometer_worker_thread(void *arg) {
+  struct mgos_barometer_worker *w = (struct mgos_barometer_worker *)arg;
+
+  for (;;) {
+    usleep(mgos_barometer_worker_run(w));
+  }
+  return NULL;
+}
+
+static bool mgos_barometer_worker_start(struct mgos_barometer_worker *w, int core) {
+  (void)core;
+  if (w->started) {
+    return true;
+  }
+  if (pthread_create(&w->thread, NULL, mgos_barometer_worker_thread, w) != 0) {
+    return false;
+  }
+  pthread_detach(w->thread);
+  w->started = true;
+  return true;
+}
+
+static void mgos_barometer_worker_idle(struct mgos_barometer_worker *w) {
+  (void)w;
+}
+
+#else
+static void mgos_barometer_worker_timer_cb(void *arg) {
+  struct mgos_barometer_worker *w = (struct mgos_barometer_worker *)arg;
+  uint32_t wait_usecs             = mgos_barometer_worker_run(w);
+
+  // Round up, so the timer never fires before the deadline.
+  w->timer = mgos_set_timer((wait_usecs + 999) / 1000, 0, mgos_barometer_worker_timer_cb, w);
+}
+
+// Without tasks, the worker is a timer on the main task. It is stopped
+// while the bus has no worker-sampled sensors.
+static bool mgos_barometer_worker_start(struct mgos_barometer_worker *w, int core) {
+  (void)core;
+  if (w->started) {
+    return true;
+  }
+  w->timer = mgos_set_timer(0, 0, mgos_barometer_worker_timer_cb, w);
+  if (w->timer == MGOS_INVALID_TIMER_ID) {
+    return false;
+  }
+  w->started = true;
+  return true;
+}
+
+static void mgos_barometer_worker_idle(struct mgos_barometer_worker *w) {
+  mgos_clear_timer(w->timer);
+  w->timer   = MGOS_INVALID_TIMER_ID;
+  w->started = false;
+}
+#endif
+
+static struct mgos_barometer_worker *mgos_barometer_worker_get(struct mgos_barometer_bus *bus, bool create) {
+  int free_idx = -1;
+
+  for (int i = 0; i < MGOS_BAROMETER_MAX_BUSES; i++) {
+    if (s_workers[i] && s_workers[i]->bus == bus) {
+      return s_workers[i];
+    }
+    if (!s_workers[i] && free_idx < 0) {
+      free_idx = i;
+    }
+  }
+  if (!create || free_idx < 0) {
+    return NULL;
+  }
+  // Workers live for the rest of the program, their tasks never exit.
+  s_workers[free_idx] = calloc(1, sizeof(struct mgos_barometer_worker));
+  if (s_workers[free_idx]) {
+    s_workers[free_idx]->bus = bus;
+  }
+  return s_workers[free_idx];
+}
+
+// Private functions end
+
+// Public functions follow
+bool mgos_barometer_start_worker_sampling(struct mgos_barometer *sensor, uint32_t interval_ms, int core,
+                                          mgos_barometer_batch_cb cb, void *cb_arg) {
+  struct mgos_barometer_worker *     w;
+  struct mgos_barometer_worker_slot *slot = NULL, *unused = NULL;
+  bool active = false;
+
+  if (!sensor || !sensor->bus) {
+    return false;
+  }
+  if (interval_ms > 0 && !cb) {
+    return false;
+  }
+  w = mgos_barometer_worker_get(sensor->bus, interval_ms > 0);
+  if (!w) {
+    if (interval_ms == 0) {
+      return true;
+    }
+    LOG(LL_ERROR, ("Could not allocate a worker for %s", mgos_barometer_get_name(sensor)));
+    return false;
+  }
+
+  mgos_barometer_bus_lock(sensor);
+  for (int i = 0; i < MGOS_BAROMETER_WORKER_SENSORS; i++) {
+    if (w->slots[i].sensor == sensor) {
+      slot = &w->slots[i];
+    } else if (!w->slots[i].sensor && !unused) {
+      unused = &w->slots[i];
+    }
+  }
+  if (interval_ms == 0) {
+    if (slot) {
+      memset(slot, 0, sizeof(struct mgos_barometer_worker_slot));
+    }
+  } else {
+    if (!slot) {
+      slot = unused;
+    }
+    if (!slot) {
+      mgos_barometer_bus_unlock(sensor);
+      LOG(LL_ERROR, ("No worker slot for %s, increase MGOS_BAROMETER_WORKER_SENSORS", mgos_barometer_get_name(sensor)));
+      return false;
+    }
+    slot->sensor         = sensor;
+    slot->cb             = cb;
+    slot->cb_arg         = cb_arg;
+    slot->interval_usecs = 1000 * interval_ms;
+    slot->next_usecs     = mgos_uptime_micros();
+  }
+  for (int i = 0; i < MGOS_BAROMETER_WORKER_SENSORS; i++) {
+    active |= (w->slots[i].sensor != NULL);
+  }
+  mgos_barometer_bus_unlock(sensor);
+
+  if (!active) {
+    mgos_barometer_worker_idle(w);
+    return true;
+  }
+  if (!mgos_barometer_worker_start(w, core)) {
+    LOG(LL_ERROR, ("Could not start the worker for %s", mgos_barometer_get_name(sensor)));
+    mgos_barometer_start_worker_sampling(sensor, 0, core, NULL, NULL);
+    return false;
+  }
+  return true;
+}
+
+// Public functions end
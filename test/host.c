@@ -0,0 +1,386 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <pthread.h>
+#include <time.h>
+
+#include "host.h"
+#include "mgos_gpio.h"
+#include "mgos_i2c.h"
+
+// Poll the main loop at least this often while waiting for timers
+#define HOST_POLL_USECS      (1000)
+#define HOST_EVENT_HANDLERS  (16)
+
+struct host_timer {
+  mgos_timer_id  id;
+  int64_t        due_usecs;
+  uint32_t       interval_usecs;  // 0 unless repeating
+  timer_callback cb;
+  void *         cb_arg;
+};
+
+struct host_cb {
+  mgos_cb_t cb;
+  void *    arg;
+};
+
+struct host_event_handler {
+  int                  ev;
+  mgos_event_handler_t cb;
+  void *               userdata;
+};
+
+int host_log_level = LL_WARN;
+struct mgos_config_barometer_s0 host_config[2];
+
+static pthread_mutex_t    s_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host_timer *s_timers;
+static int                s_timers_len, s_timers_cap;
+static mgos_timer_id      s_timer_next_id = 1;
+static struct host_cb *   s_cbs;
+static int                s_cbs_len, s_cbs_cap;
+static struct host_event_handler s_handlers[HOST_EVENT_HANDLERS];
+static int                       s_handlers_len;
+
+struct mgos_rlock_type {
+  pthread_mutex_t m;
+};
+
+// Private functions follow
+static int host_timer_find(mgos_timer_id id) {
+  for (int i = 0; i < s_timers_len; i++) {
+    if (s_timers[i].id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Take the timer off the list, or re-arm it if it repeats. Called locked.
+static bool host_timer_take(mgos_timer_id id, int64_t now, struct host_timer *t) {
+  int i = host_timer_find(id);
+
+  if (i < 0 || s_timers[i].due_usecs > now) {
+    return false;
+  }
+  *t = s_timers[i];
+  if (t->interval_usecs > 0) {
+    s_timers[i].due_usecs = now + t->interval_usecs;
+  } else {
+    s_timers[i] = s_timers[--s_timers_len];
+  }
+  return true;
+}
+
+// Private functions end
+
+// Public functions follow
+double mg_time(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int64_t mgos_uptime_micros(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+double mgos_uptime(void) {
+  return mgos_uptime_micros() / 1e6;
+}
+
+void mgos_usleep(uint32_t usecs) {
+  struct timespec ts = { usecs / 1000000, (usecs % 1000000) * 1000 };
+
+  nanosleep(&ts, NULL);
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb, void *cb_arg) {
+  struct host_timer *t;
+  mgos_timer_id      id;
+
+  pthread_mutex_lock(&s_lock);
+  if (s_timers_len == s_timers_cap) {
+    int cap = s_timers_cap ? 2 * s_timers_cap : 64;
+    struct host_timer *timers = realloc(s_timers, cap * sizeof(struct host_timer));
+    if (!timers) {
+      pthread_mutex_unlock(&s_lock);
+      return MGOS_INVALID_TIMER_ID;
+    }
+    s_timers     = timers;
+    s_timers_cap = cap;
+  }
+  id                = s_timer_next_id++;
+  t                 = &s_timers[s_timers_len++];
+  t->id             = id;
+  t->interval_usecs = (flags & MGOS_TIMER_REPEAT) ? (uint32_t)msecs * 1000 : 0;
+  t->due_usecs      = mgos_uptime_micros() + ((flags & MGOS_TIMER_RUN_NOW) ? 0 : (int64_t)msecs * 1000);
+  t->cb             = cb;
+  t->cb_arg         = cb_arg;
+  pthread_mutex_unlock(&s_lock);
+  return id;
+}
+
+void mgos_clear_timer(mgos_timer_id id) {
+  int i;
+
+  pthread_mutex_lock(&s_lock);
+  i = host_timer_find(id);
+  if (i >= 0) {
+    s_timers[i] = s_timers[--s_timers_len];
+  }
+  pthread_mutex_unlock(&s_lock);
+}
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr) {
+  bool ret = true;
+
+  (void)from_isr;
+  pthread_mutex_lock(&s_lock);
+  if (s_cbs_len == s_cbs_cap) {
+    int cap = s_cbs_cap ? 2 * s_cbs_cap : 64;
+    struct host_cb *cbs = realloc(s_cbs, cap * sizeof(struct host_cb));
+    if (cbs) {
+      s_cbs     = cbs;
+      s_cbs_cap = cap;
+    }
+  }
+  if (s_cbs_len < s_cbs_cap) {
+    s_cbs[s_cbs_len].cb  = cb;
+    s_cbs[s_cbs_len].arg = arg;
+    s_cbs_len++;
+  } else {
+    ret = false;
+  }
+  pthread_mutex_unlock(&s_lock);
+  return ret;
+}
+
+int host_poll(void) {
+  int64_t        now = mgos_uptime_micros();
+  mgos_timer_id *due;
+  int            n_due = 0, n = 0;
+
+  // Timers armed by the callbacks below wait for the next poll.
+  pthread_mutex_lock(&s_lock);
+  due = malloc((s_timers_len + 1) * sizeof(mgos_timer_id));
+  for (int i = 0; due && i < s_timers_len; i++) {
+    if (s_timers[i].due_usecs <= now) {
+      due[n_due++] = s_timers[i].id;
+    }
+  }
+  pthread_mutex_unlock(&s_lock);
+
+  for (int i = 0; i < n_due; i++) {
+    struct host_timer t;
+    bool taken;
+
+    pthread_mutex_lock(&s_lock);
+    taken = host_timer_take(due[i], now, &t);
+    pthread_mutex_unlock(&s_lock);
+    if (taken) {
+      t.cb(t.cb_arg);
+      n++;
+    }
+  }
+  free(due);
+
+  for (;;) {
+    struct host_cb cb;
+
+    pthread_mutex_lock(&s_lock);
+    if (s_cbs_len == 0) {
+      pthread_mutex_unlock(&s_lock);
+      break;
+    }
+    cb = s_cbs[0];
+    memmove(s_cbs, s_cbs + 1, --s_cbs_len * sizeof(struct host_cb));
+    pthread_mutex_unlock(&s_lock);
+    cb.cb(cb.arg);
+    n++;
+  }
+  return n;
+}
+
+void host_run_for(uint32_t usecs) {
+  int64_t end = mgos_uptime_micros() + usecs;
+  int64_t now;
+
+  while ((now = mgos_uptime_micros()) < end) {
+    int64_t next = now + HOST_POLL_USECS;
+
+    host_poll();
+    pthread_mutex_lock(&s_lock);
+    for (int i = 0; i < s_timers_len; i++) {
+      if (s_timers[i].due_usecs < next) {
+        next = s_timers[i].due_usecs;
+      }
+    }
+    if (s_cbs_len > 0) {
+      next = now;
+    }
+    pthread_mutex_unlock(&s_lock);
+    if (next > end) {
+      next = end;
+    }
+    now = mgos_uptime_micros();
+    if (next > now) {
+      mgos_usleep(next - now);
+    }
+  }
+}
+
+struct mgos_rlock_type *mgos_rlock_create(void) {
+  struct mgos_rlock_type *l = calloc(1, sizeof(struct mgos_rlock_type));
+  pthread_mutexattr_t     attr;
+
+  if (!l) {
+    return NULL;
+  }
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&l->m, &attr);
+  pthread_mutexattr_destroy(&attr);
+  return l;
+}
+
+void mgos_rlock(struct mgos_rlock_type *l) {
+  pthread_mutex_lock(&l->m);
+}
+
+void mgos_runlock(struct mgos_rlock_type *l) {
+  pthread_mutex_unlock(&l->m);
+}
+
+void mgos_rlock_destroy(struct mgos_rlock_type *l) {
+  if (l) {
+    pthread_mutex_destroy(&l->m);
+    free(l);
+  }
+}
+
+bool mgos_event_register_base(int base_event_number, const char *name) {
+  (void)base_event_number;
+  (void)name;
+  return true;
+}
+
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata) {
+  if (s_handlers_len == HOST_EVENT_HANDLERS) {
+    return false;
+  }
+  s_handlers[s_handlers_len].ev       = ev;
+  s_handlers[s_handlers_len].cb       = cb;
+  s_handlers[s_handlers_len].userdata = userdata;
+  s_handlers_len++;
+  return true;
+}
+
+int mgos_event_trigger(int ev, void *ev_data) {
+  int n = 0;
+
+  for (int i = 0; i < s_handlers_len; i++) {
+    if (s_handlers[i].ev == ev) {
+      s_handlers[i].cb(ev, ev_data, s_handlers[i].userdata);
+      n++;
+    }
+  }
+  return n;
+}
+
+const struct mgos_config_barometer_s0 *mgos_sys_config_get_barometer_s0(void) {
+  return &host_config[0];
+}
+
+const struct mgos_config_barometer_s0 *mgos_sys_config_get_barometer_s1(void) {
+  return &host_config[1];
+}
+
+// No devices on the bus: transfers succeed and read zeroes, so only drivers
+// registered by the tests produce samples.
+bool mgos_i2c_write(struct mgos_i2c *conn, uint16_t addr, const void *data, size_t len, bool stop) {
+  return true;
+}
+
+bool mgos_i2c_read(struct mgos_i2c *conn, uint16_t addr, void *data, size_t len, bool stop) {
+  memset(data, 0, len);
+  return true;
+}
+
+int mgos_i2c_read_reg_b(struct mgos_i2c *conn, uint16_t addr, uint8_t reg) {
+  return 0;
+}
+
+int mgos_i2c_read_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg) {
+  return 0;
+}
+
+bool mgos_i2c_read_reg_n(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, size_t n, uint8_t *buf) {
+  memset(buf, 0, n);
+  return true;
+}
+
+bool mgos_i2c_write_reg_b(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, uint8_t value) {
+  return true;
+}
+
+bool mgos_i2c_write_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, uint16_t value) {
+  return true;
+}
+
+bool mgos_i2c_write_reg_n(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, size_t n, const uint8_t *buf) {
+  return true;
+}
+
+// Bus n is (struct mgos_i2c *)(n + 1), so tests can make up their own.
+struct mgos_i2c *mgos_i2c_get_global(void) {
+  return mgos_i2c_get_bus(0);
+}
+
+struct mgos_i2c *mgos_i2c_get_bus(int bus_no) {
+  return (struct mgos_i2c *)(intptr_t)(bus_no + 1);
+}
+
+bool mgos_gpio_set_mode(int pin, enum mgos_gpio_mode mode) {
+  return true;
+}
+
+bool mgos_gpio_set_pull(int pin, enum mgos_gpio_pull_type pull) {
+  return true;
+}
+
+bool mgos_gpio_set_int_handler(int pin, enum mgos_gpio_int_mode mode, mgos_gpio_int_handler_f cb, void *arg) {
+  return true;
+}
+
+bool mgos_gpio_enable_int(int pin) {
+  return true;
+}
+
+bool mgos_gpio_disable_int(int pin) {
+  return true;
+}
+
+void mgos_gpio_remove_int_handler(int pin, mgos_gpio_int_handler_f *old_cb, void **old_arg) {
+}
+
+// Public functions end
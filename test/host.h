@@ -0,0 +1,43 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos.h"
+
+/*
+ * Host side of the Mongoose OS stubs in mgos/. Timers and mgos_invoke_cb()
+ * callbacks run on whichever thread calls host_poll(), which stands in for
+ * the main task.
+ */
+
+// Run the timers that are due and the callbacks queued so far. Returns the
+// number of callbacks run.
+int host_poll(void);
+
+// Poll until usecs have passed, sleeping until the next timer in between.
+void host_run_for(uint32_t usecs);
+
+// Returned by mgos_sys_config_get_barometer_s0() and _s1(), all zero
+// (disabled) unless a test fills them in.
+extern struct mgos_config_barometer_s0 host_config[2];
+
+// Call an mg_rpc handler registered under method with the JSON args, and
+// put its result, or error message, into buf. Returns 0 on success, the
+// error code, or -1 if there is no such method or it did not respond.
+// Needs host_rpc.c.
+int host_rpc_call(const char *method, const char *args, char *buf, size_t len);
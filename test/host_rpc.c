@@ -0,0 +1,343 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <ctype.h>
+
+#include "host.h"
+#include "mgos_rpc.h"
+
+#define HOST_RPC_HANDLERS    (16)
+
+struct host_rpc_handler {
+  const char *    method;
+  const char *    args_fmt;
+  mg_handler_cb_t cb;
+  void *          cb_arg;
+};
+
+static struct host_rpc_handler s_rpc_handlers[HOST_RPC_HANDLERS];
+static int                     s_rpc_handlers_len;
+
+// Private functions follow
+static void json_out_put(struct json_out *out, const char *s, size_t n) {
+  for (size_t i = 0; i < n; i++, out->len++) {
+    if (out->len + 1 < out->size) {
+      out->buf[out->len] = s[i];
+    }
+  }
+  if (out->size > 0) {
+    out->buf[out->len < out->size ? out->len : out->size - 1] = '\0';
+  }
+}
+
+static int json_out_quoted(struct json_out *out, const char *s) {
+  size_t start = out->len;
+
+  if (!s) {
+    json_out_put(out, "null", 4);
+    return 4;
+  }
+  json_out_put(out, "\"", 1);
+  for (; *s; s++) {
+    char esc[8];
+
+    if (*s == '"' || *s == '\\') {
+      esc[0] = '\\', esc[1] = *s;
+      json_out_put(out, esc, 2);
+    } else if ((unsigned char)*s < 0x20) {
+      json_out_put(out, esc, snprintf(esc, sizeof(esc), "\\u%04x", *s));
+    } else {
+      json_out_put(out, s, 1);
+    }
+  }
+  json_out_put(out, "\"", 1);
+  return out->len - start;
+}
+
+// One printf conversion spec, e.g. "%.2f" or "%lld", printed with snprintf.
+static int json_out_number(struct json_out *out, const char *spec, size_t n, va_list *ap) {
+  char fmt[16], num[64];
+  char conv  = spec[n - 1];
+  int  longs = 0, len;
+
+  if (n >= sizeof(fmt)) {
+    return 0;
+  }
+  memcpy(fmt, spec, n);
+  fmt[n] = '\0';
+  for (size_t i = 0; i < n; i++) {
+    longs += spec[i] == 'l';
+  }
+  if (strchr("fFeEgG", conv)) {
+    len = snprintf(num, sizeof(num), fmt, va_arg(*ap, double));
+  } else if (strchr("di", conv)) {
+    len = longs >= 2 ? snprintf(num, sizeof(num), fmt, va_arg(*ap, long long)) :
+          longs == 1 ? snprintf(num, sizeof(num), fmt, va_arg(*ap, long)) : snprintf(num, sizeof(num), fmt, va_arg(*ap, int));
+  } else {
+    len = longs >= 2 ? snprintf(num, sizeof(num), fmt, va_arg(*ap, unsigned long long)) :
+          longs == 1 ? snprintf(num, sizeof(num), fmt, va_arg(*ap, unsigned long)) : snprintf(num, sizeof(num), fmt, va_arg(*ap, unsigned));
+  }
+  json_out_put(out, num, len);
+  return len;
+}
+
+static const char *json_skip_ws(const char *p, const char *end) {
+  while (p < end && isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
+}
+
+// Finds "key": in the top level object of [p, end), returning its value.
+static const char *json_find_key(const char *p, const char *end, const char *key, size_t key_len) {
+  int depth = 0;
+
+  for (; p < end; p++) {
+    if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (*p == '}' || *p == ']') {
+      depth--;
+    } else if (*p == '"') {
+      const char *s = ++p;
+
+      while (p < end && *p != '"') {
+        p += (*p == '\\') ? 2 : 1;
+      }
+      if (depth == 1 && p < end && (size_t)(p - s) == key_len && memcmp(s, key, key_len) == 0) {
+        const char *v = json_skip_ws(p + 1, end);
+
+        if (v < end && *v == ':') {
+          return json_skip_ws(v + 1, end);
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static struct host_rpc_handler *host_rpc_find(const char *method) {
+  for (int i = 0; i < s_rpc_handlers_len; i++) {
+    if (strcmp(s_rpc_handlers[i].method, method) == 0) {
+      return &s_rpc_handlers[i];
+    }
+  }
+  return NULL;
+}
+
+// Private functions end
+
+// Public functions follow
+int json_vprintf(struct json_out *out, const char *fmt, va_list xap) {
+  size_t  start = out->len;
+  va_list ap;
+
+  va_copy(ap, xap);
+  while (*fmt) {
+    if (*fmt == '%') {
+      const char *spec = fmt++;
+
+      while (*fmt && strchr("-+ #0123456789.hlLqjzt", *fmt)) {
+        fmt++;
+      }
+      switch (*fmt) {
+      case 'M': {
+        json_printf_callback_t cb = va_arg(ap, json_printf_callback_t);
+        cb(out, &ap);
+        break;
+      }
+
+      case 'Q': json_out_quoted(out, va_arg(ap, const char *)); break;
+
+      case 'B': {
+        int b = va_arg(ap, int);
+        json_out_put(out, b ? "true" : "false", b ? 4 : 5);
+        break;
+      }
+
+      case 's': {
+        const char *s = va_arg(ap, const char *);
+        json_out_put(out, s, strlen(s));
+        break;
+      }
+
+      case '%': json_out_put(out, "%", 1); break;
+
+      case '\0': fmt--; break;
+
+      default: json_out_number(out, spec, fmt - spec + 1, &ap); break;
+      }
+      fmt++;
+    } else if (*fmt == '"') {
+      // Quoted in fmt already: copy through
+      const char *s = fmt++;
+
+      while (*fmt && *fmt != '"') {
+        fmt += (*fmt == '\\' && fmt[1]) ? 2 : 1;
+      }
+      if (*fmt) {
+        fmt++;
+      }
+      json_out_put(out, s, fmt - s);
+    } else if (isalpha((unsigned char)*fmt) || *fmt == '_') {
+      const char *s = fmt;
+
+      while (isalnum((unsigned char)*fmt) || *fmt == '_') {
+        fmt++;
+      }
+      json_out_put(out, "\"", 1);
+      json_out_put(out, s, fmt - s);
+      json_out_put(out, "\"", 1);
+    } else {
+      json_out_put(out, fmt++, 1);
+    }
+  }
+  va_end(ap);
+  return out->len - start;
+}
+
+int json_printf(struct json_out *out, const char *fmt, ...) {
+  va_list ap;
+  int     len;
+
+  va_start(ap, fmt);
+  len = json_vprintf(out, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+int json_scanf(const char *str, int str_len, const char *fmt, ...) {
+  const char *end = str + str_len;
+  va_list     ap;
+  int         found = 0;
+
+  va_start(ap, fmt);
+  while (*fmt) {
+    const char *key, *v;
+    size_t      key_len;
+    char        conv;
+    void *      dst;
+
+    while (*fmt && !isalpha((unsigned char)*fmt) && *fmt != '_') {
+      fmt++;
+    }
+    if (!*fmt) {
+      break;
+    }
+    key = fmt;
+    while (isalnum((unsigned char)*fmt) || *fmt == '_') {
+      fmt++;
+    }
+    key_len = fmt - key;
+    fmt     = strchr(fmt, '%');
+    if (!fmt || !fmt[1]) {
+      break;
+    }
+    conv = fmt[1];
+    fmt += 2;
+    dst  = va_arg(ap, void *);
+
+    v = json_find_key(str, end, key, key_len);
+    if (!v || v >= end) {
+      continue;
+    }
+    if (conv == 'B' && (strncmp(v, "true", 4) == 0 || strncmp(v, "false", 5) == 0)) {
+      *(bool *)dst = (*v == 't');
+      found++;
+    } else if ((conv == 'd' || conv == 'u') && (isdigit((unsigned char)*v) || *v == '-')) {
+      if (conv == 'd') {
+        *(int *)dst = (int)strtol(v, NULL, 10);
+      } else {
+        *(unsigned *)dst = (unsigned)strtoul(v, NULL, 10);
+      }
+      found++;
+    }
+  }
+  va_end(ap);
+  return found;
+}
+
+struct mg_rpc *mgos_rpc_get_global(void) {
+  static int s_rpc;
+
+  return (struct mg_rpc *)&s_rpc;
+}
+
+bool mg_rpc_add_handler(struct mg_rpc *c, const char *method, const char *args_fmt, mg_handler_cb_t cb, void *cb_arg) {
+  if (s_rpc_handlers_len == HOST_RPC_HANDLERS || host_rpc_find(method)) {
+    return false;
+  }
+  s_rpc_handlers[s_rpc_handlers_len].method   = method;
+  s_rpc_handlers[s_rpc_handlers_len].args_fmt = args_fmt;
+  s_rpc_handlers[s_rpc_handlers_len].cb       = cb;
+  s_rpc_handlers[s_rpc_handlers_len].cb_arg   = cb_arg;
+  s_rpc_handlers_len++;
+  return true;
+}
+
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri, const char *result_json_fmt, ...) {
+  va_list ap;
+
+  if (ri->responded) {
+    return false;
+  }
+  va_start(ap, result_json_fmt);
+  json_vprintf(&ri->result, result_json_fmt, ap);
+  va_end(ap);
+  ri->responded = true;
+  return true;
+}
+
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code, const char *error_msg_fmt, ...) {
+  va_list ap;
+  char    msg[256];
+
+  if (ri->responded) {
+    return false;
+  }
+  va_start(ap, error_msg_fmt);
+  vsnprintf(msg, sizeof(msg), error_msg_fmt, ap);
+  va_end(ap);
+  json_out_put(&ri->result, msg, strlen(msg));
+  ri->error_code = error_code;
+  ri->responded  = true;
+  return true;
+}
+
+int host_rpc_call(const char *method, const char *args, char *buf, size_t len) {
+  struct host_rpc_handler * h = host_rpc_find(method);
+  struct mg_rpc_request_info ri;
+  struct mg_str              a = { args, strlen(args) };
+
+  if (len > 0) {
+    buf[0] = '\0';
+  }
+  if (!h) {
+    return -1;
+  }
+  memset(&ri, 0, sizeof(ri));
+  ri.method      = method;
+  ri.args_fmt    = h->args_fmt;
+  ri.result.buf  = buf;
+  ri.result.size = len;
+  h->cb(&ri, h->cb_arg, NULL, a);
+  if (!ri.responded) {
+    return -1;
+  }
+  return ri.error_code;
+}
+
+// Public functions end
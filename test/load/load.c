@@ -0,0 +1,142 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos_barometer_internal.h"
+#include "host.h"
+#include "test.h"
+#include "sim.h"
+
+/*
+ * Load test with simulated sensors. For each sensor count, the sensors are
+ * spread over LOAD_BUSES buses and the mux channels on each, and run for
+ * LOAD_RUN_USECS. Three in four are sampled on the main task every 1, 2 or
+ * 4 seconds. The rest are read by the application every LOAD_POLL_MS
+ * through a cache with stale-while-revalidate, so they are refreshed with
+ * non-blocking conversions. Per count, it prints the memory per sensor, the
+ * sampler's own overhead per tick, the deadlines missed and the samples
+ * taken per second. Busy is the share of the run the sampler spent in
+ * reads. The main task nears its limit at the largest default count, where
+ * deadlines start to be missed and fewer reads are served from the cache.
+ *
+ * Counts can be given on the command line, e.g. `./load 50 300`.
+ */
+
+TEST_MAIN_DECLS;
+
+#define LOAD_BUSES           (4)
+#define LOAD_MAX_SENSORS     (LOAD_BUSES * 128)
+#define LOAD_RUN_USECS       (5000000)
+#define LOAD_POLL_MS         (100)
+#define LOAD_CACHE_TTL_MS    (500)
+#define LOAD_CACHE_STALE_MS  (1000)
+
+static const int      s_counts[]    = { 10, 100, 250, 500 };
+static const uint32_t s_intervals[] = { 1000, 2000, 4000 };
+
+static struct mgos_barometer *s_sensors[LOAD_MAX_SENSORS];
+static int s_num_sensors;
+
+// Private functions follow
+static bool load_cached(int i) {
+  return (i + i / LOAD_BUSES) % 4 == 3;
+}
+
+static void load_poll_cb(void *arg) {
+  for (int i = 0; i < s_num_sensors; i++) {
+    if (load_cached(i)) {
+      mgos_barometer_read(s_sensors[i]);
+    }
+  }
+}
+
+static void load_run(int n) {
+  struct mgos_barometer_footprint      fp;
+  struct mgos_barometer_sampling_stats ss;
+  struct mgos_barometer_stats          st;
+  mgos_timer_id poll;
+  uint64_t      mem = 0, ticks = 0, missed = 0, samples = 0, reads = 0, cached = 0, xfers = 0;
+  double        overhead = 0, busy = 0;
+  int64_t       start, elapsed;
+
+  s_num_sensors = 0;
+  for (int i = 0; i < n; i++) {
+    struct mgos_barometer *s = mgos_barometer_create_i2c(mgos_i2c_get_bus(i % LOAD_BUSES), i / LOAD_BUSES, SIM_TYPE);
+
+    TEST_CHECK(s != NULL, "create sensor %d", i);
+    if (!s) {
+      break;
+    }
+    s_sensors[s_num_sensors++] = s;
+    if (load_cached(i)) {
+      mgos_barometer_set_cache_ttl(s, LOAD_CACHE_TTL_MS);
+      mgos_barometer_set_cache_stale(s, LOAD_CACHE_STALE_MS);
+    } else {
+      mgos_barometer_start_sampling(s, s_intervals[i % 3]);
+    }
+  }
+
+  start = mgos_uptime_micros();
+  poll  = mgos_set_timer(LOAD_POLL_MS, MGOS_TIMER_REPEAT, load_poll_cb, NULL);
+  host_run_for(LOAD_RUN_USECS);
+  mgos_clear_timer(poll);
+  elapsed = mgos_uptime_micros() - start;
+
+  for (int i = 0; i < s_num_sensors; i++) {
+    mgos_barometer_get_footprint(s_sensors[i], &fp);
+    mgos_barometer_get_stats(s_sensors[i], &st);
+    mem   += fp.core_bytes + fp.user_data_bytes + fp.aux_bytes;
+    xfers += st.i2c_transactions;
+    if (mgos_barometer_get_sampling_stats(s_sensors[i], &ss)) {
+      ticks    += ss.ticks;
+      missed   += ss.missed;
+      samples  += ss.samples;
+      overhead += ss.overhead_usecs;
+      busy     += ss.busy_usecs;
+    } else {
+      samples += st.cache_miss + st.cache_refresh;
+      reads   += st.read;
+      cached  += st.read_success_cached;
+    }
+  }
+  TEST_CHECK(ticks > 0 && samples > 0, "%d: no samples", n);
+  TEST_CHECK(reads == 0 || cached > 0, "%d: no cached reads", n);
+
+  printf("%4d sensors: %5.0f bytes/sensor, %5.1f us/tick overhead, %5.1f%% busy, %6llu missed, %7.1f samples/s, %.2f i2c/sample, %5.1f%% cached\n",
+         s_num_sensors, s_num_sensors ? (double)mem / s_num_sensors : 0, ticks ? overhead / ticks : 0,
+         100.0 * busy / elapsed, (unsigned long long)missed, samples * 1e6 / elapsed,
+         samples ? (double)xfers / samples : 0, reads ? 100.0 * cached / reads : 0);
+
+  for (int i = 0; i < s_num_sensors; i++) {
+    mgos_barometer_destroy(&s_sensors[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  TEST_CHECK(mgos_barometer_register_driver(&sim_driver), "register driver");
+  if (argc > 1) {
+    for (int i = 1; i < argc; i++) {
+      int n = atoi(argv[i]);
+
+      load_run(n < LOAD_MAX_SENSORS ? n : LOAD_MAX_SENSORS);
+    }
+  } else {
+    for (size_t i = 0; i < sizeof(s_counts) / sizeof(s_counts[0]); i++) {
+      load_run(s_counts[i]);
+    }
+  }
+  return test_summary("load");
+}
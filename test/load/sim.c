@@ -0,0 +1,164 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <math.h>
+
+#include "sim.h"
+
+// Channel currently selected on each bus's mux.
+static struct {
+  struct mgos_i2c *i2c;
+  uint8_t          channel;
+} s_sim_mux[MGOS_BAROMETER_MAX_BUSES];
+
+static const uint32_t s_sim_conv_usecs[] = SIM_CONV_USECS;
+
+// Private functions follow
+static uint32_t sim_rand(struct sim_data *sim) {
+  sim->rng ^= sim->rng << 13;
+  sim->rng ^= sim->rng >> 17;
+  sim->rng ^= sim->rng << 5;
+  return sim->rng;
+}
+
+static void sim_xfer(struct mgos_barometer *dev, size_t bytes) {
+  dev->stats.i2c_transactions++;
+  dev->stats.i2c_bytes += bytes;
+  mgos_usleep(SIM_XFER_USECS(bytes));
+}
+
+// Selects the sensor's mux channel, unless the previous transaction on this
+// bus went to the same channel. Called with the bus locked.
+static void sim_select(struct mgos_barometer *dev) {
+  uint8_t channel = SIM_MUX_CHANNEL(dev->i2caddr);
+  int     i;
+
+  for (i = 0; i < MGOS_BAROMETER_MAX_BUSES; i++) {
+    if (s_sim_mux[i].i2c == dev->i2c) {
+      break;
+    }
+    if (!s_sim_mux[i].i2c) {
+      s_sim_mux[i].i2c     = dev->i2c;
+      s_sim_mux[i].channel = SIM_MUX_NONE;
+      break;
+    }
+  }
+  if (i == MGOS_BAROMETER_MAX_BUSES || s_sim_mux[i].channel == channel) {
+    return;
+  }
+  sim_xfer(dev, 1);
+  s_sim_mux[i].channel = channel;
+}
+
+// Slow weather-like drift with a few Pascals of noise on top.
+static void sim_sample(struct mgos_barometer *dev, struct sim_data *sim) {
+  float t     = mgos_uptime_micros() / 1e6f;
+  float noise = (int32_t)(sim_rand(sim) % 401 - 200) / 100.0f;
+
+  sim_select(dev);
+  sim_xfer(dev, SIM_DATA_BYTES);
+  dev->pressure    = sim->p0 + 30.0f * sinf(t / 600.0f) + noise;
+  dev->temperature = 20.0f + 2.0f * sinf(t / 900.0f);
+  dev->humidity    = 45.0f + 5.0f * sinf(t / 1200.0f);
+}
+
+static bool sim_create(struct mgos_barometer *dev) {
+  struct sim_data *sim;
+
+  if (!dev) {
+    return false;
+  }
+  sim = (struct sim_data *)dev->user_data;
+  if (!sim) {
+    return false;
+  }
+
+  sim->rng        = 0x9e3779b9u ^ (dev->i2caddr * 2654435761u) ^ (uint32_t)(uintptr_t)dev->i2c;
+  sim->rng       |= 1;
+  sim->conv_usecs = s_sim_conv_usecs[dev->i2caddr % (sizeof(s_sim_conv_usecs) / sizeof(s_sim_conv_usecs[0]))];
+  // Sensors at different heights, about 1 meter per address.
+  sim->p0 = 101325.0f - 12.0f * dev->i2caddr;
+  return true;
+}
+
+static bool sim_read(struct mgos_barometer *dev) {
+  struct sim_data *sim;
+
+  if (!dev) {
+    return false;
+  }
+  sim = (struct sim_data *)dev->user_data;
+  if (!sim) {
+    return false;
+  }
+
+  sim_select(dev);
+  sim_xfer(dev, SIM_START_BYTES);
+  dev->ts_usecs = mgos_uptime_micros() + sim->conv_usecs / 2;
+  mgos_usleep(sim->conv_usecs);
+  sim_sample(dev, sim);
+  return true;
+}
+
+static bool sim_start(struct mgos_barometer *dev, uint32_t *wait_usecs) {
+  struct sim_data *sim;
+
+  if (!dev || !wait_usecs) {
+    return false;
+  }
+  sim = (struct sim_data *)dev->user_data;
+  if (!sim) {
+    return false;
+  }
+
+  sim_select(dev);
+  sim_xfer(dev, SIM_START_BYTES);
+  dev->ts_usecs = mgos_uptime_micros() + sim->conv_usecs / 2;
+  *wait_usecs   = sim->conv_usecs;
+  return true;
+}
+
+static int sim_collect(struct mgos_barometer *dev) {
+  struct sim_data *sim;
+
+  if (!dev) {
+    return -1;
+  }
+  sim = (struct sim_data *)dev->user_data;
+  if (!sim) {
+    return -1;
+  }
+
+  sim_sample(dev, sim);
+  return 1;
+}
+
+_Static_assert(sizeof(struct sim_data) <= MGOS_BAROMETER_USER_DATA_SIZE, "MGOS_BAROMETER_USER_DATA_SIZE too small");
+
+const struct mgos_barometer_driver sim_driver = {
+  .name            = "SIM",
+  .type            = SIM_TYPE,
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER | MGOS_BAROMETER_CAP_HYGROMETER,
+  .i2caddr         = { 0x08, 0x00 },
+  .user_data_size  = sizeof(struct sim_data),
+  .conv_usecs      = SIM_CONV_USECS_MAX,
+  .read_cost_usecs = SIM_READ_COST_USECS,
+  .create          = sim_create,
+  .read            = sim_read,
+  .start           = sim_start,
+  .collect         = sim_collect,
+};
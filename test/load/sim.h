@@ -0,0 +1,51 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos.h"
+#include "mgos_barometer_internal.h"
+
+// Simulated sensors, for exercising the core with many more sensors than a
+// bench can hold. They sit behind a modelled 8 channel I2C mux such as the
+// TCA9548A: bits 4..6 of the address select the mux channel, and switching
+// channels costs a one byte write to the mux. No I2C traffic is generated,
+// but the modelled traffic is timed with mgos_usleep() and counted in the
+// sensor's stats like real transactions.
+#define SIM_TYPE                  (BARO_USER)
+#define SIM_MUX_CHANNEL(addr)     (((addr) >> 4) & 0x07)
+#define SIM_MUX_NONE              (0xff)
+#define SIM_BUS_HZ                (400000)
+// Duration of a transaction moving n bytes after the address byte.
+#define SIM_XFER_USECS(n)         (((n) + 1) * 9 * 1000000 / SIM_BUS_HZ)
+#define SIM_START_BYTES           (2)    // register address and command
+#define SIM_DATA_BYTES            (10)   // register address, then P, T and H
+
+// Conversion times of the sensors the simulated ones stand in for, picked
+// by address: MPL115, BMP3 and MS5611.
+#define SIM_CONV_USECS_MAX        (9040)
+#define SIM_CONV_USECS            { 3000, 5000, SIM_CONV_USECS_MAX }
+#define SIM_READ_COST_USECS       (10000)
+
+struct sim_data {
+  uint32_t rng;                  // xorshift32 state, never 0
+  uint32_t conv_usecs;           // of the sensor type this one stands in for
+  float    p0;                   // mean pressure, in Pascals
+};
+
+// Registered as SIM_TYPE with mgos_barometer_register_driver()
+extern const struct mgos_barometer_driver sim_driver;
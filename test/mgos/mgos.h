@@ -0,0 +1,89 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Just enough of the Mongoose OS API to build the library on a host. The
+ * implementations are in test/host.c.
+ */
+
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CS_P_UNIX     1
+#define CS_P_ESP32    15
+#ifndef CS_PLATFORM
+#define CS_PLATFORM   0     // neither: workers run on main task timers
+#endif
+
+enum cs_log_level {
+  LL_NONE = -1,
+  LL_ERROR,
+  LL_WARN,
+  LL_INFO,
+  LL_DEBUG,
+  LL_VERBOSE_DEBUG
+};
+
+// Messages above host_log_level are dropped, LL_WARN by default.
+extern int host_log_level;
+#define LOG(l, x)                      \
+  do {                                 \
+    if ((l) <= host_log_level) {       \
+      printf x;                        \
+      printf("\n");                    \
+    }                                  \
+  } while (0)
+
+double mg_time(void);
+double mgos_uptime(void);
+int64_t mgos_uptime_micros(void);
+void mgos_usleep(uint32_t usecs);
+
+typedef uintptr_t mgos_timer_id;
+typedef void (*timer_callback)(void *param);
+#define MGOS_INVALID_TIMER_ID    ((mgos_timer_id)0)
+#define MGOS_TIMER_REPEAT        (1 << 0)
+#define MGOS_TIMER_RUN_NOW       (1 << 1)
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb, void *cb_arg);
+void mgos_clear_timer(mgos_timer_id id);
+
+struct mgos_rlock_type;
+struct mgos_rlock_type *mgos_rlock_create(void);
+void mgos_rlock(struct mgos_rlock_type *l);
+void mgos_runlock(struct mgos_rlock_type *l);
+void mgos_rlock_destroy(struct mgos_rlock_type *l);
+
+typedef void (*mgos_cb_t)(void *arg);
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "mgos_event.h"
+#include "mgos_sys_config.h"
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MGOS_EVENT_BASE(a, b, c)    ((a) << 24 | (b) << 16 | (c) << 8)
+
+typedef void (*mgos_event_handler_t)(int ev, void *ev_data, void *userdata);
+
+bool mgos_event_register_base(int base_event_number, const char *name);
+bool mgos_event_add_handler(int ev, mgos_event_handler_t cb, void *userdata);
+int mgos_event_trigger(int ev, void *ev_data);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum mgos_gpio_mode {
+  MGOS_GPIO_MODE_INPUT = 0,
+  MGOS_GPIO_MODE_OUTPUT
+};
+
+enum mgos_gpio_pull_type {
+  MGOS_GPIO_PULL_NONE = 0,
+  MGOS_GPIO_PULL_UP,
+  MGOS_GPIO_PULL_DOWN
+};
+
+enum mgos_gpio_int_mode {
+  MGOS_GPIO_INT_NONE = 0,
+  MGOS_GPIO_INT_EDGE_POS,
+  MGOS_GPIO_INT_EDGE_NEG,
+  MGOS_GPIO_INT_EDGE_ANY,
+  MGOS_GPIO_INT_LEVEL_HI,
+  MGOS_GPIO_INT_LEVEL_LO
+};
+
+typedef void (*mgos_gpio_int_handler_f)(int pin, void *arg);
+
+bool mgos_gpio_set_mode(int pin, enum mgos_gpio_mode mode);
+bool mgos_gpio_set_pull(int pin, enum mgos_gpio_pull_type pull);
+bool mgos_gpio_set_int_handler(int pin, enum mgos_gpio_int_mode mode, mgos_gpio_int_handler_f cb, void *arg);
+bool mgos_gpio_enable_int(int pin);
+bool mgos_gpio_disable_int(int pin);
+void mgos_gpio_remove_int_handler(int pin, mgos_gpio_int_handler_f *old_cb, void **old_arg);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include "mgos.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mgos_i2c;
+
+bool mgos_i2c_write(struct mgos_i2c *conn, uint16_t addr, const void *data, size_t len, bool stop);
+bool mgos_i2c_read(struct mgos_i2c *conn, uint16_t addr, void *data, size_t len, bool stop);
+int mgos_i2c_read_reg_b(struct mgos_i2c *conn, uint16_t addr, uint8_t reg);
+int mgos_i2c_read_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg);
+bool mgos_i2c_read_reg_n(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, size_t n, uint8_t *buf);
+bool mgos_i2c_write_reg_b(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, uint8_t value);
+bool mgos_i2c_write_reg_w(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, uint16_t value);
+bool mgos_i2c_write_reg_n(struct mgos_i2c *conn, uint16_t addr, uint8_t reg, size_t n, const uint8_t *buf);
+struct mgos_i2c *mgos_i2c_get_global(void);
+struct mgos_i2c *mgos_i2c_get_bus(int bus_no);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * The parts of mg_rpc and frozen's JSON API that the Barometer.* service
+ * uses. Requests are dispatched in process by host_rpc_call(), see
+ * test/host.h.
+ */
+
+#pragma once
+
+#include <stdarg.h>
+
+#include "mgos.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mg_str {
+  const char *p;
+  size_t      len;
+};
+
+// Output to a fixed buffer, which is kept NUL-terminated. len counts all
+// output, including any that did not fit.
+struct json_out {
+  char * buf;
+  size_t size;
+  size_t len;
+};
+
+#define JSON_OUT_BUF(b, n)    { (b), (n), 0 }
+
+typedef int (*json_printf_callback_t)(struct json_out *out, va_list *ap);
+
+// Keys may be left unquoted in fmt. Besides the printf conversions, %Q is
+// a quoted string, %B a bool and %M a json_printf_callback_t and its
+// arguments.
+int json_printf(struct json_out *out, const char *fmt, ...);
+int json_vprintf(struct json_out *out, const char *fmt, va_list ap);
+
+// Top level keys of a JSON object into %d, %u (int *, unsigned *) and %B
+// (bool *). Returns the number of values found.
+int json_scanf(const char *str, int str_len, const char *fmt, ...);
+
+struct mg_rpc;
+struct mg_rpc_frame_info;
+
+struct mg_rpc_request_info {
+  const char *    method;
+  const char *    args_fmt;        // as registered
+  struct json_out result;
+  int             error_code;      // 0 on success
+  bool            responded;
+};
+
+typedef void (*mg_handler_cb_t)(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args);
+
+struct mg_rpc *mgos_rpc_get_global(void);
+bool mg_rpc_add_handler(struct mg_rpc *c, const char *method, const char *args_fmt, mg_handler_cb_t cb, void *cb_arg);
+bool mg_rpc_send_responsef(struct mg_rpc_request_info *ri, const char *result_json_fmt, ...);
+bool mg_rpc_send_errorf(struct mg_rpc_request_info *ri, int error_code, const char *error_msg_fmt, ...);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The barometer.sN sections of mos.yml
+struct mgos_config_barometer_s0 {
+  int         enable;
+  const char *label;
+  int         bus;
+  const char *type;
+  int         addr;
+  int         profile;
+  int         rate_ms;
+};
+
+// Both return host_config[0] and host_config[1], which are disabled
+// unless a test sets them.
+const struct mgos_config_barometer_s0 *mgos_sys_config_get_barometer_s0(void);
+const struct mgos_config_barometer_s0 *mgos_sys_config_get_barometer_s1(void);
+
+#ifdef __cplusplus
+}
+#endif
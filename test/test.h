@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/*
+ * Minimal checks for the host tests. A failed check is reported with its
+ * location and counted, and the test returns test_summary() from main().
+ */
+
+extern int test_checks, test_failures;
+
+#define TEST_CHECK(cond, ...)                            \
+  do {                                                   \
+    test_checks++;                                       \
+    if (!(cond)) {                                       \
+      test_failures++;                                   \
+      printf("%s:%d: FAIL: ", __FILE__, __LINE__);       \
+      printf(__VA_ARGS__);                               \
+      printf("\n");                                      \
+    }                                                    \
+  } while (0)
+
+// Defines the counters, once per test binary
+#define TEST_MAIN_DECLS    int test_checks, test_failures
+
+static inline int64_t test_now_nsecs(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Timing thresholds are multiplied by BENCH_SLACK from the environment, for
+// slow or loaded hosts. BENCH_SLACK=0 skips them, e.g. under sanitizers.
+static inline double test_bench_slack(void) {
+  const char *s = getenv("BENCH_SLACK");
+
+  return s ? atof(s) : 1.0;
+}
+
+static inline int test_summary(const char *name) {
+  printf("%s: %d checks, %d failures\n", name, test_checks, test_failures);
+  return test_failures ? 1 : 0;
+}
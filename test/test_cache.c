@@ -0,0 +1,207 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_barometer_internal.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * The read cache: per channel TTLs up to the largest one, and
+ * stale-while-revalidate, where a sample past its TTL is still served while
+ * a refresh runs from a timer, by start() and collect() if the driver has
+ * them and by read() otherwise. Every sample reads one Pa higher than the
+ * one before, so each check can tell which sample it got.
+ */
+
+TEST_MAIN_DECLS;
+
+#define CACHE_TTL_MS       (100)
+#define CACHE_STALE_MS     (300)
+#define CACHE_CONV_USECS   (5000)
+#define CACHE_BASE_PA      (100000)
+
+static uint32_t s_samples, s_reads, s_starts, s_collects;
+static bool     s_temp_step;     // the next collect() converted temperature
+
+// Private functions follow
+static void cache_sample(struct mgos_barometer *dev) {
+  dev->pressure    = CACHE_BASE_PA + ++s_samples;
+  dev->temperature = 20;
+}
+
+static bool cache_read(struct mgos_barometer *dev) {
+  s_reads++;
+  cache_sample(dev);
+  return true;
+}
+
+static bool cache_start(struct mgos_barometer *dev, uint32_t *wait_usecs) {
+  s_starts++;
+  *wait_usecs = CACHE_CONV_USECS;
+  return true;
+}
+
+static int cache_collect(struct mgos_barometer *dev) {
+  s_collects++;
+  if (s_temp_step) {
+    s_temp_step = false;
+    return 0;
+  }
+  cache_sample(dev);
+  return 1;
+}
+
+static const struct mgos_barometer_driver s_cache_driver = {
+  .name            = "CACHE",
+  .type            = BARO_USER,
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .read_cost_usecs = CACHE_CONV_USECS,
+  .read            = cache_read,
+  .start           = cache_start,
+  .collect         = cache_collect,
+};
+
+// The same sensor without a non-blocking conversion
+static const struct mgos_barometer_driver s_blocking_driver = {
+  .name            = "BLOCKING",
+  .type            = (enum mgos_barometer_type)(BARO_USER + 1),
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .read_cost_usecs = CACHE_CONV_USECS,
+  .read            = cache_read,
+};
+
+static float cache_pressure(struct mgos_barometer *s) {
+  float p = 0;
+
+  TEST_CHECK(mgos_barometer_get_pressure(s, &p), "no pressure");
+  return p - CACHE_BASE_PA;
+}
+
+// A TTL of UINT16_MAX caches for 65 s like any other.
+static void test_cache_max_ttl(struct mgos_barometer *s) {
+  struct mgos_barometer_stats st;
+  uint32_t reads = s_reads;
+
+  mgos_barometer_set_channel_ttl(s, BARO_CHANNEL_PRESSURE, UINT16_MAX);
+  cache_pressure(s);
+  cache_pressure(s);
+  TEST_CHECK(s_reads == reads + 1, "pressure TTL of %u ms: %u reads", UINT16_MAX, s_reads - reads);
+
+  // The temperature channel still has no TTL.
+  TEST_CHECK(mgos_barometer_read(s), "read failed");
+  TEST_CHECK(s_reads == reads + 2, "all channels, temperature TTL of 0: %u reads", s_reads - reads);
+
+  mgos_barometer_set_cache_ttl(s, UINT16_MAX);
+  TEST_CHECK(mgos_barometer_read(s), "read failed");
+  TEST_CHECK(s_reads == reads + 2, "all channels, TTL of %u ms: %u reads", UINT16_MAX, s_reads - reads);
+  mgos_barometer_set_cache_ttl(s, 0);
+
+  mgos_barometer_get_stats(s, &st);
+  TEST_CHECK(st.cache_miss == 2 && st.read_success_cached == 2, "stats: miss %u, cached %u", st.cache_miss, st.read_success_cached);
+}
+
+// Stale samples are served at once and refreshed by start() and collect(),
+// once per stale window, the first collect() converting temperature.
+static void test_cache_stale(struct mgos_barometer *s) {
+  struct mgos_barometer_stats st;
+  float    p;
+  uint32_t reads = s_reads, starts = s_starts;
+
+  mgos_barometer_set_cache_ttl(s, CACHE_TTL_MS);
+  mgos_barometer_set_cache_stale(s, CACHE_STALE_MS);
+  p = cache_pressure(s);
+  TEST_CHECK(s_reads == reads + 1, "first read: %u reads", s_reads - reads);
+  TEST_CHECK(cache_pressure(s) == p, "not cached within the TTL");
+
+  mgos_usleep((CACHE_TTL_MS + CACHE_STALE_MS / 4) * 1000);
+  TEST_CHECK(cache_pressure(s) == p, "stale sample not served");
+  TEST_CHECK(s_starts == starts + 1 && s_reads == reads + 1, "stale: %u starts, %u reads", s_starts - starts, s_reads - reads);
+  TEST_CHECK(cache_pressure(s) == p, "stale sample not served while refreshing");
+  TEST_CHECK(s_starts == starts + 1, "refresh started again: %u starts", s_starts - starts);
+
+  s_temp_step = true;
+  host_run_for(4 * CACHE_CONV_USECS);
+  TEST_CHECK(s_collects == 2 && s_starts == starts + 2, "refresh: %u collects, %u starts", s_collects, s_starts - starts);
+  TEST_CHECK(cache_pressure(s) == p + 1, "refreshed sample not served");
+  TEST_CHECK(s_reads == reads + 1 && s_starts == starts + 2, "after the refresh: %u reads, %u starts", s_reads - reads, s_starts - starts);
+
+  mgos_barometer_get_stats(s, &st);
+  TEST_CHECK(st.cache_stale == 1 && st.cache_refresh == 1, "stats: stale %u, refresh %u", st.cache_stale, st.cache_refresh);
+
+  // Past the stale window, the caller waits for a new sample.
+  mgos_usleep((CACHE_TTL_MS + CACHE_STALE_MS + 50) * 1000);
+  TEST_CHECK(cache_pressure(s) == p + 2, "expired sample served");
+  TEST_CHECK(s_reads == reads + 2 && s_starts == starts + 2, "expired: %u reads, %u starts", s_reads - reads, s_starts - starts);
+  mgos_barometer_get_stats(s, &st);
+  TEST_CHECK(st.cache_stale == 1 && st.cache_refresh == 1, "stats: stale %u, refresh %u", st.cache_stale, st.cache_refresh);
+
+  // With no time for a read, read_deadline() revalidates an expired sample
+  // in the background.
+  mgos_usleep((CACHE_TTL_MS + CACHE_STALE_MS + 50) * 1000);
+  TEST_CHECK(mgos_barometer_read_deadline(s, CACHE_CONV_USECS / 10, NULL) == BARO_READ_CACHED, "short budget not cached");
+  TEST_CHECK(s_starts == starts + 3 && s_reads == reads + 2, "short budget: %u starts, %u reads", s_starts - starts, s_reads - reads);
+  host_run_for(4 * CACHE_CONV_USECS);
+  TEST_CHECK(cache_pressure(s) == p + 3, "deadline refresh not served");
+  mgos_barometer_get_stats(s, &st);
+  TEST_CHECK(st.cache_refresh == 2, "stats: refresh %u", st.cache_refresh);
+}
+
+// Without start(), the refresh timer calls read().
+static void test_cache_stale_blocking(struct mgos_barometer *s) {
+  struct mgos_barometer_stats st;
+  float    p;
+  uint32_t reads;
+
+  mgos_barometer_set_cache_ttl(s, CACHE_TTL_MS);
+  mgos_barometer_set_cache_stale(s, CACHE_STALE_MS);
+  mgos_usleep((CACHE_TTL_MS + CACHE_STALE_MS + 50) * 1000);
+  p     = cache_pressure(s);
+  reads = s_reads;
+
+  mgos_usleep((CACHE_TTL_MS + CACHE_STALE_MS / 4) * 1000);
+  TEST_CHECK(cache_pressure(s) == p, "stale sample not served");
+  TEST_CHECK(s_reads == reads, "stale sample read at once");
+  host_poll();
+  TEST_CHECK(s_reads == reads + 1, "refresh: %u reads", s_reads - reads);
+  TEST_CHECK(cache_pressure(s) == p + 1, "refreshed sample not served");
+
+  mgos_barometer_get_stats(s, &st);
+  TEST_CHECK(st.cache_stale == 1 && st.cache_refresh == 1, "stats: stale %u, refresh %u", st.cache_stale, st.cache_refresh);
+}
+
+// Private functions end
+
+int main(void) {
+  struct mgos_barometer *s, *b;
+
+  TEST_CHECK(mgos_barometer_register_driver(&s_cache_driver), "driver not registered");
+  TEST_CHECK(mgos_barometer_register_driver(&s_blocking_driver), "driver not registered");
+  s = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x10, BARO_USER);
+  b = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x11, (enum mgos_barometer_type)(BARO_USER + 1));
+  TEST_CHECK(s && b, "sensors not created");
+  if (!s || !b) {
+    return test_summary("test_cache");
+  }
+
+  test_cache_max_ttl(b);
+  test_cache_stale(s);
+  test_cache_stale_blocking(b);
+
+  host_run_for(4 * CACHE_CONV_USECS);
+  mgos_barometer_destroy(&s);
+  mgos_barometer_destroy(&b);
+  return test_summary("test_cache");
+}
@@ -0,0 +1,791 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include "mgos_barometer_compensate.h"
+#include "test.h"
+
+/*
+ * Accuracy and speed of the compensation kernels. Every kernel is checked
+ * against datasheet examples, then swept over random calibrations and ADC
+ * words against a long double (or, for MS56xx, the datasheet's integer)
+ * reference. Each driver's formula is also timed in float, double and integer
+ * arithmetic: the library kernel is one of them, the others are written out
+ * here so that the choice made in the library stays measured.
+ */
+
+TEST_MAIN_DECLS;
+
+#define SWEEP_CALIBS     (16)
+#define SWEEP_SAMPLES    (256)         // per calibration
+#define BENCH_NSECS      (20000000)    // per kernel and round
+#define BENCH_ROUNDS     (3)           // best of
+
+typedef void (*kernel_fn)(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t);
+typedef void (*reference_fn)(const struct mgos_barometer_calib *c, uint32_t adc_p, uint32_t adc_t, long double *p, long double *t);
+typedef void (*generate_fn)(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n);
+
+struct variant {
+  const char *arith;             // "float", "double" or "int"
+  kernel_fn   fn;
+  double      tol_pa, tol_c;     // against the reference
+  double      max_nsecs;         // per sample
+};
+
+struct driver {
+  const char    *name;
+  generate_fn    generate;
+  reference_fn   reference;
+  struct variant variants[3];    // the library kernel first
+};
+
+// Deterministic inputs, so failures reproduce.
+static uint32_t test_rand(uint32_t *seed) {
+  *seed = *seed * 1664525u + 1013904223u;
+  return *seed >> 8;
+}
+
+// Uniform in [lo, hi]
+static int32_t test_range(uint32_t *seed, int32_t lo, int32_t hi) {
+  return lo + (int32_t)(test_rand(seed) % (uint32_t)(hi - lo + 1));
+}
+
+// v scaled by up to +-permille/1000
+static int32_t test_jitter(uint32_t *seed, int32_t v, int permille) {
+  return v + (int32_t)((int64_t)v * test_range(seed, -permille, permille) / 1000);
+}
+
+/*
+ * MPL115: a0, b1, b2 and c12 are Q12.3, Q2.13, Q1.14 and Q0.13 with 9 bits
+ * of padding, exact in float. The AN3785 example is a0=2009.75 b1=-2.37585
+ * b2=-0.92047 c12=0.000790.
+ */
+#define MPL115_A0    (16078)
+#define MPL115_B1    (-19463)
+#define MPL115_B2    (-15081)
+#define MPL115_C12   (3314)
+
+static void mpl115_calib(struct mgos_barometer_calib *c, int32_t a0, int32_t b1, int32_t b2, int32_t c12) {
+  memset(c, 0, sizeof(*c));
+  c->kind        = BARO_CALIB_MPL115;
+  c->u.mpl115.a0  = a0 / 8.0f;
+  c->u.mpl115.b1  = b1 / 8192.0f;
+  c->u.mpl115.b2  = b2 / 16384.0f;
+  c->u.mpl115.c12 = c12 / 4194304.0f;
+}
+
+static void mpl115_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  mpl115_calib(c, test_jitter(seed, MPL115_A0, 30), test_jitter(seed, MPL115_B1, 30), test_jitter(seed, MPL115_B2, 30),
+               test_jitter(seed, MPL115_C12, 30));
+  for (size_t i = 0; i < n; i++) {
+    raw[i].adc_p = test_range(seed, 0, 1023);
+    raw[i].adc_t = test_range(seed, 0, 1023);
+  }
+}
+
+static void mpl115_reference(const struct mgos_barometer_calib *c, uint32_t adc_p, uint32_t adc_t, long double *p, long double *t) {
+  const struct mgos_barometer_calib_mpl115 *k = &c->u.mpl115;
+  long double pcomp = k->a0 + ((long double)k->b1 + (long double)k->c12 * adc_t) * adc_p + (long double)k->b2 * adc_t;
+
+  *p = (pcomp * 65 / 1023 + 50) * 1000;
+  *t = ((long double)adc_t - 498) / -5.35L + 25;
+}
+
+static void mpl115_float(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  mgos_barometer_compensate_mpl115(&c->u.mpl115, raw, n, p, t);
+}
+
+static void mpl115_double(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const struct mgos_barometer_calib_mpl115 *k = &c->u.mpl115;
+
+  for (size_t i = 0; i < n; i++) {
+    double padc  = raw[i].adc_p;
+    double tadc  = raw[i].adc_t;
+    double pcomp = k->a0 + ((double)k->b1 + (double)k->c12 * tadc) * padc + (double)k->b2 * tadc;
+
+    p[i] = (float)((pcomp * (65.0 / 1023) + 50.0) * 1000);
+    t[i] = (float)((tadc - 498.0) / -5.35 + 25.0);
+  }
+}
+
+// Pcomp exactly in Q22, then Pascals in Q4 and centidegrees
+static void mpl115_int(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  int64_t a0  = lrintf(c->u.mpl115.a0 * 8);
+  int64_t b1  = lrintf(c->u.mpl115.b1 * 8192);
+  int64_t b2  = lrintf(c->u.mpl115.b2 * 16384);
+  int64_t c12 = lrintf(c->u.mpl115.c12 * 4194304);
+
+  for (size_t i = 0; i < n; i++) {
+    int64_t padc  = raw[i].adc_p;
+    int64_t tadc  = raw[i].adc_t;
+    int64_t pcomp = a0 * 524288 + (b1 * 512 + c12 * tadc) * padc + b2 * tadc * 256;
+
+    p[i] = (float)((pcomp * 65000 + (int64_t)50000 * 1023 * 4194304) / ((int64_t)1023 * 262144)) / 16;
+    t[i] = (float)(2500 - (tadc - 498) * 10000 / 535) / 100;
+  }
+}
+
+// MPL3115: compensated on chip
+static void mpl3115_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  memset(c, 0, sizeof(*c));
+  c->kind = BARO_CALIB_MPL3115;
+  for (size_t i = 0; i < n; i++) {
+    raw[i].adc_p = test_range(seed, 20000 * 4, 110000 * 4);
+    raw[i].adc_t = test_range(seed, 0, 0xFFF);
+  }
+}
+
+static void mpl3115_reference(const struct mgos_barometer_calib *c, uint32_t adc_p, uint32_t adc_t, long double *p, long double *t) {
+  *p = adc_p / 4.0L;
+  *t = (adc_t & 0x800 ? (long double)adc_t - 0x1000 : (long double)adc_t) / 16;
+}
+
+static void mpl3115_int(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  mgos_barometer_compensate_mpl3115(raw, n, p, t);
+}
+
+/*
+ * BME280, with the BMP280 datasheet example calibration, section 3.12.
+ */
+static const struct mgos_barometer_calib_bme280 s_bme280_example = {
+  .dig_T1 = 27504, .dig_T2 = 26435, .dig_T3 = -1000,
+  .dig_P1 = 36477, .dig_P2 = -10685, .dig_P3 = 3024, .dig_P4 = 2855, .dig_P5 = 140,
+  .dig_P6 = -7, .dig_P7 = 15500, .dig_P8 = -14600, .dig_P9 = 6000,
+};
+
+static void bme280_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  struct mgos_barometer_calib_bme280 *k = &c->u.bme280;
+
+  memset(c, 0, sizeof(*c));
+  c->kind   = BARO_CALIB_BME280;
+  *k        = s_bme280_example;
+  k->dig_T1 = test_jitter(seed, k->dig_T1, 20);
+  k->dig_T2 = test_jitter(seed, k->dig_T2, 20);
+  k->dig_P1 = test_jitter(seed, k->dig_P1, 20);
+  k->dig_P2 = test_jitter(seed, k->dig_P2, 20);
+  k->dig_P4 = test_jitter(seed, k->dig_P4, 20);
+  k->dig_P5 = test_jitter(seed, k->dig_P5, 20);
+  k->dig_P7 = test_jitter(seed, k->dig_P7, 20);
+  k->dig_P8 = test_jitter(seed, k->dig_P8, 20);
+  k->dig_P9 = test_jitter(seed, k->dig_P9, 20);
+  // About -40..85C and 30..110kPa
+  for (size_t i = 0; i < n; i++) {
+    raw[i].adc_p = test_range(seed, 360000, 820000);
+    raw[i].adc_t = test_range(seed, 320000, 710000);
+  }
+}
+
+// Datasheet section 8.1, including the truncation of t_fine
+static void bme280_reference(const struct mgos_barometer_calib *c, uint32_t adc_p, uint32_t adc_t, long double *p, long double *t) {
+  const struct mgos_barometer_calib_bme280 *k = &c->u.bme280;
+  long double v1, v2, x;
+  int32_t     t_fine;
+
+  v1     = ((long double)adc_t / 16384 - (long double)k->dig_T1 / 1024) * k->dig_T2;
+  x      = (long double)adc_t / 131072 - (long double)k->dig_T1 / 8192;
+  v2     = x * x * k->dig_T3;
+  t_fine = (int32_t)(v1 + v2);
+  *t     = (v1 + v2) / 5120;
+
+  v1 = (long double)t_fine / 2 - 64000;
+  v2 = v1 * v1 * k->dig_P6 / 32768 + v1 * k->dig_P5 * 2;
+  v2 = v2 / 4 + (long double)k->dig_P4 * 65536;
+  v1 = ((long double)k->dig_P3 * v1 * v1 / 524288 + (long double)k->dig_P2 * v1) / 524288;
+  v1 = (1 + v1 / 32768) * k->dig_P1;
+  x  = 1048576 - (long double)adc_p;
+  x  = (x - v2 / 4096) * 6250 / v1;
+  *p = x + ((long double)k->dig_P9 * x * x / 2147483648.0L + x * k->dig_P8 / 32768 + k->dig_P7) / 16;
+}
+
+static void bme280_double(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  mgos_barometer_compensate_bme280(&c->u.bme280, raw, n, p, t);
+}
+
+// The double formula in single precision
+static void bme280_float(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const struct mgos_barometer_calib_bme280 *k = &c->u.bme280;
+
+  for (size_t i = 0; i < n; i++) {
+    float   adc_t = (float)raw[i].adc_t;
+    float   v1, v2, x;
+    int32_t t_fine;
+
+    v1     = (adc_t / 16384.0f - k->dig_T1 / 1024.0f) * k->dig_T2;
+    x      = adc_t / 131072.0f - k->dig_T1 / 8192.0f;
+    v2     = x * x * k->dig_T3;
+    t_fine = (int32_t)(v1 + v2);
+    t[i]   = (v1 + v2) / 5120.0f;
+
+    v1 = t_fine / 2.0f - 64000.0f;
+    v2 = v1 * v1 * k->dig_P6 / 32768.0f + v1 * k->dig_P5 * 2.0f;
+    v2 = v2 / 4.0f + k->dig_P4 * 65536.0f;
+    v1 = (k->dig_P3 * v1 * v1 / 524288.0f + k->dig_P2 * v1) / 524288.0f;
+    v1 = (1.0f + v1 / 32768.0f) * k->dig_P1;
+    x  = 1048576.0f - (float)raw[i].adc_p;
+    x  = (x - v2 / 4096.0f) * 6250.0f / v1;
+    p[i] = x + (k->dig_P9 * x * x / 2147483648.0f + x * k->dig_P8 / 32768.0f + k->dig_P7) / 16.0f;
+  }
+}
+
+// Datasheet section 8.2, 32 bit temperature and 64 bit pressure. Shifts of
+// signed values are written as multiplications and divisions.
+static void bme280_int(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const struct mgos_barometer_calib_bme280 *k = &c->u.bme280;
+
+  for (size_t i = 0; i < n; i++) {
+    int32_t adc_t = raw[i].adc_t, adc_p = raw[i].adc_p;
+    int32_t t1, t2, t_fine;
+    int64_t v1, v2, x;
+
+    t1     = (((adc_t >> 3) - ((int32_t)k->dig_T1 << 1)) * k->dig_T2) >> 11;
+    t2     = (((((adc_t >> 4) - (int32_t)k->dig_T1) * ((adc_t >> 4) - (int32_t)k->dig_T1)) >> 12) * k->dig_T3) >> 14;
+    t_fine = t1 + t2;
+    t[i]   = (float)((t_fine * 5 + 128) >> 8) / 100;
+
+    v1 = (int64_t)t_fine - 128000;
+    v2 = v1 * v1 * k->dig_P6;
+    v2 = v2 + v1 * k->dig_P5 * 131072;
+    v2 = v2 + (int64_t)k->dig_P4 * 34359738368;
+    v1 = ((v1 * v1 * k->dig_P3) >> 8) + v1 * k->dig_P2 * 4096;
+    v1 = ((((int64_t)1 << 47) + v1) * k->dig_P1) >> 33;
+    if (v1 == 0) {
+      p[i] = 0;
+      continue;
+    }
+    x    = 1048576 - adc_p;
+    x    = ((x * 2147483648) - v2) * 3125 / v1;
+    v1   = ((int64_t)k->dig_P9 * (x >> 13) * (x >> 13)) >> 25;
+    v2   = ((int64_t)k->dig_P8 * x) >> 19;
+    x    = ((x + v1 + v2) >> 8) + (int64_t)k->dig_P7 * 16;
+    p[i] = (float)x / 256;
+  }
+}
+
+/*
+ * MS56xx: the library kernel is the datasheets' integer algorithm, so the
+ * reference is each datasheet written out separately and must match exactly.
+ */
+static const uint16_t s_ms5611_prom[8] = { 0, 40127, 36924, 23317, 23282, 33464, 28312, 0 };
+static const uint16_t s_ms5607_prom[8] = { 0, 46372, 43981, 29059, 27842, 31553, 28165, 0 };
+
+static void ms56xx_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n, uint8_t variant) {
+  const uint16_t *example = variant == BARO_MS56XX_MS5611 || variant == BARO_MS56XX_MS5803 ? s_ms5611_prom : s_ms5607_prom;
+  uint16_t       *prom    = c->u.ms56xx.prom;
+
+  memset(c, 0, sizeof(*c));
+  c->kind             = BARO_CALIB_MS56XX;
+  c->u.ms56xx.variant = variant;
+  for (int i = 1; i <= 6; i++) {
+    prom[i] = test_jitter(seed, example[i], 50);
+  }
+  // About -40..85C, any pressure word
+  for (size_t i = 0; i < n; i++) {
+    int32_t dT = (int32_t)((int64_t)test_range(seed, -6000, 6500) * 8388608 / prom[6]);
+
+    raw[i].adc_t = (int32_t)prom[5] * 256 + dT;
+    raw[i].adc_p = test_range(seed, 2000000, 12000000);
+  }
+}
+
+static void ms5611_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  ms56xx_generate(seed, c, raw, n, BARO_MS56XX_MS5611);
+}
+
+static void ms5607_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  ms56xx_generate(seed, c, raw, n, BARO_MS56XX_MS5607);
+}
+
+static void ms5637_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  ms56xx_generate(seed, c, raw, n, BARO_MS56XX_MS5637);
+}
+
+static void ms5803_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  ms56xx_generate(seed, c, raw, n, BARO_MS56XX_MS5803);
+}
+
+// MS5611-01BA03, pressure and temperature calculation and second order
+// temperature compensation
+static void ms5611_reference(const struct mgos_barometer_calib *c, uint32_t D1, uint32_t D2, long double *p, long double *t) {
+  const uint16_t *C = c->u.ms56xx.prom;
+  int64_t dT   = (int64_t)D2 - ((int64_t)C[5] << 8);
+  int64_t TEMP = 2000 + ((dT * C[6]) >> 23);
+  int64_t OFF  = ((int64_t)C[2] << 16) + ((C[4] * dT) >> 7);
+  int64_t SENS = ((int64_t)C[1] << 15) + ((C[3] * dT) >> 8);
+  int64_t T2 = 0, OFF2 = 0, SENS2 = 0;
+
+  if (TEMP < 2000) {
+    T2    = (dT * dT) >> 31;
+    OFF2  = 5 * (TEMP - 2000) * (TEMP - 2000) / 2;
+    SENS2 = 5 * (TEMP - 2000) * (TEMP - 2000) / 4;
+    if (TEMP < -1500) {
+      OFF2  += 7 * (TEMP + 1500) * (TEMP + 1500);
+      SENS2 += 11 * (TEMP + 1500) * (TEMP + 1500) / 2;
+    }
+  }
+  TEMP -= T2;
+  OFF  -= OFF2;
+  SENS -= SENS2;
+  *p = (((D1 * SENS) >> 21) - OFF) >> 15;
+  *t = TEMP / 100.0L;
+}
+
+// MS5607-02BA03
+static void ms5607_reference(const struct mgos_barometer_calib *c, uint32_t D1, uint32_t D2, long double *p, long double *t) {
+  const uint16_t *C = c->u.ms56xx.prom;
+  int64_t dT   = (int64_t)D2 - ((int64_t)C[5] << 8);
+  int64_t TEMP = 2000 + ((dT * C[6]) >> 23);
+  int64_t OFF  = ((int64_t)C[2] << 17) + ((C[4] * dT) >> 6);
+  int64_t SENS = ((int64_t)C[1] << 16) + ((C[3] * dT) >> 7);
+  int64_t T2 = 0, OFF2 = 0, SENS2 = 0;
+
+  if (TEMP < 2000) {
+    T2    = (dT * dT) >> 31;
+    OFF2  = 61 * (TEMP - 2000) * (TEMP - 2000) / 16;
+    SENS2 = 2 * (TEMP - 2000) * (TEMP - 2000);
+    if (TEMP < -1500) {
+      OFF2  += 15 * (TEMP + 1500) * (TEMP + 1500);
+      SENS2 += 8 * (TEMP + 1500) * (TEMP + 1500);
+    }
+  }
+  TEMP -= T2;
+  OFF  -= OFF2;
+  SENS -= SENS2;
+  *p = (((D1 * SENS) >> 21) - OFF) >> 15;
+  *t = TEMP / 100.0L;
+}
+
+// MS5637-02BA03, which also corrects above 20C
+static void ms5637_reference(const struct mgos_barometer_calib *c, uint32_t D1, uint32_t D2, long double *p, long double *t) {
+  const uint16_t *C = c->u.ms56xx.prom;
+  int64_t dT   = (int64_t)D2 - ((int64_t)C[5] << 8);
+  int64_t TEMP = 2000 + ((dT * C[6]) >> 23);
+  int64_t OFF  = ((int64_t)C[2] << 17) + ((C[4] * dT) >> 6);
+  int64_t SENS = ((int64_t)C[1] << 16) + ((C[3] * dT) >> 7);
+  int64_t T2, OFF2 = 0, SENS2 = 0;
+
+  if (TEMP < 2000) {
+    T2    = (3 * dT * dT) >> 33;
+    OFF2  = 61 * (TEMP - 2000) * (TEMP - 2000) / 16;
+    SENS2 = 29 * (TEMP - 2000) * (TEMP - 2000) / 16;
+    if (TEMP < -1500) {
+      OFF2  += 17 * (TEMP + 1500) * (TEMP + 1500);
+      SENS2 += 9 * (TEMP + 1500) * (TEMP + 1500);
+    }
+  } else {
+    T2 = (5 * dT * dT) >> 38;
+  }
+  TEMP -= T2;
+  OFF  -= OFF2;
+  SENS -= SENS2;
+  *p = (((D1 * SENS) >> 21) - OFF) >> 15;
+  *t = TEMP / 100.0L;
+}
+
+// MS5803-01BA, which has no OFF2 term below -15C but corrects SENS above 45C
+static void ms5803_reference(const struct mgos_barometer_calib *c, uint32_t D1, uint32_t D2, long double *p, long double *t) {
+  const uint16_t *C = c->u.ms56xx.prom;
+  int64_t dT   = (int64_t)D2 - ((int64_t)C[5] << 8);
+  int64_t TEMP = 2000 + ((dT * C[6]) >> 23);
+  int64_t OFF  = ((int64_t)C[2] << 16) + ((C[4] * dT) >> 7);
+  int64_t SENS = ((int64_t)C[1] << 15) + ((C[3] * dT) >> 8);
+  int64_t T2 = 0, OFF2 = 0, SENS2 = 0;
+
+  if (TEMP < 2000) {
+    T2    = (dT * dT) >> 31;
+    OFF2  = 3 * (TEMP - 2000) * (TEMP - 2000);
+    SENS2 = 7 * (TEMP - 2000) * (TEMP - 2000) / 8;
+    if (TEMP < -1500) {
+      SENS2 += 2 * (TEMP + 1500) * (TEMP + 1500);
+    }
+  } else if (TEMP > 4500) {
+    SENS2 -= (TEMP - 4500) * (TEMP - 4500) / 8;
+  }
+  TEMP -= T2;
+  OFF  -= OFF2;
+  SENS -= SENS2;
+  *p = (((D1 * SENS) >> 21) - OFF) >> 15;
+  *t = TEMP / 100.0L;
+}
+
+static void ms56xx_int(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  mgos_barometer_compensate_ms56xx(&c->u.ms56xx, raw, n, p, t);
+}
+
+// The same formulas without truncation, as multipliers per variant
+static const struct {
+  double sens_c1, sens_c3, off_c2, off_c4;
+  double lo_t2, lo_off2, lo_sens2, vlo_off2, vlo_sens2, hi_t2, vhi_sens2;
+} s_ms56xx_scale[] = {
+  [BARO_MS56XX_MS5611] = { 32768, 1 / 256.0, 65536, 1 / 128.0, 1 / 2147483648.0, 5 / 2.0, 5 / 4.0, 7, 11 / 2.0, 0, 0 },
+  [BARO_MS56XX_MS5607] = { 65536, 1 / 128.0, 131072, 1 / 64.0, 1 / 2147483648.0, 61 / 16.0, 2, 15, 8, 0, 0 },
+  [BARO_MS56XX_MS5637] = { 65536, 1 / 128.0, 131072, 1 / 64.0, 3 / 8589934592.0, 61 / 16.0, 29 / 16.0, 17, 9, 5 / 274877906944.0, 0 },
+  [BARO_MS56XX_MS5803] = { 32768, 1 / 256.0, 65536, 1 / 128.0, 1 / 2147483648.0, 3, 7 / 8.0, 0, 2, 0, 1 / 8.0 },
+};
+
+static void ms56xx_double(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const uint16_t *C = c->u.ms56xx.prom;
+  double sens_c1 = s_ms56xx_scale[c->u.ms56xx.variant].sens_c1, sens_c3 = s_ms56xx_scale[c->u.ms56xx.variant].sens_c3;
+  double off_c2 = s_ms56xx_scale[c->u.ms56xx.variant].off_c2, off_c4 = s_ms56xx_scale[c->u.ms56xx.variant].off_c4;
+  double lo_t2 = s_ms56xx_scale[c->u.ms56xx.variant].lo_t2, hi_t2 = s_ms56xx_scale[c->u.ms56xx.variant].hi_t2;
+  double lo_off2 = s_ms56xx_scale[c->u.ms56xx.variant].lo_off2, lo_sens2 = s_ms56xx_scale[c->u.ms56xx.variant].lo_sens2;
+  double vlo_off2 = s_ms56xx_scale[c->u.ms56xx.variant].vlo_off2, vlo_sens2 = s_ms56xx_scale[c->u.ms56xx.variant].vlo_sens2;
+  double vhi_sens2 = s_ms56xx_scale[c->u.ms56xx.variant].vhi_sens2;
+
+  for (size_t i = 0; i < n; i++) {
+    double dT   = (double)raw[i].adc_t - C[5] * 256.0;
+    double temp = 2000 + dT * C[6] / 8388608;
+    double off  = C[2] * off_c2 + C[4] * dT * off_c4;
+    double sens = C[1] * sens_c1 + C[3] * dT * sens_c3;
+    double lo   = temp < 2000 ? temp - 2000 : 0;
+    double vlo  = temp < -1500 ? temp + 1500 : 0;
+    double vhi  = temp > 4500 ? temp - 4500 : 0;
+
+    off  -= lo_off2 * lo * lo + vlo_off2 * vlo * vlo;
+    sens -= lo_sens2 * lo * lo + vlo_sens2 * vlo * vlo - vhi_sens2 * vhi * vhi;
+    temp -= (temp < 2000 ? lo_t2 : hi_t2) * dT * dT;
+    p[i] = (float)((raw[i].adc_p * sens / 2097152 - off) / 32768);
+    t[i] = (float)(temp / 100);
+  }
+}
+
+static void ms56xx_float(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const uint16_t *C = c->u.ms56xx.prom;
+  float sens_c1 = s_ms56xx_scale[c->u.ms56xx.variant].sens_c1, sens_c3 = s_ms56xx_scale[c->u.ms56xx.variant].sens_c3;
+  float off_c2 = s_ms56xx_scale[c->u.ms56xx.variant].off_c2, off_c4 = s_ms56xx_scale[c->u.ms56xx.variant].off_c4;
+  float lo_t2 = s_ms56xx_scale[c->u.ms56xx.variant].lo_t2, hi_t2 = s_ms56xx_scale[c->u.ms56xx.variant].hi_t2;
+  float lo_off2 = s_ms56xx_scale[c->u.ms56xx.variant].lo_off2, lo_sens2 = s_ms56xx_scale[c->u.ms56xx.variant].lo_sens2;
+  float vlo_off2 = s_ms56xx_scale[c->u.ms56xx.variant].vlo_off2, vlo_sens2 = s_ms56xx_scale[c->u.ms56xx.variant].vlo_sens2;
+  float vhi_sens2 = s_ms56xx_scale[c->u.ms56xx.variant].vhi_sens2;
+
+  for (size_t i = 0; i < n; i++) {
+    float dT   = (float)raw[i].adc_t - C[5] * 256.0f;
+    float temp = 2000 + dT * C[6] / 8388608.0f;
+    float off  = C[2] * off_c2 + C[4] * dT * off_c4;
+    float sens = C[1] * sens_c1 + C[3] * dT * sens_c3;
+    float lo   = temp < 2000 ? temp - 2000 : 0;
+    float vlo  = temp < -1500 ? temp + 1500 : 0;
+    float vhi  = temp > 4500 ? temp - 4500 : 0;
+
+    off  -= lo_off2 * lo * lo + vlo_off2 * vlo * vlo;
+    sens -= lo_sens2 * lo * lo + vlo_sens2 * vlo * vlo - vhi_sens2 * vhi * vhi;
+    temp -= (temp < 2000 ? lo_t2 : hi_t2) * dT * dT;
+    p[i] = ((float)raw[i].adc_p * sens / 2097152.0f - off) / 32768.0f;
+    t[i] = temp / 100.0f;
+  }
+}
+
+/*
+ * BMP3: NVM words from a BMP388, scaled as in mgos_barometer_bmp3_create().
+ * The integer variant keeps them unscaled.
+ */
+struct bmp3_nvm {
+  uint16_t t1, t2;
+  int8_t   t3;
+  int16_t  p1, p2;
+  int8_t   p3, p4;
+  uint16_t p5, p6;
+  int8_t   p7, p8;
+  int16_t  p9;
+  int8_t   p10, p11;
+};
+
+static const struct bmp3_nvm s_bmp3_example = { 27755, 18764, -10, 12084, -1521, 35, 0, 19055, 24942, 3, -6, 3656, 0, 0 };
+
+// The integer variant needs the NVM words, which the calibration block does
+// not keep. Sweeps and benchmarks run one calibration at a time.
+static struct bmp3_nvm s_bmp3_nvm;
+
+static void bmp3_generate(uint32_t *seed, struct mgos_barometer_calib *c, struct mgos_barometer_raw *raw, size_t n) {
+  struct mgos_barometer_calib_bmp3 *k = &c->u.bmp3;
+  struct bmp3_nvm *v = &s_bmp3_nvm;
+
+  *v    = s_bmp3_example;
+  v->t1 = test_jitter(seed, v->t1, 10);
+  v->t2 = test_jitter(seed, v->t2, 10);
+  v->p1 = test_jitter(seed, v->p1, 10);
+  v->p2 = test_jitter(seed, v->p2, 10);
+  v->p5 = test_jitter(seed, v->p5, 10);
+  v->p6 = test_jitter(seed, v->p6, 10);
+  v->p9 = test_jitter(seed, v->p9, 10);
+
+  memset(c, 0, sizeof(*c));
+  c->kind    = BARO_CALIB_BMP3;
+  k->par_t1  = v->t1 * 256.0f;
+  k->par_t2  = v->t2 / 1073741824.0f;
+  k->par_t3  = v->t3 / 281474976710656.0f;
+  k->par_p1  = (v->p1 - 16384.0f) / 1048576.0f;
+  k->par_p2  = (v->p2 - 16384.0f) / 536870912.0f;
+  k->par_p3  = v->p3 / 4294967296.0f;
+  k->par_p4  = v->p4 / 137438953472.0f;
+  k->par_p5  = v->p5 * 8.0f;
+  k->par_p6  = v->p6 / 64.0f;
+  k->par_p7  = v->p7 / 256.0f;
+  k->par_p8  = v->p8 / 32768.0f;
+  k->par_p9  = v->p9 / 281474976710656.0f;
+  k->par_p10 = v->p10 / 281474976710656.0f;
+  k->par_p11 = v->p11 / 36893488147419103232.0f;
+
+  // About 30..125kPa and -40..85C
+  for (size_t i = 0; i < n; i++) {
+    raw[i].adc_p = test_range(seed, 0x400000, 0x900000);
+    raw[i].adc_t = test_range(seed, 0x700000, 0x900000);
+  }
+}
+
+// Datasheet section 9.3, from the NVM words rather than the float block
+static void bmp3_reference(const struct mgos_barometer_calib *c, uint32_t adc_p, uint32_t adc_t, long double *p, long double *t) {
+  const struct bmp3_nvm *v = &s_bmp3_nvm;
+  long double p1 = (v->p1 - 16384.0L) / 1048576, p2 = (v->p2 - 16384.0L) / 536870912, p3 = v->p3 / 4294967296.0L;
+  long double p4 = v->p4 / 137438953472.0L, p5 = v->p5 * 8.0L, p6 = v->p6 / 64.0L, p7 = v->p7 / 256.0L;
+  long double p8 = v->p8 / 32768.0L, p9 = v->p9 / 281474976710656.0L, p10 = v->p10 / 281474976710656.0L;
+  long double p11 = v->p11 / 36893488147419103232.0L;
+  long double d  = (long double)adc_t - v->t1 * 256.0L;
+  long double tl = d * (v->t2 / 1073741824.0L) + d * d * (v->t3 / 281474976710656.0L);
+  long double up = adc_p;
+
+  *t = tl;
+  *p = p5 + p6 * tl + p7 * tl * tl + p8 * tl * tl * tl + up * (p1 + p2 * tl + p3 * tl * tl + p4 * tl * tl * tl) +
+       up * up * (p9 + p10 * tl) + up * up * up * p11;
+}
+
+static void bmp3_float(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  mgos_barometer_compensate_bmp3(&c->u.bmp3, raw, n, p, t);
+}
+
+static void bmp3_double(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const struct mgos_barometer_calib_bmp3 *k = &c->u.bmp3;
+
+  for (size_t i = 0; i < n; i++) {
+    double d  = (double)raw[i].adc_t - k->par_t1;
+    double tl = d * k->par_t2 + d * d * k->par_t3;
+    double up = raw[i].adc_p;
+    double o1 = k->par_p5 + k->par_p6 * tl + k->par_p7 * tl * tl + k->par_p8 * tl * tl * tl;
+    double o2 = up * (k->par_p1 + k->par_p2 * tl + k->par_p3 * tl * tl + k->par_p4 * tl * tl * tl);
+
+    p[i] = (float)(o1 + o2 + up * up * (k->par_p9 + k->par_p10 * tl) + up * up * up * k->par_p11);
+    t[i] = (float)tl;
+  }
+}
+
+// Bosch BMP3 API, compensate_temperature() and compensate_pressure() without
+// floating point: t_lin in Q16, results in 1/100 C and 1/100 Pa.
+static void bmp3_int(const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n, float *p, float *t) {
+  const struct bmp3_nvm *v = &s_bmp3_nvm;
+
+  for (size_t i = 0; i < n; i++) {
+    int64_t up = raw[i].adc_p;
+    int64_t d1, t_lin, d2, d3, d4, d5, d6, offset, sens;
+
+    d1    = (int64_t)raw[i].adc_t - (int64_t)256 * v->t1;
+    t_lin = (d1 * v->t2 * 262144 + d1 * d1 * v->t3) / 4294967296;
+    t[i]  = (float)(t_lin * 25 / 16384) / 100;
+
+    d1     = t_lin * t_lin;
+    d2     = d1 / 64;
+    d3     = d2 * t_lin / 256;
+    d4     = v->p8 * d3 / 32;
+    d5     = v->p7 * d1 * 16;
+    d6     = v->p6 * t_lin * 4194304;
+    offset = v->p5 * 140737488355328 + d4 + d5 + d6;
+    d2     = v->p4 * d3 / 32;
+    d4     = v->p3 * d1 * 4;
+    d5     = (v->p2 - 16384) * t_lin * 2097152;
+    sens   = (v->p1 - 16384) * 70368744177664 + d2 + d4 + d5;
+    d1     = sens / 16777216 * up;
+    d2     = v->p10 * t_lin;
+    d3     = d2 + 65536 * v->p9;
+    d4     = d3 * up / 8192;
+    // Divided by 10 and multiplied back, so that up * d4 cannot overflow
+    d5     = up * (d4 / 10) / 512 * 10;
+    d6     = up * up;
+    d2     = v->p11 * d6 / 65536;
+    d3     = d2 * up / 128;
+    d4     = offset / 4 + d1 + d5 + d3;
+    p[i]   = (float)((uint64_t)d4 * 25 / 1099511627776) / 100;
+  }
+}
+
+// Tolerances are about twice the worst error seen on x86-64. The integer
+// variants round to 1/100 C; the MS56xx formulas without truncation differ
+// from the datasheets' integer algorithm by up to 1 Pa.
+static const struct driver s_drivers[] = {
+  { "mpl115", mpl115_generate, mpl115_reference, {
+    { "float",  mpl115_float,  0.05, 0.0001,  15 },
+    { "double", mpl115_double, 0.02, 0.0001,  20 },
+    { "int",    mpl115_int,    0.1,  0.011,   25 } } },
+  { "mpl3115", mpl3115_generate, mpl3115_reference, {
+    { "int",    mpl3115_int,   0,    0,       10 } } },
+  { "bme280", bme280_generate, bme280_reference, {
+    { "double", bme280_double, 0.01, 0.0001,  50 },
+    { "float",  bme280_float,  0.1,  0.0001,  50 },
+    { "int",    bme280_int,    1,    0.011,   40 } } },
+  { "ms5611", ms5611_generate, ms5611_reference, {
+    { "int",    ms56xx_int,    0,    0.00001, 40 },
+    { "double", ms56xx_double, 1.5,  0.011,   30 },
+    { "float",  ms56xx_float,  1.5,  0.011,   30 } } },
+  { "ms5607", ms5607_generate, ms5607_reference, {
+    { "int",    ms56xx_int,    0,    0.00001, 40 },
+    { "double", ms56xx_double, 1.5,  0.011,   30 },
+    { "float",  ms56xx_float,  1.5,  0.011,   30 } } },
+  { "ms5637", ms5637_generate, ms5637_reference, {
+    { "int",    ms56xx_int,    0,    0.00001, 40 },
+    { "double", ms56xx_double, 1.5,  0.011,   30 },
+    { "float",  ms56xx_float,  1.5,  0.011,   30 } } },
+  { "ms5803", ms5803_generate, ms5803_reference, {
+    { "int",    ms56xx_int,    0,    0.00001, 40 },
+    { "double", ms56xx_double, 1.5,  0.011,   30 },
+    { "float",  ms56xx_float,  1.5,  0.011,   30 } } },
+  { "bmp3", bmp3_generate, bmp3_reference, {
+    { "float",  bmp3_float,    0.1,  0.0001,  25 },
+    { "double", bmp3_double,   0.02, 0.0001,  35 },
+    { "int",    bmp3_int,      0.05, 0.011,   60 } } },
+};
+
+// Datasheet examples, through the dispatcher
+struct golden {
+  struct mgos_barometer_calib calib;
+  uint32_t                    adc_p, adc_t;
+  double                      pressure, temperature;
+  double                      tol_pa, tol_c;     // as rounded in the datasheet
+};
+
+static void test_golden(void) {
+  struct golden g[7];
+  struct mgos_barometer_raw raw;
+  float p, t;
+
+  memset(g, 0, sizeof(g));
+  // MPL115A2 application note AN3785
+  mpl115_calib(&g[0].calib, MPL115_A0, MPL115_B1, MPL115_B2, MPL115_C12);
+  g[0].adc_p = 410, g[0].adc_t = 507, g[0].pressure = 96587.33, g[0].temperature = 23.32, g[0].tol_pa = 0.5, g[0].tol_c = 0.01;
+  // 0.25 Pa and 1/16 C per LSB
+  g[1].calib.kind = BARO_CALIB_MPL3115;
+  g[1].adc_p = 405301, g[1].adc_t = 0xE80, g[1].pressure = 101325.25, g[1].temperature = -24, g[1].tol_pa = 0, g[1].tol_c = 0;
+  // BMP280 datasheet, section 3.12; BME280 shares the algorithm
+  g[2].calib.kind = BARO_CALIB_BME280, g[2].calib.u.bme280 = s_bme280_example;
+  g[2].adc_p = 415148, g[2].adc_t = 519888, g[2].pressure = 100653.27, g[2].temperature = 25.08, g[2].tol_pa = 0.01, g[2].tol_c = 0.005;
+  // MS5611-01BA03, MS5607-02BA03 and MS5637-02BA03 typical values
+  g[3].calib.kind = BARO_CALIB_MS56XX, g[3].calib.u.ms56xx.variant = BARO_MS56XX_MS5611;
+  memcpy(g[3].calib.u.ms56xx.prom, s_ms5611_prom, sizeof(s_ms5611_prom));
+  g[3].adc_p = 9085466, g[3].adc_t = 8569150, g[3].pressure = 100009, g[3].temperature = 20.07, g[3].tol_pa = 0, g[3].tol_c = 0;
+  for (int i = 4; i < 6; i++) {
+    g[i].calib.kind = BARO_CALIB_MS56XX, g[i].calib.u.ms56xx.variant = i == 4 ? BARO_MS56XX_MS5607 : BARO_MS56XX_MS5637;
+    memcpy(g[i].calib.u.ms56xx.prom, s_ms5607_prom, sizeof(s_ms5607_prom));
+    g[i].adc_p = 6465444, g[i].adc_t = 8077636, g[i].pressure = 110002, g[i].temperature = 20.00, g[i].tol_pa = 0, g[i].tol_c = 0;
+  }
+  // MS5803-01BA typical values, the same as the MS5611's
+  g[6].calib.kind = BARO_CALIB_MS56XX, g[6].calib.u.ms56xx.variant = BARO_MS56XX_MS5803;
+  memcpy(g[6].calib.u.ms56xx.prom, s_ms5611_prom, sizeof(s_ms5611_prom));
+  g[6].adc_p = 9085466, g[6].adc_t = 8569150, g[6].pressure = 100009, g[6].temperature = 20.07, g[6].tol_pa = 0, g[6].tol_c = 0;
+
+  for (size_t i = 0; i < sizeof(g) / sizeof(g[0]); i++) {
+    raw.ts_usecs = 0;
+    raw.calib    = &g[i].calib;
+    raw.adc_p    = g[i].adc_p;
+    raw.adc_t    = g[i].adc_t;
+    TEST_CHECK(mgos_barometer_compensate(&raw, 1, &p, &t) == 1, "golden %zu not converted", i);
+    TEST_CHECK(fabs(p - g[i].pressure) <= g[i].tol_pa + 0.005, "golden %zu: %.3f Pa, want %.3f", i, p, g[i].pressure);
+    TEST_CHECK(fabs(t - g[i].temperature) <= g[i].tol_c + 0.0005, "golden %zu: %.4f C, want %.4f", i, t, g[i].temperature);
+  }
+
+  // The dispatcher stops at the first unknown calibration
+  struct mgos_barometer_raw two[2] = { raw, raw };
+  struct mgos_barometer_calib none = { .kind = BARO_CALIB_NONE };
+  float p2[2], t2[2];
+  two[1].calib = &none;
+  TEST_CHECK(mgos_barometer_compensate(two, 2, p2, t2) == 1, "unknown calibration converted");
+}
+
+static double bench(const struct variant *v, const struct mgos_barometer_calib *c, const struct mgos_barometer_raw *raw, size_t n) {
+  static float p[SWEEP_SAMPLES], t[SWEEP_SAMPLES];
+  volatile float sink = 0;
+  double best = 0;
+
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    int64_t start = test_now_nsecs(), elapsed;
+    int64_t count = 0;
+
+    do {
+      v->fn(c, raw, n, p, t);
+      sink  += p[count % n];
+      count += n;
+      elapsed = test_now_nsecs() - start;
+    } while (elapsed < BENCH_NSECS);
+    if (r == 0 || (double)elapsed / count < best) {
+      best = (double)elapsed / count;
+    }
+  }
+  (void)sink;
+  return best;
+}
+
+static void test_driver(const struct driver *d, double slack) {
+  static struct mgos_barometer_raw raw[SWEEP_SAMPLES];
+  static float p[SWEEP_SAMPLES], t[SWEEP_SAMPLES];
+  static long double ref_p[SWEEP_SAMPLES], ref_t[SWEEP_SAMPLES];
+  struct mgos_barometer_calib c;
+  double   err_p[3] = { 0 }, err_t[3] = { 0 };
+  uint32_t seed = 1;
+
+  for (int k = 0; k < SWEEP_CALIBS; k++) {
+    d->generate(&seed, &c, raw, SWEEP_SAMPLES);
+    for (int i = 0; i < SWEEP_SAMPLES; i++) {
+      raw[i].ts_usecs = 0;
+      raw[i].calib    = &c;
+      d->reference(&c, raw[i].adc_p, raw[i].adc_t, &ref_p[i], &ref_t[i]);
+    }
+    for (int j = 0; j < 3 && d->variants[j].fn; j++) {
+      d->variants[j].fn(&c, raw, SWEEP_SAMPLES, p, t);
+      for (int i = 0; i < SWEEP_SAMPLES; i++) {
+        double ep = fabsl(p[i] - ref_p[i]), et = fabsl(t[i] - ref_t[i]);
+
+        // NaN fails the check
+        if (!(ep <= err_p[j])) {
+          err_p[j] = ep;
+        }
+        if (!(et <= err_t[j])) {
+          err_t[j] = et;
+        }
+      }
+    }
+  }
+
+  // The last calibration's samples are the benchmark's input
+  for (int j = 0; j < 3 && d->variants[j].fn; j++) {
+    const struct variant *v = &d->variants[j];
+    double nsecs = bench(v, &c, raw, SWEEP_SAMPLES);
+
+    printf("%-8s %-7s %s  max err %.4f Pa %.5f C  %6.2f ns/sample\n", d->name, v->arith, j == 0 ? "lib " : "    ", err_p[j], err_t[j], nsecs);
+    TEST_CHECK(err_p[j] <= v->tol_pa, "%s %s: pressure error %g Pa over %g", d->name, v->arith, err_p[j], v->tol_pa);
+    TEST_CHECK(err_t[j] <= v->tol_c, "%s %s: temperature error %g C over %g", d->name, v->arith, err_t[j], v->tol_c);
+    if (slack > 0) {
+      TEST_CHECK(nsecs <= v->max_nsecs * slack, "%s %s: %.2f ns/sample over %.2f", d->name, v->arith, nsecs, v->max_nsecs * slack);
+    }
+  }
+}
+
+int main(void) {
+  double slack = test_bench_slack();
+
+  test_golden();
+  for (size_t i = 0; i < sizeof(s_drivers) / sizeof(s_drivers[0]); i++) {
+    test_driver(&s_drivers[i], slack);
+  }
+  return test_summary("test_compensate");
+}
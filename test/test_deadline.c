@@ -0,0 +1,188 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+
+#include "mgos_barometer_internal.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * mgos_barometer_read_deadline(): what it returns with and without a sample
+ * and budget, and that it never waits for another caller's transaction. A
+ * second sensor on the same bus is read from a thread to hold the bus, once
+ * for a long read and then in a tight loop, where a try-lock that could lose
+ * the lock after claiming the bus would stall for a whole read.
+ */
+
+TEST_MAIN_DECLS;
+
+#define DEADLINE_READ_USECS    (50000)
+#define DEADLINE_AGE_USECS     (30000)
+#define DEADLINE_STRESS_USECS  (1000000)
+#define DEADLINE_SLACK_USECS   (10000)   // for host scheduling, times BENCH_SLACK
+
+static volatile int      s_in_read, s_stop;
+static volatile uint32_t s_on_bus, s_overlaps;
+
+// Private functions follow
+static bool deadline_read(struct mgos_barometer *dev) {
+  if (__atomic_fetch_add(&s_on_bus, 1, __ATOMIC_SEQ_CST) != 0) {
+    __atomic_fetch_add(&s_overlaps, 1, __ATOMIC_RELAXED);
+  }
+  s_in_read = 1;
+  mgos_usleep(DEADLINE_READ_USECS);
+  dev->pressure    = 101325;
+  dev->temperature = 20;
+  __atomic_fetch_sub(&s_on_bus, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+static const struct mgos_barometer_driver s_deadline_driver = {
+  .name            = "DEADLINE",
+  .type            = BARO_USER,
+  .capabilities    = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .read_cost_usecs = DEADLINE_READ_USECS,
+  .read            = deadline_read,
+};
+
+static void *deadline_hold(void *arg) {
+  mgos_barometer_read((struct mgos_barometer *)arg);
+  return NULL;
+}
+
+static void *deadline_hammer(void *arg) {
+  while (!s_stop) {
+    mgos_barometer_read((struct mgos_barometer *)arg);
+  }
+  return NULL;
+}
+
+// Times one call, in usecs.
+static int64_t deadline_call(struct mgos_barometer *s, uint32_t max_usecs, enum mgos_barometer_read_result *ret, uint32_t *age) {
+  int64_t start = test_now_nsecs();
+
+  *ret = mgos_barometer_read_deadline(s, max_usecs, age);
+  return (test_now_nsecs() - start) / 1000;
+}
+
+static void test_deadline_results(struct mgos_barometer *s, double slack) {
+  enum mgos_barometer_read_result ret;
+  struct mgos_barometer_stats     st;
+  uint32_t age = 0;
+  int64_t  usecs;
+
+  usecs = deadline_call(s, DEADLINE_READ_USECS / 2, &ret, &age);
+  TEST_CHECK(ret == BARO_READ_TIMEOUT, "no sample yet, short budget: %d", ret);
+  TEST_CHECK(slack == 0 || usecs < DEADLINE_SLACK_USECS * slack, "timeout took %lld us", (long long)usecs);
+
+  usecs = deadline_call(s, 10 * DEADLINE_READ_USECS, &ret, &age);
+  TEST_CHECK(ret == BARO_READ_FRESH, "budget for a read: %d", ret);
+  TEST_CHECK(usecs >= DEADLINE_READ_USECS, "fresh read took %lld us", (long long)usecs);
+  TEST_CHECK(slack == 0 || age < DEADLINE_SLACK_USECS * slack, "fresh sample is %u us old", age);
+
+  mgos_usleep(DEADLINE_AGE_USECS);
+  usecs = deadline_call(s, DEADLINE_READ_USECS / 2, &ret, &age);
+  TEST_CHECK(ret == BARO_READ_CACHED, "short budget after a read: %d", ret);
+  TEST_CHECK(age >= DEADLINE_AGE_USECS, "cached sample is %u us old", age);
+  TEST_CHECK(slack == 0 || age < DEADLINE_AGE_USECS + DEADLINE_SLACK_USECS * slack, "cached sample is %u us old", age);
+  TEST_CHECK(slack == 0 || usecs < DEADLINE_SLACK_USECS * slack, "cached read took %lld us", (long long)usecs);
+
+  // Within the TTL, a cached sample is returned whatever the budget.
+  mgos_barometer_set_cache_ttl(s, 1000);
+  TEST_CHECK(mgos_barometer_read_deadline(s, 10 * DEADLINE_READ_USECS, NULL) == BARO_READ_CACHED, "within TTL");
+  mgos_barometer_set_cache_ttl(s, 0);
+
+  mgos_barometer_get_stats(s, &st);
+  TEST_CHECK(st.read == 4 && st.read_success == 1 && st.read_success_cached == 2 && st.cache_miss == 1,
+             "stats: read %u, success %u, cached %u, miss %u", st.read, st.read_success, st.read_success_cached, st.cache_miss);
+}
+
+// Another caller's read is in progress: even a budget for a full read
+// returns at once.
+static void test_deadline_contended(struct mgos_barometer *s, struct mgos_barometer *empty, struct mgos_barometer *other, double slack) {
+  enum mgos_barometer_read_result ret;
+  pthread_t thread;
+  uint32_t  age = 0;
+  int64_t   usecs;
+
+  s_in_read = 0;
+  pthread_create(&thread, NULL, deadline_hold, other);
+  while (!s_in_read) {
+    mgos_usleep(100);
+  }
+  usecs = deadline_call(s, 10 * DEADLINE_READ_USECS, &ret, &age);
+  TEST_CHECK(ret == BARO_READ_CACHED, "contended: %d", ret);
+  TEST_CHECK(age >= DEADLINE_AGE_USECS, "contended: sample is %u us old", age);
+  TEST_CHECK(slack == 0 || usecs < DEADLINE_SLACK_USECS * slack, "contended: took %lld us", (long long)usecs);
+
+  usecs = deadline_call(empty, 10 * DEADLINE_READ_USECS, &ret, &age);
+  TEST_CHECK(ret == BARO_READ_TIMEOUT, "contended, no sample yet: %d", ret);
+  TEST_CHECK(slack == 0 || usecs < DEADLINE_SLACK_USECS * slack, "contended, no sample yet: took %lld us", (long long)usecs);
+  pthread_join(thread, NULL);
+}
+
+// The other sensor takes and drops the bus back to back, so the bus is idle
+// only for moments, which is when a try-lock can claim it.
+static void test_deadline_stress(struct mgos_barometer *s, struct mgos_barometer *other, double slack) {
+  enum mgos_barometer_read_result ret;
+  pthread_t thread;
+  int64_t   end, usecs, max = 0;
+  long      calls = 0, cached = 0;
+
+  s_stop = 0;
+  pthread_create(&thread, NULL, deadline_hammer, other);
+  end = test_now_nsecs() + DEADLINE_STRESS_USECS * 1000LL;
+  while (test_now_nsecs() < end) {
+    usecs = deadline_call(s, DEADLINE_READ_USECS / 2, &ret, NULL);
+    if (usecs > max) {
+      max = usecs;
+    }
+    cached += ret == BARO_READ_CACHED;
+    calls++;
+  }
+  s_stop = 1;
+  pthread_join(thread, NULL);
+  printf("%ld calls against a busy bus, %lld us at most\n", calls, (long long)max);
+  TEST_CHECK(cached == calls, "%ld of %ld calls not cached", calls - cached, calls);
+  TEST_CHECK(slack == 0 || max < DEADLINE_SLACK_USECS * slack, "a call took %lld us", (long long)max);
+}
+
+// Private functions end
+
+int main(void) {
+  struct mgos_barometer *s, *empty, *other;
+  double slack = test_bench_slack();
+
+  TEST_CHECK(mgos_barometer_register_driver(&s_deadline_driver), "driver not registered");
+  s     = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x10, BARO_USER);
+  empty = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x11, BARO_USER);
+  other = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x12, BARO_USER);
+  TEST_CHECK(s && empty && other, "sensors not created");
+  if (!s || !empty || !other) {
+    return test_summary("test_deadline");
+  }
+
+  test_deadline_results(s, slack);
+  test_deadline_contended(s, empty, other, slack);
+  test_deadline_stress(s, other, slack);
+  TEST_CHECK(s_overlaps == 0, "%u overlapping transactions on the bus", s_overlaps);
+
+  mgos_barometer_destroy(&s);
+  mgos_barometer_destroy(&empty);
+  mgos_barometer_destroy(&other);
+  return test_summary("test_deadline");
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_barometer_internal.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * Sample events: sequence numbers, holds and releases, held slots being
+ * skipped, every slot held, and a handler turning events off while later
+ * handlers still use the event. Samples are fed to mgos_barometer_emit()
+ * directly, as the sampling paths would. Run under ASan to catch a ring
+ * freed too early.
+ */
+
+TEST_MAIN_DECLS;
+
+#define EVENTS_LEN        (4)
+#define EVENTS_MAX_HELD   (4)
+
+enum events_action {
+  EVENTS_NONE,
+  EVENTS_HOLD,       // first handler holds every event
+  EVENTS_TURN_OFF,   // first handler turns events off
+};
+
+static enum events_action               s_action;
+static struct mgos_barometer_event_data s_last, s_log[16], s_held[EVENTS_MAX_HELD];
+static int      s_events, s_num_held, s_second_held;
+static uint32_t s_second_seen;
+
+// Private functions follow
+static bool events_read(struct mgos_barometer *dev) {
+  return true;
+}
+
+static const struct mgos_barometer_driver s_events_driver = {
+  .name         = "EVENTS",
+  .type         = BARO_USER,
+  .capabilities = MGOS_BAROMETER_CAP_BAROMETER,
+  .read         = events_read,
+};
+
+static void events_first(int ev, void *ev_data, void *userdata) {
+  struct mgos_barometer_event_data *e = (struct mgos_barometer_event_data *)ev_data;
+
+  s_last = *e;
+  s_log[s_events++ % 16] = *e;
+  if (s_action == EVENTS_HOLD && s_num_held < EVENTS_MAX_HELD && mgos_barometer_event_hold(e)) {
+    s_held[s_num_held++] = *e;
+  } else if (s_action == EVENTS_TURN_OFF) {
+    mgos_barometer_set_events(e->sensor, 0);
+  }
+}
+
+// Runs after events_first, and uses the event as any handler would.
+static void events_second(int ev, void *ev_data, void *userdata) {
+  struct mgos_barometer_event_data *e = (struct mgos_barometer_event_data *)ev_data;
+
+  for (int i = 0; i < e->n; i++) {
+    s_second_seen += (uint32_t)e->samples[i].pressure;
+  }
+  if (mgos_barometer_event_hold(e)) {
+    s_second_held++;
+    mgos_barometer_event_release(e);
+  }
+}
+
+static void events_emit(struct mgos_barometer *s, int64_t *ts, int n) {
+  struct mgos_barometer_sample samples[8];
+
+  memset(samples, 0, sizeof(samples));
+  for (int i = 0; i < n; i++) {
+    samples[i].ts_usecs = ++(*ts);
+    samples[i].pressure = 100000 + *ts;
+  }
+  mgos_barometer_emit(s, samples, n);
+}
+
+static void events_release_all(void) {
+  for (int i = 0; i < s_num_held; i++) {
+    mgos_barometer_event_release(&s_held[i]);
+  }
+  s_num_held = 0;
+}
+
+static void test_events_hold(struct mgos_barometer *s) {
+  int64_t ts = 0;
+
+  TEST_CHECK(mgos_barometer_set_events(s, EVENTS_LEN), "events not set");
+  s_action = EVENTS_HOLD;
+  events_emit(s, &ts, 2);
+  TEST_CHECK(s_events == 1 && s_last.seq == 0 && s_last.n == 2, "first: %d events, seq %u, n %u", s_events, s_last.seq, s_last.n);
+  TEST_CHECK(s_num_held == 1, "first event not held");
+
+  // Samples already published are not repeated.
+  ts -= 2;
+  events_emit(s, &ts, 2);
+  TEST_CHECK(s_events == 1, "repeated samples published again");
+
+  // Slots 2 and 3 are free, then 0 and 1 are held and skipped.
+  s_action = EVENTS_NONE;
+  events_emit(s, &ts, 3);
+  TEST_CHECK(s_events == 3, "after wrapping: %d events", s_events);
+  TEST_CHECK(s_last.seq == 6 && s_last.n == 1, "after the held slots: seq %u, n %u", s_last.seq, s_last.n);
+  TEST_CHECK(mgos_barometer_get_events_dropped(s) == 2, "%u dropped, 2 skipped", mgos_barometer_get_events_dropped(s));
+  TEST_CHECK(s_held[0].samples[0].pressure == 100001 && s_held[0].samples[1].pressure == 100002,
+             "held samples overwritten: %.0f %.0f", s_held[0].samples[0].pressure, s_held[0].samples[1].pressure);
+
+  // An event whose slots were reused since can no longer be held.
+  TEST_CHECK(s_log[1].seq == 2 && !mgos_barometer_event_hold(&s_log[1]), "hold of overwritten samples");
+  TEST_CHECK(mgos_barometer_event_hold(&s_last), "hold of the newest event");
+  mgos_barometer_event_release(&s_last);
+  events_release_all();
+}
+
+static void test_events_overrun(struct mgos_barometer *s) {
+  int64_t  ts = 100;
+  uint32_t dropped;
+
+  TEST_CHECK(mgos_barometer_set_events(s, EVENTS_LEN), "events not set");
+  s_events = 0;
+  s_action = EVENTS_HOLD;
+  for (int i = 0; i < EVENTS_LEN; i++) {
+    events_emit(s, &ts, 1);
+  }
+  TEST_CHECK(s_num_held == EVENTS_LEN, "%d of %d held", s_num_held, EVENTS_LEN);
+
+  // Every slot held: samples are left out, not waited for.
+  dropped = mgos_barometer_get_events_dropped(s);
+  events_emit(s, &ts, 3);
+  TEST_CHECK(s_events == EVENTS_LEN, "published with every slot held");
+  TEST_CHECK(mgos_barometer_get_events_dropped(s) == dropped + 3, "%u dropped with every slot held", mgos_barometer_get_events_dropped(s) - dropped);
+
+  // Once one is released, publishing resumes in its slot.
+  mgos_barometer_event_release(&s_held[0]);
+  s_held[0] = s_held[--s_num_held];
+  s_action  = EVENTS_NONE;
+  events_emit(s, &ts, 1);
+  TEST_CHECK(s_events == EVENTS_LEN + 1 && s_last.n == 1, "after a release: %d events", s_events);
+  TEST_CHECK(s_last.samples[0].pressure == 100000 + ts, "released slot not reused");
+  events_release_all();
+}
+
+// The first handler frees the ring if nothing holds it; the second must
+// still be able to read and hold the event.
+static void test_events_turn_off(struct mgos_barometer *s) {
+  int64_t ts = 200;
+
+  TEST_CHECK(mgos_barometer_set_events(s, EVENTS_LEN), "events not set");
+  s_events      = 0;
+  s_second_seen = 0;
+  s_second_held = 0;
+  s_action      = EVENTS_TURN_OFF;
+  events_emit(s, &ts, 2);
+  TEST_CHECK(s_events == 1, "%d events", s_events);
+  TEST_CHECK(s->events == NULL, "events still on");
+  TEST_CHECK(s_second_seen == 2 * 100000 + 201 + 202, "second handler saw %u", s_second_seen);
+  TEST_CHECK(s_second_held == 1, "second handler could not hold the event");
+
+  // Holds outlive the sensor's events: the ring goes with the last release.
+  s_action = EVENTS_HOLD;
+  TEST_CHECK(mgos_barometer_set_events(s, EVENTS_LEN), "events not set");
+  events_emit(s, &ts, 1);
+  TEST_CHECK(s_num_held == 1, "not held");
+  mgos_barometer_set_events(s, 0);
+  TEST_CHECK(s_held[0].samples[0].pressure == 100000 + ts, "held sample lost with the ring");
+  events_release_all();
+}
+
+// Private functions end
+
+int main(void) {
+  struct mgos_barometer *s;
+
+  TEST_CHECK(mgos_barometer_register_driver(&s_events_driver), "driver not registered");
+  mgos_event_add_handler(MGOS_BAROMETER_EV_SAMPLES, events_first, NULL);
+  mgos_event_add_handler(MGOS_BAROMETER_EV_SAMPLES, events_second, NULL);
+  s = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x10, BARO_USER);
+  TEST_CHECK(s != NULL, "sensor not created");
+  if (!s) {
+    return test_summary("test_events");
+  }
+
+  test_events_hold(s);
+  test_events_overrun(s);
+  test_events_turn_off(s);
+  mgos_barometer_destroy(&s);
+  return test_summary("test_events");
+}
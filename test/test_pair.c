@@ -0,0 +1,218 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "mgos_barometer_internal.h"
+#include "mgos_barometer_pair.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * Differential pairs, with drivers that convert in the background and take
+ * their timestamp mid conversion. Sensor b converts for longer, which shows
+ * up as skew, reads PAIR_OFFSET_PA low, and converts temperature instead of
+ * pressure every PAIR_TEMP_EVERY cycles, which leaves a's sample unpaired.
+ * Callbacks destroy the pair, which must not touch it afterwards; run under
+ * ASan to check.
+ */
+
+TEST_MAIN_DECLS;
+
+#define PAIR_CONV_A_USECS   (2000)
+#define PAIR_CONV_B_USECS   (4000)
+#define PAIR_OFFSET_PA      (12.5f)
+#define PAIR_TEMP_EVERY     (4)
+#define PAIR_RUN_USECS      (300000)
+
+struct pair_data {
+  uint32_t conv_usecs;
+  uint32_t collects;
+  uint32_t temps;         // collects that converted temperature
+  float    offset_pa;
+  bool     leader;        // starts a new cycle of the true pressure
+  bool     temp_cycles;
+};
+
+static uint32_t s_cycle;
+static int      s_outputs, s_destroy_after;
+static struct mgos_barometer_pair_output s_last;
+
+// Private functions follow
+static bool pair_create(struct mgos_barometer *dev) {
+  struct pair_data *d = (struct pair_data *)dev->user_data;
+
+  d->leader      = dev->i2caddr == 0x10;
+  d->temp_cycles = !d->leader;
+  d->conv_usecs  = d->leader ? PAIR_CONV_A_USECS : PAIR_CONV_B_USECS;
+  d->offset_pa   = d->leader ? 0 : -PAIR_OFFSET_PA;
+  return true;
+}
+
+static void pair_sample(struct mgos_barometer *dev, struct pair_data *d) {
+  dev->pressure    = 100000 + 10 * (s_cycle % 100) + d->offset_pa;
+  dev->temperature = 20;
+}
+
+static bool pair_read(struct mgos_barometer *dev) {
+  struct pair_data *d = (struct pair_data *)dev->user_data;
+
+  if (d->leader) {
+    s_cycle++;
+  }
+  pair_sample(dev, d);
+  return true;
+}
+
+static bool pair_start(struct mgos_barometer *dev, uint32_t *wait_usecs) {
+  struct pair_data *d = (struct pair_data *)dev->user_data;
+
+  if (d->leader) {
+    s_cycle++;
+  }
+  dev->ts_usecs = mgos_uptime_micros() + d->conv_usecs / 2;
+  *wait_usecs   = d->conv_usecs;
+  return true;
+}
+
+static int pair_collect(struct mgos_barometer *dev) {
+  struct pair_data *d = (struct pair_data *)dev->user_data;
+
+  if (d->temp_cycles && ++d->collects % PAIR_TEMP_EVERY == 0) {
+    d->temps++;
+    return 0;
+  }
+  pair_sample(dev, d);
+  return 1;
+}
+
+static const struct mgos_barometer_driver s_pair_driver = {
+  .name           = "PAIR",
+  .type           = BARO_USER,
+  .capabilities   = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .user_data_size = sizeof(struct pair_data),
+  .create         = pair_create,
+  .read           = pair_read,
+  .start          = pair_start,
+  .collect        = pair_collect,
+};
+
+// The same sensors, read at once
+static const struct mgos_barometer_driver s_blocking_driver = {
+  .name           = "BLOCKING",
+  .type           = (enum mgos_barometer_type)(BARO_USER + 1),
+  .capabilities   = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER,
+  .user_data_size = sizeof(struct pair_data),
+  .create         = pair_create,
+  .read           = pair_read,
+};
+
+static void pair_cb(struct mgos_barometer_pair *pair, const struct mgos_barometer_pair_output *out, void *cb_arg) {
+  struct mgos_barometer_pair **handle = (struct mgos_barometer_pair **)cb_arg;
+
+  s_last = *out;
+  if (++s_outputs == s_destroy_after) {
+    TEST_CHECK(*handle == NULL || *handle == pair, "callback for another pair");
+    mgos_barometer_pair_destroy(&pair);
+    *handle = NULL;
+  }
+}
+
+static void test_pair_sampling(struct mgos_barometer *a, struct mgos_barometer *b) {
+  struct mgos_barometer_pair *     pair = NULL;
+  struct mgos_barometer_pair_stats st;
+  struct pair_data *db = (struct pair_data *)b->user_data;
+  uint32_t temps, skew_lo = PAIR_CONV_B_USECS / 2 - PAIR_CONV_A_USECS / 2;
+
+  s_outputs       = 0;
+  s_destroy_after = 0;
+  pair            = mgos_barometer_pair_create(a, b, 0, pair_cb, &pair);
+  TEST_CHECK(pair != NULL, "pair not created");
+  if (!pair) {
+    return;
+  }
+  TEST_CHECK(mgos_barometer_pair_calibrate(pair, 5), "calibration not started");
+  host_run_for(PAIR_RUN_USECS);
+
+  TEST_CHECK(mgos_barometer_pair_get_stats(pair, &st), "no stats");
+  temps = db->temps;
+  printf("%u pairs, %u unpaired, skew %.0f us mean, %u us max, offset %.3f Pa\n", st.pairs, st.unpaired, st.mean_skew_usecs, st.max_skew_usecs, st.offset_pa);
+  TEST_CHECK(st.pairs > 20 && st.pairs == (uint32_t)s_outputs, "%u pairs, %d outputs", st.pairs, s_outputs);
+  TEST_CHECK(temps > 0 && st.unpaired == temps, "%u unpaired, %u temperature conversions", st.unpaired, temps);
+  TEST_CHECK(st.pairs >= (PAIR_TEMP_EVERY - 1) * temps, "%u pairs to %u unpaired", st.pairs, st.unpaired);
+  TEST_CHECK(st.calibrating == 0, "still calibrating, %u left", st.calibrating);
+  TEST_CHECK(st.offset_pa > PAIR_OFFSET_PA - 0.01 && st.offset_pa < PAIR_OFFSET_PA + 0.01, "offset %.3f Pa", st.offset_pa);
+  TEST_CHECK(s_last.diff_pa > -0.01 && s_last.diff_pa < 0.01, "corrected differential %.3f Pa", s_last.diff_pa);
+  TEST_CHECK(s_last.pressure_a - s_last.pressure_b == PAIR_OFFSET_PA, "pressures %.2f and %.2f", s_last.pressure_a, s_last.pressure_b);
+  // b's timestamp is half its longer conversion after a's.
+  TEST_CHECK(s_last.skew_usecs >= (int32_t)skew_lo && st.max_skew_usecs < skew_lo + 500, "skew %d us, at most %u", s_last.skew_usecs, st.max_skew_usecs);
+
+  TEST_CHECK(mgos_barometer_pair_set_offset(pair, 0), "offset not set");
+  host_run_for(20000);
+  TEST_CHECK(s_last.diff_pa == PAIR_OFFSET_PA, "uncorrected differential %.3f Pa", s_last.diff_pa);
+  mgos_barometer_pair_destroy(&pair);
+  TEST_CHECK(pair == NULL, "handle not cleared");
+}
+
+// The natural "got enough" pattern, with conversions still to restart.
+static void test_pair_destroy_in_cb(struct mgos_barometer *a, struct mgos_barometer *b) {
+  struct mgos_barometer_pair *pair = NULL;
+
+  s_outputs       = 0;
+  s_destroy_after = 3;
+  pair            = mgos_barometer_pair_create(a, b, 0, pair_cb, &pair);
+  TEST_CHECK(pair != NULL, "pair not created");
+  host_run_for(50000);
+  TEST_CHECK(pair == NULL && s_outputs == 3, "%d outputs after destroying the pair at 3", s_outputs);
+  TEST_CHECK(!(a->flags & MGOS_BAROMETER_FLAG_CONVERTING) && !(b->flags & MGOS_BAROMETER_FLAG_CONVERTING), "conversions left running");
+  TEST_CHECK(mgos_barometer_read(a) && mgos_barometer_read(b), "sensors not readable after the pair");
+}
+
+// Sensors read at once produce the first output inside create.
+static void test_pair_destroy_in_create(struct mgos_barometer *a, struct mgos_barometer *b) {
+  struct mgos_barometer_pair *pair = NULL;
+
+  s_outputs       = 0;
+  s_destroy_after = 1;
+  pair            = mgos_barometer_pair_create(a, b, 10, pair_cb, &pair);
+  TEST_CHECK(pair == NULL && s_outputs == 1, "destroyed in create: %p, %d outputs", (void *)pair, s_outputs);
+  host_run_for(50000);
+  TEST_CHECK(s_outputs == 1, "%d outputs after destroying the pair", s_outputs);
+}
+
+// Private functions end
+
+int main(void) {
+  struct mgos_barometer *a, *b, *ba, *bb;
+
+  TEST_CHECK(mgos_barometer_register_driver(&s_pair_driver), "driver not registered");
+  TEST_CHECK(mgos_barometer_register_driver(&s_blocking_driver), "blocking driver not registered");
+  a  = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x10, BARO_USER);
+  b  = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x11, BARO_USER);
+  ba = mgos_barometer_create_i2c(mgos_i2c_get_bus(1), 0x10, s_blocking_driver.type);
+  bb = mgos_barometer_create_i2c(mgos_i2c_get_bus(1), 0x11, s_blocking_driver.type);
+  TEST_CHECK(a && b && ba && bb, "sensors not created");
+  if (!a || !b || !ba || !bb) {
+    return test_summary("test_pair");
+  }
+
+  test_pair_sampling(a, b);
+  test_pair_destroy_in_cb(a, b);
+  test_pair_destroy_in_create(ba, bb);
+  mgos_barometer_destroy(&a);
+  mgos_barometer_destroy(&b);
+  mgos_barometer_destroy(&ba);
+  mgos_barometer_destroy(&bb);
+  return test_summary("test_pair");
+}
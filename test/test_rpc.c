@@ -0,0 +1,258 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <ctype.h>
+
+#include "mgos_barometer_internal.h"
+#include "mgos_rpc.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * The Barometer.* RPC service over an in-process loopback: every response
+ * must be valid JSON and agree with the C API.
+ */
+
+TEST_MAIN_DECLS;
+
+#define RPC_HISTORY_LEN    (8)
+#define RPC_BUF_LEN        (8192)
+
+static char s_buf[RPC_BUF_LEN];
+
+// Private functions follow
+static bool rpc_read(struct mgos_barometer *dev) {
+  uint32_t *k = (uint32_t *)dev->user_data;
+
+  (*k)++;
+  dev->pressure    = 100000 + *k;
+  dev->temperature = 20 + *k / 4.0f;
+  dev->humidity    = 50;
+  return true;
+}
+
+static const struct mgos_barometer_driver s_rpc_driver = {
+  .name           = "LOOPBACK",
+  .type           = BARO_USER,
+  .capabilities   = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER | MGOS_BAROMETER_CAP_HYGROMETER,
+  .user_data_size = sizeof(uint32_t),
+  .read           = rpc_read,
+};
+
+// Strict enough JSON validation: returns the end of the value, or NULL.
+static const char *json_value(const char *p);
+
+static const char *json_ws(const char *p) {
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
+}
+
+static const char *json_string(const char *p) {
+  if (*p++ != '"') {
+    return NULL;
+  }
+  while (*p && *p != '"') {
+    if ((unsigned char)*p < 0x20) {
+      return NULL;
+    }
+    p += (*p == '\\' && p[1]) ? 2 : 1;
+  }
+  return *p == '"' ? p + 1 : NULL;
+}
+
+static const char *json_list(const char *p, char close, bool keys) {
+  p = json_ws(p + 1);
+  if (*p == close) {
+    return p + 1;
+  }
+  for (;;) {
+    if (keys) {
+      if (!(p = json_string(p)) || *(p = json_ws(p)) != ':') {
+        return NULL;
+      }
+      p = json_ws(p + 1);
+    }
+    if (!(p = json_value(p))) {
+      return NULL;
+    }
+    p = json_ws(p);
+    if (*p == close) {
+      return p + 1;
+    }
+    if (*p != ',') {
+      return NULL;
+    }
+    p = json_ws(p + 1);
+  }
+}
+
+static const char *json_value(const char *p) {
+  char *end;
+
+  p = json_ws(p);
+  switch (*p) {
+  case '{': return json_list(p, '}', true);
+
+  case '[': return json_list(p, ']', false);
+
+  case '"': return json_string(p);
+
+  case 't': return strncmp(p, "true", 4) ? NULL : p + 4;
+
+  case 'f': return strncmp(p, "false", 5) ? NULL : p + 5;
+
+  case 'n': return strncmp(p, "null", 4) ? NULL : p + 4;
+
+  default:
+    if (*p != '-' && !isdigit((unsigned char)*p)) {
+      return NULL;
+    }
+    strtod(p, &end);
+    return end;
+  }
+}
+
+static bool json_valid(const char *s) {
+  const char *end = json_value(s);
+
+  return end && *json_ws(end) == '\0';
+}
+
+// Number after the nth "key": in s, or NAN
+static double json_number(const char *s, const char *key, int nth) {
+  char pat[64];
+
+  snprintf(pat, sizeof(pat), "\"%s\":", key);
+  for (s = strstr(s, pat); s && nth > 0; nth--) {
+    s = strstr(s + 1, pat);
+  }
+  return s ? strtod(json_ws(s + strlen(pat)), NULL) : NAN;
+}
+
+static int json_count(const char *s, const char *pat) {
+  int n = 0;
+
+  for (s = strstr(s, pat); s; s = strstr(s + 1, pat)) {
+    n++;
+  }
+  return n;
+}
+
+static int rpc_call(const char *method, const char *args) {
+  int ret = host_rpc_call(method, args, s_buf, sizeof(s_buf));
+
+  if (ret == 0) {
+    TEST_CHECK(json_valid(s_buf), "%s(%s): invalid JSON: %s", method, args, s_buf);
+  }
+  return ret;
+}
+
+// Private functions end
+
+int main(void) {
+  static struct mgos_barometer_sample history[RPC_HISTORY_LEN];
+  struct mgos_barometer *sensors[3];
+  struct mgos_barometer_sample sample;
+  struct mgos_barometer_stats  stats;
+  char args[64], *latency;
+  int  id;
+
+  TEST_CHECK(mgos_barometer_register_driver(&s_rpc_driver), "driver not registered");
+  TEST_CHECK(mgos_barometer_init(), "init failed");
+  for (int i = 0; i < 3; i++) {
+    sensors[i] = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x10 + i, BARO_USER);
+    TEST_CHECK(sensors[i] != NULL, "sensor %d not created", i);
+    if (!sensors[i]) {
+      return test_summary("test_rpc");
+    }
+    mgos_barometer_set_cache_ttl(sensors[i], 0);
+  }
+  id = mgos_barometer_get_id(sensors[1]);
+
+  // List
+  TEST_CHECK(rpc_call("Barometer.List", "") == 0, "List failed: %s", s_buf);
+  TEST_CHECK(json_count(s_buf, "\"name\": \"LOOPBACK\"") == 3, "List: %s", s_buf);
+  TEST_CHECK(json_number(s_buf, "type", 0) == BARO_USER, "List: %s", s_buf);
+
+  // Read of a sensor that has no sample yet, then fresh
+  snprintf(args, sizeof(args), "{\"id\": %d}", id);
+  TEST_CHECK(rpc_call("Barometer.Read", args) == 0 && strstr(s_buf, "pressure") == NULL, "Read before a sample: %s", s_buf);
+  snprintf(args, sizeof(args), "{\"id\": %d, \"fresh\": true}", id);
+  TEST_CHECK(rpc_call("Barometer.Read", args) == 0, "Read failed: %s", s_buf);
+  TEST_CHECK(mgos_barometer_get_sample(sensors[1], &sample), "no sample after a fresh read");
+  TEST_CHECK(json_number(s_buf, "id", 0) == id, "Read: %s", s_buf);
+  TEST_CHECK(fabs(json_number(s_buf, "pressure", 0) - sample.pressure) < 0.01, "Read: %s", s_buf);
+  TEST_CHECK(fabs(json_number(s_buf, "temperature", 0) - sample.temperature) < 0.01, "Read: %s", s_buf);
+  TEST_CHECK(json_number(s_buf, "ts_usecs", 0) == sample.ts_usecs, "Read: %s", s_buf);
+  TEST_CHECK(rpc_call("Barometer.Read", "{\"fresh\": true}") == 0, "Read all failed: %s", s_buf);
+  TEST_CHECK(json_count(s_buf, "\"pressure\":") == 3, "Read all: %s", s_buf);
+  TEST_CHECK(rpc_call("Barometer.Read", "{\"id\": 999}") == 404, "Read of an unknown id: %s", s_buf);
+
+  // History, straight out of the ring
+  TEST_CHECK(rpc_call("Barometer.History", args) == 400, "History without a ring: %s", s_buf);
+  TEST_CHECK(rpc_call("Barometer.History", "{}") == 400, "History without an id: %s", s_buf);
+  TEST_CHECK(mgos_barometer_set_history(sensors[1], history, RPC_HISTORY_LEN), "history not set");
+  for (int i = 0; i < 12; i++) {
+    mgos_barometer_read(sensors[1]);
+  }
+  snprintf(args, sizeof(args), "{\"id\": %d, \"limit\": 5}", id);
+  TEST_CHECK(rpc_call("Barometer.History", args) == 0, "History failed: %s", s_buf);
+  TEST_CHECK(json_number(s_buf, "first", 0) == 4 && json_number(s_buf, "next", 0) == 9, "History: %s", s_buf);
+  TEST_CHECK(json_count(s_buf, "], [") == 4, "History rows: %s", s_buf);
+  for (int i = 0; i < 5; i++) {
+    const struct mgos_barometer_sample *h = &history[(4 + i) % RPC_HISTORY_LEN];
+    char row[96];
+
+    snprintf(row, sizeof(row), "[%lld, %.2f, %.2f, %.2f, %.2f]", (long long)h->ts_usecs, h->pressure, h->temperature, h->humidity, h->altitude);
+    TEST_CHECK(strstr(s_buf, row) != NULL, "History: %s missing from %s", row, s_buf);
+  }
+  snprintf(args, sizeof(args), "{\"id\": %d, \"since\": 10}", id);
+  TEST_CHECK(rpc_call("Barometer.History", args) == 0, "History since failed: %s", s_buf);
+  TEST_CHECK(json_number(s_buf, "first", 0) == 10 && json_number(s_buf, "next", 0) == 12, "History since: %s", s_buf);
+
+  // Stats
+  snprintf(args, sizeof(args), "{\"id\": %d}", id);
+  TEST_CHECK(rpc_call("Barometer.Stats", args) == 0, "Stats failed: %s", s_buf);
+  TEST_CHECK(mgos_barometer_get_stats(sensors[1], &stats), "no stats");
+  TEST_CHECK(json_number(s_buf, "read", 0) == stats.read, "Stats: %s", s_buf);
+  TEST_CHECK(json_number(s_buf, "read_success", 0) == stats.read_success, "Stats: %s", s_buf);
+  TEST_CHECK(strstr(s_buf, "\"read_latency_bounds_usecs\": [1000, 2000, 5000,") != NULL, "Stats: %s", s_buf);
+  latency = strstr(s_buf, "\"read_latency\": [");
+  TEST_CHECK(latency != NULL, "Stats: %s", s_buf);
+  if (latency) {
+    char *p = latency + strlen("\"read_latency\": [");
+    int   buckets = 0;
+    long  sum = 0;
+
+    for (; *p != ']'; buckets++) {
+      sum += strtol(p, &p, 10);
+      p   += strspn(p, ", ");
+    }
+    TEST_CHECK(buckets == MGOS_BAROMETER_LATENCY_BUCKETS && sum == stats.read_success,
+               "%d latency buckets with %ld reads: %s", buckets, sum, s_buf);
+  }
+  TEST_CHECK(rpc_call("Barometer.Stats", "") == 0, "Stats of all failed: %s", s_buf);
+  TEST_CHECK(json_count(s_buf, "\"read_success\":") == 3, "Stats of all: %s", s_buf);
+
+  for (int i = 0; i < 3; i++) {
+    mgos_barometer_destroy(&sensors[i]);
+  }
+  TEST_CHECK(rpc_call("Barometer.List", "") == 0 && strcmp(s_buf, "{\"sensors\": []}") == 0, "List when empty: %s", s_buf);
+  return test_summary("test_rpc");
+}
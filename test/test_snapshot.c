@@ -0,0 +1,150 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <pthread.h>
+
+#include "mgos_barometer_internal.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * Torn reads: writer threads publish samples whose pressure, temperature and
+ * humidity are derived from one counter, while reader threads check every
+ * snapshot they load for a mix of two samples. Two sensors share a bus, and
+ * their driver checks that its transactions never overlap.
+ */
+
+TEST_MAIN_DECLS;
+
+#define SNAPSHOT_SENSORS    (2)
+#define SNAPSHOT_READERS    (3)
+#define SNAPSHOT_WRITES     (200000)   // per sensor
+
+struct snapshot_reader_result {
+  long loads, torn, backwards;
+};
+
+static volatile int      s_stop;
+static volatile uint32_t s_on_bus, s_overlaps;
+
+// Private functions follow
+static bool snapshot_read(struct mgos_barometer *dev) {
+  uint32_t *k = (uint32_t *)dev->user_data;
+  uint32_t  v;
+
+  if (__atomic_fetch_add(&s_on_bus, 1, __ATOMIC_SEQ_CST) != 0) {
+    __atomic_fetch_add(&s_overlaps, 1, __ATOMIC_RELAXED);
+  }
+  v                = ++(*k) % 4096;
+  dev->pressure    = 90000 + v;
+  dev->temperature = v / 16.0f;
+  dev->humidity    = v / 64.0f;
+  __atomic_fetch_sub(&s_on_bus, 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+static const struct mgos_barometer_driver s_snapshot_driver = {
+  .name           = "SNAPSHOT",
+  .type           = BARO_USER,
+  .capabilities   = MGOS_BAROMETER_CAP_BAROMETER | MGOS_BAROMETER_CAP_THERMOMETER | MGOS_BAROMETER_CAP_HYGROMETER,
+  .user_data_size = sizeof(uint32_t),
+  .read           = snapshot_read,
+};
+
+static struct mgos_barometer *s_sensors[SNAPSHOT_SENSORS];
+
+static void *snapshot_writer(void *arg) {
+  struct mgos_barometer *sensor = (struct mgos_barometer *)arg;
+
+  for (int i = 0; i < SNAPSHOT_WRITES; i++) {
+    mgos_barometer_read(sensor);
+  }
+  return NULL;
+}
+
+static void *snapshot_reader(void *arg) {
+  struct snapshot_reader_result *r = (struct snapshot_reader_result *)arg;
+  int64_t last_ts[SNAPSHOT_SENSORS] = { 0 };
+
+  while (!s_stop) {
+    for (int i = 0; i < SNAPSHOT_SENSORS; i++) {
+      struct mgos_barometer_sample s;
+      float v;
+
+      if (!mgos_barometer_get_sample(s_sensors[i], &s)) {
+        continue;
+      }
+      v = s.pressure - 90000;
+      if (v != s.temperature * 16 || v != s.humidity * 64) {
+        r->torn++;
+      }
+      if (s.ts_usecs < last_ts[i]) {
+        r->backwards++;
+      }
+      last_ts[i] = s.ts_usecs;
+      r->loads++;
+    }
+  }
+  return NULL;
+}
+
+// Private functions end
+
+int main(void) {
+  pthread_t writers[SNAPSHOT_SENSORS], readers[SNAPSHOT_READERS];
+  struct snapshot_reader_result results[SNAPSHOT_READERS];
+  long loads = 0;
+
+  TEST_CHECK(mgos_barometer_register_driver(&s_snapshot_driver), "driver not registered");
+  for (int i = 0; i < SNAPSHOT_SENSORS; i++) {
+    s_sensors[i] = mgos_barometer_create_i2c(mgos_i2c_get_bus(0), 0x10 + i, BARO_USER);
+    TEST_CHECK(s_sensors[i] != NULL, "sensor %d not created", i);
+    if (!s_sensors[i]) {
+      return test_summary("test_snapshot");
+    }
+    mgos_barometer_set_cache_ttl(s_sensors[i], 0);
+  }
+
+  for (int i = 0; i < SNAPSHOT_READERS; i++) {
+    memset(&results[i], 0, sizeof(results[i]));
+    pthread_create(&readers[i], NULL, snapshot_reader, &results[i]);
+  }
+  for (int i = 0; i < SNAPSHOT_SENSORS; i++) {
+    pthread_create(&writers[i], NULL, snapshot_writer, s_sensors[i]);
+  }
+  for (int i = 0; i < SNAPSHOT_SENSORS; i++) {
+    pthread_join(writers[i], NULL);
+  }
+  s_stop = 1;
+  for (int i = 0; i < SNAPSHOT_READERS; i++) {
+    pthread_join(readers[i], NULL);
+    TEST_CHECK(results[i].torn == 0, "reader %d: %ld torn snapshots", i, results[i].torn);
+    TEST_CHECK(results[i].backwards == 0, "reader %d: %ld snapshots older than the one before", i, results[i].backwards);
+    loads += results[i].loads;
+  }
+
+  printf("%d writes per sensor, %ld snapshots loaded\n", SNAPSHOT_WRITES, loads);
+  TEST_CHECK(s_overlaps == 0, "%u overlapping bus transactions", s_overlaps);
+  for (int i = 0; i < SNAPSHOT_SENSORS; i++) {
+    struct mgos_barometer_stats stats;
+
+    TEST_CHECK(mgos_barometer_get_stats(s_sensors[i], &stats) && stats.read_success == SNAPSHOT_WRITES,
+               "sensor %d: %u of %d reads counted", i, stats.read_success, SNAPSHOT_WRITES);
+    mgos_barometer_destroy(&s_sensors[i]);
+  }
+  return test_summary("test_snapshot");
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2018 Google Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "mgos_barometer_vario.h"
+#include "host.h"
+#include "test.h"
+
+/*
+ * Replay benchmark of the variometer filter with its default configuration:
+ * step lag, steady-state noise and bias in a climb, tracking error through a
+ * thermal, and cost per sample, over synthetic traces at several rates with
+ * Gaussian altitude noise of VARIO_NOISE_M.
+ */
+
+TEST_MAIN_DECLS;
+
+#define VARIO_SECONDS      (60)
+#define VARIO_MAX_RATE     (200)
+#define VARIO_SAMPLES      (VARIO_SECONDS * VARIO_MAX_RATE)
+#define VARIO_NOISE_M      (0.2)
+#define VARIO_STEP_USECS   (10000000)   // level flight, then a 1 m/s climb
+#define VARIO_THERMAL_S    (20.0)       // period of the thermal's +-2 m/s
+#define VARIO_BENCH_NSECS  (20000000)
+
+struct vario_limits {
+  uint16_t rate_hz;
+  uint32_t max_lag_usecs;      // to 63% of a 1 m/s step, noise free
+  double   max_bias;           // m/s, mean error in a steady climb
+  double   max_sd;             // m/s, standard deviation in a steady climb
+  double   max_rms;            // m/s, RMS error through the thermal
+  double   max_nsecs;          // per sample replayed
+};
+
+// Private functions follow
+static uint32_t vario_rand(uint32_t *seed) {
+  *seed = *seed * 1664525u + 1013904223u;
+  return *seed >> 8;
+}
+
+static double vario_gauss(uint32_t *seed) {
+  double u1 = (vario_rand(seed) + 1.0) / 16777217.0;
+  double u2 = vario_rand(seed) / 16777216.0;
+
+  return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+// The inverse of the altitude formula the filter uses
+static float vario_pressure(double h) {
+  return 101325.0 * pow(1 - h / 44330.77, 1 / 0.190263);
+}
+
+static double vario_step_vz(double t) {
+  return t * 1e6 < VARIO_STEP_USECS ? 0 : 1;
+}
+
+static double vario_step_h(double t) {
+  return t * 1e6 < VARIO_STEP_USECS ? 0 : t - VARIO_STEP_USECS / 1e6;
+}
+
+static double vario_thermal_vz(double t) {
+  return 2 * sin(2 * M_PI * t / VARIO_THERMAL_S);
+}
+
+static double vario_thermal_h(double t) {
+  return 2 * VARIO_THERMAL_S / (2 * M_PI) * (1 - cos(2 * M_PI * t / VARIO_THERMAL_S));
+}
+
+static int vario_trace(struct mgos_barometer_sample *s, uint16_t rate_hz, double (*h)(double), uint32_t *seed) {
+  int n = VARIO_SECONDS * rate_hz;
+
+  memset(s, 0, n * sizeof(*s));
+  for (int i = 0; i < n; i++) {
+    double t = (i + 1) / (double)rate_hz;
+
+    s[i].ts_usecs    = (int64_t)(t * 1e6);
+    s[i].pressure    = vario_pressure(h(t) + VARIO_NOISE_M * vario_gauss(seed));
+    s[i].temperature = 20;
+  }
+  return n;
+}
+
+static double vario_bench(const struct mgos_barometer_sample *s, int n, struct mgos_barometer_vario_output *out) {
+  int64_t start = test_now_nsecs(), elapsed;
+  int64_t count = 0;
+
+  do {
+    mgos_barometer_vario_replay(NULL, s, n, out);
+    count  += n;
+    elapsed = test_now_nsecs() - start;
+  } while (elapsed < VARIO_BENCH_NSECS);
+  return (double)elapsed / count;
+}
+
+// Private functions end
+
+int main(void) {
+  // Limits are about 1.25x what x86-64 measures, twice for timing. The lag
+  // is set by accel_sigma rather than the rate, which lowers the noise.
+  static const struct vario_limits limits[] = {
+    { 25,  1000000, 0.03, 0.100, 0.35, 60 },
+    { 50,  1000000, 0.03, 0.070, 0.35, 60 },
+    { 100, 1000000, 0.03, 0.055, 0.35, 60 },
+    { 200, 1000000, 0.03, 0.035, 0.35, 60 },
+  };
+  static struct mgos_barometer_sample       s[VARIO_SAMPLES];
+  static struct mgos_barometer_vario_output out[VARIO_SAMPLES];
+  double   slack = test_bench_slack();
+  uint32_t seed  = 1, prev_lag = UINT32_MAX;
+
+  printf("rate  lag ms   bias    sd      rms     ns/sample\n");
+  for (size_t k = 0; k < sizeof(limits) / sizeof(limits[0]); k++) {
+    const struct vario_limits *l = &limits[k];
+    uint32_t lag = mgos_barometer_vario_step_lag_usecs(NULL, l->rate_hz);
+    double   sum = 0, sum2 = 0, rms = 0, nsecs;
+    int      n, m = 0;
+
+    // Steady climb: the second half of the trace, well after the step
+    n = vario_trace(s, l->rate_hz, vario_step_h, &seed);
+    TEST_CHECK(mgos_barometer_vario_replay(NULL, s, n, out) == n, "%u Hz: replay short", l->rate_hz);
+    for (int i = n / 2; i < n; i++, m++) {
+      double e = out[i].vspeed - vario_step_vz(s[i].ts_usecs / 1e6);
+
+      sum  += e;
+      sum2 += e * e;
+    }
+    sum  /= m;
+    sum2  = sqrt(sum2 / m - sum * sum);
+
+    // Thermal, after the first period
+    n = vario_trace(s, l->rate_hz, vario_thermal_h, &seed);
+    mgos_barometer_vario_replay(NULL, s, n, out);
+    m = 0;
+    for (int i = n / 3; i < n; i++, m++) {
+      double e = out[i].vspeed - vario_thermal_vz(s[i].ts_usecs / 1e6);
+
+      rms += e * e;
+    }
+    rms   = sqrt(rms / m);
+    nsecs = vario_bench(s, n, out);
+
+    printf("%4u  %6.0f  %+.3f  %.3f  %.3f  %6.1f\n", l->rate_hz, lag / 1000.0, sum, sum2, rms, nsecs);
+    TEST_CHECK(lag > 0 && lag <= l->max_lag_usecs, "%u Hz: step lag %u usecs", l->rate_hz, lag);
+    TEST_CHECK(lag <= prev_lag, "%u Hz: lag %u usecs grew with the rate", l->rate_hz, lag);
+    TEST_CHECK(fabs(sum) <= l->max_bias, "%u Hz: bias %.3f m/s", l->rate_hz, sum);
+    TEST_CHECK(sum2 <= l->max_sd, "%u Hz: sd %.3f m/s", l->rate_hz, sum2);
+    TEST_CHECK(rms <= l->max_rms, "%u Hz: thermal rms error %.3f m/s", l->rate_hz, rms);
+    TEST_CHECK(out[n - 1].altitude_noise > VARIO_NOISE_M / 2 && out[n - 1].altitude_noise < VARIO_NOISE_M * 2,
+               "%u Hz: altitude noise %.3f m reported for %.3f m", l->rate_hz, out[n - 1].altitude_noise, VARIO_NOISE_M);
+    if (slack > 0) {
+      TEST_CHECK(nsecs <= l->max_nsecs * slack, "%u Hz: %.1f ns/sample", l->rate_hz, nsecs);
+    }
+    prev_lag = lag;
+  }
+  return test_summary("test_vario");
+}